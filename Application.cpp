@@ -1,7 +1,10 @@
 #include "Application.h"
+#include "Frustum.h"
 
 #include "glm/gtx/polar_coordinates.hpp"
 
+#include <cstring>
+
 // Custom ImGui widgets
 namespace ImGui {
 	bool DragDirection(const char* label, glm::vec4& direction) {
@@ -22,9 +25,34 @@ bool Application::Initialize() {
 
 	ConfigureSurface();
 
+	// Textures are staged in a ring of buffers and copied at the next frame
+	if (m_uploadManager.Init(m_device)) {
+		Loader::setUploadManager(&m_uploadManager);
+	}
+
+	// Textures start with their smallest levels, finer ones are streamed in
+	m_textureStreamer.Init(m_device);
+	m_textureRegistry->SetStreamer(&m_textureStreamer);
+	m_textureArrays->Init(m_device);
+	m_textureStreamer.SetTextureArrays(m_textureArrays.get());
+
+	// Before the pipelines, which use its bind group layout
+	m_virtualTextures->Resize(static_cast<uint32_t>(m_windowDimensions.x), static_cast<uint32_t>(m_windowDimensions.y));
+	if (!m_virtualTextures->Init(m_device, &m_uploadManager)) return false;
+
+	// Mip levels are built on the CPU if the compute pipeline is not available
+	if (m_mipGenerator.Init(m_device)) {
+		Loader::setMipGenerator(&m_mipGenerator);
+	}
+
 	if (!InitLightingUniforms()) return false;
+	// Prefiltered on the worker threads, lighting is black until it is ready.
+	// The map is not in the repository (see Environment), without it the sky
+	// is lit by the first light.
+	if (!m_environment.Init(m_device, RESOURCE_DIR "/environment.hdr", GetSun())) return false;
 	if (!InitPipeline()) return false; // No need for InitBuffers();
 	if (!InitGameObjects()) return false;
+	if (!InitPointCloud()) return false;
 	if (!InitGui()) return false;
 	
 	return true;
@@ -33,6 +61,7 @@ bool Application::Initialize() {
 
 void Application::Terminate() {
 	TerminateGui();
+	TerminatePointCloud();
 
 	m_depthTextureView.release();
 	m_depthTexture.destroy();
@@ -43,7 +72,29 @@ void Application::Terminate() {
 		m_gameObjects[i].Terminate();
 	}
 
+	for (std::shared_ptr<Buffer> buffer : { m_objectUniformBuffer, m_drawCommandBuffer }) {
+		if (*buffer) {
+			buffer->destroy();
+			buffer->release();
+			*buffer = nullptr;
+		}
+	}
+
+	m_textureRegistry->Terminate();
+	m_textureArrays->Terminate();
+	m_virtualTextures->Terminate();
+	m_environment.Terminate();
+	m_textureRegistry->SetStreamer(nullptr);
+	m_textureStreamer.Terminate();
+	Loader::setMipGenerator(nullptr);
+	m_mipGenerator.Terminate();
+	Loader::setUploadManager(nullptr);
+	m_uploadManager.Terminate();
+
 	m_pipeline.release();
+	m_virtualPipeline.release();
+	m_feedbackPipeline.release();
+	m_virtualBindGroupLayout.release();
 	m_surface.unconfigure();
 	m_queue.release();
 	m_surface.release();
@@ -58,17 +109,46 @@ void Application::MainLoop() {
 
 	UpdateDragInertia();
 	UpdateUniforms();
+	UpdateObjectUniforms();
+	UpdateInstances();
+	UpdateDrawCommands();
+	CullGameObjects();
 	UpdateLightingUniforms();
+	m_environment.Update();
+	UpdatePointCloud();
+	UpdateClusteredGameObjects();
 
 	// Get the next target texture view
 	TextureView targetView = GetNextSurfaceTextureView();
 	if (!targetView) return;
 
+	// After the early return, so that the copies to the textures that the
+	// streamer replaces are always submitted before it destroys them
+	UpdateTextureStreaming();
+
 	// Create a command encoder for the draw call
 	CommandEncoderDescriptor encoderDesc = {};
 	encoderDesc.label = "My command encoder";
 	CommandEncoder encoder = wgpuDeviceCreateCommandEncoder(m_device, &encoderDesc);
 
+	// Texture uploads staged since the last frame land before anything is drawn
+	m_uploadManager.RecordCopies(encoder);
+	// Then the textures they wrote are packed in their arrays
+	m_textureArrays->RecordCopies(encoder);
+
+	// The virtual objects write the pages they sample, read back a few
+	// frames later to load them
+	if (RenderPassEncoder feedbackPass = m_virtualTextures->BeginFeedbackPass(encoder)) {
+		feedbackPass.setPipeline(m_feedbackPipeline);
+		feedbackPass.setBindGroup(1, m_environment.GetBindGroup(), 0, nullptr);
+		feedbackPass.setBindGroup(2, m_virtualTextures->GetBindGroup(), 0, nullptr);
+		BindGroup feedbackGroup = nullptr;
+		for (GameObject& gameObject : m_gameObjects) {
+			if (!gameObject.IsVirtual() || !m_objectVisible[gameObject.GetObjectIndex()]) continue;
+			gameObject.Draw(feedbackPass, feedbackGroup);
+		}
+		m_virtualTextures->EndFeedbackPass(encoder, feedbackPass);
+	}
 
 	// Create the render pass that clears the screen with our color
 	RenderPassDescriptor renderPassDesc = {};
@@ -112,13 +192,38 @@ void Application::MainLoop() {
 	// Select which render pipeline to use
 	// To Do: Define own pipeline for each GameObject, depending on the shader used.
 	renderPass.setPipeline(m_pipeline);
+	// The environment is the same for every object and pipeline
+	renderPass.setBindGroup(1, m_environment.GetBindGroup(), 0, nullptr);
+
+	// Objects sharing a bind group are drawn one after the other, so that it
+	// is only set once, and the virtual ones last, so that the pipeline only
+	// changes once. Draw arguments are read from the draw command buffer.
+	std::vector<GameObject*> drawOrder;
+	for (GameObject& gameObject : m_gameObjects) {
+		if (m_objectVisible[gameObject.GetObjectIndex()]) drawOrder.push_back(&gameObject);
+	}
+	std::stable_sort(drawOrder.begin(), drawOrder.end(), [](GameObject* a, GameObject* b) {
+		if (a->IsVirtual() != b->IsVirtual()) return b->IsVirtual();
+		return std::less<WGPUBindGroup>()(a->GetBindGroup(), b->GetBindGroup());
+	});
+	BindGroup boundGroup = nullptr;
+	bool virtualPipelineSet = false;
+	for (GameObject* gameObject : drawOrder) {
+		if (gameObject->IsVirtual() && !virtualPipelineSet) {
+			renderPass.setPipeline(m_virtualPipeline);
+			renderPass.setBindGroup(2, m_virtualTextures->GetBindGroup(), 0, nullptr);
+			// Group 0 has another layout in this pipeline
+			boundGroup = nullptr;
+			virtualPipelineSet = true;
+		}
+		gameObject->Draw(renderPass, boundGroup);
+	}
 
-	for (int i = 0; i < (int)m_gameObjects.size(); i++)
-	{
-		renderPass.setVertexBuffer(0, m_gameObjects[i].GetVertexBuffer(), 0, m_gameObjects[i].GetVertexData().size() * sizeof(VertexAttributes));
-		renderPass.setBindGroup(0, m_gameObjects[i].GetBindGroup(), 0, nullptr);
-
-		renderPass.draw(m_gameObjects[i].GetIndexCount(), 1, 0, 0);
+	if (m_pointCloud.IsOpen()) {
+		bool splats = m_pointCloudRenderMode == PointCloud::RenderMode::Splats;
+		renderPass.setPipeline(splats ? m_splatPipeline : m_pointPipeline);
+		renderPass.setBindGroup(0, m_pointCloudBindGroup, 0, nullptr);
+		m_pointCloud.Draw(renderPass, m_pointCloudRenderMode);
 	}
 
 	// We add the GUI drawing commands to the render pass
@@ -136,6 +241,8 @@ void Application::MainLoop() {
 	std::cout << "Submitting command..." << std::endl;
 	m_queue.submit(1, &command);
 	command.release();
+	m_uploadManager.OnSubmitted();
+	m_virtualTextures->OnSubmitted();
 	std::cout << "Command submitted." << std::endl;
 
 	// At the enc of the frame
@@ -172,6 +279,7 @@ void Application::OnResize()
 
 	// InitDepthBuffer();
 	UpdateWindowDimensions();
+	m_virtualTextures->Resize(static_cast<uint32_t>(m_windowDimensions.x), static_cast<uint32_t>(m_windowDimensions.y));
 
 	InitInstanceAndSurface();
 	ConfigureSurface();
@@ -277,7 +385,18 @@ void Application::InitDevice()
 	std::cout << "Requesting device..." << std::endl;
 	DeviceDescriptor deviceDesc = {};
 	deviceDesc.label = "My Device";
-	deviceDesc.requiredFeatureCount = 0;
+	// Textures are block compressed when the adapter supports it (see Loader::loadTexture)
+	std::vector<FeatureName> requiredFeatures;
+	if (m_adapter.hasFeature(FeatureName::TextureCompressionBC)) {
+		requiredFeatures.push_back(FeatureName::TextureCompressionBC);
+	}
+	// Indirect draws may start past the first instance (see GameObject::AppendDrawCommands)
+	m_indirectFirstInstance = m_adapter.hasFeature(FeatureName::IndirectFirstInstance);
+	if (m_indirectFirstInstance) {
+		requiredFeatures.push_back(FeatureName::IndirectFirstInstance);
+	}
+	deviceDesc.requiredFeatureCount = requiredFeatures.size();
+	deviceDesc.requiredFeatures = (const WGPUFeatureName*)requiredFeatures.data();
 	deviceDesc.requiredLimits = nullptr;
 	deviceDesc.defaultQueue.nextInChain = nullptr;
 	deviceDesc.defaultQueue.label = "The default queue";
@@ -294,6 +413,13 @@ void Application::InitDevice()
 	m_device = m_adapter.requestDevice(deviceDesc);
 	std::cout << "Got device: " << m_device << std::endl;
 
+	// Textures loaded from now on fit in what the device really supports
+	SupportedLimits deviceLimits;
+	if (m_device.getLimits(&deviceLimits)) {
+		m_textureQuality.maxSize = deviceLimits.limits.maxTextureDimension2D;
+	}
+	Loader::setTextureQuality(m_textureQuality);
+
 	uncapturedErrorCallbackHandle = m_device.setUncapturedErrorCallback([](ErrorType type, char const* message) {
 		std::cout << "Uncaptured device error: type " << type;
 		if (message) std::cout << " (" << message << ")";
@@ -406,9 +532,15 @@ bool Application::InitGameObjects()
 		RESOURCE_DIR "/flatspot_car_2.obj",
 		glm::vec3(0),
 		std::make_shared<Buffer>(m_uniformBuffer),
+		m_objectUniformBuffer,
+		m_drawCommandBuffer,
 		std::make_shared<Buffer>(m_lightingUniformBuffer),
 		std::make_shared<Sampler>(m_sampler),
-		std::make_shared<BindGroupLayout>(m_bindGroupLayout)
+		std::make_shared<BindGroupLayout>(m_bindGroupLayout),
+		m_textureRegistry,
+		m_textureArrays,
+		m_virtualTextures,
+		std::make_shared<BindGroupLayout>(m_virtualBindGroupLayout)
 	);
 
 	flatSpotCar.SetAlbedoTexture(RESOURCE_DIR "/texture_flatspot.png");
@@ -420,9 +552,15 @@ bool Application::InitGameObjects()
 		RESOURCE_DIR "/plane.obj",
 		glm::vec3(0),
 		std::make_shared<Buffer>(m_uniformBuffer),
+		m_objectUniformBuffer,
+		m_drawCommandBuffer,
 		std::make_shared<Buffer>(m_lightingUniformBuffer),
 		std::make_shared<Sampler>(m_sampler),
-		std::make_shared<BindGroupLayout>(m_bindGroupLayout)
+		std::make_shared<BindGroupLayout>(m_bindGroupLayout),
+		m_textureRegistry,
+		m_textureArrays,
+		m_virtualTextures,
+		std::make_shared<BindGroupLayout>(m_virtualBindGroupLayout)
 	);
 
 	plane.SetAlbedoTexture(RESOURCE_DIR "/tarmac_albedo.jpg");
@@ -432,16 +570,105 @@ bool Application::InitGameObjects()
 	m_gameObjects.push_back(flatSpotCar);
 	m_gameObjects.push_back(plane);
 
-	
+	// An assembly too large for memory is cooked once into clusters that
+	// are paged in while rendering. It is optional.
+	const fs::path assemblyPath = RESOURCE_DIR "/assembly.obj";
+	const fs::path assemblyClustersPath = RESOURCE_DIR "/assembly.clusters";
+	if (!fs::exists(assemblyClustersPath) && fs::exists(assemblyPath)) {
+		ClusteredMesh::Cook(assemblyPath, assemblyClustersPath);
+	}
+	if (fs::exists(assemblyClustersPath)) {
+		GameObject assembly = GameObject(
+			std::make_shared<Device>(m_device),
+			"Assembly",
+			assemblyClustersPath.string(),
+			glm::vec3(0),
+			std::make_shared<Buffer>(m_uniformBuffer),
+			m_objectUniformBuffer,
+			m_drawCommandBuffer,
+			std::make_shared<Buffer>(m_lightingUniformBuffer),
+			std::make_shared<Sampler>(m_sampler),
+			std::make_shared<BindGroupLayout>(m_bindGroupLayout),
+			m_textureRegistry,
+			m_textureArrays,
+			m_virtualTextures,
+			std::make_shared<BindGroupLayout>(m_virtualBindGroupLayout)
+		);
+
+		assembly.SetAlbedoTexture(RESOURCE_DIR "/texture.jpg");
+		assembly.SetNormalTexture(RESOURCE_DIR "/texture_flatspot_normal.png");
+
+		m_gameObjects.push_back(assembly);
+	}
+
+	// The uniforms of each object, in a buffer the objects share
+	m_objectUniforms.resize(std::max<size_t>(m_gameObjects.size(), 1));
+	BufferDescriptor objectBufferDesc;
+	objectBufferDesc.label = "Object uniforms";
+	objectBufferDesc.size = m_objectUniforms.size() * sizeof(GameObject::ObjectUniforms);
+	objectBufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Storage;
+	objectBufferDesc.mappedAtCreation = false;
+	*m_objectUniformBuffer = m_device.createBuffer(objectBufferDesc);
+
 	for (int i = 0; i < (int)m_gameObjects.size(); i++)
 	{
 		m_gameObjects[i].Initialize(i);
 	}
+	m_frustumCuller.Resize(static_cast<uint32_t>(m_gameObjects.size()));
+	UpdateObjectUniforms();
+	UpdateDrawCommands();
+	UpdateTextureBindings();
 
 	return true;
 }
 
 
+void Application::UpdateTextureStreaming()
+{
+	// Textures decoded since the last frame replace their placeholders
+	m_textureRegistry->Update();
+
+	// Pixels covered by a world unit seen at a distance of 1
+	float pixelsPerUnitAtOneMeter = 0.5f * m_windowDimensions.y * m_uniforms.projectionMatrix[1][1];
+	for (GameObject& gameObject : m_gameObjects) {
+		gameObject.RequestTextureLevels(m_textureStreamer, m_uniforms.cameraWorldPosition, pixelsPerUnitAtOneMeter);
+	}
+	m_textureStreamer.Update();
+	m_textureArrays->Update();
+	// Pages requested by the feedback of a few frames ago
+	m_virtualTextures->Update();
+	UpdateTextureBindings();
+}
+
+
+void Application::UpdateTextureBindings()
+{
+	// Packing the textures of an object may grow an array, whose new view
+	// the objects updated before must use too
+	uint32_t generation;
+	do {
+		generation = m_textureArrays->GetGeneration();
+		for (GameObject& gameObject : m_gameObjects) {
+			gameObject.UpdateTextureBindings();
+		}
+	} while (generation != m_textureArrays->GetGeneration());
+}
+
+
+void Application::UpdateClusteredGameObjects()
+{
+	glm::mat4x4 viewProjection = m_uniforms.projectionMatrix * m_uniforms.viewMatrix;
+	for (GameObject& gameObject : m_gameObjects) {
+		if (std::shared_ptr<ClusteredMesh> clusteredMesh = gameObject.GetClusteredMesh()) {
+			// Clusters are culled in the space of the object
+			glm::mat4x4 modelMatrix = m_uniforms.modelMatrix * gameObject.GetModelMatrix();
+			glm::vec3 cameraPosition = glm::vec3(glm::inverse(modelMatrix) * glm::vec4(m_uniforms.cameraWorldPosition, 1.0f));
+			clusteredMesh->Update(viewProjection * modelMatrix, cameraPosition);
+		}
+	}
+}
+
+
 bool Application::InitPipeline()
 {
 	std::cout << "Creating shader module..." << std::endl;
@@ -500,9 +727,35 @@ bool Application::InitPipeline()
 
 	vertexBufferLayout.stepMode = VertexStepMode::Vertex;
 
-
-	pipelineDesc.vertex.bufferCount = 1;
-	pipelineDesc.vertex.buffers = &vertexBufferLayout;
+	// Per-instance model matrix, one column per attribute (@location(6) to @location(9))
+	std::vector<VertexAttribute> instanceAttribs(7);
+	for (uint32_t column = 0; column < 4; ++column) {
+		instanceAttribs[column].shaderLocation = 6 + column;
+		instanceAttribs[column].format = VertexFormat::Float32x4;
+		instanceAttribs[column].offset = offsetof(GameObject::InstanceAttributes, modelMatrix) + column * sizeof(glm::vec4);
+	}
+	// Texture array layers (@location(10))
+	instanceAttribs[4].shaderLocation = 10;
+	instanceAttribs[4].format = VertexFormat::Uint32x2;
+	instanceAttribs[4].offset = offsetof(GameObject::InstanceAttributes, textureLayers);
+	// Tint of the instance (@location(11))
+	instanceAttribs[5].shaderLocation = 11;
+	instanceAttribs[5].format = VertexFormat::Float32x4;
+	instanceAttribs[5].offset = offsetof(GameObject::InstanceAttributes, tint);
+	// Index of the uniforms of the object (@location(12))
+	instanceAttribs[6].shaderLocation = 12;
+	instanceAttribs[6].format = VertexFormat::Uint32;
+	instanceAttribs[6].offset = offsetof(GameObject::InstanceAttributes, objectIndex);
+
+	std::vector<VertexBufferLayout> vertexBufferLayouts(2);
+	vertexBufferLayouts[0] = vertexBufferLayout;
+	vertexBufferLayouts[1].attributeCount = static_cast<uint32_t>(instanceAttribs.size());
+	vertexBufferLayouts[1].attributes = instanceAttribs.data();
+	vertexBufferLayouts[1].arrayStride = sizeof(GameObject::InstanceAttributes);
+	vertexBufferLayouts[1].stepMode = VertexStepMode::Instance;
+
+	pipelineDesc.vertex.bufferCount = static_cast<uint32_t>(vertexBufferLayouts.size());
+	pipelineDesc.vertex.buffers = vertexBufferLayouts.data();
 	// [...] Describe vertex shader
 	// NB: We define the 'shaderModule' in the second part of this chapter.
 	// Here we tell that the programmable vertex shader stage is described
@@ -612,7 +865,7 @@ bool Application::InitPipeline()
 	// [...] Define bindingLayout
 	// Create binding layouts
 	// Since we now have 2 bindings, we use a vector to store them
-	std::vector<BindGroupLayoutEntry> bindingLayoutEntries(5, Default);
+	std::vector<BindGroupLayoutEntry> bindingLayoutEntries(6, Default);
 	//                                                     ^ This was a 4
 
 	// The uniform buffer binding that we already had
@@ -628,14 +881,14 @@ bool Application::InitPipeline()
 	textureBindingLayout.binding = 1;
 	textureBindingLayout.visibility = ShaderStage::Fragment;
 	textureBindingLayout.texture.sampleType = TextureSampleType::Float;
-	textureBindingLayout.texture.viewDimension = TextureViewDimension::_2D;
+	textureBindingLayout.texture.viewDimension = TextureViewDimension::_2DArray;
 
 	// The normal map binding
 	BindGroupLayoutEntry& normalTextureBindingLayout = bindingLayoutEntries[2];
 	normalTextureBindingLayout.binding = 2;
 	normalTextureBindingLayout.visibility = ShaderStage::Fragment;
 	normalTextureBindingLayout.texture.sampleType = TextureSampleType::Float;
-	normalTextureBindingLayout.texture.viewDimension = TextureViewDimension::_2D;
+	normalTextureBindingLayout.texture.viewDimension = TextureViewDimension::_2DArray;
 
 	// The texture sampler binding
 	BindGroupLayoutEntry& samplerBindingLayout = bindingLayoutEntries[3];
@@ -650,6 +903,13 @@ bool Application::InitPipeline()
 	lightingUniformLayout.buffer.type = BufferBindingType::Uniform;
 	lightingUniformLayout.buffer.minBindingSize = sizeof(GameObject::LightingUniforms);
 
+	// The uniforms of all the objects, which the instances index
+	BindGroupLayoutEntry& objectUniformLayout = bindingLayoutEntries[5];
+	objectUniformLayout.binding = 5;
+	objectUniformLayout.visibility = ShaderStage::Vertex;
+	objectUniformLayout.buffer.type = BufferBindingType::ReadOnlyStorage;
+	objectUniformLayout.buffer.minBindingSize = sizeof(GameObject::ObjectUniforms);
+
 
 	// Create a bind group layout
 	BindGroupLayoutDescriptor bindGroupLayoutDesc{};
@@ -659,10 +919,11 @@ bool Application::InitPipeline()
 
 
 
-	// Create the pipeline layout
+	// Create the pipeline layout, group 1 is the image based lighting
+	std::vector<WGPUBindGroupLayout> bindGroupLayouts = { m_bindGroupLayout, m_environment.GetBindGroupLayout() };
 	PipelineLayoutDescriptor layoutDesc;
-	layoutDesc.bindGroupLayoutCount = 1;
-	layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)&m_bindGroupLayout;
+	layoutDesc.bindGroupLayoutCount = (uint32_t)bindGroupLayouts.size();
+	layoutDesc.bindGroupLayouts = bindGroupLayouts.data();
 	PipelineLayout layout = m_device.createPipelineLayout(layoutDesc);
 
 	// Assign the PipelineLayout to the RenderPipelineDescriptor's layout field
@@ -670,6 +931,32 @@ bool Application::InitPipeline()
 
 	m_pipeline = m_device.createRenderPipeline(pipelineDesc);
 
+	// Objects with virtual textures sample them through group 2, their own
+	// group only has the uniforms
+	std::vector<BindGroupLayoutEntry> virtualBindingLayoutEntries = { bindingLayout, lightingUniformLayout, objectUniformLayout };
+	bindGroupLayoutDesc.entryCount = (uint32_t)virtualBindingLayoutEntries.size();
+	bindGroupLayoutDesc.entries = virtualBindingLayoutEntries.data();
+	m_virtualBindGroupLayout = m_device.createBindGroupLayout(bindGroupLayoutDesc);
+
+	std::vector<WGPUBindGroupLayout> virtualBindGroupLayouts = { m_virtualBindGroupLayout, m_environment.GetBindGroupLayout(), m_virtualTextures->GetBindGroupLayout() };
+	layoutDesc.bindGroupLayoutCount = (uint32_t)virtualBindGroupLayouts.size();
+	layoutDesc.bindGroupLayouts = virtualBindGroupLayouts.data();
+	PipelineLayout virtualLayout = m_device.createPipelineLayout(layoutDesc);
+	pipelineDesc.layout = virtualLayout;
+
+	fragmentState.entryPoint = "fs_main_virtual";
+	m_virtualPipeline = m_device.createRenderPipeline(pipelineDesc);
+
+	// The feedback pass writes page requests, which are not blended
+	ColorTargetState feedbackTarget;
+	feedbackTarget.format = VirtualTextures::FeedbackFormat;
+	feedbackTarget.blend = nullptr;
+	feedbackTarget.writeMask = ColorWriteMask::All;
+	fragmentState.targets = &feedbackTarget;
+	fragmentState.entryPoint = "fs_feedback";
+	m_feedbackPipeline = m_device.createRenderPipeline(pipelineDesc);
+	virtualLayout.release();
+
 	InitDepthTextureView();
 
 	InitSampler();
@@ -720,6 +1007,143 @@ void Application::UpdateUniforms()
 }
 
 
+void Application::UpdateInstances()
+{
+	for (GameObject& gameObject : m_gameObjects) {
+		gameObject.UpdateInstanceBuffer();
+	}
+}
+
+
+void Application::SetCarCopies(uint32_t count)
+{
+	if (m_gameObjects.empty()) return;
+	GameObject& car = m_gameObjects[0];
+
+	// Rows of cars side by side on the ground, each with its own tint. The
+	// copies that remain keep their place, so only new ones are uploaded.
+	constexpr uint32_t CarsPerRow = 20;
+	uint32_t previousCount = car.GetInstanceCount();
+	car.SetInstanceCount(count);
+	for (uint32_t i = previousCount; i < count; ++i) {
+		GameObject::Instance instance;
+		float column = static_cast<float>(i % CarsPerRow);
+		float row = static_cast<float>(i / CarsPerRow);
+		instance.transform = glm::translate(glm::mat4x4(1.0f), glm::vec3(0.8f * column, 0.0f, -1.8f * row));
+		if (i > 0) {
+			float hue = 0.618034f * i;
+			instance.tint = glm::vec4(0.6f + 0.4f * glm::cos(2.0f * PI * (hue + glm::vec3(0.0f, 1.0f / 3.0f, 2.0f / 3.0f))), 1.0f);
+		}
+		car.SetInstance(i, instance);
+	}
+	m_carCopies = count;
+}
+
+
+void Application::UpdateObjectUniforms()
+{
+	if (!*m_objectUniformBuffer) return;
+
+	// Gathered in a CPU copy of the buffer, uploaded at once rather than
+	// with a write per object
+	for (const GameObject& gameObject : m_gameObjects) {
+		m_objectUniforms[gameObject.GetObjectIndex()].modelMatrix = gameObject.GetModelMatrix();
+	}
+	m_queue.writeBuffer(*m_objectUniformBuffer, 0, m_objectUniforms.data(), m_objectUniforms.size() * sizeof(GameObject::ObjectUniforms));
+}
+
+
+void Application::CullGameObjects()
+{
+	uint32_t objectCount = static_cast<uint32_t>(m_gameObjects.size());
+	if (m_cullingMode == CullingMode::Off) {
+		m_objectVisible.assign(objectCount, 1);
+		return;
+	}
+	glm::mat4x4 viewProjection = m_uniforms.projectionMatrix * m_uniforms.viewMatrix * m_uniforms.modelMatrix;
+
+	if (m_cullingMode == CullingMode::PerObject) {
+		// Bounds change as objects and their instances move
+		for (const GameObject& gameObject : m_gameObjects) {
+			glm::vec3 center;
+			float radius;
+			gameObject.GetWorldBounds(center, radius);
+			m_frustumCuller.SetSphere(gameObject.GetObjectIndex(), center, radius);
+		}
+		m_frustumCuller.Cull(viewProjection);
+		m_objectVisible.resize(objectCount);
+		for (uint32_t i = 0; i < objectCount; ++i) {
+			m_objectVisible[i] = m_frustumCuller.IsVisible(i) ? 1 : 0;
+		}
+		return;
+	}
+
+	// Boxes around the bounding spheres, infinite bounds stay out of the
+	// hierarchy. Only the objects that moved are refit.
+	bool rebuild = m_sceneBvh.GetCount() != objectCount;
+	m_objectBounds.resize(objectCount);
+	for (const GameObject& gameObject : m_gameObjects) {
+		glm::vec3 center;
+		float radius;
+		gameObject.GetWorldBounds(center, radius);
+		SceneBvh::Bounds bounds;
+		if (std::isfinite(radius)) {
+			bounds.min = center - radius;
+			bounds.max = center + radius;
+		}
+		m_objectBounds[gameObject.GetObjectIndex()] = bounds;
+		if (!rebuild) m_sceneBvh.SetBounds(gameObject.GetObjectIndex(), bounds);
+	}
+	if (rebuild || m_sceneBvh.NeedsRebuild()) {
+		m_sceneBvh.Build(m_objectBounds);
+	}
+	else {
+		m_sceneBvh.Refit();
+	}
+
+	m_visibleObjects.clear();
+	m_sceneBvh.Cull(Frustum(viewProjection), m_visibleObjects);
+	m_objectVisible.assign(objectCount, 0);
+	for (uint32_t index : m_visibleObjects) {
+		m_objectVisible[index] = 1;
+	}
+}
+
+
+void Application::UpdateDrawCommands()
+{
+	bool changed = !*m_drawCommandBuffer;
+	for (const GameObject& gameObject : m_gameObjects) {
+		changed = changed || gameObject.DrawCommandsChanged();
+	}
+	if (!changed) return;
+
+	// Commands only change with the number of instances, the buffer is
+	// written again then, and grows if needed
+	m_drawCommands.clear();
+	for (GameObject& gameObject : m_gameObjects) {
+		gameObject.AppendDrawCommands(m_drawCommands, m_indirectFirstInstance);
+	}
+	uint64_t size = std::max<size_t>(m_drawCommands.size(), 1) * sizeof(GameObject::DrawIndirectArgs);
+	if (!*m_drawCommandBuffer || m_drawCommandBuffer->getSize() < size) {
+		if (*m_drawCommandBuffer) {
+			m_drawCommandBuffer->destroy();
+			m_drawCommandBuffer->release();
+		}
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = "Draw commands";
+		bufferDesc.size = size;
+		// Storage too, so that compute passes may edit the commands on the GPU
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Indirect | BufferUsage::Storage;
+		bufferDesc.mappedAtCreation = false;
+		*m_drawCommandBuffer = m_device.createBuffer(bufferDesc);
+	}
+	if (!m_drawCommands.empty()) {
+		m_queue.writeBuffer(*m_drawCommandBuffer, 0, m_drawCommands.data(), m_drawCommands.size() * sizeof(GameObject::DrawIndirectArgs));
+	}
+}
+
+
 void Application::UpdateWindowDimensions()
 {
 	// Get the current size of the window's framebuffer:
@@ -821,9 +1245,86 @@ void Application::UpdateGui(RenderPassEncoder renderPass) {
 	changed = ImGui::SliderFloat("Hardness", &m_lightingUniforms.hardness, 1.0f, 100.0f) || changed;
 	changed = ImGui::SliderFloat("K Diffuse", &m_lightingUniforms.kd, 0.0f, 1.0f) || changed;
 	changed = ImGui::SliderFloat("K Specular", &m_lightingUniforms.ks, 0.0f, 1.0f) || changed;
+	float environmentIntensity = m_environment.GetIntensity();
+	if (ImGui::SliderFloat("Environment Intensity", &environmentIntensity, 0.0f, 4.0f)) {
+		m_environment.SetIntensity(environmentIntensity);
+	}
+	ImGui::Text("Environment: %s", m_environment.IsReady() ? "ready" : "prefiltering...");
+	ImGui::End();
+
+	ImGui::Begin("Objects");
+	// Copies of the car drawn by the same draw calls, see GameObject::Instance
+	int carCopies = static_cast<int>(m_carCopies);
+	if (ImGui::SliderInt("Car Copies", &carCopies, 1, 500)) {
+		SetCarCopies(static_cast<uint32_t>(carCopies));
+	}
+	ImGui::Text("Draw commands: %zu, drawn indirectly%s", m_drawCommands.size(),
+		m_indirectFirstInstance ? "" : " (without IndirectFirstInstance)");
+	int cullingMode = static_cast<int>(m_cullingMode);
+	ImGui::Combo("Culling", &cullingMode, "Off\0Per Object\0Scene BVH\0");
+	m_cullingMode = static_cast<CullingMode>(cullingMode);
+	if (m_cullingMode == CullingMode::PerObject) {
+		const FrustumCuller::Stats& cullingStats = m_frustumCuller.GetStats();
+		ImGui::Text("Visible: %u of %u objects (%s)", cullingStats.visible, cullingStats.tested, FrustumCuller::InstructionSet());
+	}
+	else if (m_cullingMode == CullingMode::Hierarchical) {
+		const SceneBvh::Stats& bvhStats = m_sceneBvh.GetStats();
+		ImGui::Text("Visible: %u of %u objects, %u of %u nodes tested", bvhStats.visibleObjects, bvhStats.objectCount, bvhStats.testedNodes, bvhStats.nodeCount);
+		ImGui::Text("BVH depth %u, SAH cost %.1f (%.1f when built)", bvhStats.depth, bvhStats.cost, bvhStats.buildCost);
+	}
 	ImGui::End();
 	m_lightingUniformsChanged = changed;
 
+	TextureRegistry::Stats textureStats = m_textureRegistry->GetStats();
+	ImGui::Begin("Textures");
+	ImGui::Text("Quality: %u levels skipped, at most %u texels wide", m_textureQuality.skippedLevels, m_textureQuality.maxSize);
+	ImGui::Text("Loads: %u misses, %u hits (%u by content)", textureStats.misses,
+		textureStats.pathHits + textureStats.contentHits, textureStats.contentHits);
+	ImGui::Text("Resident: %u textures, %u being decoded", textureStats.residentTextures, textureStats.pendingLoads);
+	TextureArrays::Stats arrayStats = m_textureArrays->GetStats();
+	ImGui::Text("Arrays: %u with %u/%u layers used (%.1f MB, %.1f MB unused), %u packed last frame, %u bind groups", arrayStats.arrayCount,
+		arrayStats.usedLayers, arrayStats.totalLayers, arrayStats.allocatedBytes / (1024.0 * 1024.0), arrayStats.unusedBytes / (1024.0 * 1024.0),
+		arrayStats.packedLayers, arrayStats.bindGroupCount);
+	const TextureStreamer::Stats& streamingStats = m_textureStreamer.GetStats();
+	TextureStreamer::Settings& streamingSettings = m_textureStreamer.GetSettings();
+	int budgetMegabytes = static_cast<int>(streamingSettings.budgetBytes >> 20);
+	ImGui::SliderInt("Budget (MB)", &budgetMegabytes, 16, 1024);
+	ImGui::SliderFloat("Level Bias", &streamingSettings.levelBias, -2.0f, 4.0f);
+	streamingSettings.budgetBytes = static_cast<uint64_t>(budgetMegabytes) << 20;
+	ImGui::Text("Streamed: %.1f MB resident, %.1f MB requested", streamingStats.residentBytes / (1024.0 * 1024.0),
+		streamingStats.requestedBytes / (1024.0 * 1024.0));
+	ImGui::Text("Streaming: %u reads pending, %u in, %u out", streamingStats.pendingReads, streamingStats.streamedIn, streamingStats.streamedOut);
+	const UploadManager::Stats& uploadStats = m_uploadManager.GetStats();
+	ImGui::Text("Uploads: %u copies, %.1f MB staged last frame (%u chunks)", uploadStats.copies,
+		uploadStats.bytes / (1024.0 * 1024.0), uploadStats.chunks);
+	const VirtualTextures::Stats& virtualStats = m_virtualTextures->GetStats();
+	ImGui::Text("Virtual: %u textures, %u/%u pages resident, %u requested", virtualStats.textureCount,
+		virtualStats.residentPages, 2 * virtualStats.slotCount, virtualStats.requestedPages);
+	ImGui::Text("Virtual pages: %u reads pending, %u in, %u out", virtualStats.pendingReads,
+		virtualStats.uploadedPages, virtualStats.evictedPages);
+	ImGui::SliderFloat("Virtual Level Bias", &m_virtualTextures->GetSettings().levelBias, -2.0f, 4.0f);
+	ImGui::End();
+
+	if (m_pointCloud.IsOpen()) {
+		PointCloud::Settings& settings = m_pointCloud.GetSettings();
+		const PointCloud::Stats& stats = m_pointCloud.GetStats();
+		int mode = static_cast<int>(m_pointCloudRenderMode);
+		int pointBudget = static_cast<int>(settings.pointBudget);
+
+		ImGui::Begin("Point Cloud");
+		ImGui::Combo("Render Mode", &mode, "Points\0Splats\0");
+		ImGui::SliderInt("Point Budget", &pointBudget, 100000, 20000000);
+		ImGui::SliderFloat("Min Node Size (px)", &settings.minNodeScreenSize, 10.0f, 500.0f);
+		ImGui::SliderFloat("Splat Size (px)", &m_pointCloudUniforms.pointSize, 1.0f, 16.0f);
+		ImGui::Text("Visible: %u nodes, %llu points", stats.visibleNodes, (unsigned long long)stats.visiblePoints);
+		ImGui::Text("Resident: %u nodes, %llu points", stats.residentNodes, (unsigned long long)stats.residentPoints);
+		ImGui::Text("Pending loads: %u", stats.pendingLoads);
+		ImGui::End();
+
+		m_pointCloudRenderMode = static_cast<PointCloud::RenderMode>(mode);
+		settings.pointBudget = static_cast<uint32_t>(pointBudget);
+	}
+
 	// Draw the UI
 	ImGui::EndFrame();
 	// Convert the UI defined above into low-level drawing commands
@@ -863,15 +1364,183 @@ void Application::TerminateLightingUniforms()
 }
 
 
+Environment::Sun Application::GetSun() const
+{
+	Environment::Sun sun;
+	sun.direction = glm::vec3(m_lightingUniforms.directions[0]);
+	sun.color = glm::vec3(m_lightingUniforms.colors[0]);
+	return sun;
+}
+
 void Application::UpdateLightingUniforms()
 {
 	if (m_lightingUniformsChanged) {
 		m_queue.writeBuffer(m_lightingUniformBuffer, 0, &m_lightingUniforms, sizeof(GameObject::LightingUniforms));
+		m_environment.SetSun(GetSun());
 		m_lightingUniformsChanged = false;
 	}
 }
 
 
+bool Application::InitPointCloud()
+{
+	// A raw `[points]` file is cooked once into an octree cache next to it
+	const fs::path cacheDir = RESOURCE_DIR "/pointcloud";
+	const fs::path sourcePath = RESOURCE_DIR "/pointcloud.txt";
+	if (!PointCloud::IsCooked(cacheDir)) {
+		if (!fs::exists(sourcePath)) return true; // Point cloud mode is optional
+		if (!PointCloud::Cook(sourcePath, cacheDir)) return true;
+	}
+	if (!m_pointCloud.Open(cacheDir, m_device)) return true;
+
+	std::cout << "Creating point cloud pipelines..." << std::endl;
+	ShaderModule shaderModule = Loader::loadShaderModule(RESOURCE_DIR "/point_cloud.wgsl", m_device);
+
+	// Uniform buffer with the settings specific to the point cloud
+	BufferDescriptor bufferDesc;
+	bufferDesc.size = sizeof(PointCloud::Uniforms);
+	bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+	bufferDesc.mappedAtCreation = false;
+	m_pointCloudUniformBuffer = m_device.createBuffer(bufferDesc);
+
+	// Binding 0 is the same MyUniforms as the main pipeline, for the camera
+	std::vector<BindGroupLayoutEntry> bindingLayoutEntries(2, Default);
+	bindingLayoutEntries[0].binding = 0;
+	bindingLayoutEntries[0].visibility = ShaderStage::Vertex | ShaderStage::Fragment;
+	bindingLayoutEntries[0].buffer.type = BufferBindingType::Uniform;
+	bindingLayoutEntries[0].buffer.minBindingSize = sizeof(GameObject::MyUniforms);
+
+	bindingLayoutEntries[1].binding = 1;
+	bindingLayoutEntries[1].visibility = ShaderStage::Vertex;
+	bindingLayoutEntries[1].buffer.type = BufferBindingType::Uniform;
+	bindingLayoutEntries[1].buffer.minBindingSize = sizeof(PointCloud::Uniforms);
+
+	BindGroupLayoutDescriptor bindGroupLayoutDesc{};
+	bindGroupLayoutDesc.entryCount = (uint32_t)bindingLayoutEntries.size();
+	bindGroupLayoutDesc.entries = bindingLayoutEntries.data();
+	BindGroupLayout bindGroupLayout = m_device.createBindGroupLayout(bindGroupLayoutDesc);
+
+	std::vector<BindGroupEntry> bindings(2);
+	bindings[0].binding = 0;
+	bindings[0].buffer = m_uniformBuffer;
+	bindings[0].offset = 0;
+	bindings[0].size = sizeof(GameObject::MyUniforms);
+
+	bindings[1].binding = 1;
+	bindings[1].buffer = m_pointCloudUniformBuffer;
+	bindings[1].offset = 0;
+	bindings[1].size = sizeof(PointCloud::Uniforms);
+
+	BindGroupDescriptor bindGroupDesc;
+	bindGroupDesc.layout = bindGroupLayout;
+	bindGroupDesc.entryCount = (uint32_t)bindings.size();
+	bindGroupDesc.entries = bindings.data();
+	m_pointCloudBindGroup = m_device.createBindGroup(bindGroupDesc);
+
+	PipelineLayoutDescriptor layoutDesc;
+	layoutDesc.bindGroupLayoutCount = 1;
+	layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)&bindGroupLayout;
+	PipelineLayout layout = m_device.createPipelineLayout(layoutDesc);
+
+	// Position and packed color of each point
+	std::vector<VertexAttribute> vertexAttribs(2);
+	vertexAttribs[0].shaderLocation = 0;
+	vertexAttribs[0].format = VertexFormat::Float32x3;
+	vertexAttribs[0].offset = offsetof(PointCloud::Point, position);
+
+	vertexAttribs[1].shaderLocation = 1;
+	vertexAttribs[1].format = VertexFormat::Unorm8x4;
+	vertexAttribs[1].offset = offsetof(PointCloud::Point, color);
+
+	VertexBufferLayout vertexBufferLayout;
+	vertexBufferLayout.attributeCount = static_cast<uint32_t>(vertexAttribs.size());
+	vertexBufferLayout.attributes = vertexAttribs.data();
+	vertexBufferLayout.arrayStride = sizeof(PointCloud::Point);
+
+	ColorTargetState colorTarget;
+	colorTarget.format = m_surfaceFormat;
+	colorTarget.blend = nullptr; // points are opaque
+	colorTarget.writeMask = ColorWriteMask::All;
+
+	FragmentState fragmentState;
+	fragmentState.module = shaderModule;
+	fragmentState.constantCount = 0;
+	fragmentState.constants = nullptr;
+	fragmentState.targetCount = 1;
+	fragmentState.targets = &colorTarget;
+
+	DepthStencilState depthStencilState = Default;
+	depthStencilState.depthCompare = CompareFunction::Less;
+	depthStencilState.depthWriteEnabled = true;
+	depthStencilState.format = m_depthTextureFormat;
+	depthStencilState.stencilReadMask = 0;
+	depthStencilState.stencilWriteMask = 0;
+
+	RenderPipelineDescriptor pipelineDesc;
+	pipelineDesc.layout = layout;
+	pipelineDesc.vertex.bufferCount = 1;
+	pipelineDesc.vertex.buffers = &vertexBufferLayout;
+	pipelineDesc.vertex.module = shaderModule;
+	pipelineDesc.vertex.constantCount = 0;
+	pipelineDesc.vertex.constants = nullptr;
+	pipelineDesc.primitive.stripIndexFormat = IndexFormat::Undefined;
+	pipelineDesc.primitive.frontFace = FrontFace::CCW;
+	pipelineDesc.primitive.cullMode = CullMode::None;
+	pipelineDesc.fragment = &fragmentState;
+	pipelineDesc.depthStencil = &depthStencilState;
+	pipelineDesc.multisample.count = 1;
+	pipelineDesc.multisample.mask = ~0u;
+	pipelineDesc.multisample.alphaToCoverageEnabled = false;
+
+	// One vertex per point
+	vertexBufferLayout.stepMode = VertexStepMode::Vertex;
+	pipelineDesc.vertex.entryPoint = "vs_points";
+	fragmentState.entryPoint = "fs_points";
+	pipelineDesc.primitive.topology = PrimitiveTopology::PointList;
+	m_pointPipeline = m_device.createRenderPipeline(pipelineDesc);
+
+	// One quad instance per point
+	vertexBufferLayout.stepMode = VertexStepMode::Instance;
+	pipelineDesc.vertex.entryPoint = "vs_splats";
+	fragmentState.entryPoint = "fs_splats";
+	pipelineDesc.primitive.topology = PrimitiveTopology::TriangleList;
+	m_splatPipeline = m_device.createRenderPipeline(pipelineDesc);
+
+	layout.release();
+	bindGroupLayout.release();
+	shaderModule.release();
+
+	return m_pointPipeline != nullptr && m_splatPipeline != nullptr;
+}
+
+
+void Application::TerminatePointCloud()
+{
+	m_pointCloud.Terminate();
+
+	if (m_pointCloudBindGroup) m_pointCloudBindGroup.release();
+	if (m_pointPipeline) m_pointPipeline.release();
+	if (m_splatPipeline) m_splatPipeline.release();
+	if (m_pointCloudUniformBuffer) {
+		m_pointCloudUniformBuffer.destroy();
+		m_pointCloudUniformBuffer.release();
+	}
+}
+
+
+void Application::UpdatePointCloud()
+{
+	if (!m_pointCloud.IsOpen()) return;
+
+	// Traversal and node loading happen on the worker threads
+	m_pointCloud.Update(m_uniforms.viewMatrix, m_uniforms.projectionMatrix, m_windowDimensions);
+
+	m_pointCloudUniforms.modelMatrix = m_pointCloud.GetModelMatrix();
+	m_pointCloudUniforms.viewportSize = m_windowDimensions;
+	m_queue.writeBuffer(m_pointCloudUniformBuffer, 0, &m_pointCloudUniforms, sizeof(PointCloud::Uniforms));
+}
+
+
 TextureView Application::GetNextSurfaceTextureView() {
 	// Get the surface texture
 	SurfaceTexture surfaceTexture;
@@ -906,35 +1575,46 @@ RequiredLimits Application::GetRequiredLimits(Adapter adapter) const
 	// Error in Chrome so we hardcode values:
 	supportedLimits.limits.minStorageBufferOffsetAlignment = 256;
 	supportedLimits.limits.minUniformBufferOffsetAlignment = 256;
+	supportedLimits.limits.maxTextureDimension1D = 8192;
+	supportedLimits.limits.maxTextureDimension2D = 8192;
 	#else
 	adapter.getLimits(&supportedLimits);
 	#endif
 
 
 	RequiredLimits requiredLimits = Default;
-	requiredLimits.limits.maxVertexAttributes = 6;
-	requiredLimits.limits.maxVertexBuffers = 1;
-	requiredLimits.limits.maxBufferSize = 150000 * sizeof(VertexAttributes);
+	// Vertex attributes, plus the 4 columns of the instance matrix, the
+	// texture layers, the tint and the object index
+	requiredLimits.limits.maxVertexAttributes = 13;
+	requiredLimits.limits.maxVertexBuffers = 2;
+	// Large enough for the pool of ClusteredMesh
+	requiredLimits.limits.maxBufferSize = std::max<uint64_t>(150000 * sizeof(VertexAttributes), ClusteredMesh::Settings().poolBytes);
 	requiredLimits.limits.maxVertexBufferArrayStride = sizeof(VertexAttributes);
 	requiredLimits.limits.minStorageBufferOffsetAlignment = supportedLimits.limits.minStorageBufferOffsetAlignment;
 	requiredLimits.limits.minUniformBufferOffsetAlignment = supportedLimits.limits.minUniformBufferOffsetAlignment;
-	requiredLimits.limits.maxInterStageShaderComponents = 17;
-	requiredLimits.limits.maxBindGroups = 2;
-	requiredLimits.limits.maxUniformBuffersPerShaderStage = 2;
-	requiredLimits.limits.maxUniformBufferBindingSize = 16 * 4 * sizeof(float);
-	// Allow textures up to 2K
-	int num = 0;
-
-	GLFWmonitor** some = glfwGetMonitors(&num);
-
-	int xPos, yPos, width, height;
-	glfwGetMonitorWorkarea(*some, &xPos, &yPos, &width, &height);
-
-	requiredLimits.limits.maxTextureDimension1D = width;
-	requiredLimits.limits.maxTextureDimension2D = width;
-	requiredLimits.limits.maxTextureArrayLayers = 1;
-	requiredLimits.limits.maxSampledTexturesPerShaderStage = 2;
-	requiredLimits.limits.maxSamplersPerShaderStage = 1;
+	requiredLimits.limits.maxInterStageShaderComponents = 22;
+	// The object, the environment and the virtual textures
+	requiredLimits.limits.maxBindGroups = 3;
+	// The uniforms of the object and of the lights, and those of the
+	// environment and of the virtual textures
+	requiredLimits.limits.maxUniformBuffersPerShaderStage = 4;
+	requiredLimits.limits.maxUniformBufferBindingSize = std::max<uint32_t>(16 * 4 * sizeof(float), sizeof(VirtualTextures::Uniforms));
+	// Textures as large as the adapter supports, larger ones drop their finer
+	// levels at load (see Loader::setTextureQuality)
+	requiredLimits.limits.maxTextureDimension1D = supportedLimits.limits.maxTextureDimension1D;
+	requiredLimits.limits.maxTextureDimension2D = supportedLimits.limits.maxTextureDimension2D;
+	requiredLimits.limits.maxTextureArrayLayers = std::max(TextureArrays::MaxLayers, VirtualTextures::MaxTextures);
+	// The page table, the two caches and the environment of the virtual pipeline
+	requiredLimits.limits.maxSampledTexturesPerShaderStage = 4;
+	requiredLimits.limits.maxSamplersPerShaderStage = 2;
+	// Mip generation (see MipGenerator)
+	requiredLimits.limits.maxStorageTexturesPerShaderStage = MipGenerator::MaxLevelsPerDispatch;
+	requiredLimits.limits.maxComputeWorkgroupStorageSize = 16 * 16 * 4 * sizeof(float);
+	requiredLimits.limits.maxComputeInvocationsPerWorkgroup = 16 * 16;
+	requiredLimits.limits.maxComputeWorkgroupSizeX = 16;
+	requiredLimits.limits.maxComputeWorkgroupSizeY = 16;
+	requiredLimits.limits.maxComputeWorkgroupSizeZ = 1;
+	requiredLimits.limits.maxComputeWorkgroupsPerDimension = 65535; // default, enough for textures up to 1M
 
 	adapter.hasFeature(wgpu::FeatureName::DepthClipControl);
 
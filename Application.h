@@ -27,6 +27,13 @@
 #include "Helper.h"
 
 #include "GameObject.h"
+#include "MipGenerator.h"
+#include "UploadManager.h"
+#include "PointCloud.h"
+#include "VirtualTextures.h"
+#include "Environment.h"
+#include "FrustumCuller.h"
+#include "SceneBvh.h"
 
 
 // ImGUI
@@ -52,6 +59,10 @@ public:
 	// Return true as long as the main loop should keep on running
 	bool IsRunning();
 
+	// Finest mip levels all the textures drop at load, to run on machines with
+	// less memory. Call before Initialize().
+	void SetSkippedTextureLevels(uint32_t skippedLevels) { m_textureQuality.skippedLevels = skippedLevels; }
+
 	// A function called when the window is resized.
 	void OnResize();
 
@@ -72,6 +83,13 @@ private:
 	void InitSampler();
 
 	bool InitGameObjects();
+	void UpdateClusteredGameObjects();
+	// Swap in the textures decoded since the last frame, request the texture
+	// levels the objects need on screen, and pack the textures that changed
+	// in their arrays
+	void UpdateTextureStreaming();
+	// Get the bind groups of the objects whose textures or arrays changed
+	void UpdateTextureBindings();
 
 	bool InitPipeline();
 	void InitBuffers();
@@ -79,6 +97,16 @@ private:
 	void InitUniforms();
 
 	void UpdateUniforms();
+	// Write the ObjectUniforms of every game object, in a single write
+	void UpdateObjectUniforms();
+	// Upload the instances that changed since the last frame
+	void UpdateInstances();
+	// Write the draw commands of the game objects again if one of them changed
+	void UpdateDrawCommands();
+	// Find the game objects in the view frustum, the others are not drawn
+	void CullGameObjects();
+	// Draw the car `count` times with hardware instancing, in a grid
+	void SetCarCopies(uint32_t count);
 
 	void UpdateWindowDimensions();
 
@@ -92,10 +120,17 @@ private:
 	void TerminateGui();
 	void UpdateGui(wgpu::RenderPassEncoder renderPass);
 
+	// Point cloud mode, only enabled when a point cloud is found in the resources
+	bool InitPointCloud();
+	void TerminatePointCloud();
+	void UpdatePointCloud();
+
 	// Lighting Uniforms
 	bool InitLightingUniforms(); // called in onInit()
 	void TerminateLightingUniforms(); // called in onFinish()
 	void UpdateLightingUniforms(); // called when GUI is tweaked
+	// Sun of the procedural sky, from the first light
+	Environment::Sun GetSun() const;
 
 	TextureView GetNextSurfaceTextureView();
 	RequiredLimits GetRequiredLimits(Adapter adapter) const;
@@ -103,6 +138,15 @@ private:
 private:
 	
 
+	// How game objects off screen are found
+	enum class CullingMode {
+		Off,
+		// Every object against the frustum, see FrustumCuller
+		PerObject,
+		// Down the scene BVH, see SceneBvh
+		Hierarchical,
+	};
+
 	struct CameraState {
 		// angles.x is the rotation of the camera around the global vertical axis, affected by mouse.x
 		// angles.y is the rotation of the camera around its local horizontal axis, affected by mouse.y
@@ -141,6 +185,11 @@ private:
 	BindGroupLayout m_bindGroupLayout = nullptr;
 
 	RenderPipeline m_pipeline;
+	// Objects with virtual textures: group 0 without the textures, and group 2
+	// of VirtualTextures. The feedback pipeline writes the pages they sample.
+	BindGroupLayout m_virtualBindGroupLayout = nullptr;
+	RenderPipeline m_virtualPipeline = nullptr;
+	RenderPipeline m_feedbackPipeline = nullptr;
 	TextureFormat m_surfaceFormat = TextureFormat::Undefined;
 	TextureFormat m_depthTextureFormat = TextureFormat::Undefined;
 
@@ -148,6 +197,23 @@ private:
 	TextureView m_depthTextureView;
 
 	std::vector<GameObject> m_gameObjects;
+	// Textures shared by the game objects
+	std::shared_ptr<TextureRegistry> m_textureRegistry = std::make_shared<TextureRegistry>();
+	TextureStreamer m_textureStreamer;
+	// Arrays the textures of the game objects are packed in, and their bind groups
+	std::shared_ptr<TextureArrays> m_textureArrays = std::make_shared<TextureArrays>();
+	// Pages of the textures too large to be resident
+	std::shared_ptr<VirtualTextures> m_virtualTextures = std::make_shared<VirtualTextures>();
+	// Image based lighting of every object
+	Environment m_environment;
+
+	// Quality tier of the textures, clamped to the limits of the device
+	Loader::TextureQuality m_textureQuality;
+
+	// Builds the mip levels of the textures loaded by the game objects
+	MipGenerator m_mipGenerator;
+	// Stages the texels of the textures until they are copied by the next frame
+	UploadManager m_uploadManager;
 
 	TextureDescriptor m_textureDesc;
 
@@ -155,6 +221,26 @@ private:
 
 	Buffer m_tempBuffer;
 	Buffer m_uniformBuffer;
+	// The GameObject::ObjectUniforms of every game object, in a storage
+	// buffer that the shader indexes with the object index of the instances.
+	// Shared with the objects, it is created once they are all known.
+	std::shared_ptr<Buffer> m_objectUniformBuffer = std::make_shared<Buffer>(nullptr);
+	std::vector<GameObject::ObjectUniforms> m_objectUniforms;
+	// The arguments of the draw calls of every game object, which they draw
+	// with drawIndirect(). Shared with the objects.
+	std::shared_ptr<Buffer> m_drawCommandBuffer = std::make_shared<Buffer>(nullptr);
+	std::vector<GameObject::DrawIndirectArgs> m_drawCommands;
+	bool m_indirectFirstInstance = false;
+	// Visibility of the game objects, indexed by their object index
+	CullingMode m_cullingMode = CullingMode::Hierarchical;
+	std::vector<uint8_t> m_objectVisible;
+	FrustumCuller m_frustumCuller;
+	// Boxes around the game objects, indexed by their object index, and the
+	// hierarchy over them, refit when objects move
+	std::vector<SceneBvh::Bounds> m_objectBounds;
+	SceneBvh m_sceneBvh;
+	std::vector<uint32_t> m_visibleObjects;
+	uint32_t m_carCopies = 1;
 	Buffer m_lightingUniformBuffer = nullptr;
 	GameObject::LightingUniforms m_lightingUniforms;
 
@@ -168,6 +254,14 @@ private:
 	DragState m_drag;
 
 	bool m_lightingUniformsChanged = false;
+
+	PointCloud m_pointCloud;
+	PointCloud::RenderMode m_pointCloudRenderMode = PointCloud::RenderMode::Points;
+	PointCloud::Uniforms m_pointCloudUniforms;
+	RenderPipeline m_pointPipeline = nullptr;
+	RenderPipeline m_splatPipeline = nullptr;
+	Buffer m_pointCloudUniformBuffer = nullptr;
+	BindGroup m_pointCloudBindGroup = nullptr;
 };
 
 #endif // APPLICATION_H
\ No newline at end of file
@@ -0,0 +1,417 @@
+#include "AsyncFileReader.h"
+
+#include "ThreadPool.h"
+
+#include <fstream>
+#include <iostream>
+
+#ifdef ASYNC_FILE_READER_IO_URING
+#  include <linux/io_uring.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <sys/eventfd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#  include <cerrno>
+#  include <cstring>
+#endif // ASYNC_FILE_READER_IO_URING
+
+namespace fs = std::filesystem;
+
+AsyncFileReader::AsyncFileReader()
+{
+#ifdef ASYNC_FILE_READER_IO_URING
+	if (InitRing()) {
+		m_ioThread = std::thread([this]() { IoThreadLoop(); });
+	}
+#endif // ASYNC_FILE_READER_IO_URING
+}
+
+AsyncFileReader::~AsyncFileReader()
+{
+#ifdef ASYNC_FILE_READER_IO_URING
+	if (m_ioThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		WakeIoThread();
+		m_ioThread.join();
+	}
+	TerminateRing();
+#endif // ASYNC_FILE_READER_IO_URING
+}
+
+void AsyncFileReader::ReadBatch(std::vector<Request> requests)
+{
+#ifdef ASYNC_FILE_READER_IO_URING
+	if (m_ring) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (Request& request : requests) {
+				m_incoming.push_back(std::move(request));
+			}
+		}
+		WakeIoThread();
+		return;
+	}
+#endif // ASYNC_FILE_READER_IO_URING
+
+	for (Request& request : requests) {
+		ThreadPool::Shared().Submit([request = std::move(request)]() {
+			// Already on a worker, no need to bounce through Complete()
+			request.onComplete(ReadNow(request));
+		});
+	}
+}
+
+void AsyncFileReader::Read(const fs::path& path, Completion onComplete)
+{
+	Read(path, 0, WholeFile, std::move(onComplete));
+}
+
+void AsyncFileReader::Read(const fs::path& path, uint64_t offset, uint64_t size, Completion onComplete)
+{
+	std::vector<Request> requests(1);
+	requests[0].path = path;
+	requests[0].offset = offset;
+	requests[0].size = size;
+	requests[0].onComplete = std::move(onComplete);
+	ReadBatch(std::move(requests));
+}
+
+std::future<AsyncFileReader::ReadResult> AsyncFileReader::Read(const fs::path& path)
+{
+	auto promise = std::make_shared<std::promise<ReadResult>>();
+	std::future<ReadResult> future = promise->get_future();
+	Read(path, [promise](ReadResult&& result) { promise->set_value(std::move(result)); });
+	return future;
+}
+
+const char* AsyncFileReader::GetBackendName() const
+{
+#ifdef ASYNC_FILE_READER_IO_URING
+	if (m_ring) return "io_uring";
+#endif // ASYNC_FILE_READER_IO_URING
+	return "thread pool";
+}
+
+AsyncFileReader& AsyncFileReader::Shared()
+{
+	static AsyncFileReader reader;
+	return reader;
+}
+
+AsyncFileReader::ReadResult AsyncFileReader::ReadNow(const Request& request)
+{
+	ReadResult result;
+	result.path = request.path;
+
+	std::ifstream file(request.path, std::ios::binary);
+	if (!file.is_open()) {
+		return result;
+	}
+	file.seekg(0, std::ios::end);
+	uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+	uint64_t offset = std::min(request.offset, fileSize);
+	uint64_t size = std::min(request.size, fileSize - offset);
+
+	result.bytes.resize(size);
+	file.seekg(offset);
+	file.read(reinterpret_cast<char*>(result.bytes.data()), size);
+	result.success = static_cast<bool>(file);
+	return result;
+}
+
+void AsyncFileReader::Complete(Completion onComplete, ReadResult&& result)
+{
+	auto shared = std::make_shared<ReadResult>(std::move(result));
+	ThreadPool::Shared().Submit([onComplete = std::move(onComplete), shared]() {
+		onComplete(std::move(*shared));
+	});
+}
+
+
+#ifdef ASYNC_FILE_READER_IO_URING
+
+namespace {
+	// Reads in flight at once, one ring slot is kept for the wake-up poll
+	constexpr unsigned RingEntries = 64;
+	constexpr unsigned MaxInFlight = RingEntries - 1;
+	// user_data of the poll on the wake-up eventfd
+	constexpr uint64_t WakeTag = 0;
+
+	int ioUringSetup(unsigned entries, io_uring_params* params) {
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+	}
+} // namespace
+
+// The three shared memory regions of an io_uring, as documented in io_uring(7).
+struct AsyncFileReader::Ring {
+	int fd = -1;
+
+	void* sqRing = MAP_FAILED;
+	size_t sqRingSize = 0;
+	void* cqRing = MAP_FAILED;
+	size_t cqRingSize = 0;
+	io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t sqesSize = 0;
+
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	io_uring_cqe* cqes;
+	// Tail of the entries returned by NextSqe(), ahead of *sqTail until
+	// Publish()
+	unsigned sqeTail = 0;
+
+	// Return a zeroed submission entry, or nullptr if the ring is full. The
+	// kernel does not see it before Publish(), so it can be filled in first.
+	io_uring_sqe* NextSqe() {
+		if (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) return nullptr;
+		unsigned index = sqeTail & *sqMask;
+		io_uring_sqe* sqe = &sqes[index];
+		std::memset(sqe, 0, sizeof(*sqe));
+		sqArray[index] = index;
+		++sqeTail;
+		return sqe;
+	}
+
+	// Hand the entries filled in since the last call to the kernel, with one
+	// release store of the tail. Returns how many entries the kernel has not
+	// consumed yet, which includes those left by an interrupted
+	// io_uring_enter: that is the count to submit.
+	unsigned Publish() {
+		__atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+		return sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	}
+};
+
+// A read submitted to the ring. Its address is the sqe's user_data, and it
+// owns the iovec the kernel reads from until the completion arrives.
+struct AsyncFileReader::InFlightRead {
+	Request request;
+	int fd = -1;
+	uint64_t size = 0;
+	uint64_t done = 0;
+	std::vector<unsigned char> bytes;
+	iovec vector;
+};
+
+bool AsyncFileReader::InitRing()
+{
+	auto ring = std::make_unique<Ring>();
+
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	ring->fd = ioUringSetup(RingEntries, &params);
+	if (ring->fd < 0) {
+		std::cout << "io_uring not available (" << std::strerror(errno) << "), using thread pool reads" << std::endl;
+		return false;
+	}
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap) {
+		ring->sqRingSize = ring->cqRingSize = std::max(ring->sqRingSize, ring->cqRingSize);
+	}
+
+	ring->sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cqRing = singleMmap
+		? ring->sqRing
+		: mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	ring->sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES));
+
+	m_ring = std::move(ring);
+	if (m_ring->sqRing == MAP_FAILED || m_ring->cqRing == MAP_FAILED || m_ring->sqes == MAP_FAILED) {
+		TerminateRing();
+		return false;
+	}
+
+	char* sq = static_cast<char*>(m_ring->sqRing);
+	char* cq = static_cast<char*>(m_ring->cqRing);
+	m_ring->sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	m_ring->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	m_ring->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	m_ring->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	m_ring->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	m_ring->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	m_ring->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	m_ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	m_ring->sqeTail = *m_ring->sqTail;
+
+	// Used to interrupt the I/O thread when it waits for completions
+	m_wakeFd = eventfd(0, EFD_CLOEXEC);
+	if (m_wakeFd < 0) {
+		TerminateRing();
+		return false;
+	}
+	return true;
+}
+
+void AsyncFileReader::TerminateRing()
+{
+	if (m_wakeFd >= 0) {
+		close(m_wakeFd);
+		m_wakeFd = -1;
+	}
+	if (!m_ring) return;
+
+	if (m_ring->sqes != MAP_FAILED) munmap(m_ring->sqes, m_ring->sqesSize);
+	if (m_ring->cqRing != MAP_FAILED && m_ring->cqRing != m_ring->sqRing) munmap(m_ring->cqRing, m_ring->cqRingSize);
+	if (m_ring->sqRing != MAP_FAILED) munmap(m_ring->sqRing, m_ring->sqRingSize);
+	close(m_ring->fd);
+	m_ring.reset();
+}
+
+void AsyncFileReader::WakeIoThread()
+{
+	uint64_t one = 1;
+	ssize_t written = write(m_wakeFd, &one, sizeof(one));
+	(void)written; // the counter saturating is fine, the thread wakes up anyway
+}
+
+void AsyncFileReader::IoThreadLoop()
+{
+	std::deque<Request> waiting;
+	unsigned inFlight = 0;
+	bool wakePollArmed = false;
+
+	auto fail = [](Request& request) {
+		ReadResult result;
+		result.path = request.path;
+		Complete(std::move(request.onComplete), std::move(result));
+	};
+
+	auto submitRead = [this](InFlightRead* read) {
+		io_uring_sqe* sqe = m_ring->NextSqe();
+		uint64_t remaining = read->size - read->done;
+		read->vector.iov_base = read->bytes.data() + read->done;
+		read->vector.iov_len = static_cast<size_t>(std::min<uint64_t>(remaining, 1u << 30));
+		// READV rather than READ to support kernels older than 5.6
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = read->fd;
+		sqe->addr = reinterpret_cast<uint64_t>(&read->vector);
+		sqe->len = 1;
+		sqe->off = read->request.offset + read->done;
+		sqe->user_data = reinterpret_cast<uint64_t>(read);
+	};
+
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			while (!m_incoming.empty()) {
+				waiting.push_back(std::move(m_incoming.front()));
+				m_incoming.pop_front();
+			}
+			if (m_stopping && waiting.empty() && inFlight == 0) break;
+		}
+
+		// Open and submit as many reads as the ring allows, in one syscall
+		while (!waiting.empty() && inFlight < MaxInFlight) {
+			Request request = std::move(waiting.front());
+			waiting.pop_front();
+
+			int fd = open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+			struct stat fileStat;
+			if (fd < 0 || fstat(fd, &fileStat) != 0) {
+				if (fd >= 0) close(fd);
+				fail(request);
+				continue;
+			}
+
+			auto read = std::make_unique<InFlightRead>();
+			uint64_t fileSize = static_cast<uint64_t>(fileStat.st_size);
+			read->fd = fd;
+			read->request = std::move(request);
+			read->request.offset = std::min(read->request.offset, fileSize);
+			read->size = std::min(read->request.size, fileSize - read->request.offset);
+			read->bytes.resize(read->size);
+
+			if (read->size == 0) {
+				close(fd);
+				ReadResult result;
+				result.path = read->request.path;
+				result.success = true;
+				Complete(std::move(read->request.onComplete), std::move(result));
+				continue;
+			}
+
+			submitRead(read.release());
+			++inFlight;
+		}
+
+		if (!wakePollArmed) {
+			io_uring_sqe* sqe = m_ring->NextSqe();
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = m_wakeFd;
+			sqe->poll_events = POLLIN;
+			sqe->user_data = WakeTag;
+			wakePollArmed = true;
+		}
+
+		int entered = ioUringEnter(m_ring->fd, m_ring->Publish(), 1, IORING_ENTER_GETEVENTS);
+		if (entered < 0 && errno != EINTR) {
+			std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+			break;
+		}
+
+		// Reap completions
+		unsigned head = *m_ring->cqHead;
+		bool resubmitted = false;
+		while (head != __atomic_load_n(m_ring->cqTail, __ATOMIC_ACQUIRE)) {
+			io_uring_cqe cqe = m_ring->cqes[head & *m_ring->cqMask];
+			++head;
+
+			if (cqe.user_data == WakeTag) {
+				uint64_t counter;
+				ssize_t readBytes = ::read(m_wakeFd, &counter, sizeof(counter));
+				(void)readBytes;
+				wakePollArmed = false;
+				continue;
+			}
+
+			InFlightRead* read = reinterpret_cast<InFlightRead*>(cqe.user_data);
+			if (cqe.res > 0) {
+				read->done += static_cast<uint64_t>(cqe.res);
+				if (read->done < read->size) {
+					// Short read, ask for the rest
+					submitRead(read);
+					resubmitted = true;
+					continue;
+				}
+			}
+
+			ReadResult result;
+			result.path = read->request.path;
+			result.success = cqe.res >= 0;
+			result.bytes = std::move(read->bytes);
+			result.bytes.resize(read->done); // the file may have shrunk (res == 0)
+			close(read->fd);
+			Complete(std::move(read->request.onComplete), std::move(result));
+			delete read;
+			--inFlight;
+		}
+		__atomic_store_n(m_ring->cqHead, head, __ATOMIC_RELEASE);
+
+		// If interrupted, the next io_uring_enter submits them
+		if (resubmitted) {
+			ioUringEnter(m_ring->fd, m_ring->Publish(), 0, 0);
+		}
+	}
+}
+
+#endif // ASYNC_FILE_READER_IO_URING
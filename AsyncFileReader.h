@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__) && __has_include(<linux/io_uring.h>)
+#  define ASYNC_FILE_READER_IO_URING
+#endif
+
+// Asynchronous file reads for asset loading.
+//
+// On Linux, reads are submitted in batches to an io_uring from a dedicated
+// I/O thread, so dozens of files are in flight at once (this matters most on
+// network storage). Elsewhere, or when io_uring is not available (old kernel,
+// seccomp), each read is a blocking read on the shared ThreadPool instead.
+//
+// Either way, the completion callback runs on the ThreadPool as soon as the
+// bytes of that file are there, so decoding overlaps with the remaining I/O.
+class AsyncFileReader {
+public:
+	static constexpr uint64_t WholeFile = ~0ull;
+
+	struct ReadResult {
+		std::filesystem::path path;
+		bool success = false;
+		std::vector<unsigned char> bytes;
+	};
+	using Completion = std::function<void(ReadResult&& result)>;
+
+	struct Request {
+		std::filesystem::path path;
+		uint64_t offset = 0;
+		uint64_t size = WholeFile; // clamped to the end of the file
+		Completion onComplete;
+	};
+
+	AsyncFileReader();
+	~AsyncFileReader();
+
+	AsyncFileReader(const AsyncFileReader&) = delete;
+	AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+	// Queue many reads at once; completions may run in any order.
+	void ReadBatch(std::vector<Request> requests);
+	void Read(const std::filesystem::path& path, Completion onComplete);
+	void Read(const std::filesystem::path& path, uint64_t offset, uint64_t size, Completion onComplete);
+
+	// Convenience for callers that just want to wait for the bytes
+	std::future<ReadResult> Read(const std::filesystem::path& path);
+
+	const char* GetBackendName() const;
+
+	static AsyncFileReader& Shared();
+
+private:
+	// Blocking read used by the fallback backend
+	static ReadResult ReadNow(const Request& request);
+	static void Complete(Completion onComplete, ReadResult&& result);
+
+#ifdef ASYNC_FILE_READER_IO_URING
+	struct Ring;
+	struct InFlightRead;
+
+	bool InitRing();
+	void TerminateRing();
+	void IoThreadLoop();
+	void WakeIoThread();
+
+	std::unique_ptr<Ring> m_ring;
+	std::thread m_ioThread;
+	int m_wakeFd = -1;
+	std::mutex m_mutex;
+	std::deque<Request> m_incoming;
+	bool m_stopping = false;
+#endif // ASYNC_FILE_READER_IO_URING
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CPU encoders for the BC (a.k.a. DXT) block compressed texture formats.
+//
+// Images are RGBA8 with tightly packed rows, and are encoded as blocks of 4x4
+// texels. Edge blocks of images whose size is not a multiple of 4 repeat the
+// last row and column. Blocks are independent, so rows of blocks are encoded
+// in parallel on the shared ThreadPool.
+class BlockCompression
+{
+public:
+	enum class Format {
+		BC1, // RGB in 8 bytes per block, for opaque masks
+		BC5, // RG in 16 bytes per block, for normal maps (Z is reconstructed)
+		BC7, // RGBA in 16 bytes per block, for colors
+	};
+
+	// Bytes of one block of 4x4 texels
+	static uint32_t blockBytes(Format format);
+	// Bytes of an image of width x height texels, once encoded
+	static size_t encodedSize(uint32_t width, uint32_t height, Format format);
+
+	// Encode `image` (width x height) into `blocks`, which must hold
+	// encodedSize(width, height, format) bytes. Blocks are stored row by row.
+	static void encodeImage(const unsigned char* image, uint32_t width, uint32_t height, Format format,
+		unsigned char* blocks, bool multithreaded = true);
+
+	// Encoders of a single block, `texels` is 16 RGBA8 texels row by row.
+	// BC1 uses 4-color blocks and ignores alpha.
+	static void encodeBlockBC1(const unsigned char texels[64], unsigned char block[8]);
+	// BC5 keeps the red and green channels, each as a BC4 block.
+	static void encodeBlockBC5(const unsigned char texels[64], unsigned char block[16]);
+	// BC7 uses mode 6 only (one subset, 7-bit RGBA endpoints with a p-bit,
+	// 4-bit indices), which handles smooth colors and alpha well.
+	static void encodeBlockBC7(const unsigned char texels[64], unsigned char block[16]);
+};
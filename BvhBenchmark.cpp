@@ -0,0 +1,106 @@
+// Measure building and refitting the scene BVH (see SceneBvh) over 100k
+// objects, on one thread and on the shared ThreadPool, and culling against
+// it. Built only with -DBUILD_BENCHMARKS=ON.
+//
+// Usage: BvhBenchmark [object count]
+
+#include "SceneBvh.h"
+#include "Frustum.h"
+#include "ThreadPool.h"
+
+#include <glm/ext.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+namespace {
+	// Written after each run so that the work is not optimized out
+	volatile size_t g_sink = 0;
+
+	// Objects scattered along a closed track, the way the scenes are laid out:
+	// dense along a ring of a kilometer, sparse around it
+	std::vector<SceneBvh::Bounds> generateTrack(uint32_t count) {
+		std::vector<SceneBvh::Bounds> bounds(count);
+		uint32_t seed = 12345;
+		auto random = [&seed]() {
+			seed = seed * 1664525u + 1013904223u;
+			return static_cast<float>(seed >> 8) / static_cast<float>(1 << 24);
+		};
+		for (SceneBvh::Bounds& box : bounds) {
+			float angle = 2.0f * glm::pi<float>() * random();
+			float distance = 160.0f + 40.0f * (random() - 0.5f) * (random() < 0.9f ? 1.0f : 10.0f);
+			glm::vec3 center(distance * std::cos(angle), distance * std::sin(angle), 5.0f * random());
+			glm::vec3 halfSize = glm::vec3(0.2f) + 2.0f * glm::vec3(random(), random(), random());
+			box.min = center - halfSize;
+			box.max = center + halfSize;
+		}
+		return bounds;
+	}
+
+	// Move every `stride`-th object a little
+	void moveObjects(std::vector<SceneBvh::Bounds>& bounds, uint32_t stride, float step) {
+		for (size_t i = 0; i < bounds.size(); i += stride) {
+			glm::vec3 offset(step * std::sin(static_cast<float>(i)), step * std::cos(static_cast<float>(i)), 0.0f);
+			bounds[i].min += offset;
+			bounds[i].max += offset;
+		}
+	}
+
+	// Best of a few runs, in milliseconds
+	double timeBest(const std::function<void()>& setup, const std::function<void()>& run) {
+		double best = 1e30;
+		for (int i = 0; i < 5; ++i) {
+			setup();
+			auto start = std::chrono::steady_clock::now();
+			run();
+			auto end = std::chrono::steady_clock::now();
+			best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+		}
+		return best;
+	}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	uint32_t count = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 100000;
+	std::vector<SceneBvh::Bounds> bounds = generateTrack(count);
+	SceneBvh bvh;
+
+	std::cout << count << " objects, worker threads: " << ThreadPool::Shared().GetThreadCount() << std::endl;
+
+	double single = timeBest([]() {}, [&]() { bvh.Build(bounds, false); });
+	double multi = timeBest([]() {}, [&]() { bvh.Build(bounds, true); });
+	const SceneBvh::Stats& stats = bvh.GetStats();
+	std::cout << "Build: " << single << " ms on one thread, " << multi << " ms on the pool (x" << single / multi << "), "
+		<< stats.nodeCount << " nodes, depth " << stats.depth << ", SAH cost " << stats.buildCost << std::endl;
+
+	// Refits of every object, then of 1% of them
+	for (uint32_t stride : { 1u, 100u }) {
+		auto setBounds = [&]() {
+			moveObjects(bounds, stride, 0.1f);
+			for (size_t i = 0; i < bounds.size(); i += stride) {
+				bvh.SetBounds(static_cast<uint32_t>(i), bounds[i]);
+			}
+		};
+		single = timeBest(setBounds, [&]() { bvh.Refit(false); });
+		multi = timeBest(setBounds, [&]() { bvh.Refit(true); });
+		std::cout << "Refit of " << (count + stride - 1) / stride << " objects: " << single << " ms on one thread, "
+			<< multi << " ms on the pool (x" << single / multi << "), SAH cost " << bvh.GetStats().cost << std::endl;
+	}
+
+	// A camera on the track, looking along it
+	glm::mat4x4 projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 500.0f);
+	glm::mat4x4 view = glm::lookAt(glm::vec3(160.0f, 0.0f, 2.0f), glm::vec3(160.0f, 50.0f, 2.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+	Frustum frustum(projection * view);
+	std::vector<uint32_t> visible;
+	double culling = timeBest([&]() { visible.clear(); }, [&]() { bvh.Cull(frustum, visible); });
+	g_sink = visible.size();
+	std::cout << "Cull: " << culling << " ms, " << bvh.GetStats().visibleObjects << " objects visible, "
+		<< bvh.GetStats().testedNodes << " nodes tested" << std::endl;
+	return 0;
+}
@@ -0,0 +1,771 @@
+#include "ClusteredMesh.h"
+
+#include "Frustum.h"
+#include "AsyncFileReader.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+
+namespace {
+	constexpr uint32_t ClustersMagic = 0x534D4C43; // "CLMS"
+	constexpr uint32_t ClustersVersion = 1;
+
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t clusterCount;
+		uint32_t maxClusterVertices;
+	};
+
+	// Interleave the lower 10 bits of x with two zero bits
+	uint32_t expandBits(uint32_t x) {
+		x = (x | (x << 16)) & 0x030000FF;
+		x = (x | (x << 8)) & 0x0300F00F;
+		x = (x | (x << 4)) & 0x030C30C3;
+		x = (x | (x << 2)) & 0x09249249;
+		return x;
+	}
+
+	uint32_t mortonCode(const glm::vec3& normalized) {
+		glm::uvec3 cell = glm::uvec3(glm::clamp(normalized * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f)));
+		return expandBits(cell.x) | (expandBits(cell.y) << 1) | (expandBits(cell.z) << 2);
+	}
+
+	// The cook never holds the whole mesh in memory. Triangles are split in
+	// buckets of at most this many, by the top bits of their Morton code, and
+	// each bucket is sorted on its own.
+	constexpr uint64_t BucketTriangles = 1 << 18;
+	constexpr uint32_t BucketPrefixBits = 16;
+	// Triangles buffered per bucket before they are appended to the bucket file
+	constexpr size_t BucketFlushTriangles = 256;
+	// Triangles read at once from the triangle file
+	constexpr size_t TriangleBlockSize = 65536;
+
+	constexpr uint32_t NoIndex = ~0u;
+
+	// Intermediate files of the cook: the OBJ attributes, already converted to
+	// our frame, and the faces as indices into them (0-based, NoIndex when the
+	// OBJ gives no uv or normal).
+	struct ObjVertex {
+		glm::vec3 position;
+		glm::vec3 color;
+	};
+	struct ObjCorner {
+		uint32_t position;
+		uint32_t uv;
+		uint32_t normal;
+	};
+	struct ObjTriangle {
+		ObjCorner corners[3];
+	};
+
+	// What bucket files contain
+	struct SortedTriangle {
+		uint32_t code;
+		Loader::VertexAttributes vertices[3];
+	};
+
+	template <typename T>
+	bool writeRecords(const fs::path& path, const std::vector<T>& records, bool append = false) {
+		std::ofstream file(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+		file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T));
+		return static_cast<bool>(file);
+	}
+
+	template <typename T>
+	bool readRecords(const fs::path& path, std::vector<T>& records) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) return false;
+		file.seekg(0, std::ios::end);
+		size_t size = file.tellg();
+		file.seekg(0);
+		records.resize(size / sizeof(T));
+		file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(T));
+		return static_cast<bool>(file);
+	}
+
+	// Turn a 1-based OBJ index, or a negative one relative to the end of what
+	// was read so far, into a 0-based index. 0 means absent.
+	uint32_t resolveIndex(long index, uint64_t count) {
+		if (index > 0) return static_cast<uint32_t>(index - 1);
+		if (index < 0 && (uint64_t)(-index) <= count) return static_cast<uint32_t>(count + index);
+		return NoIndex;
+	}
+
+	struct ObjCounts {
+		uint64_t positions = 0;
+		uint64_t uvs = 0;
+		uint64_t normals = 0;
+		uint64_t faces = 0;
+	};
+
+	// Pass 1: stream the OBJ file line by line into the attribute files and
+	// the face file of `tempDir`. Each face is stored as its corner count
+	// followed by its corners.
+	bool splitObj(const fs::path& objPath, const fs::path& tempDir, ObjCounts& counts) {
+		std::ifstream obj(objPath);
+		if (!obj.is_open()) return false;
+		std::ofstream positions(tempDir / "positions.bin", std::ios::binary);
+		std::ofstream uvs(tempDir / "uvs.bin", std::ios::binary);
+		std::ofstream normals(tempDir / "normals.bin", std::ios::binary);
+		std::ofstream faces(tempDir / "faces.bin", std::ios::binary);
+
+		std::string line;
+		double values[6];
+		std::vector<ObjCorner> face;
+		while (getline(obj, line)) {
+			// overcome the `CRLF` problem
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			size_t keywordEnd = line.find_first_of(" \t");
+			if (keywordEnd == std::string::npos) {
+				continue;
+			}
+			std::string keyword = line.substr(0, keywordEnd);
+
+			// strtod is much faster than istringstream on the huge files this is meant for
+			const char* cursor = line.c_str() + keywordEnd;
+			auto readValues = [&](int maxCount) {
+				int count = 0;
+				for (; count < maxCount; ++count) {
+					char* end = nullptr;
+					values[count] = std::strtod(cursor, &end);
+					if (end == cursor) break;
+					cursor = end;
+				}
+				return count;
+			};
+
+			if (keyword == "v") {
+				// Optional vertex colors follow the position, white otherwise
+				int count = readValues(6);
+				if (count < 3) return false;
+				ObjVertex vertex;
+				// OBJ files are Y-up, convert to our Z-up frame
+				vertex.position = glm::vec3(values[0], -values[2], values[1]);
+				vertex.color = count == 6 ? glm::vec3(values[3], values[4], values[5]) : glm::vec3(1.0f);
+				positions.write(reinterpret_cast<const char*>(&vertex), sizeof(vertex));
+				++counts.positions;
+			}
+			else if (keyword == "vt") {
+				if (readValues(2) < 2) return false;
+				glm::vec2 uv(values[0], 1.0 - values[1]);
+				uvs.write(reinterpret_cast<const char*>(&uv), sizeof(uv));
+				++counts.uvs;
+			}
+			else if (keyword == "vn") {
+				if (readValues(3) < 3) return false;
+				glm::vec3 normal(values[0], -values[2], values[1]);
+				normals.write(reinterpret_cast<const char*>(&normal), sizeof(normal));
+				++counts.normals;
+			}
+			else if (keyword == "f") {
+				// Corners are v, v/vt, v//vn or v/vt/vn
+				face.clear();
+				while (true) {
+					char* end = nullptr;
+					long v = std::strtol(cursor, &end, 10);
+					if (end == cursor) break;
+					cursor = end;
+					long vt = 0, vn = 0;
+					if (*cursor == '/') {
+						++cursor;
+						if (*cursor != '/') {
+							vt = std::strtol(cursor, &end, 10);
+							cursor = end;
+						}
+						if (*cursor == '/') {
+							++cursor;
+							vn = std::strtol(cursor, &end, 10);
+							cursor = end;
+						}
+					}
+					face.push_back({ resolveIndex(v, counts.positions), resolveIndex(vt, counts.uvs), resolveIndex(vn, counts.normals) });
+				}
+				// Like tinyobj, faces of less than 3 corners are skipped
+				if (face.size() < 3) continue;
+				uint32_t cornerCount = static_cast<uint32_t>(face.size());
+				faces.write(reinterpret_cast<const char*>(&cornerCount), sizeof(cornerCount));
+				faces.write(reinterpret_cast<const char*>(face.data()), face.size() * sizeof(ObjCorner));
+				++counts.faces;
+			}
+		}
+		return positions && uvs && normals && faces;
+	}
+
+	// The attribute files of pass 1, mapped so that faces can index them in
+	// any order without loading them.
+	class ObjAttributes {
+	public:
+		bool Open(const fs::path& tempDir, const ObjCounts& counts) {
+			m_counts = counts;
+			// Empty files cannot be mapped, but then no face refers to them
+			return m_positions.Open(tempDir / "positions.bin")
+				&& (counts.uvs == 0 || m_uvs.Open(tempDir / "uvs.bin"))
+				&& (counts.normals == 0 || m_normals.Open(tempDir / "normals.bin"));
+		}
+
+		// Whether all the indices of the corner are in range
+		bool IsValid(const ObjCorner& corner) const {
+			return corner.position < m_counts.positions
+				&& (corner.uv == NoIndex || corner.uv < m_counts.uvs)
+				&& (corner.normal == NoIndex || corner.normal < m_counts.normals);
+		}
+
+		const glm::vec3& Position(const ObjCorner& corner) const {
+			return reinterpret_cast<const ObjVertex*>(m_positions.GetData())[corner.position].position;
+		}
+
+		// Same attributes as Loader::loadGeometryFromObj(), with the face normal
+		// when the OBJ has none and the uv at the origin when it has no uvs.
+		void GetVertices(const ObjTriangle& triangle, Loader::VertexAttributes vertices[3]) const {
+			const ObjVertex* objVertices = reinterpret_cast<const ObjVertex*>(m_positions.GetData());
+			const glm::vec2* uvs = reinterpret_cast<const glm::vec2*>(m_uvs.GetData());
+			const glm::vec3* normals = reinterpret_cast<const glm::vec3*>(m_normals.GetData());
+			const ObjCorner* corners = triangle.corners;
+			glm::vec3 faceNormal = glm::cross(Position(corners[1]) - Position(corners[0]), Position(corners[2]) - Position(corners[0]));
+			faceNormal = glm::length(faceNormal) > 0.0f ? glm::normalize(faceNormal) : glm::vec3(0.0f, 0.0f, 1.0f);
+			for (int i = 0; i < 3; ++i) {
+				const ObjVertex& objVertex = objVertices[corners[i].position];
+				vertices[i].position = objVertex.position;
+				vertices[i].color = objVertex.color;
+				vertices[i].normal = corners[i].normal != NoIndex ? normals[corners[i].normal] : faceNormal;
+				vertices[i].uv = corners[i].uv != NoIndex ? uvs[corners[i].uv] : glm::vec2(0.0f);
+			}
+			Loader::populateTextureFrameAttributes(vertices, 3);
+		}
+
+	private:
+		ObjCounts m_counts;
+		MappedFile m_positions;
+		MappedFile m_uvs;
+		MappedFile m_normals;
+	};
+
+	// Whether (x, y) is inside the polygon, see https://wrf.ecse.rpi.edu//Research/Short_Notes/pnpoly.html
+	bool insidePolygon(int count, const float* xs, const float* ys, float x, float y) {
+		bool inside = false;
+		for (int i = 0, j = count - 1; i < count; j = i++) {
+			if ((ys[i] > y) != (ys[j] > y) && x < (xs[j] - xs[i]) * (y - ys[i]) / (ys[j] - ys[i]) + xs[i]) {
+				inside = !inside;
+			}
+		}
+		return inside;
+	}
+
+	// Split a face in triangles the same way tinyobj does for
+	// Loader::loadGeometryFromObj(), so that both give the same mesh: quads
+	// along their shortest diagonal, larger polygons by ear clipping in the
+	// plane of the two axes along which they are the widest.
+	void triangulate(std::vector<ObjCorner>& face, const ObjAttributes& attributes, std::vector<ObjTriangle>& triangles) {
+		if (face.size() == 3) {
+			triangles.push_back({ { face[0], face[1], face[2] } });
+			return;
+		}
+		if (face.size() == 4) {
+			float diagonal02 = glm::length(attributes.Position(face[2]) - attributes.Position(face[0]));
+			float diagonal13 = glm::length(attributes.Position(face[3]) - attributes.Position(face[1]));
+			if (diagonal02 < diagonal13) {
+				triangles.push_back({ { face[0], face[1], face[2] } });
+				triangles.push_back({ { face[0], face[2], face[3] } });
+			}
+			else {
+				triangles.push_back({ { face[0], face[1], face[3] } });
+				triangles.push_back({ { face[1], face[2], face[3] } });
+			}
+			return;
+		}
+
+		// Back to the Y-up frame of the OBJ file, in which tinyobj picks the axes
+		auto objPosition = [&](const ObjCorner& corner) {
+			glm::vec3 position = attributes.Position(corner);
+			return glm::vec3(position.x, position.z, -position.y);
+		};
+		int axes[2] = { 1, 2 };
+		for (size_t k = 0; k < face.size(); ++k) {
+			glm::vec3 p0 = objPosition(face[k]);
+			glm::vec3 p1 = objPosition(face[(k + 1) % face.size()]);
+			glm::vec3 p2 = objPosition(face[(k + 2) % face.size()]);
+			glm::vec3 c = glm::abs(glm::cross(p1 - p0, p2 - p1));
+			float epsilon = std::numeric_limits<float>::epsilon();
+			if (c.x > epsilon || c.y > epsilon || c.z > epsilon) {
+				if (!(c.x > c.y && c.x > c.z)) {
+					axes[0] = 0;
+					if (c.z > c.x && c.z > c.y) axes[1] = 1;
+				}
+				break;
+			}
+		}
+
+		// Cut ears until a triangle is left, or give up when no ear is found in
+		// a whole turn (e.g. degenerate polygons)
+		size_t guess = 0;
+		size_t remainingIterations = face.size();
+		size_t previousCount = face.size();
+		while (face.size() > 3 && remainingIterations > 0) {
+			size_t count = face.size();
+			if (guess >= count) guess -= count;
+			if (previousCount != count) {
+				previousCount = count;
+				remainingIterations = count;
+			}
+			else {
+				--remainingIterations;
+			}
+
+			float xs[3], ys[3];
+			for (size_t k = 0; k < 3; ++k) {
+				glm::vec3 position = objPosition(face[(guess + k) % count]);
+				xs[k] = position[axes[0]];
+				ys[k] = position[axes[1]];
+			}
+			// Reflex corner (the "area" is tinyobj's, not the actual one)
+			float cross = (xs[1] - xs[0]) * (ys[2] - ys[1]) - (ys[1] - ys[0]) * (xs[2] - xs[1]);
+			float area = (xs[0] * ys[1] - ys[0] * xs[1]) * 0.5f;
+			if (cross * area < 0.0f) {
+				++guess;
+				continue;
+			}
+			// Other corners inside the ear
+			bool overlap = false;
+			for (size_t other = 3; other < count && !overlap; ++other) {
+				glm::vec3 position = objPosition(face[(guess + other) % count]);
+				overlap = insidePolygon(3, xs, ys, position[axes[0]], position[axes[1]]);
+			}
+			if (overlap) {
+				++guess;
+				continue;
+			}
+
+			triangles.push_back({ { face[guess % count], face[(guess + 1) % count], face[(guess + 2) % count] } });
+			face.erase(face.begin() + (guess + 1) % count);
+		}
+		if (face.size() == 3) {
+			triangles.push_back({ { face[0], face[1], face[2] } });
+		}
+	}
+
+	// Pass 2: split the faces of the face file in triangles, written to the
+	// triangle file. Return the number of triangles, 0 on error.
+	uint64_t triangulateFaces(const fs::path& tempDir, const ObjCounts& counts, const ObjAttributes& attributes) {
+		std::ifstream faces(tempDir / "faces.bin", std::ios::binary);
+		std::ofstream output(tempDir / "triangles.bin", std::ios::binary);
+		std::vector<ObjCorner> face;
+		std::vector<ObjTriangle> triangles;
+		uint64_t triangleCount = 0;
+		for (uint64_t f = 0; f < counts.faces; ++f) {
+			uint32_t cornerCount = 0;
+			faces.read(reinterpret_cast<char*>(&cornerCount), sizeof(cornerCount));
+			face.resize(cornerCount);
+			faces.read(reinterpret_cast<char*>(face.data()), face.size() * sizeof(ObjCorner));
+			if (!faces) return 0;
+			for (const ObjCorner& corner : face) {
+				if (!attributes.IsValid(corner)) {
+					std::cerr << "Invalid face index" << std::endl;
+					return 0;
+				}
+			}
+
+			triangulate(face, attributes, triangles);
+			if (triangles.size() >= TriangleBlockSize || f + 1 == counts.faces) {
+				output.write(reinterpret_cast<const char*>(triangles.data()), triangles.size() * sizeof(ObjTriangle));
+				triangleCount += triangles.size();
+				triangles.clear();
+			}
+		}
+		return output ? triangleCount : 0;
+	}
+
+	// Call onTriangle for each triangle of the triangle file, reading it by blocks
+	void forEachTriangle(const fs::path& tempDir, const std::function<void(const ObjTriangle&)>& onTriangle) {
+		std::ifstream file(tempDir / "triangles.bin", std::ios::binary);
+		std::vector<ObjTriangle> block(TriangleBlockSize);
+		while (file) {
+			file.read(reinterpret_cast<char*>(block.data()), block.size() * sizeof(ObjTriangle));
+			size_t count = static_cast<size_t>(file.gcount()) / sizeof(ObjTriangle);
+			for (size_t i = 0; i < count; ++i) {
+				onTriangle(block[i]);
+			}
+		}
+	}
+} // namespace
+
+bool ClusteredMesh::Cook(const fs::path& objPath, const fs::path& cookedPath, uint32_t clusterTriangles)
+{
+	// The source may not fit in memory, so it is cooked in streamed passes
+	// through intermediate files next to the cooked one.
+	fs::path tempDir = fs::path(cookedPath).concat(".tmp");
+	std::error_code error;
+	fs::remove_all(tempDir, error);
+	fs::create_directories(tempDir, error);
+	auto fail = [&](const char* message) {
+		std::cerr << message << " " << objPath << std::endl;
+		fs::remove_all(tempDir, error);
+		return false;
+	};
+
+	// Pass 1: convert the OBJ into attribute and face files
+	ObjCounts counts;
+	if (!splitObj(objPath, tempDir, counts)) {
+		return fail("Could not read OBJ file");
+	}
+	ObjAttributes attributes;
+	if (counts.faces == 0 || !attributes.Open(tempDir, counts)) {
+		return fail("No face in OBJ file");
+	}
+
+	// Pass 2: split faces in triangles
+	uint64_t triangleCount = triangulateFaces(tempDir, counts, attributes);
+	if (triangleCount == 0) {
+		return fail("Could not triangulate OBJ file");
+	}
+
+	// Pass 3: bounds of the triangles, to normalize Morton codes
+	glm::vec3 boundsMin(std::numeric_limits<float>::max());
+	glm::vec3 boundsMax(std::numeric_limits<float>::lowest());
+	forEachTriangle(tempDir, [&](const ObjTriangle& triangle) {
+		for (const ObjCorner& corner : triangle.corners) {
+			boundsMin = glm::min(boundsMin, attributes.Position(corner));
+			boundsMax = glm::max(boundsMax, attributes.Position(corner));
+		}
+	});
+	glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(1e-6f));
+	auto triangleCode = [&](const ObjTriangle& triangle) {
+		const ObjCorner* corners = triangle.corners;
+		glm::vec3 centroid = (attributes.Position(corners[0]) + attributes.Position(corners[1]) + attributes.Position(corners[2])) / 3.0f;
+		return mortonCode((centroid - boundsMin) / extent);
+	};
+
+	// Pass 4: count triangles per Morton prefix, and group consecutive
+	// prefixes in buckets small enough to be sorted in memory. A prefix
+	// holding more than BucketTriangles still gets a bucket of its own.
+	constexpr uint32_t PrefixShift = 30 - BucketPrefixBits;
+	std::vector<uint64_t> prefixCounts(size_t(1) << BucketPrefixBits, 0);
+	forEachTriangle(tempDir, [&](const ObjTriangle& triangle) {
+		++prefixCounts[triangleCode(triangle) >> PrefixShift];
+	});
+	std::vector<uint32_t> prefixBuckets(prefixCounts.size());
+	uint32_t bucketCount = 0;
+	uint64_t bucketSize = 0;
+	for (size_t prefix = 0; prefix < prefixCounts.size(); ++prefix) {
+		if (bucketSize > 0 && bucketSize + prefixCounts[prefix] > BucketTriangles) {
+			++bucketCount;
+			bucketSize = 0;
+		}
+		prefixBuckets[prefix] = bucketCount;
+		bucketSize += prefixCounts[prefix];
+	}
+	++bucketCount;
+
+	// Pass 5: distribute the final triangles in the bucket files
+	auto bucketFilePath = [&](uint32_t bucket) { return tempDir / ("bucket" + std::to_string(bucket) + ".bin"); };
+	std::vector<std::vector<SortedTriangle>> bucketBuffers(bucketCount);
+	bool written = true;
+	forEachTriangle(tempDir, [&](const ObjTriangle& triangle) {
+		SortedTriangle sorted;
+		sorted.code = triangleCode(triangle);
+		attributes.GetVertices(triangle, sorted.vertices);
+		uint32_t bucket = prefixBuckets[sorted.code >> PrefixShift];
+		bucketBuffers[bucket].push_back(sorted);
+		if (bucketBuffers[bucket].size() >= BucketFlushTriangles) {
+			written = writeRecords(bucketFilePath(bucket), bucketBuffers[bucket], true /* append */) && written;
+			bucketBuffers[bucket].clear();
+		}
+	});
+	for (uint32_t bucket = 0; bucket < bucketCount; ++bucket) {
+		written = writeRecords(bucketFilePath(bucket), bucketBuffers[bucket], true /* append */) && written;
+		bucketBuffers[bucket] = {};
+	}
+	if (!written) {
+		return fail("Could not write the buckets of OBJ file");
+	}
+
+	// Pass 6: sort each bucket, buckets being already in Morton order, and
+	// emit the clusters. Written aside then renamed, so that an interrupted
+	// cook does not leave a truncated file that looks up to date.
+	uint32_t clusterCount = static_cast<uint32_t>((triangleCount + clusterTriangles - 1) / clusterTriangles);
+	std::vector<ClusterInfo> clusters(clusterCount);
+	fs::path partialPath = fs::path(cookedPath).concat(".partial");
+	std::ofstream file(partialPath, std::ios::binary);
+	if (!file.is_open()) {
+		return fail("Could not write the clusters of OBJ file");
+	}
+	FileHeader header = { ClustersMagic, ClustersVersion, clusterCount, 3 * clusterTriangles };
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	// The table is only known at the end, its place is reserved for now
+	file.write(reinterpret_cast<const char*>(clusters.data()), clusters.size() * sizeof(ClusterInfo));
+
+	uint64_t dataOffset = sizeof(FileHeader) + clusterCount * sizeof(ClusterInfo);
+	uint64_t triangleIndex = 0;
+	std::vector<SortedTriangle> bucketTriangles;
+	for (uint32_t bucket = 0; bucket < bucketCount && file; ++bucket) {
+		if (!readRecords(bucketFilePath(bucket), bucketTriangles)) {
+			written = false;
+			break;
+		}
+		std::stable_sort(bucketTriangles.begin(), bucketTriangles.end(), [](const SortedTriangle& a, const SortedTriangle& b) {
+			return a.code < b.code;
+		});
+		for (const SortedTriangle& triangle : bucketTriangles) {
+			ClusterInfo& cluster = clusters[triangleIndex / clusterTriangles];
+			if (triangleIndex % clusterTriangles == 0) {
+				cluster.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+				cluster.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+				cluster.fileOffset = dataOffset + triangleIndex * 3 * sizeof(Loader::VertexAttributes);
+			}
+			for (const auto& vertex : triangle.vertices) {
+				cluster.boundsMin = glm::min(cluster.boundsMin, vertex.position);
+				cluster.boundsMax = glm::max(cluster.boundsMax, vertex.position);
+			}
+			cluster.vertexCount += 3;
+			++triangleIndex;
+			file.write(reinterpret_cast<const char*>(triangle.vertices), sizeof(triangle.vertices));
+		}
+		fs::remove(bucketFilePath(bucket), error);
+	}
+	bucketTriangles = {};
+
+	file.seekp(sizeof(FileHeader));
+	file.write(reinterpret_cast<const char*>(clusters.data()), clusters.size() * sizeof(ClusterInfo));
+	file.close();
+	if (!written || !file || triangleIndex != triangleCount) {
+		fs::remove(partialPath, error);
+		return fail("Could not write the clusters of OBJ file");
+	}
+	fs::remove_all(tempDir, error);
+	fs::rename(partialPath, cookedPath, error);
+	if (error) {
+		std::cerr << "Could not rename " << partialPath << ": " << error.message() << std::endl;
+		return false;
+	}
+
+	std::cout << "Cooked " << objPath << " into " << clusterCount << " clusters" << std::endl;
+	return true;
+}
+
+bool ClusteredMesh::Open(const fs::path& cookedPath, Device device)
+{
+	std::ifstream file(cookedPath, std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	FileHeader header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!file || header.magic != ClustersMagic || header.version != ClustersVersion) {
+		std::cerr << "Invalid cluster file " << cookedPath << std::endl;
+		return false;
+	}
+	m_clusters.resize(header.clusterCount);
+	file.read(reinterpret_cast<char*>(m_clusters.data()), m_clusters.size() * sizeof(ClusterInfo));
+	if (!file) {
+		std::cerr << "Truncated cluster file " << cookedPath << std::endl;
+		return false;
+	}
+
+	m_path = cookedPath;
+	m_device = device;
+	m_states = std::vector<ClusterState>(m_clusters.size());
+	m_stats.clusterCount = header.clusterCount;
+
+	// The pool is cut in slots large enough for the biggest cluster
+	m_slotVertices = header.maxClusterVertices;
+	uint64_t slotBytes = (uint64_t)m_slotVertices * sizeof(Loader::VertexAttributes);
+	uint32_t slotCount = static_cast<uint32_t>(std::max<uint64_t>(m_settings.poolBytes / slotBytes, 1));
+	m_slotOwners.assign(slotCount, -1);
+
+	BufferDescriptor bufferDesc;
+	bufferDesc.label = "Cluster pool";
+	bufferDesc.size = slotCount * slotBytes;
+	bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Vertex;
+	bufferDesc.mappedAtCreation = false;
+	m_pool = m_device.createBuffer(bufferDesc);
+
+	return m_pool != nullptr;
+}
+
+void ClusteredMesh::Update(const glm::mat4x4& viewProjection, const glm::vec3& cameraPosition)
+{
+	if (m_clusters.empty()) return;
+	++m_frame;
+
+	// Rank visible clusters by distance to the camera
+	Frustum frustum(viewProjection);
+	std::vector<std::pair<float, uint32_t>> ranked;
+	for (uint32_t c = 0; c < m_clusters.size(); ++c) {
+		const ClusterInfo& cluster = m_clusters[c];
+		if (!frustum.IntersectsBox(cluster.boundsMin, cluster.boundsMax)) continue;
+		glm::vec3 closest = glm::clamp(cameraPosition, cluster.boundsMin, cluster.boundsMax);
+		ranked.emplace_back(glm::distance(closest, cameraPosition), c);
+	}
+	std::sort(ranked.begin(), ranked.end());
+
+	// Only as many clusters as fit in the pool are needed
+	m_visibleClusters.clear();
+	for (const auto& entry : ranked) {
+		m_visibleClusters.push_back(entry.second);
+	}
+	size_t neededCount = std::min(m_visibleClusters.size(), m_slotOwners.size());
+	for (size_t i = 0; i < neededCount; ++i) {
+		m_states[m_visibleClusters[i]].lastNeededFrame = m_frame;
+	}
+
+	CollectReads();
+	RequestReads();
+
+	m_stats.visibleClusters = static_cast<uint32_t>(m_visibleClusters.size());
+	m_stats.drawnClusters = 0;
+	for (uint32_t c : m_visibleClusters) {
+		if (m_states[c].slot >= 0) ++m_stats.drawnClusters;
+	}
+}
+
+void ClusteredMesh::Draw(RenderPassEncoder renderPass) const
+{
+	if (!m_pool) return;
+	renderPass.setVertexBuffer(0, m_pool, 0, m_slotOwners.size() * m_slotVertices * sizeof(Loader::VertexAttributes));
+	for (uint32_t c : m_visibleClusters) {
+		int32_t slot = m_states[c].slot;
+		if (slot < 0) continue;
+		renderPass.draw(m_clusters[c].vertexCount, 1, slot * m_slotVertices, 0);
+	}
+}
+
+void ClusteredMesh::Terminate()
+{
+	for (ClusterState& state : m_states) {
+		if (state.pendingRead.valid()) state.pendingRead.wait();
+	}
+	m_states.clear();
+	m_clusters.clear();
+	m_visibleClusters.clear();
+	if (m_pool) {
+		m_pool.destroy();
+		m_pool.release();
+		m_pool = nullptr;
+	}
+}
+
+void ClusteredMesh::CollectReads()
+{
+	Queue queue = m_device.getQueue();
+	m_stats.uploadedBytes = 0;
+
+	// Visit in priority order so that the budget goes to the closest clusters
+	for (uint32_t c : m_visibleClusters) {
+		ClusterState& state = m_states[c];
+		if (!state.pendingRead.valid()) continue;
+		if (state.pendingRead.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+
+		// A failed read must not evict a resident cluster, and is not
+		// retried every frame (the file is truncated or unreadable)
+		if (!CheckRead(c)) continue;
+
+		uint64_t bytes = (uint64_t)m_clusters[c].vertexCount * sizeof(Loader::VertexAttributes);
+		if (m_stats.uploadedBytes + bytes > m_settings.uploadBytesPerFrame) break;
+
+		// Without a slot, the read stays pending until one frees up rather
+		// than being thrown away and read again. Slots are not freed within
+		// this loop, so the other reads would not find one either.
+		int32_t slot = AcquireSlot();
+		if (slot < 0) break;
+
+		uint64_t slotBytes = (uint64_t)m_slotVertices * sizeof(Loader::VertexAttributes);
+		queue.writeBuffer(m_pool, slot * slotBytes, state.pendingRead.get().data(), bytes);
+		state.pendingRead = {};
+		--m_stats.pendingReads;
+		m_slotOwners[slot] = static_cast<int32_t>(c);
+		state.slot = slot;
+		++m_stats.residentClusters;
+		m_stats.uploadedBytes += bytes;
+	}
+
+	// Reads that completed for clusters no longer visible are dropped
+	for (ClusterState& state : m_states) {
+		if (!state.pendingRead.valid() || state.lastNeededFrame == m_frame) continue;
+		if (state.pendingRead.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+		state.pendingRead = {};
+		--m_stats.pendingReads;
+	}
+
+	queue.release();
+}
+
+void ClusteredMesh::RequestReads()
+{
+	// Submit all the reads of this frame as one batch so that they are in
+	// flight together rather than one after the other.
+	std::vector<AsyncFileReader::Request> requests;
+	size_t neededCount = std::min(m_visibleClusters.size(), m_slotOwners.size());
+	for (size_t i = 0; i < neededCount && m_stats.pendingReads < m_settings.maxConcurrentReads; ++i) {
+		uint32_t c = m_visibleClusters[i];
+		ClusterState& state = m_states[c];
+		if (state.slot >= 0 || state.pendingRead.valid() || state.readFailed) continue;
+
+		uint32_t vertexCount = m_clusters[c].vertexCount;
+		auto promise = std::make_shared<std::promise<std::vector<Loader::VertexAttributes>>>();
+		state.pendingRead = promise->get_future().share();
+
+		AsyncFileReader::Request request;
+		request.path = m_path;
+		request.offset = m_clusters[c].fileOffset;
+		request.size = vertexCount * sizeof(Loader::VertexAttributes);
+		request.onComplete = [promise, vertexCount](AsyncFileReader::ReadResult&& result) {
+			std::vector<Loader::VertexAttributes> vertices;
+			if (result.success && result.bytes.size() == vertexCount * sizeof(Loader::VertexAttributes)) {
+				vertices.resize(vertexCount);
+				std::memcpy(vertices.data(), result.bytes.data(), result.bytes.size());
+			}
+			promise->set_value(std::move(vertices));
+		};
+		requests.push_back(std::move(request));
+		++m_stats.pendingReads;
+	}
+	if (!requests.empty()) {
+		AsyncFileReader::Shared().ReadBatch(std::move(requests));
+	}
+}
+
+bool ClusteredMesh::CheckRead(uint32_t c)
+{
+	ClusterState& state = m_states[c];
+	if (state.pendingRead.get().size() == m_clusters[c].vertexCount) return true;
+
+	std::cerr << "Could not read cluster " << c << " of " << m_path << ", it is not drawn" << std::endl;
+	state.pendingRead = {};
+	state.readFailed = true;
+	--m_stats.pendingReads;
+	return false;
+}
+
+int32_t ClusteredMesh::AcquireSlot()
+{
+	// Prefer a free slot, otherwise evict the least recently needed cluster
+	int32_t bestSlot = -1;
+	uint64_t oldestFrame = m_frame;
+	for (int32_t slot = 0; slot < (int32_t)m_slotOwners.size(); ++slot) {
+		int32_t owner = m_slotOwners[slot];
+		if (owner < 0) return slot;
+		uint64_t lastNeeded = m_states[owner].lastNeededFrame;
+		if (lastNeeded < oldestFrame) {
+			oldestFrame = lastNeeded;
+			bestSlot = slot;
+		}
+	}
+
+	if (bestSlot >= 0) {
+		m_states[m_slotOwners[bestSlot]].slot = -1;
+		m_slotOwners[bestSlot] = -1;
+		--m_stats.residentClusters;
+	}
+	return bestSlot;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/glm.hpp> // all types inspired from GLSL
+#include <glm/ext.hpp>
+
+#include <filesystem>
+#include <future>
+#include <vector>
+
+#include "Loader.h"
+
+// A mesh stored on disk as spatially coherent clusters of triangles, of which
+// only the visible ones closest to the camera are resident on the GPU.
+//
+// Resident clusters live in fixed-size slots of a single vertex buffer (the
+// pool), so the GPU memory used does not depend on the size of the model.
+// Every frame the residency manager ranks clusters by visibility and
+// distance, reads missing ones on the worker threads, and uploads at most a
+// fixed number of bytes, evicting the least recently needed clusters.
+class ClusteredMesh {
+public:
+	struct Settings {
+		// Size of the GPU vertex buffer holding the resident clusters
+		uint64_t poolBytes = 128ull << 20;
+		// Bytes uploaded to the pool per frame
+		uint64_t uploadBytesPerFrame = 8ull << 20;
+		// Cluster reads in flight on the worker threads
+		uint32_t maxConcurrentReads = 16;
+	};
+
+	struct Stats {
+		uint32_t clusterCount = 0;
+		uint32_t visibleClusters = 0;
+		uint32_t drawnClusters = 0;
+		uint32_t residentClusters = 0;
+		uint32_t pendingReads = 0;
+		uint64_t uploadedBytes = 0; // during the last frame
+	};
+
+	// Split an OBJ file into clusters of `clusterTriangles` triangles sorted
+	// along a Morton curve, and write them to `cookedPath` (a .clusters file).
+	// The OBJ file is streamed and sorted in buckets through intermediate
+	// files in `cookedPath`.tmp, so that it does not need to fit in memory.
+	static bool Cook(const fs::path& objPath, const fs::path& cookedPath, uint32_t clusterTriangles = 1024);
+
+	bool Open(const fs::path& cookedPath, wgpu::Device device);
+
+	// Update residency for the camera given by `viewProjection` (model is identity).
+	void Update(const glm::mat4x4& viewProjection, const glm::vec3& cameraPosition);
+
+	// Draw the resident visible clusters with the main pipeline.
+	void Draw(wgpu::RenderPassEncoder renderPass) const;
+
+	void Terminate();
+
+	Settings& GetSettings() { return m_settings; }
+	const Stats& GetStats() const { return m_stats; }
+
+private:
+	// As stored in the cluster table of the file
+	struct ClusterInfo {
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		uint32_t vertexCount;
+		uint32_t _pad;
+		uint64_t fileOffset; // of the first vertex
+	};
+	static_assert(sizeof(ClusterInfo) == 40);
+
+	struct ClusterState {
+		int32_t slot = -1; // pool slot, -1 when not resident
+		// Shared so that the result can be checked before a slot is taken for it
+		std::shared_future<std::vector<Loader::VertexAttributes>> pendingRead;
+		uint64_t lastNeededFrame = 0;
+		bool readFailed = false; // not read again, the cluster is not drawn
+	};
+
+	void CollectReads();
+	void RequestReads();
+	// True if the completed read of cluster `c` holds all its vertices,
+	// otherwise the read is dropped and the cluster is marked as failed
+	bool CheckRead(uint32_t c);
+	int32_t AcquireSlot();
+
+private:
+	fs::path m_path;
+	wgpu::Device m_device = nullptr;
+	Settings m_settings;
+	Stats m_stats;
+
+	std::vector<ClusterInfo> m_clusters;
+	std::vector<ClusterState> m_states;
+
+	wgpu::Buffer m_pool = nullptr;
+	uint32_t m_slotVertices = 0; // largest cluster
+	std::vector<int32_t> m_slotOwners; // cluster in each slot, -1 if free
+
+	// Visible clusters sorted by distance, i.e. by priority
+	std::vector<uint32_t> m_visibleClusters;
+	uint64_t m_frame = 0;
+};
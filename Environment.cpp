@@ -0,0 +1,664 @@
+#include "Environment.h"
+
+#include "Loader.h"
+#include "MappedFile.h"
+#include "TextureRegistry.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#if defined(__x86_64__) || defined(_M_X64) || ((defined(__i386__) || defined(_M_IX86)) && (defined(__SSE2__) || _M_IX86_FP >= 2))
+#  define ENVIRONMENT_SSE2
+#  include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#  define ENVIRONMENT_NEON
+#  include <arm_neon.h>
+#endif
+
+namespace {
+	constexpr float Pi = 3.14159265359f;
+	constexpr uint32_t CacheMagic = 0x314C4249; // "IBL1"
+	// Largest faces of the radiance cube the map is first resampled to
+	constexpr uint32_t MaxSourceSize = 512;
+	// Faces of the radiance cube the harmonics are projected from
+	constexpr uint32_t HarmonicsSize = 32;
+
+	// Followed by the 9 coefficients of the irradiance, then the RGBA16F
+	// texels of each level of the cubemap
+	struct CacheHeader {
+		uint32_t magic;
+		uint32_t faceSize;
+		uint32_t levelCount;
+		uint32_t sampleCount;
+	};
+
+	// RGB and an unused channel as 4 floats, the unit of work of the filters
+#if defined(ENVIRONMENT_SSE2)
+	using Float4 = __m128;
+	inline Float4 load4(const float* p) { return _mm_loadu_ps(p); }
+	inline void store4(float* p, Float4 v) { _mm_storeu_ps(p, v); }
+	inline Float4 splat4(float x) { return _mm_set1_ps(x); }
+	inline Float4 add4(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+	inline Float4 sub4(Float4 a, Float4 b) { return _mm_sub_ps(a, b); }
+	inline Float4 mul4(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+#elif defined(ENVIRONMENT_NEON)
+	using Float4 = float32x4_t;
+	inline Float4 load4(const float* p) { return vld1q_f32(p); }
+	inline void store4(float* p, Float4 v) { vst1q_f32(p, v); }
+	inline Float4 splat4(float x) { return vdupq_n_f32(x); }
+	inline Float4 add4(Float4 a, Float4 b) { return vaddq_f32(a, b); }
+	inline Float4 sub4(Float4 a, Float4 b) { return vsubq_f32(a, b); }
+	inline Float4 mul4(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+#else
+	struct Float4 { float v[4]; };
+	inline Float4 load4(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+	inline void store4(float* p, Float4 a) { for (int c = 0; c < 4; ++c) p[c] = a.v[c]; }
+	inline Float4 splat4(float x) { return { { x, x, x, x } }; }
+	inline Float4 add4(Float4 a, Float4 b) { for (int c = 0; c < 4; ++c) a.v[c] += b.v[c]; return a; }
+	inline Float4 sub4(Float4 a, Float4 b) { for (int c = 0; c < 4; ++c) a.v[c] -= b.v[c]; return a; }
+	inline Float4 mul4(Float4 a, Float4 b) { for (int c = 0; c < 4; ++c) a.v[c] *= b.v[c]; return a; }
+#endif
+	inline Float4 lerp4(Float4 a, Float4 b, float t) { return add4(a, mul4(sub4(b, a), splat4(t))); }
+
+	// A level of a cubemap, as RGBA floats for each face one after the other
+	struct CubeLevel {
+		uint32_t size = 0;
+		std::vector<float> texels;
+
+		float* Texel(uint32_t face, uint32_t x, uint32_t y) { return &texels[4 * ((static_cast<size_t>(face) * size + y) * size + x)]; }
+		const float* Texel(uint32_t face, uint32_t x, uint32_t y) const { return &texels[4 * ((static_cast<size_t>(face) * size + y) * size + x)]; }
+	};
+
+	// Direction of the point (s, t) in [-1, 1]² of a face, s to the right and
+	// t downwards. Faces are in the order of the layers of a cubemap: +X, -X,
+	// +Y, -Y, +Z, -Z.
+	glm::vec3 faceDirection(uint32_t face, float s, float t) {
+		switch (face) {
+		case 0: return { 1.0f, -t, -s };
+		case 1: return { -1.0f, -t, s };
+		case 2: return { s, 1.0f, t };
+		case 3: return { s, -1.0f, -t };
+		case 4: return { s, -t, 1.0f };
+		default: return { -s, -t, -1.0f };
+		}
+	}
+
+	// Face and point (s, t) of a direction, the inverse of faceDirection()
+	uint32_t directionFace(const glm::vec3& d, float& s, float& t) {
+		glm::vec3 a = glm::abs(d);
+		if (a.x >= a.y && a.x >= a.z) {
+			t = -d.y / a.x;
+			s = d.x > 0.0f ? -d.z / a.x : d.z / a.x;
+			return d.x > 0.0f ? 0 : 1;
+		}
+		if (a.y >= a.z) {
+			s = d.x / a.y;
+			t = d.y > 0.0f ? d.z / a.y : -d.z / a.y;
+			return d.y > 0.0f ? 2 : 3;
+		}
+		t = -d.y / a.z;
+		s = d.z > 0.0f ? d.x / a.z : -d.x / a.z;
+		return d.z > 0.0f ? 4 : 5;
+	}
+
+	// Center of texel (x, y) of a face of `size` texels, in [-1, 1]
+	float texelCenter(uint32_t x, uint32_t size) {
+		return 2.0f * (x + 0.5f) / size - 1.0f;
+	}
+
+	// Bilinear sample of a level, within the face of the direction
+	Float4 sampleCube(const CubeLevel& level, const glm::vec3& direction) {
+		float s, t;
+		uint32_t face = directionFace(direction, s, t);
+		float n = static_cast<float>(level.size);
+		float x = std::clamp(0.5f * (s + 1.0f) * n - 0.5f, 0.0f, n - 1.0f);
+		float y = std::clamp(0.5f * (t + 1.0f) * n - 0.5f, 0.0f, n - 1.0f);
+		uint32_t x0 = static_cast<uint32_t>(x);
+		uint32_t y0 = static_cast<uint32_t>(y);
+		uint32_t x1 = std::min(x0 + 1, level.size - 1);
+		uint32_t y1 = std::min(y0 + 1, level.size - 1);
+		float fx = x - x0;
+		float fy = y - y0;
+		Float4 top = lerp4(load4(level.Texel(face, x0, y0)), load4(level.Texel(face, x1, y0)), fx);
+		Float4 bottom = lerp4(load4(level.Texel(face, x0, y1)), load4(level.Texel(face, x1, y1)), fx);
+		return lerp4(top, bottom, fy);
+	}
+
+	// Bilinear sample of an equirectangular map of RGB texels, whose top row
+	// is +Z and whose left column is -X
+	Float4 sampleEquirect(const float* rgb, uint32_t width, uint32_t height, const glm::vec3& direction) {
+		float u = std::atan2(direction.y, direction.x) / (2.0f * Pi) + 0.5f;
+		float v = std::acos(std::clamp(direction.z, -1.0f, 1.0f)) / Pi;
+		float x = u * width - 0.5f;
+		float y = std::clamp(v * height - 0.5f, 0.0f, static_cast<float>(height - 1));
+		float fx = x - std::floor(x);
+		float fy = y - std::floor(y);
+		// Columns wrap around, rows stop at the poles
+		uint32_t x0 = static_cast<uint32_t>((static_cast<int64_t>(std::floor(x)) % width + width) % width);
+		uint32_t x1 = (x0 + 1) % width;
+		uint32_t y0 = static_cast<uint32_t>(y);
+		uint32_t y1 = std::min(y0 + 1, height - 1);
+		auto texel = [&](uint32_t tx, uint32_t ty) {
+			// RGB texels are 3 floats, the 4th one may be past the end
+			const float* p = rgb + 3 * (static_cast<size_t>(ty) * width + tx);
+			float value[4] = { p[0], p[1], p[2], 0.0f };
+			return load4(value);
+		};
+		Float4 top = lerp4(texel(x0, y0), texel(x1, y0), fx);
+		Float4 bottom = lerp4(texel(x0, y1), texel(x1, y1), fx);
+		return lerp4(top, bottom, fy);
+	}
+
+	// Average of each 2x2 block of texels of a level
+	void downsampleCube(const CubeLevel& source, CubeLevel& destination) {
+		destination.size = source.size / 2;
+		destination.texels.resize(4 * 6 * static_cast<size_t>(destination.size) * destination.size);
+		for (uint32_t face = 0; face < 6; ++face) {
+			for (uint32_t y = 0; y < destination.size; ++y) {
+				for (uint32_t x = 0; x < destination.size; ++x) {
+					Float4 sum = add4(
+						add4(load4(source.Texel(face, 2 * x, 2 * y)), load4(source.Texel(face, 2 * x + 1, 2 * y))),
+						add4(load4(source.Texel(face, 2 * x, 2 * y + 1)), load4(source.Texel(face, 2 * x + 1, 2 * y + 1))));
+					store4(destination.Texel(face, x, y), mul4(sum, splat4(0.25f)));
+				}
+			}
+		}
+	}
+
+	// Point (0, 1) of the Hammersley set of `count` points
+	float radicalInverse(uint32_t bits) {
+		bits = (bits << 16u) | (bits >> 16u);
+		bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+		bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+		bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+		bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+		return static_cast<float>(bits) * 2.3283064365386963e-10f;
+	}
+
+	// A light direction of the GGX lobe around the normal, in its tangent
+	// space, with its weight and the level of the radiance cube it reads
+	struct LobeSample {
+		glm::vec3 direction;
+		float weight; // N.L
+		float level;
+	};
+
+	// Importance samples of the GGX lobe of `roughness`, seen along the
+	// normal (the usual split sum assumption N = V = R). Samples of low
+	// probability read coarser levels so that few samples are enough, see
+	// "Real Shading in Unreal Engine 4" (Karis, 2013) and GPU Gems 3, ch. 20.
+	std::vector<LobeSample> lobeSamples(float roughness, uint32_t sourceSize, uint32_t sourceLevelCount) {
+		float alpha = roughness * roughness;
+		float alpha2 = alpha * alpha;
+		float texelSolidAngle = 4.0f * Pi / (6.0f * sourceSize * sourceSize);
+		std::vector<LobeSample> samples;
+		for (uint32_t i = 0; i < Environment::SampleCount; ++i) {
+			float xi1 = static_cast<float>(i) / Environment::SampleCount;
+			float xi2 = radicalInverse(i);
+			float phi = 2.0f * Pi * xi1;
+			float cosTheta = std::sqrt((1.0f - xi2) / (1.0f + (alpha2 - 1.0f) * xi2));
+			float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+			glm::vec3 h(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+			glm::vec3 l = 2.0f * h.z * h - glm::vec3(0.0f, 0.0f, 1.0f);
+			if (l.z <= 0.0f) continue;
+
+			// pdf(L) = D(H) (N.H) / (4 V.H), with N = V
+			float d = (h.z * h.z) * (alpha2 - 1.0f) + 1.0f;
+			float pdf = alpha2 / (Pi * d * d) / 4.0f;
+			float sampleSolidAngle = 1.0f / (Environment::SampleCount * pdf + 1e-6f);
+			float level = std::clamp(0.5f * std::log2(sampleSolidAngle / texelSolidAngle) + 1.0f, 0.0f, static_cast<float>(sourceLevelCount - 1));
+			samples.push_back({ l, l.z, level });
+		}
+		return samples;
+	}
+
+	// Solid angle of the texel at (s, t) of a face of `size` texels
+	float texelSolidAngle(float s, float t, uint32_t size) {
+		float area = 4.0f / (static_cast<float>(size) * size);
+		return area / std::pow(1.0f + s * s + t * t, 1.5f);
+	}
+
+	// Nearest half float, large values are clamped to the largest finite one
+	uint16_t toHalf(float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		uint32_t sign = (bits >> 16) & 0x8000;
+		uint32_t mantissa = bits & 0x7FFFFF;
+		int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xFF) - 127 + 15;
+		if (((bits >> 23) & 0xFF) == 0xFF) return static_cast<uint16_t>(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+		if (exponent >= 31) return static_cast<uint16_t>(sign | 0x7BFF);
+		if (exponent <= 0) {
+			if (exponent < -10) return static_cast<uint16_t>(sign);
+			return static_cast<uint16_t>(sign | ((mantissa | 0x800000) >> (14 - exponent)));
+		}
+		uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+		if (mantissa & 0x1000) ++half;
+		return static_cast<uint16_t>(sign | std::min(half, 0x7BFFu));
+	}
+
+	void toHalfs(const CubeLevel& level, std::vector<uint16_t>& halfs) {
+		halfs.resize(level.texels.size());
+		for (size_t i = 0; i < halfs.size(); ++i) {
+			halfs[i] = toHalf((i & 3) == 3 ? 1.0f : level.texels[i]);
+		}
+	}
+
+	// Sky with a sun and a darker ground, as an equirectangular map
+	std::vector<float> proceduralSky(uint32_t width, uint32_t height, const Environment::Sun& sun) {
+		const glm::vec3 zenith(0.25f, 0.45f, 0.9f);
+		const glm::vec3 horizon(1.1f, 1.05f, 1.0f);
+		const glm::vec3 ground(0.3f, 0.27f, 0.24f);
+		const glm::vec3 sunDirection = glm::normalize(sun.direction);
+		// The disc covers little of the sky, so it is much brighter than it
+		const glm::vec3 sunColor = 50.0f * sun.color;
+		std::vector<float> rgb(3 * static_cast<size_t>(width) * height);
+		for (uint32_t y = 0; y < height; ++y) {
+			float theta = (y + 0.5f) / height * Pi;
+			for (uint32_t x = 0; x < width; ++x) {
+				float phi = ((x + 0.5f) / width - 0.5f) * 2.0f * Pi;
+				glm::vec3 d(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
+				glm::vec3 color = d.z >= 0.0f
+					? glm::mix(horizon, zenith, std::sqrt(d.z))
+					: glm::mix(horizon, ground, std::min(1.0f, -8.0f * d.z));
+				if (glm::dot(d, sunDirection) > std::cos(2.0f * Pi / 180.0f)) color += sunColor;
+				std::memcpy(&rgb[3 * (static_cast<size_t>(y) * width + x)], &color, 3 * sizeof(float));
+			}
+		}
+		return rgb;
+	}
+
+	fs::path cachePath(const fs::path& mapPath, uint64_t hash) {
+		std::ostringstream name;
+		name << "." << std::hex << hash << ".ibl";
+		return fs::path(mapPath).concat(name.str());
+	}
+
+	size_t levelTexelCount(uint32_t level) {
+		size_t size = Environment::FaceSize >> level;
+		return 4 * 6 * size * size;
+	}
+
+	bool readCache(const fs::path& path, Environment::Prefiltered& prefiltered) {
+		MappedFile file;
+		if (!file.Open(path)) return false;
+		size_t expectedSize = sizeof(CacheHeader) + sizeof(prefiltered.irradiance);
+		for (uint32_t level = 0; level < Environment::LevelCount; ++level) {
+			expectedSize += levelTexelCount(level) * sizeof(uint16_t);
+		}
+		CacheHeader header;
+		if (file.GetSize() != expectedSize) return false;
+		std::memcpy(&header, file.GetData(), sizeof(header));
+		if (header.magic != CacheMagic || header.faceSize != Environment::FaceSize || header.levelCount != Environment::LevelCount
+			|| header.sampleCount != Environment::SampleCount) {
+			return false;
+		}
+
+		const unsigned char* data = file.GetData() + sizeof(header);
+		std::memcpy(prefiltered.irradiance.data(), data, sizeof(prefiltered.irradiance));
+		data += sizeof(prefiltered.irradiance);
+		prefiltered.levels.resize(Environment::LevelCount);
+		for (uint32_t level = 0; level < Environment::LevelCount; ++level) {
+			prefiltered.levels[level].resize(levelTexelCount(level));
+			std::memcpy(prefiltered.levels[level].data(), data, levelTexelCount(level) * sizeof(uint16_t));
+			data += levelTexelCount(level) * sizeof(uint16_t);
+		}
+		return true;
+	}
+
+	bool writeCache(const fs::path& path, const Environment::Prefiltered& prefiltered) {
+		// Written aside then renamed, like cooked textures
+		fs::path partialPath = fs::path(path).concat(".partial");
+		{
+			std::ofstream file(partialPath, std::ios::binary);
+			if (!file.is_open()) return false;
+			CacheHeader header = { CacheMagic, Environment::FaceSize, Environment::LevelCount, Environment::SampleCount };
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			file.write(reinterpret_cast<const char*>(prefiltered.irradiance.data()), sizeof(prefiltered.irradiance));
+			for (const std::vector<uint16_t>& level : prefiltered.levels) {
+				file.write(reinterpret_cast<const char*>(level.data()), level.size() * sizeof(uint16_t));
+			}
+			if (!file) return false;
+		}
+		std::error_code error;
+		fs::rename(partialPath, path, error);
+		return !error;
+	}
+} // namespace
+
+void Environment::Prefilter(const float* rgb, uint32_t width, uint32_t height, Prefiltered& prefiltered)
+{
+	// The map is resampled to a cube of about its resolution, then into the
+	// mip chain the lobe samples read from
+	uint32_t sourceSize = FaceSize;
+	while (sourceSize < MaxSourceSize && 2 * sourceSize <= width / 4) sourceSize *= 2;
+	std::vector<CubeLevel> source(1);
+	source[0].size = sourceSize;
+	source[0].texels.resize(4 * 6 * static_cast<size_t>(sourceSize) * sourceSize);
+	ThreadPool::Shared().ParallelFor(0, 6 * static_cast<size_t>(sourceSize), 16, [&](size_t begin, size_t end) {
+		for (size_t row = begin; row < end; ++row) {
+			uint32_t face = static_cast<uint32_t>(row / sourceSize);
+			uint32_t y = static_cast<uint32_t>(row % sourceSize);
+			for (uint32_t x = 0; x < sourceSize; ++x) {
+				glm::vec3 direction = glm::normalize(faceDirection(face, texelCenter(x, sourceSize), texelCenter(y, sourceSize)));
+				store4(source[0].Texel(face, x, y), sampleEquirect(rgb, width, height, direction));
+			}
+		}
+	});
+	while (source.back().size > 1) {
+		CubeLevel level;
+		downsampleCube(source.back(), level);
+		source.push_back(std::move(level));
+	}
+	uint32_t sourceLevelCount = static_cast<uint32_t>(source.size());
+	auto sourceLevel = [&](uint32_t size) {
+		uint32_t level = 0;
+		while (source[level].size > size) ++level;
+		return level;
+	};
+
+	// Level 0 reflects like a mirror
+	std::vector<CubeLevel> levels(LevelCount);
+	levels[0] = source[sourceLevel(FaceSize)];
+
+	// Rougher levels sum the lobe samples around each texel, 4 channels at once
+	for (uint32_t level = 1; level < LevelCount; ++level) {
+		float roughness = static_cast<float>(level) / (LevelCount - 1);
+		std::vector<LobeSample> samples = lobeSamples(roughness, sourceSize, sourceLevelCount);
+		CubeLevel& destination = levels[level];
+		destination.size = FaceSize >> level;
+		destination.texels.resize(4 * 6 * static_cast<size_t>(destination.size) * destination.size);
+		ThreadPool::Shared().ParallelFor(0, 6 * static_cast<size_t>(destination.size), 1, [&](size_t begin, size_t end) {
+			for (size_t row = begin; row < end; ++row) {
+				uint32_t face = static_cast<uint32_t>(row / destination.size);
+				uint32_t y = static_cast<uint32_t>(row % destination.size);
+				for (uint32_t x = 0; x < destination.size; ++x) {
+					glm::vec3 n = glm::normalize(faceDirection(face, texelCenter(x, destination.size), texelCenter(y, destination.size)));
+					glm::vec3 up = std::abs(n.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+					glm::vec3 tangent = glm::normalize(glm::cross(up, n));
+					glm::vec3 bitangent = glm::cross(n, tangent);
+
+					Float4 sum = splat4(0.0f);
+					float weightSum = 0.0f;
+					for (const LobeSample& sample : samples) {
+						glm::vec3 l = tangent * sample.direction.x + bitangent * sample.direction.y + n * sample.direction.z;
+						// Trilinear, between the two closest levels
+						uint32_t fine = static_cast<uint32_t>(sample.level);
+						uint32_t coarse = std::min(fine + 1, sourceLevelCount - 1);
+						Float4 radiance = lerp4(sampleCube(source[fine], l), sampleCube(source[coarse], l), sample.level - fine);
+						sum = add4(sum, mul4(radiance, splat4(sample.weight)));
+						weightSum += sample.weight;
+					}
+					store4(destination.Texel(face, x, y), mul4(sum, splat4(weightSum > 0.0f ? 1.0f / weightSum : 0.0f)));
+				}
+			}
+		});
+	}
+
+	// Radiance projected on the 9 first spherical harmonics, each face on
+	// its own thread...
+	const CubeLevel& harmonicsLevel = source[sourceLevel(HarmonicsSize)];
+	std::array<std::array<glm::vec4, 9>, 6> faceSums;
+	ThreadPool::Shared().ParallelFor(0, 6, 1, [&](size_t begin, size_t end) {
+		for (size_t face = begin; face < end; ++face) {
+			Float4 sums[9];
+			for (Float4& sum : sums) sum = splat4(0.0f);
+			uint32_t size = harmonicsLevel.size;
+			for (uint32_t y = 0; y < size; ++y) {
+				for (uint32_t x = 0; x < size; ++x) {
+					float s = texelCenter(x, size);
+					float t = texelCenter(y, size);
+					glm::vec3 d = glm::normalize(faceDirection(static_cast<uint32_t>(face), s, t));
+					float solidAngle = texelSolidAngle(s, t, size);
+					Float4 radiance = load4(harmonicsLevel.Texel(static_cast<uint32_t>(face), x, y));
+					// Polynomials of the basis, its constants are applied once at the end
+					const float basis[9] = {
+						1.0f, d.y, d.z, d.x,
+						d.x * d.y, d.y * d.z, 3.0f * d.z * d.z - 1.0f, d.x * d.z, d.x * d.x - d.y * d.y,
+					};
+					for (int i = 0; i < 9; ++i) {
+						sums[i] = add4(sums[i], mul4(radiance, splat4(basis[i] * solidAngle)));
+					}
+				}
+			}
+			for (int i = 0; i < 9; ++i) {
+				store4(&faceSums[face][i].x, sums[i]);
+			}
+		}
+	});
+
+	// ...then convolved with the cosine lobe (Ramamoorthi and Hanrahan, 2001)
+	// and divided by pi, with the basis constants applied twice: once for the
+	// projection and once for the evaluation in the shader
+	const float basisConstants[9] = { 0.282095f, 0.488603f, 0.488603f, 0.488603f, 1.092548f, 1.092548f, 0.315392f, 1.092548f, 0.546274f };
+	const float cosineLobe[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+	for (int i = 0; i < 9; ++i) {
+		glm::vec4 sum(0.0f);
+		for (uint32_t face = 0; face < 6; ++face) sum += faceSums[face][i];
+		prefiltered.irradiance[i] = glm::vec4(glm::vec3(sum) * basisConstants[i] * basisConstants[i] * cosineLobe[i], 0.0f);
+	}
+
+	prefiltered.levels.resize(LevelCount);
+	for (uint32_t level = 0; level < LevelCount; ++level) {
+		toHalfs(levels[level], prefiltered.levels[level]);
+	}
+}
+
+bool Environment::Load(const fs::path& mapPath, const Sun& sun, Prefiltered& prefiltered)
+{
+	uint64_t hash = 0, size = 0;
+	if (TextureRegistry::hashFile(mapPath, hash, size)) {
+		// Prefiltered already, with the same settings
+		fs::path cookedPath = cachePath(mapPath, hash);
+		if (readCache(cookedPath, prefiltered)) return true;
+
+		// Decoded from memory, like images, so that it is safe on the worker threads
+		MappedFile file;
+		int width = 0, height = 0, channels = 0;
+		float* rgb = nullptr;
+		if (file.Open(mapPath)) {
+			rgb = stbi_loadf_from_memory(file.GetData(), static_cast<int>(file.GetSize()), &width, &height, &channels, 3);
+		}
+		if (rgb != nullptr) {
+			Prefilter(rgb, static_cast<uint32_t>(width), static_cast<uint32_t>(height), prefiltered);
+			stbi_image_free(rgb);
+			if (!writeCache(cookedPath, prefiltered)) {
+				std::cerr << "Cannot cache the prefiltered environment in " << cookedPath << std::endl;
+			}
+			std::cout << "Prefiltered environment " << mapPath << " into " << cookedPath << std::endl;
+			return true;
+		}
+		std::cerr << "Cannot read environment " << mapPath << ": " << stbi_failure_reason() << std::endl;
+	}
+
+	PrefilterSky(sun, prefiltered);
+	return false;
+}
+
+void Environment::PrefilterSky(const Sun& sun, Prefiltered& prefiltered)
+{
+	// A procedural sky is small enough to prefilter every time
+	constexpr uint32_t SkyWidth = 256;
+	std::vector<float> sky = proceduralSky(SkyWidth, SkyWidth / 2, sun);
+	Prefilter(sky.data(), SkyWidth, SkyWidth / 2, prefiltered);
+	prefiltered.procedural = true;
+}
+
+bool Environment::Init(Device device, const fs::path& mapPath, const Sun& sun)
+{
+	m_device = device;
+	m_sun = sun;
+	m_queue = device.getQueue();
+
+	// Half floats keep the range of HDR maps
+	TextureDescriptor textureDesc;
+	textureDesc.label = "Environment specular cubemap";
+	textureDesc.dimension = TextureDimension::_2D;
+	textureDesc.format = TextureFormat::RGBA16Float;
+	textureDesc.size = { FaceSize, FaceSize, 6 };
+	textureDesc.mipLevelCount = LevelCount;
+	textureDesc.sampleCount = 1;
+	textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	m_cubemap = m_device.createTexture(textureDesc);
+
+	TextureViewDescriptor viewDesc;
+	viewDesc.aspect = TextureAspect::All;
+	viewDesc.baseArrayLayer = 0;
+	viewDesc.arrayLayerCount = 6;
+	viewDesc.baseMipLevel = 0;
+	viewDesc.mipLevelCount = LevelCount;
+	viewDesc.dimension = TextureViewDimension::Cube;
+	viewDesc.format = textureDesc.format;
+	m_cubemapView = m_cubemap.createView(viewDesc);
+
+	// Levels blend into each other as the roughness varies
+	SamplerDescriptor samplerDesc;
+	samplerDesc.addressModeU = AddressMode::ClampToEdge;
+	samplerDesc.addressModeV = AddressMode::ClampToEdge;
+	samplerDesc.addressModeW = AddressMode::ClampToEdge;
+	samplerDesc.magFilter = FilterMode::Linear;
+	samplerDesc.minFilter = FilterMode::Linear;
+	samplerDesc.mipmapFilter = MipmapFilterMode::Linear;
+	samplerDesc.lodMinClamp = 0.0f;
+	samplerDesc.lodMaxClamp = static_cast<float>(LevelCount);
+	samplerDesc.compare = CompareFunction::Undefined;
+	samplerDesc.maxAnisotropy = 1;
+	m_sampler = m_device.createSampler(samplerDesc);
+
+	BufferDescriptor bufferDesc;
+	bufferDesc.label = "Environment uniforms";
+	bufferDesc.size = sizeof(Uniforms);
+	bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+	bufferDesc.mappedAtCreation = false;
+	m_uniformBuffer = m_device.createBuffer(bufferDesc);
+	m_queue.writeBuffer(m_uniformBuffer, 0, &m_uniforms, sizeof(Uniforms));
+
+	std::vector<BindGroupLayoutEntry> layoutEntries(3, Default);
+	layoutEntries[0].binding = 0;
+	layoutEntries[0].visibility = ShaderStage::Fragment;
+	layoutEntries[0].buffer.type = BufferBindingType::Uniform;
+	layoutEntries[0].buffer.minBindingSize = sizeof(Uniforms);
+	layoutEntries[1].binding = 1;
+	layoutEntries[1].visibility = ShaderStage::Fragment;
+	layoutEntries[1].texture.sampleType = TextureSampleType::Float;
+	layoutEntries[1].texture.viewDimension = TextureViewDimension::Cube;
+	layoutEntries[2].binding = 2;
+	layoutEntries[2].visibility = ShaderStage::Fragment;
+	layoutEntries[2].sampler.type = SamplerBindingType::Filtering;
+
+	BindGroupLayoutDescriptor layoutDesc;
+	layoutDesc.entryCount = static_cast<uint32_t>(layoutEntries.size());
+	layoutDesc.entries = layoutEntries.data();
+	m_bindGroupLayout = m_device.createBindGroupLayout(layoutDesc);
+
+	std::vector<BindGroupEntry> entries(3);
+	entries[0].binding = 0;
+	entries[0].buffer = m_uniformBuffer;
+	entries[0].offset = 0;
+	entries[0].size = sizeof(Uniforms);
+	entries[1].binding = 1;
+	entries[1].textureView = m_cubemapView;
+	entries[2].binding = 2;
+	entries[2].sampler = m_sampler;
+
+	BindGroupDescriptor bindGroupDesc;
+	bindGroupDesc.layout = m_bindGroupLayout;
+	bindGroupDesc.entryCount = static_cast<uint32_t>(entries.size());
+	bindGroupDesc.entries = entries.data();
+	m_bindGroup = m_device.createBindGroup(bindGroupDesc);
+
+	// The first time a map is used, the prefilter takes a moment
+	m_pending = ThreadPool::Shared().Submit([mapPath, sun]() {
+		Prefiltered prefiltered;
+		Load(mapPath, sun, prefiltered);
+		return prefiltered;
+	});
+
+	return m_cubemap && m_bindGroup;
+}
+
+void Environment::Terminate()
+{
+	if (m_pending.valid()) m_pending.wait();
+	m_pending = {};
+	if (m_bindGroup) m_bindGroup.release();
+	if (m_bindGroupLayout) m_bindGroupLayout.release();
+	if (m_uniformBuffer) {
+		m_uniformBuffer.destroy();
+		m_uniformBuffer.release();
+	}
+	if (m_sampler) m_sampler.release();
+	if (m_cubemapView) m_cubemapView.release();
+	if (m_cubemap) {
+		m_cubemap.destroy();
+		m_cubemap.release();
+	}
+	if (m_queue) m_queue.release();
+	m_bindGroup = nullptr;
+	m_bindGroupLayout = nullptr;
+	m_uniformBuffer = nullptr;
+	m_sampler = nullptr;
+	m_cubemapView = nullptr;
+	m_cubemap = nullptr;
+	m_queue = nullptr;
+	m_device = nullptr;
+	m_ready = false;
+	m_procedural = false;
+	m_sunChanged = false;
+}
+
+void Environment::Update()
+{
+	// The sky follows the sun once the previous prefilter is uploaded
+	if (m_procedural && m_sunChanged && !m_pending.valid()) {
+		m_sunChanged = false;
+		m_pending = ThreadPool::Shared().Submit([sun = m_sun]() {
+			Prefiltered prefiltered;
+			PrefilterSky(sun, prefiltered);
+			return prefiltered;
+		});
+	}
+
+	if (!m_pending.valid() || m_pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+	Prefiltered prefiltered = m_pending.get();
+	m_procedural = prefiltered.procedural;
+
+	// The cubemap keeps its size, so the bind group stays valid
+	ImageCopyTexture destination;
+	destination.texture = m_cubemap;
+	destination.origin = { 0, 0, 0 };
+	destination.aspect = TextureAspect::All;
+	TextureDataLayout source;
+	source.offset = 0;
+	for (uint32_t level = 0; level < LevelCount && level < prefiltered.levels.size(); ++level) {
+		uint32_t size = FaceSize >> level;
+		destination.mipLevel = level;
+		source.bytesPerRow = 4 * sizeof(uint16_t) * size;
+		source.rowsPerImage = size;
+		const std::vector<uint16_t>& texels = prefiltered.levels[level];
+		m_queue.writeTexture(destination, texels.data(), texels.size() * sizeof(uint16_t), source, { size, size, 6 });
+	}
+
+	m_uniforms.irradiance = prefiltered.irradiance;
+	m_queue.writeBuffer(m_uniformBuffer, 0, &m_uniforms, sizeof(Uniforms));
+	m_ready = true;
+}
+
+void Environment::SetSun(const Sun& sun)
+{
+	if (sun == m_sun) return;
+	m_sun = sun;
+	m_sunChanged = true;
+}
+
+void Environment::SetIntensity(float intensity)
+{
+	m_uniforms.intensity = intensity;
+	m_queue.writeBuffer(m_uniformBuffer, offsetof(Uniforms, intensity), &m_uniforms.intensity, sizeof(float));
+}
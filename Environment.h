@@ -0,0 +1,121 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <vector>
+
+// Image based lighting from an HDR environment map (an equirectangular
+// .hdr image, whose top is the world +Z axis).
+//
+// The environment is prefiltered once on the CPU into:
+// - a specular cubemap whose mip levels hold the light reflected by surfaces
+//   of increasing roughness (GGX importance sampling, 0 at level 0 and 1 at
+//   the last level), sampled in the reflected direction;
+// - the irradiance of the diffuse lighting, as 9 spherical harmonics
+//   coefficients evaluated in the shader.
+// Texels are convolved 4 floats at a time (SSE2 or NEON) on the worker
+// threads, and the result is cached next to the map, named after the hash of
+// its content, so that the convolution only runs once per environment.
+//
+// The application reads resources/environment.hdr, which is not part of the
+// repository: any equirectangular Radiance .hdr image works, for instance a
+// 1k map from Poly Haven (polyhaven.com/hdris, CC0) saved under that name.
+//
+// Without a map, a procedural sky is prefiltered instead, whose sun follows
+// SetSun(). Lighting is black until the first prefilter is ready, which
+// Update() uploads.
+class Environment {
+public:
+	// Texels per side of the faces of level 0 of the specular cubemap
+	static constexpr uint32_t FaceSize = 128;
+	// Down to 4x4 faces, rougher surfaces than that are lit by the irradiance
+	static constexpr uint32_t LevelCount = 6;
+	// GGX samples per texel of the levels after the first one
+	static constexpr uint32_t SampleCount = 128;
+
+	// Matches EnvironmentUniforms in shader.wgsl
+	struct Uniforms {
+		// Spherical harmonics of the irradiance divided by pi (the diffuse
+		// lighting of a white surface), with the constants of the basis folded in
+		std::array<glm::vec4, 9> irradiance = {};
+		float specularLevels = static_cast<float>(LevelCount);
+		float intensity = 1.0f;
+		float _pad[2] = { 0.0f, 0.0f };
+	};
+	static_assert(sizeof(Uniforms) % 16 == 0);
+
+	// Result of the prefilter, as cached on disk
+	struct Prefiltered {
+		std::array<glm::vec4, 9> irradiance = {};
+		// RGBA16F texels of each level, the 6 faces one after the other
+		std::vector<std::vector<uint16_t>> levels;
+		// Of the procedural sky rather than of a map (not cached)
+		bool procedural = false;
+	};
+
+	// Sun of the procedural sky, in the convention of the lights: direction
+	// towards the sun, and its color
+	struct Sun {
+		glm::vec3 direction = glm::vec3(0.5f, -0.9f, 0.1f);
+		glm::vec3 color = glm::vec3(1.0f, 0.9f, 0.6f);
+
+		bool operator==(const Sun& other) const { return direction == other.direction && color == other.color; }
+		bool operator!=(const Sun& other) const { return !(*this == other); }
+	};
+
+	// Prefilter an equirectangular map of width x height RGB float texels
+	static void Prefilter(const float* rgb, uint32_t width, uint32_t height, Prefiltered& prefiltered);
+	// Read the prefiltered map at `mapPath`, from its cache if it exists,
+	// otherwise prefiltered and cached. A procedural sky lit by `sun` if the
+	// map cannot be read.
+	static bool Load(const std::filesystem::path& mapPath, const Sun& sun, Prefiltered& prefiltered);
+	static void PrefilterSky(const Sun& sun, Prefiltered& prefiltered);
+
+	// Create the cubemap and start loading `mapPath` on the worker threads
+	bool Init(wgpu::Device device, const std::filesystem::path& mapPath, const Sun& sun);
+	void Terminate();
+
+	// Upload the prefiltered environment once it is ready, and prefilter the
+	// procedural sky again if its sun moved. Call once per frame.
+	void Update();
+
+	// Move the sun of the procedural sky (no effect on a map). The sky is
+	// prefiltered again on the worker threads, at most one at a time.
+	void SetSun(const Sun& sun);
+
+	// Group 1 of every pipeline: uniforms, specular cubemap
+	// and its sampler
+	wgpu::BindGroupLayout GetBindGroupLayout() const { return m_bindGroupLayout; }
+	wgpu::BindGroup GetBindGroup() const { return m_bindGroup; }
+
+	// Scale of the image based lighting
+	float GetIntensity() const { return m_uniforms.intensity; }
+	void SetIntensity(float intensity);
+
+	bool IsReady() const { return m_ready; }
+
+private:
+	wgpu::Device m_device = nullptr;
+	wgpu::Queue m_queue = nullptr;
+	wgpu::Texture m_cubemap = nullptr;
+	wgpu::TextureView m_cubemapView = nullptr;
+	wgpu::Sampler m_sampler = nullptr;
+	Uniforms m_uniforms;
+	wgpu::Buffer m_uniformBuffer = nullptr;
+	wgpu::BindGroupLayout m_bindGroupLayout = nullptr;
+	wgpu::BindGroup m_bindGroup = nullptr;
+
+	std::future<Prefiltered> m_pending;
+	bool m_ready = false;
+	bool m_procedural = false; // the last upload was the procedural sky
+	Sun m_sun;
+	bool m_sunChanged = false; // since the sky was last prefiltered
+};
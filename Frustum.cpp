@@ -0,0 +1,43 @@
+#include "Frustum.h"
+
+Frustum::Frustum(const glm::mat4x4& viewProjection)
+{
+	// Gribb & Hartmann: planes are sums of the rows of the clip matrix
+	glm::mat4x4 m = glm::transpose(viewProjection);
+	m_planes[0] = m[3] + m[0]; // left
+	m_planes[1] = m[3] - m[0]; // right
+	m_planes[2] = m[3] + m[1]; // bottom
+	m_planes[3] = m[3] - m[1]; // top
+	m_planes[4] = m[2];        // near, depth is in [0, 1] (GLM_FORCE_DEPTH_ZERO_TO_ONE)
+	m_planes[5] = m[3] - m[2]; // far
+
+	for (glm::vec4& plane : m_planes) {
+		plane /= glm::length(glm::vec3(plane));
+	}
+}
+
+bool Frustum::IntersectsSphere(const glm::vec3& center, float radius) const
+{
+	for (const glm::vec4& plane : m_planes) {
+		if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Frustum::IntersectsBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+{
+	for (const glm::vec4& plane : m_planes) {
+		// Corner of the box that is the furthest along the plane normal
+		glm::vec3 positive = glm::vec3(
+			plane.x >= 0 ? boxMax.x : boxMin.x,
+			plane.y >= 0 ? boxMax.y : boxMin.y,
+			plane.z >= 0 ? boxMax.z : boxMin.z
+		);
+		if (glm::dot(glm::vec3(plane), positive) + plane.w < 0) {
+			return false;
+		}
+	}
+	return true;
+}
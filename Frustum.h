@@ -0,0 +1,27 @@
+#pragma once
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/glm.hpp> // all types inspired from GLSL
+#include <glm/ext.hpp>
+
+#include <array>
+
+// The six planes bounding what a view-projection matrix can see.
+// Each plane is (normal, distance) with the normal pointing inside, so
+// dot(normal, p) + distance >= 0 for every visible point p.
+class Frustum {
+public:
+	Frustum() = default;
+	// Planes are expressed in whatever space `viewProjection` takes as input,
+	// e.g. pass projection * view * model to test boxes in model space.
+	explicit Frustum(const glm::mat4x4& viewProjection);
+
+	bool IntersectsSphere(const glm::vec3& center, float radius) const;
+	bool IntersectsBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+
+	const std::array<glm::vec4, 6>& GetPlanes() const { return m_planes; }
+
+private:
+	std::array<glm::vec4, 6> m_planes;
+};
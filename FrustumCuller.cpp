@@ -0,0 +1,218 @@
+#include "FrustumCuller.h"
+#include "Frustum.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || ((defined(__i386__) || defined(_M_IX86)) && (defined(__SSE2__) || _M_IX86_FP >= 2))
+#  define FRUSTUM_CULLER_SSE2
+#  include <immintrin.h>
+#  if defined(_MSC_VER) && !defined(__clang__)
+#    include <intrin.h>
+#    define FRUSTUM_CULLER_TARGET_AVX2
+#  else
+#    define FRUSTUM_CULLER_TARGET_AVX2 __attribute__((target("avx2")))
+#  endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#  define FRUSTUM_CULLER_NEON
+#  include <arm_neon.h>
+#endif
+
+namespace {
+	// Spheres per iteration of the widest kernel, to which arrays are padded
+	constexpr uint32_t BatchSize = 8;
+
+	// The spheres and where to write whether they are visible
+	struct Spheres {
+		const float* x;
+		const float* y;
+		const float* z;
+		const float* radius;
+		uint8_t* visible;
+	};
+
+	// Test spheres [begin, end) and return how many are visible. Kernels get
+	// a multiple of their width.
+	using CullKernel = uint32_t(*)(const Spheres& spheres, uint32_t begin, uint32_t end, const std::array<glm::vec4, 6>& planes);
+
+#if !defined(FRUSTUM_CULLER_SSE2) && !defined(FRUSTUM_CULLER_NEON)
+	uint32_t cullScalar(const Spheres& spheres, uint32_t begin, uint32_t end, const std::array<glm::vec4, 6>& planes) {
+		uint32_t visibleCount = 0;
+		for (uint32_t i = begin; i < end; ++i) {
+			bool visible = true;
+			for (const glm::vec4& plane : planes) {
+				float distance = plane.x * spheres.x[i] + plane.y * spheres.y[i] + plane.z * spheres.z[i] + plane.w;
+				visible = visible && distance >= -spheres.radius[i];
+			}
+			spheres.visible[i] = visible ? 1 : 0;
+			visibleCount += visible ? 1 : 0;
+		}
+		return visibleCount;
+	}
+#endif
+
+#ifdef FRUSTUM_CULLER_SSE2
+	// 4 spheres per iteration
+	uint32_t cullSse2(const Spheres& spheres, uint32_t begin, uint32_t end, const std::array<glm::vec4, 6>& planes) {
+		uint32_t visibleCount = 0;
+		for (uint32_t i = begin; i < end; i += 4) {
+			__m128 x = _mm_loadu_ps(spheres.x + i);
+			__m128 y = _mm_loadu_ps(spheres.y + i);
+			__m128 z = _mm_loadu_ps(spheres.z + i);
+			__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(spheres.radius + i));
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (const glm::vec4& plane : planes) {
+				__m128 distance = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+					_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+			}
+			int mask = _mm_movemask_ps(inside);
+			for (uint32_t lane = 0; lane < 4; ++lane) {
+				spheres.visible[i + lane] = static_cast<uint8_t>((mask >> lane) & 1);
+			}
+			visibleCount += static_cast<uint32_t>(((mask >> 0) & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1));
+		}
+		return visibleCount;
+	}
+
+	// 8 spheres per iteration
+	FRUSTUM_CULLER_TARGET_AVX2
+	uint32_t cullAvx2(const Spheres& spheres, uint32_t begin, uint32_t end, const std::array<glm::vec4, 6>& planes) {
+		// Planes are broadcast once rather than at each iteration
+		__m256 planeX[6], planeY[6], planeZ[6], planeW[6];
+		for (int p = 0; p < 6; ++p) {
+			planeX[p] = _mm256_set1_ps(planes[p].x);
+			planeY[p] = _mm256_set1_ps(planes[p].y);
+			planeZ[p] = _mm256_set1_ps(planes[p].z);
+			planeW[p] = _mm256_set1_ps(planes[p].w);
+		}
+
+		uint32_t visibleCount = 0;
+		for (uint32_t i = begin; i < end; i += 8) {
+			__m256 x = _mm256_loadu_ps(spheres.x + i);
+			__m256 y = _mm256_loadu_ps(spheres.y + i);
+			__m256 z = _mm256_loadu_ps(spheres.z + i);
+			__m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(spheres.radius + i));
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (int p = 0; p < 6; ++p) {
+				__m256 distance = _mm256_add_ps(
+					_mm256_add_ps(_mm256_mul_ps(x, planeX[p]), _mm256_mul_ps(y, planeY[p])),
+					_mm256_add_ps(_mm256_mul_ps(z, planeZ[p]), planeW[p]));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+			}
+			// One bit per sphere, spread to one byte per sphere: each byte
+			// of the mask is its lane bit shifted down
+			uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(inside));
+			uint64_t bytes = 0;
+			for (uint32_t lane = 0; lane < 8; ++lane) {
+				uint32_t bit = (mask >> lane) & 1;
+				bytes |= static_cast<uint64_t>(bit) << (8 * lane);
+				visibleCount += bit;
+			}
+			std::memcpy(spheres.visible + i, &bytes, sizeof(bytes));
+		}
+		return visibleCount;
+	}
+
+	bool cpuHasAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+		__cpuid(info, 1);
+		bool osSavesYmm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+		__cpuidex(info, 7, 0);
+		return osSavesYmm && (info[1] & (1 << 5));
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif // FRUSTUM_CULLER_SSE2
+
+#ifdef FRUSTUM_CULLER_NEON
+	// 4 spheres per iteration
+	uint32_t cullNeon(const Spheres& spheres, uint32_t begin, uint32_t end, const std::array<glm::vec4, 6>& planes) {
+		uint32_t visibleCount = 0;
+		for (uint32_t i = begin; i < end; i += 4) {
+			float32x4_t x = vld1q_f32(spheres.x + i);
+			float32x4_t y = vld1q_f32(spheres.y + i);
+			float32x4_t z = vld1q_f32(spheres.z + i);
+			float32x4_t negativeRadius = vnegq_f32(vld1q_f32(spheres.radius + i));
+			uint32x4_t inside = vdupq_n_u32(~0u);
+			for (const glm::vec4& plane : planes) {
+				float32x4_t distance = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(plane.w), x, plane.x), y, plane.y), z, plane.z);
+				inside = vandq_u32(inside, vcgeq_f32(distance, negativeRadius));
+			}
+			uint32_t lanes[4];
+			vst1q_u32(lanes, vshrq_n_u32(inside, 31));
+			for (uint32_t lane = 0; lane < 4; ++lane) {
+				spheres.visible[i + lane] = static_cast<uint8_t>(lanes[lane]);
+				visibleCount += lanes[lane];
+			}
+		}
+		return visibleCount;
+	}
+#endif // FRUSTUM_CULLER_NEON
+
+	struct Kernel {
+		CullKernel cull;
+		const char* name;
+	};
+
+	// Picked once for the CPU we run on
+	const Kernel& kernel() {
+		static const Kernel selected = []() -> Kernel {
+#if defined(FRUSTUM_CULLER_SSE2)
+			if (cpuHasAvx2()) return { cullAvx2, "AVX2" };
+			return { cullSse2, "SSE2" };
+#elif defined(FRUSTUM_CULLER_NEON)
+			return { cullNeon, "NEON" };
+#else
+			return { cullScalar, "scalar" };
+#endif
+		}();
+		return selected;
+	}
+} // namespace
+
+void FrustumCuller::Resize(uint32_t count)
+{
+	uint32_t paddedCount = (count + BatchSize - 1) / BatchSize * BatchSize;
+	// Padding spheres have a radius of minus infinity, so are never visible
+	m_centerX.resize(paddedCount, 0.0f);
+	m_centerY.resize(paddedCount, 0.0f);
+	m_centerZ.resize(paddedCount, 0.0f);
+	m_radius.resize(paddedCount, -std::numeric_limits<float>::infinity());
+	m_visible.resize(paddedCount, 1);
+	for (uint32_t i = m_count; i < count; ++i) {
+		SetSphere(i, glm::vec3(0.0f), std::numeric_limits<float>::infinity());
+		m_visible[i] = 1;
+	}
+	for (uint32_t i = count; i < paddedCount; ++i) {
+		SetSphere(i, glm::vec3(0.0f), -std::numeric_limits<float>::infinity());
+	}
+	m_count = count;
+}
+
+void FrustumCuller::SetSphere(uint32_t index, const glm::vec3& center, float radius)
+{
+	m_centerX[index] = center.x;
+	m_centerY[index] = center.y;
+	m_centerZ[index] = center.z;
+	m_radius[index] = radius;
+}
+
+void FrustumCuller::Cull(const glm::mat4x4& viewProjection)
+{
+	std::array<glm::vec4, 6> planes = Frustum(viewProjection).GetPlanes();
+	Spheres spheres = { m_centerX.data(), m_centerY.data(), m_centerZ.data(), m_radius.data(), m_visible.data() };
+	// Padding spheres are never visible, they do not change the count
+	m_stats.visible = kernel().cull(spheres, 0, static_cast<uint32_t>(m_radius.size()), planes);
+	m_stats.tested = m_count;
+}
+
+const char* FrustumCuller::InstructionSet()
+{
+	return kernel().name;
+}
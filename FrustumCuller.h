@@ -0,0 +1,51 @@
+#pragma once
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Tests bounding spheres against the view frustum, to skip the objects that
+// are off screen before their draw calls are encoded.
+//
+// Spheres are stored as a structure of arrays (centers x, y and z, radii),
+// so that a vectorized kernel tests 8 of them per iteration against the 6
+// planes with AVX2 when the CPU supports it, 4 with SSE2 or NEON otherwise,
+// and one at a time on other targets. Arrays are padded to a multiple of 8
+// spheres so that kernels have no remainder to handle.
+class FrustumCuller {
+public:
+	struct Stats {
+		uint32_t tested = 0;
+		uint32_t visible = 0;
+	};
+
+	// Number of spheres, whose bounds are then set one by one. New spheres
+	// are infinite, i.e. always visible.
+	void Resize(uint32_t count);
+	uint32_t GetCount() const { return m_count; }
+	// A radius of infinity makes the sphere always visible (unknown bounds)
+	void SetSphere(uint32_t index, const glm::vec3& center, float radius);
+
+	// Test every sphere against the frustum of viewProjection (see Frustum)
+	void Cull(const glm::mat4x4& viewProjection);
+	// Result of the last Cull(), every sphere is visible before the first one
+	bool IsVisible(uint32_t index) const { return m_visible[index] != 0; }
+
+	const Stats& GetStats() const { return m_stats; }
+
+	// Name of the kernel picked for this CPU, for the stats
+	static const char* InstructionSet();
+
+private:
+	uint32_t m_count = 0;
+	// Padded to a multiple of 8 spheres
+	std::vector<float> m_centerX;
+	std::vector<float> m_centerY;
+	std::vector<float> m_centerZ;
+	std::vector<float> m_radius;
+	std::vector<uint8_t> m_visible;
+	Stats m_stats;
+};
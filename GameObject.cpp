@@ -1,5 +1,11 @@
 #include "GameObject.h"
 
+#include "AsyncFileReader.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
 // Commented to avoid warning when building for emscripten
 // constexpr float PI = 3.14159265358979323846f;
 
@@ -13,27 +19,60 @@ GameObject::GameObject(std::shared_ptr<wgpu::Device> device,
 	std::string path,
 	glm::vec3 position,
 	std::shared_ptr<wgpu::Buffer> uniformBuffer,
+	std::shared_ptr<wgpu::Buffer> objectUniformBuffer,
+	std::shared_ptr<wgpu::Buffer> drawCommandBuffer,
 	std::shared_ptr<wgpu::Buffer> lightingBuffer,
 	std::shared_ptr<wgpu::Sampler> sampler,
-	std::shared_ptr<wgpu::BindGroupLayout> bindGroupLayout)
+	std::shared_ptr<wgpu::BindGroupLayout> bindGroupLayout,
+	std::shared_ptr<TextureRegistry> textureRegistry,
+	std::shared_ptr<TextureArrays> textureArrays,
+	std::shared_ptr<VirtualTextures> virtualTextures,
+	std::shared_ptr<wgpu::BindGroupLayout> virtualBindGroupLayout)
 {
 	m_device = device;
 
 	m_name = name;
 	m_path = path;
 
-	bool success = Loader::loadGeometryFromObj(m_path, m_vertexData);
-	if (!success) {
-		std::cerr << "Could not load geometry!" << std::endl;
-		return;
+	if (fs::path(m_path).extension() == ".clusters") {
+		// Too large to be loaded at once, clusters are paged in while rendering
+		m_clusteredMesh = std::make_shared<ClusteredMesh>();
+		if (!m_clusteredMesh->Open(m_path, *m_device)) {
+			std::cerr << "Could not open clustered geometry!" << std::endl;
+			return;
+		}
+	}
+	else {
+		// Read and parse on the worker threads while the other objects and
+		// textures are being set up, the result is picked up in Initialize()
+		auto promise = std::make_shared<std::promise<std::shared_ptr<Loader::ObjGeometry>>>();
+		m_pendingGeometry = promise->get_future().share();
+		fs::path materialDir = fs::path(m_path).parent_path();
+		AsyncFileReader::Shared().Read(m_path, [promise, materialDir](AsyncFileReader::ReadResult&& result) {
+			auto geometry = std::make_shared<Loader::ObjGeometry>();
+			if (!result.success || !Loader::parseObj(result.bytes, materialDir, *geometry)) {
+				std::cerr << "Could not load geometry!" << std::endl;
+				geometry = std::make_shared<Loader::ObjGeometry>();
+			}
+			else if (size_t instanceCount = Loader::findInstances(*geometry)) {
+				std::cout << "Drawing " << instanceCount << " repeated shapes of " << result.path << " as instances" << std::endl;
+			}
+			promise->set_value(geometry);
+		});
 	}
 
 	m_position = position;
 
 	m_uniformBuffer = uniformBuffer;
+	m_objectUniformBuffer = objectUniformBuffer;
+	m_drawCommandBuffer = drawCommandBuffer;
 	m_lightingUniformBuffer = lightingBuffer;
 	m_sampler = sampler;
 	m_bindGroupLayout = bindGroupLayout;
+	m_textureRegistry = textureRegistry;
+	m_textureArrays = textureArrays;
+	m_virtualTextures = virtualTextures;
+	m_virtualBindGroupLayout = virtualBindGroupLayout;
 }
 
 
@@ -41,8 +80,11 @@ void GameObject::Initialize(int index)
 {
 	m_bufferIndex = index;
 
-	InitBuffer();
+	if (!m_clusteredMesh) InitBuffer();
+	InitInstanceBuffer();
+	InitVirtualTextures();
 	InitBindGroup();
+	m_textureGeneration = GetTextureGeneration();
 }
 
 wgpu::Buffer GameObject::GetVertexBuffer()
@@ -56,11 +98,16 @@ wgpu::Buffer GameObject::GetVertexBuffer()
 	return m_vertexBuffer;
 }
 
-std::vector<VertexAttributes> GameObject::GetVertexData()
+const std::vector<VertexAttributes>& GameObject::GetVertexData()
 {
 	return m_vertexData;
 }
 
+void GameObject::SetKeepVertexData(bool keep)
+{
+	m_keepVertexData = keep;
+}
+
 wgpu::BindGroup GameObject::GetBindGroup()
 {
 	return m_bindGroup;
@@ -71,26 +118,325 @@ uint32_t GameObject::GetIndexCount()
 	return m_indexCount;
 }
 
+std::shared_ptr<ClusteredMesh> GameObject::GetClusteredMesh()
+{
+	return m_clusteredMesh;
+}
+
+glm::mat4x4 GameObject::GetModelMatrix() const
+{
+	return glm::translate(glm::mat4x4(1.0f), m_position);
+}
+
+void GameObject::GetWorldBounds(glm::vec3& center, float& radius) const
+{
+	center = glm::vec3(GetModelMatrix() * glm::vec4(m_instanceBoundsCenter, 1.0f));
+	radius = m_instanceBoundsRadius > 0.0f ? m_instanceBoundsRadius : std::numeric_limits<float>::infinity();
+}
+
+void GameObject::Draw(wgpu::RenderPassEncoder renderPass, wgpu::BindGroup& boundGroup)
+{
+	if (m_copies.empty()) return;
+	if (static_cast<WGPUBindGroup>(m_bindGroup) != static_cast<WGPUBindGroup>(boundGroup)) {
+		renderPass.setBindGroup(0, m_bindGroup, 0, nullptr);
+		boundGroup = m_bindGroup;
+	}
+	renderPass.setVertexBuffer(1, m_instanceBuffer, 0, m_instances.size() * sizeof(InstanceAttributes));
+
+	if (m_clusteredMesh) {
+		m_clusteredMesh->Draw(renderPass);
+		return;
+	}
+	if (m_indexCount == 0) return;
+
+	renderPass.setVertexBuffer(0, m_vertexBuffer, 0, m_indexCount * sizeof(VertexAttributes));
+	if (m_drawIndirect) {
+		for (size_t i = 0; i < m_drawRanges.size(); ++i) {
+			renderPass.drawIndirect(*m_drawCommandBuffer, (m_firstDrawCommand + i) * sizeof(DrawIndirectArgs));
+		}
+		return;
+	}
+
+	// Each range draws its shapes for all the copies at once
+	uint32_t copyCount = static_cast<uint32_t>(m_copies.size());
+	for (const DrawRange& range : m_drawRanges) {
+		renderPass.draw(range.vertexCount, range.shapeCount * copyCount, range.firstVertex, range.firstShape * copyCount);
+	}
+}
+
+void GameObject::AppendDrawCommands(std::vector<DrawIndirectArgs>& commands, bool firstInstanceSupported)
+{
+	m_drawCommandsChanged = false;
+	m_drawIndirect = false;
+	m_firstDrawCommand = static_cast<uint32_t>(commands.size());
+	// Clusters are drawn by their mesh
+	if (m_clusteredMesh || m_indexCount == 0) return;
+
+	uint32_t copyCount = static_cast<uint32_t>(m_copies.size());
+	bool firstInstanceUsed = false;
+	for (const DrawRange& range : m_drawRanges) {
+		firstInstanceUsed = firstInstanceUsed || range.firstShape > 0;
+	}
+	if (firstInstanceUsed && !firstInstanceSupported) return;
+
+	for (const DrawRange& range : m_drawRanges) {
+		commands.push_back({ range.vertexCount, range.shapeCount * copyCount, range.firstVertex, range.firstShape * copyCount });
+	}
+	m_drawIndirect = true;
+}
+
 
 void GameObject::InitBuffer()
 {
-	// Create vertex buffer
+	if (!m_pendingGeometry.valid()) return;
+	std::shared_ptr<Loader::ObjGeometry> geometry = m_pendingGeometry.get();
+	m_pendingGeometry = {};
+	m_indexCount = static_cast<uint32_t>(geometry->vertexCount);
+	if (m_indexCount == 0) return;
+
+	// Create vertex buffer, mapped so that vertices are written straight into
+	// it rather than going through a CPU copy and a writeBuffer staging copy.
 	BufferDescriptor bufferDesc;
 	bufferDesc.label = m_name.c_str();
-	bufferDesc.size = m_vertexData.size() * sizeof(VertexAttributes); // changed
-	bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Vertex;
-	bufferDesc.mappedAtCreation = false;
+	bufferDesc.size = m_indexCount * sizeof(VertexAttributes);
+	bufferDesc.usage = BufferUsage::Vertex;
+	bufferDesc.mappedAtCreation = true;
 	m_vertexBuffer = m_device->createBuffer(bufferDesc);
-	m_device->getQueue().writeBuffer(m_vertexBuffer, 0, m_vertexData.data(), bufferDesc.size); // changed
 
-	m_indexCount = static_cast<int>(m_vertexData.size()); // changed
+	VertexAttributes* vertices = static_cast<VertexAttributes*>(m_vertexBuffer.getMappedRange(0, bufferDesc.size));
+	Loader::writeVertices(*geometry, vertices);
+	if (m_keepVertexData) {
+		m_vertexData.assign(vertices, vertices + m_indexCount);
+	}
+
+	// Shapes repeated in the file are drawn as instances of a single copy
+	uint32_t firstShape = 0;
+	for (const Loader::InstancedRange& range : geometry->ranges) {
+		m_drawRanges.push_back({ range.firstVertex, range.vertexCount, firstShape, static_cast<uint32_t>(range.transforms.size()) });
+		m_shapeTransforms.insert(m_shapeTransforms.end(), range.transforms.begin(), range.transforms.end());
+		firstShape += static_cast<uint32_t>(range.transforms.size());
+	}
+
+	ComputeTextureFootprint(vertices, geometry->ranges);
+	m_vertexBuffer.unmap();
+}
+
+void GameObject::ComputeTextureFootprint(const VertexAttributes* vertices, const std::vector<Loader::InstancedRange>& ranges)
+{
+	// UV density, in UV units per world unit, from the areas of the triangles
+	// (instances are rigid copies, they share it)
+	double worldArea = 0.0;
+	double uvArea = 0.0;
+	for (uint32_t i = 0; i + 2 < m_indexCount; i += 3) {
+		const VertexAttributes* corners = vertices + i;
+		worldArea += 0.5 * glm::length(glm::cross(corners[1].position - corners[0].position, corners[2].position - corners[0].position));
+		glm::vec2 e1 = corners[1].uv - corners[0].uv;
+		glm::vec2 e2 = corners[2].uv - corners[0].uv;
+		uvArea += 0.5 * std::abs(e1.x * e2.y - e1.y * e2.x);
+	}
+	m_uvDensity = worldArea > 0.0 ? static_cast<float>(std::sqrt(uvArea / worldArea)) : 0.0f;
+
+	// Bounding box of the vertices of each range, placed by its transforms
+	glm::vec3 boundsMin(std::numeric_limits<float>::max());
+	glm::vec3 boundsMax(-std::numeric_limits<float>::max());
+	auto addRange = [&](uint32_t firstVertex, uint32_t vertexCount, const std::vector<glm::mat4x4>& transforms) {
+		if (vertexCount == 0) return;
+		glm::vec3 rangeMin = vertices[firstVertex].position;
+		glm::vec3 rangeMax = rangeMin;
+		for (uint32_t i = firstVertex; i < firstVertex + vertexCount; ++i) {
+			rangeMin = glm::min(rangeMin, vertices[i].position);
+			rangeMax = glm::max(rangeMax, vertices[i].position);
+		}
+		for (const glm::mat4x4& transform : transforms) {
+			for (int corner = 0; corner < 8; ++corner) {
+				glm::vec3 p((corner & 1) ? rangeMax.x : rangeMin.x, (corner & 2) ? rangeMax.y : rangeMin.y, (corner & 4) ? rangeMax.z : rangeMin.z);
+				p = glm::vec3(transform * glm::vec4(p, 1.0f));
+				boundsMin = glm::min(boundsMin, p);
+				boundsMax = glm::max(boundsMax, p);
+			}
+		}
+	};
+	if (ranges.empty()) {
+		addRange(0, m_indexCount, { glm::mat4x4(1.0f) });
+	}
+	for (const Loader::InstancedRange& range : ranges) {
+		addRange(range.firstVertex, range.vertexCount, range.transforms);
+	}
+	if (boundsMin.x > boundsMax.x) return;
+	m_boundsCenter = 0.5f * (boundsMin + boundsMax);
+	m_boundsRadius = 0.5f * glm::length(boundsMax - boundsMin);
+}
+
+void GameObject::RequestTextureLevels(TextureStreamer& streamer, const glm::vec3& cameraPosition, float pixelsPerUnitAtOneMeter)
+{
+	// Pixels covered by a world unit at the point of the object closest to the camera
+	constexpr float MinDistance = 0.01f; // the near plane
+	glm::vec3 boundsCenter = glm::vec3(GetModelMatrix() * glm::vec4(m_instanceBoundsCenter, 1.0f));
+	float distance = std::max(glm::length(boundsCenter - cameraPosition) - m_instanceBoundsRadius, MinDistance);
+	float pixelsPerUnit = pixelsPerUnitAtOneMeter / distance;
+
+	for (const TextureHandle& handle : { m_baseColorTexture, m_normalTexture }) {
+		const TextureHandle& texture = TextureRegistry::resolve(handle);
+		if (!texture) continue;
+		// Level at which a texel covers about a pixel. The UV density of
+		// clustered meshes is not known since their geometry is not all
+		// resident, they ask for full resolution.
+		float level = 0.0f;
+		if (m_uvDensity > 0.0f) {
+			float texelsPerUnit = m_uvDensity * static_cast<float>(std::max(texture->width, texture->height));
+			level = std::log2(std::max(texelsPerUnit / pixelsPerUnit, 1.0f));
+		}
+		streamer.Request(texture, level);
+	}
+}
+
+void GameObject::UpdateTextureBindings()
+{
+	// Streamed textures move to other arrays when their resident levels
+	// change, and arrays get a new view when they grow
+	uint32_t generation = GetTextureGeneration();
+	if (generation == m_textureGeneration) return;
+	m_textureGeneration = generation;
+	InitBindGroup();
+}
+
+void GameObject::InitInstanceBuffer()
+{
+	// Objects without repeated shapes (and clustered meshes) are a single
+	// shape with an identity transform.
+	if (m_shapeTransforms.empty()) {
+		m_drawRanges.push_back({ 0, m_indexCount, 0, 1 });
+		m_shapeTransforms.push_back(glm::mat4x4(1.0f));
+	}
+	m_copyCountChanged = true;
+	UpdateInstanceBuffer();
+}
+
+void GameObject::SetInstanceCount(uint32_t count)
+{
+	if (count == m_copies.size()) return;
+	m_copies.resize(count);
+	m_copyCountChanged = true;
+	m_drawCommandsChanged = true;
+}
+
+uint32_t GameObject::AddInstance(const Instance& instance)
+{
+	m_copies.push_back(instance);
+	m_copyCountChanged = true;
+	m_drawCommandsChanged = true;
+	return static_cast<uint32_t>(m_copies.size() - 1);
+}
+
+void GameObject::SetInstance(uint32_t index, const Instance& instance)
+{
+	m_copies[index] = instance;
+	if (m_dirtyFirstCopy == m_dirtyLastCopy) {
+		m_dirtyFirstCopy = index;
+		m_dirtyLastCopy = index + 1;
+	}
+	else {
+		m_dirtyFirstCopy = std::min(m_dirtyFirstCopy, index);
+		m_dirtyLastCopy = std::max(m_dirtyLastCopy, index + 1);
+	}
+}
+
+void GameObject::UpdateInstanceBuffer()
+{
+	// Before Initialize(), the shapes are not known yet
+	if (m_shapeTransforms.empty()) return;
+
+	uint32_t copyCount = static_cast<uint32_t>(m_copies.size());
+	if (m_copyCountChanged) {
+		// Every instance moves, since those of a range are contiguous
+		m_instances.resize(m_shapeTransforms.size() * copyCount);
+		if (m_instances.size() > m_instanceCapacity) {
+			if (m_instanceBuffer) {
+				m_instanceBuffer.destroy();
+				m_instanceBuffer.release();
+			}
+			// Grows by half again, so that adding copies one at a time does
+			// not create a buffer each time
+			m_instanceCapacity = std::max<uint32_t>({ static_cast<uint32_t>(m_instances.size()), m_instanceCapacity + m_instanceCapacity / 2, 1 });
+			BufferDescriptor bufferDesc;
+			bufferDesc.label = "Instances";
+			bufferDesc.size = m_instanceCapacity * sizeof(InstanceAttributes);
+			bufferDesc.usage = BufferUsage::Vertex | BufferUsage::CopyDst;
+			bufferDesc.mappedAtCreation = false;
+			m_instanceBuffer = m_device->createBuffer(bufferDesc);
+		}
+		m_dirtyFirstCopy = 0;
+		m_dirtyLastCopy = copyCount;
+		m_copyCountChanged = false;
+	}
+	if (m_dirtyFirstCopy < m_dirtyLastCopy) {
+		WriteInstances(m_dirtyFirstCopy, std::min(m_dirtyLastCopy, copyCount));
+		ComputeInstanceBounds();
+	}
+	m_dirtyFirstCopy = 0;
+	m_dirtyLastCopy = 0;
 }
 
+void GameObject::WriteInstances(uint32_t firstCopy, uint32_t lastCopy)
+{
+	if (firstCopy >= lastCopy) return;
+	uint32_t copyCount = static_cast<uint32_t>(m_copies.size());
+	Queue queue = m_device->getQueue();
+	for (const DrawRange& range : m_drawRanges) {
+		// Instances of the range are its shapes for copy 0, then for copy 1, etc.
+		size_t first = static_cast<size_t>(range.firstShape) * copyCount + static_cast<size_t>(firstCopy) * range.shapeCount;
+		size_t index = first;
+		for (uint32_t copy = firstCopy; copy < lastCopy; ++copy) {
+			for (uint32_t shape = 0; shape < range.shapeCount; ++shape) {
+				InstanceAttributes& instance = m_instances[index++];
+				instance.modelMatrix = m_copies[copy].transform * m_shapeTransforms[range.firstShape + shape];
+				instance.textureLayers = m_textureLayers;
+				instance.tint = m_copies[copy].tint;
+				instance.objectIndex = static_cast<uint32_t>(m_bufferIndex);
+			}
+		}
+		queue.writeBuffer(m_instanceBuffer, first * sizeof(InstanceAttributes), &m_instances[first], (index - first) * sizeof(InstanceAttributes));
+	}
+	queue.release();
+}
+
+void GameObject::ComputeInstanceBounds()
+{
+	// Box of the bounding spheres of the instances, scaled as much as their
+	// transform stretches them
+	glm::vec3 boundsMin(std::numeric_limits<float>::max());
+	glm::vec3 boundsMax(-std::numeric_limits<float>::max());
+	for (const Instance& copy : m_copies) {
+		glm::vec3 center = glm::vec3(copy.transform * glm::vec4(m_boundsCenter, 1.0f));
+		float scale = std::max({ glm::length(glm::vec3(copy.transform[0])), glm::length(glm::vec3(copy.transform[1])), glm::length(glm::vec3(copy.transform[2])) });
+		boundsMin = glm::min(boundsMin, center - glm::vec3(m_boundsRadius * scale));
+		boundsMax = glm::max(boundsMax, center + glm::vec3(m_boundsRadius * scale));
+	}
+	if (boundsMin.x > boundsMax.x) return;
+	m_instanceBoundsCenter = 0.5f * (boundsMin + boundsMax);
+	m_instanceBoundsRadius = 0.5f * glm::length(boundsMax - boundsMin);
+}
+
+void GameObject::WriteTextureLayers(const glm::uvec2& textureLayers)
+{
+	if (textureLayers == m_textureLayers) return;
+	m_textureLayers = textureLayers;
+	for (InstanceAttributes& instance : m_instances) {
+		instance.textureLayers = textureLayers;
+	}
+	Queue queue = m_device->getQueue();
+	queue.writeBuffer(m_instanceBuffer, 0, m_instances.data(), m_instances.size() * sizeof(InstanceAttributes));
+	queue.release();
+}
 
 void GameObject::SetAlbedoTexture(std::string path)
 {
-	m_baseColorTextureView = nullptr;
-	m_baseColorTexture = Loader::loadTexture(path, *m_device, &m_baseColorTextureView);
+	m_albedoPath = path;
+	if (m_virtualTextures && m_virtualTextures->ShouldVirtualize(path)) {
+		m_virtual = true;
+		return;
+	}
+	m_baseColorTexture = m_textureRegistry->Load(path, *m_device);
 	
 	if (!m_baseColorTexture) {
 		std::cerr << "Could not load baseColor texture!" << std::endl;
@@ -99,27 +445,72 @@ void GameObject::SetAlbedoTexture(std::string path)
 
 void GameObject::SetNormalTexture(std::string path)
 {
-	m_normalTextureView = nullptr;
-	m_normalTexture = Loader::loadTexture(path, *m_device, &m_normalTextureView);
+	m_normalPath = path;
+	if (m_virtualTextures && m_virtualTextures->ShouldVirtualize(path)) {
+		m_virtual = true;
+		return;
+	}
+	m_normalTexture = m_textureRegistry->Load(path, *m_device, MipFilter::TextureKind::Normal);
 
 	if (!m_normalTexture) {
 		std::cerr << "Could not load normal texture!" << std::endl;
 	}
 }
 
+void GameObject::InitVirtualTextures()
+{
+	if (!m_virtual) return;
+
+	// Both textures are sampled through the page table, including one that
+	// is small enough to have been loaded on its own
+	m_baseColorTexture = nullptr;
+	m_normalTexture = nullptr;
+	if (!m_albedoPath.empty()) {
+		m_virtualTextureIds.x = m_virtualTextures->Open(m_albedoPath, MipFilter::TextureKind::Albedo);
+		if (m_virtualTextureIds.x == VirtualTextures::InvalidId) {
+			std::cerr << "Could not load virtual baseColor texture!" << std::endl;
+		}
+	}
+	if (!m_normalPath.empty()) {
+		m_virtualTextureIds.y = m_virtualTextures->Open(m_normalPath, MipFilter::TextureKind::Normal);
+		if (m_virtualTextureIds.y == VirtualTextures::InvalidId) {
+			std::cerr << "Could not load virtual normal texture!" << std::endl;
+		}
+	}
+}
+
+uint32_t GameObject::GetTextureGeneration() const
+{
+	uint32_t generation = 0;
+	// A texture found to be a copy of another one bumps its generation as it
+	// starts drawing with that one
+	for (const TextureHandle& texture : { m_baseColorTexture, m_normalTexture }) {
+		if (!texture) continue;
+		generation += texture->generation;
+		if (texture->sameAs) generation += texture->sameAs->generation;
+	}
+	if (m_virtual) generation += m_virtualTextures->GetGeneration();
+	return generation + m_textureArrays->GetGeneration();
+}
+
 void GameObject::Terminate()
 {
-	m_baseColorTexture.destroy();
-	m_baseColorTexture.release();
-	m_normalTexture.destroy();
-	m_normalTexture.release();
+	if (m_clusteredMesh) m_clusteredMesh->Terminate();
+	if (m_instanceBuffer) {
+		m_instanceBuffer.destroy();
+		m_instanceBuffer.release();
+	}
+	// Textures may be used by other objects, they are destroyed with their last handle
+	m_baseColorTexture = nullptr;
+	m_normalTexture = nullptr;
+	m_bindGroup = nullptr;
 }
 
 
 void GameObject::InitBindGroup()
 {
 	// Create a binding
-	std::vector<BindGroupEntry> bindings(5);
+	std::vector<BindGroupEntry> bindings(6);
 	//                                   ^ This was a 4
 
 	bindings[0].binding = 0;
@@ -127,11 +518,43 @@ void GameObject::InitBindGroup()
 	bindings[0].offset = 0;
 	bindings[0].size = sizeof(MyUniforms);
 
+	// The uniforms of all the objects, indexed by the instances
+	BindGroupEntry objectBinding;
+	objectBinding.binding = 5;
+	objectBinding.buffer = *m_objectUniformBuffer;
+	objectBinding.offset = 0;
+	objectBinding.size = m_objectUniformBuffer->getSize();
+
+	if (m_virtual) {
+		// Textures are in the bind group of the virtual textures (group 2),
+		// the instances select them by id. Those still being cooked are
+		// sampled as missing until they are ready.
+		auto readyId = [this](uint32_t id) { return m_virtualTextures->IsReady(id) ? id : VirtualTextures::InvalidId; };
+		WriteTextureLayers(glm::uvec2(readyId(m_virtualTextureIds.x), readyId(m_virtualTextureIds.y)));
+		bindings[1].binding = 4;
+		bindings[1].buffer = *m_lightingUniformBuffer;
+		bindings[1].offset = 0;
+		bindings[1].size = sizeof(LightingUniforms);
+		bindings[2] = objectBinding;
+
+		BindGroupDescriptor bindGroupDesc;
+		bindGroupDesc.layout = *m_virtualBindGroupLayout;
+		bindGroupDesc.entryCount = 3;
+		bindGroupDesc.entries = bindings.data();
+		m_bindGroup = m_textureArrays->GetBindGroup(bindGroupDesc);
+		return;
+	}
+
+	// Textures are layers of arrays, which the instances select
+	TextureArrays::Slot baseColorSlot = m_textureArrays->Pack(TextureRegistry::resolve(m_baseColorTexture));
+	TextureArrays::Slot normalSlot = m_textureArrays->Pack(TextureRegistry::resolve(m_normalTexture));
+	WriteTextureLayers({ baseColorSlot.layer, normalSlot.layer });
+
 	bindings[1].binding = 1;
-	bindings[1].textureView = m_baseColorTextureView;
+	bindings[1].textureView = baseColorSlot.view;
 
 	bindings[2].binding = 2;
-	bindings[2].textureView = m_normalTextureView;
+	bindings[2].textureView = normalSlot.view;
 
 	bindings[3].binding = 3;
 	bindings[3].sampler = *m_sampler;
@@ -141,9 +564,11 @@ void GameObject::InitBindGroup()
 	bindings[4].offset = 0;
 	bindings[4].size = sizeof(LightingUniforms);
 
+	bindings[5] = objectBinding;
+
 	BindGroupDescriptor bindGroupDesc;
 	bindGroupDesc.layout = *m_bindGroupLayout;
 	bindGroupDesc.entryCount = (uint32_t)bindings.size();
 	bindGroupDesc.entries = bindings.data();
-	m_bindGroup = m_device.get()->createBindGroup(bindGroupDesc);
+	m_bindGroup = m_textureArrays->GetBindGroup(bindGroupDesc);
 }
@@ -8,8 +8,14 @@
 #include <glm/ext.hpp> 
 
 #include <array>
+#include <future>
 
 #include "Loader.h"
+#include "ClusteredMesh.h"
+#include "TextureArrays.h"
+#include "TextureRegistry.h"
+#include "TextureStreamer.h"
+#include "VirtualTextures.h"
 
 
 using VertexAttributes = Loader::VertexAttributes;
@@ -21,29 +27,125 @@ public:
 		std::string name, std::string path,
 		glm::vec3 position,
 		std::shared_ptr<wgpu::Buffer> uniformBuffer,
+		std::shared_ptr<wgpu::Buffer> objectUniformBuffer,
+		std::shared_ptr<wgpu::Buffer> drawCommandBuffer,
 		std::shared_ptr<wgpu::Buffer> lightingBuffer,
 		std::shared_ptr<wgpu::Sampler> sampler,
-		std::shared_ptr<wgpu::BindGroupLayout> bindGroupLayout);
-
-	// Call after all attributes are set. Calls all init methods.
+		std::shared_ptr<wgpu::BindGroupLayout> bindGroupLayout,
+		std::shared_ptr<TextureRegistry> textureRegistry,
+		std::shared_ptr<TextureArrays> textureArrays,
+		std::shared_ptr<VirtualTextures> virtualTextures,
+		std::shared_ptr<wgpu::BindGroupLayout> virtualBindGroupLayout);
+
+	// Call after all attributes are set. Calls all init methods. The
+	// ObjectUniforms of the object are the index-th of the object buffer.
 	void Initialize(int index);
 
 	wgpu::Buffer GetVertexBuffer();
 
-	std::vector<VertexAttributes> GetVertexData();
+	// Empty unless SetKeepVertexData(true) was called before Initialize(),
+	// geometry otherwise only lives in the vertex buffer.
+	const std::vector<VertexAttributes>& GetVertexData();
+	void SetKeepVertexData(bool keep);
 
 	wgpu::BindGroup GetBindGroup();
 
 	uint32_t GetIndexCount();
 
-
-
+	// Non null when the geometry is paged in by clusters (path is a .clusters file)
+	std::shared_ptr<ClusteredMesh> GetClusteredMesh();
+
+	// Set the bind group and vertex buffers, and issue the draw calls (one
+	// per instanced shape of the OBJ file) with the main pipeline. The bind
+	// group is only set if it is not `boundGroup`, which is then updated.
+	// Objects whose textures are in the same arrays share their bind group.
+	// Draws read their arguments from the draw command buffer once
+	// AppendDrawCommands() placed them there.
+	void Draw(wgpu::RenderPassEncoder renderPass, wgpu::BindGroup& boundGroup);
+
+	// Arguments of a draw call, as read by drawIndirect()
+	struct DrawIndirectArgs {
+		uint32_t vertexCount;
+		uint32_t instanceCount;
+		uint32_t firstVertex;
+		uint32_t firstInstance;
+	};
+	// Append the arguments of the draw calls of this object to those of the
+	// draw command buffer. Without `firstInstanceSupported` (the
+	// IndirectFirstInstance feature), objects that draw from other instances
+	// than the first one keep drawing directly.
+	void AppendDrawCommands(std::vector<DrawIndirectArgs>& commands, bool firstInstanceSupported);
+	// Whether the draw calls changed since AppendDrawCommands()
+	bool DrawCommandsChanged() const { return m_drawCommandsChanged; }
+
+	// World position of the object, in its ObjectUniforms
+	glm::vec3 GetPosition() const { return m_position; }
+	void SetPosition(const glm::vec3& position) { m_position = position; }
+	glm::mat4x4 GetModelMatrix() const;
+	// Sphere around all the instances, in world space. The radius is
+	// infinite when the bounds are not known (clustered meshes, geometry
+	// not loaded yet), so that the object is never culled.
+	void GetWorldBounds(glm::vec3& center, float& radius) const;
+	// Index of the ObjectUniforms of this object in the object buffer
+	uint32_t GetObjectIndex() const { return static_cast<uint32_t>(m_bufferIndex); }
+
+	// A copy of the object, drawn by the same draw calls (hardware instancing)
+	struct Instance {
+		glm::mat4x4 transform = glm::mat4x4(1.0f); // in the space of the object
+		glm::vec4 tint = glm::vec4(1.0f); // multiplies the base color
+	};
+	// An object is a single instance with an identity transform until it is
+	// given more. Instances may change at any time, only the instances set
+	// since the last UpdateInstanceBuffer() are uploaded. Clustered meshes
+	// only draw the first one, their clusters are culled for one placement.
+	uint32_t GetInstanceCount() const { return static_cast<uint32_t>(m_copies.size()); }
+	const Instance& GetInstance(uint32_t index) const { return m_copies[index]; }
+	void SetInstanceCount(uint32_t count);
+	uint32_t AddInstance(const Instance& instance);
+	void SetInstance(uint32_t index, const Instance& instance);
+	// Upload the instances that changed, growing the instance buffer if
+	// there are more than it holds. Call once per frame, before drawing.
+	void UpdateInstanceBuffer();
+
+
+	// Objects using the same image share the texture, see TextureRegistry.
+	// If one of the images is too large to be resident (see
+	// VirtualTextures::ShouldVirtualize), both textures are virtual instead,
+	// opened by Initialize().
 	void SetAlbedoTexture(std::string path);
 	void SetNormalTexture(std::string path);
 
+	// Drawn with the virtual texturing pipeline (fs_main_virtual), with a
+	// bind group of virtualBindGroupLayout, and in the feedback pass
+	bool IsVirtual() const { return m_virtual; }
+
+	// Ask `streamer` for the mip level of each texture at which a texel covers
+	// about a pixel, given how many pixels a world unit covers at a distance
+	// of 1 from the camera.
+	void RequestTextureLevels(TextureStreamer& streamer, const glm::vec3& cameraPosition, float pixelsPerUnitAtOneMeter);
+	// Pack the textures that were replaced (once loaded or by the streamer)
+	// in their arrays again, and get the bind group of the new arrays
+	void UpdateTextureBindings();
+
 	void Terminate();
 private:
 	void InitBuffer();
+	// UV density and bounds, from which the resolution of the textures on
+	// screen is estimated
+	void ComputeTextureFootprint(const VertexAttributes* vertices, const std::vector<Loader::InstancedRange>& ranges);
+	// Changes whenever one of the textures is replaced, an array grows or a
+	// virtual texture finishes cooking
+	uint32_t GetTextureGeneration() const;
+	// Write the array layers of the textures in the instances
+	void WriteTextureLayers(const glm::uvec2& textureLayers);
+	void InitInstanceBuffer();
+	// Write the attributes of instances [firstCopy, lastCopy) to the
+	// instance buffer, one contiguous write per draw range
+	void WriteInstances(uint32_t firstCopy, uint32_t lastCopy);
+	// Bounds of all the instances, from the bounds of a single one
+	void ComputeInstanceBounds();
+	// Open the textures of a virtual object in the virtual textures
+	void InitVirtualTextures();
 	
 	void InitBindGroup();
 
@@ -62,6 +164,25 @@ public:
 	// Have the compiler check byte alignment
 	static_assert(sizeof(MyUniforms) % 16 == 0);
 
+	// Uniforms of a single object, in the storage buffer of all the objects
+	// (binding 5), where the shader finds them with the object index of the
+	// instance. Objects thus share their bind groups.
+	struct ObjectUniforms {
+		glm::mat4x4 modelMatrix; // between MyUniforms::modelMatrix and the instances
+	};
+	static_assert(sizeof(ObjectUniforms) % 16 == 0);
+
+
+	// Per-instance vertex attributes, in the second vertex buffer
+	struct InstanceAttributes {
+		glm::mat4x4 modelMatrix; // on top of ObjectUniforms::modelMatrix
+		// Layers of the base color and normal textures in their arrays (or
+		// their virtual texture ids), the same for all the instances of an object
+		glm::uvec2 textureLayers = glm::uvec2(0);
+		uint32_t objectIndex = 0; // of the ObjectUniforms of the object
+		uint32_t _pad = 0;
+		glm::vec4 tint = glm::vec4(1.0f);
+	};
 
 	// Before Application's private attributes
 	struct LightingUniforms {
@@ -88,9 +209,43 @@ private:
 
 	wgpu::Buffer m_vertexBuffer;
 	std::vector<VertexAttributes> m_vertexData;
+	bool m_keepVertexData = false;
+	// Geometry being read and parsed in the background (shared because GameObjects are copied)
+	std::shared_future<std::shared_ptr<Loader::ObjGeometry>> m_pendingGeometry;
+
+	std::shared_ptr<ClusteredMesh> m_clusteredMesh = nullptr;
+
+	// A range of the vertex buffer drawn for the shapes repeated in the OBJ
+	// file, shapes [firstShape, firstShape + shapeCount) of m_shapeTransforms
+	struct DrawRange {
+		uint32_t firstVertex;
+		uint32_t vertexCount;
+		uint32_t firstShape;
+		uint32_t shapeCount;
+	};
+	std::vector<DrawRange> m_drawRanges;
+	std::vector<glm::mat4x4> m_shapeTransforms;
+	// Instances of the object, each of which draws every shape. The instance
+	// buffer holds shapeCount instances of the first range for each copy,
+	// then those of the next range, etc., so that a draw range is a
+	// contiguous range of instances.
+	std::vector<Instance> m_copies = { Instance() };
+	std::vector<InstanceAttributes> m_instances; // the content of the instance buffer
+	wgpu::Buffer m_instanceBuffer = nullptr;
+	uint32_t m_instanceCapacity = 0; // instances the buffer holds
+	// Copies set since the last upload, or all of them if their count changed
+	uint32_t m_dirtyFirstCopy = 0;
+	uint32_t m_dirtyLastCopy = 0;
+	bool m_copyCountChanged = false;
 
 	// MyUniforms m_uniforms;
 	std::shared_ptr<wgpu::Buffer> m_uniformBuffer;
+	std::shared_ptr<wgpu::Buffer> m_objectUniformBuffer;
+	// Arguments of the draw calls of all the objects, ours start at m_firstDrawCommand
+	std::shared_ptr<wgpu::Buffer> m_drawCommandBuffer;
+	uint32_t m_firstDrawCommand = 0;
+	bool m_drawIndirect = false;
+	bool m_drawCommandsChanged = true;
 
 	LightingUniforms m_lightingUniforms;
 	std::shared_ptr<wgpu::Buffer> m_lightingUniformBuffer;
@@ -99,15 +254,33 @@ private:
 
 	std::shared_ptr<wgpu::BindGroupLayout> m_bindGroupLayout;
 
-	uint32_t m_indexCount;
-
-	wgpu::BindGroup m_bindGroup;
-
-	wgpu::Texture m_baseColorTexture = nullptr;
-	wgpu::TextureView m_baseColorTextureView = nullptr;
-	wgpu::Texture m_normalTexture = nullptr;
-	wgpu::TextureView m_normalTextureView = nullptr;
+	uint32_t m_indexCount = 0;
+
+	wgpu::BindGroup m_bindGroup; // owned by m_textureArrays
+
+	std::shared_ptr<TextureRegistry> m_textureRegistry;
+	TextureHandle m_baseColorTexture = nullptr;
+	TextureHandle m_normalTexture = nullptr;
+	uint32_t m_textureGeneration = 0; // of the textures in the bind group
+	std::shared_ptr<TextureArrays> m_textureArrays;
+	glm::uvec2 m_textureLayers = glm::uvec2(0);
+
+	std::string m_albedoPath;
+	std::string m_normalPath;
+	bool m_virtual = false;
+	std::shared_ptr<VirtualTextures> m_virtualTextures;
+	std::shared_ptr<wgpu::BindGroupLayout> m_virtualBindGroupLayout;
+	// Ids of the base color and normal textures, in place of array layers
+	glm::uvec2 m_virtualTextureIds = glm::uvec2(VirtualTextures::InvalidId);
+
+	// Texture footprint, see ComputeTextureFootprint(), of a single instance
+	// then of all of them
+	glm::vec3 m_boundsCenter = glm::vec3(0.0f);
+	float m_boundsRadius = 0.0f;
+	glm::vec3 m_instanceBoundsCenter = glm::vec3(0.0f);
+	float m_instanceBoundsRadius = 0.0f;
+	float m_uvDensity = 0.0f; // 0 if unknown
 
 	// World Position of the GameObject
-	glm::vec3 m_position;
+	glm::vec3 m_position = glm::vec3(0.0f);
 };
\ No newline at end of file
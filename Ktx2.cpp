@@ -0,0 +1,229 @@
+#include "Ktx2.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+
+namespace {
+
+const unsigned char Identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+// Identifier, then 9 words of header and the index of the data format
+// descriptor, key/value data and supercompression global data.
+constexpr size_t HeaderSize = 80;
+constexpr size_t LevelIndexEntrySize = 24;
+
+uint32_t readU32(const unsigned char* data) {
+	uint32_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+uint64_t readU64(const unsigned char* data) {
+	uint64_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+void appendU32(std::vector<unsigned char>& out, uint32_t value) {
+	unsigned char bytes[4];
+	std::memcpy(bytes, &value, sizeof(bytes));
+	out.insert(out.end(), bytes, bytes + 4);
+}
+
+void appendU64(std::vector<unsigned char>& out, uint64_t value) {
+	unsigned char bytes[8];
+	std::memcpy(bytes, &value, sizeof(bytes));
+	out.insert(out.end(), bytes, bytes + 8);
+}
+
+// A channel of the data format descriptor (see the Khronos Data Format
+// Specification), either a channel of a texel or the whole block of a
+// compressed format.
+struct Sample {
+	uint32_t bitOffset;
+	uint32_t bitLength;
+	uint32_t channel;
+	uint32_t upper;
+};
+
+struct FormatDescription {
+	uint32_t colorModel; // KHR_DF_MODEL_*
+	uint32_t blockSize; // texels per side
+	uint32_t blockBytes;
+	bool srgb;
+	std::vector<Sample> samples;
+};
+
+bool describe(uint32_t vkFormat, FormatDescription& description) {
+	constexpr uint32_t ModelRGBSDA = 1;
+	constexpr uint32_t ModelBC1A = 128;
+	constexpr uint32_t ModelBC4 = 131;
+	constexpr uint32_t ModelBC5 = 132;
+	constexpr uint32_t ModelBC7 = 134;
+	constexpr uint32_t Alpha = 15;
+	constexpr uint32_t Full = 0xFFFFFFFF;
+
+	switch (vkFormat) {
+	case Ktx2::R8Unorm:
+		description = { ModelRGBSDA, 1, 1, false, { { 0, 8, 0, 255 } } };
+		return true;
+	case Ktx2::R8G8Unorm:
+		description = { ModelRGBSDA, 1, 2, false, { { 0, 8, 0, 255 }, { 8, 8, 1, 255 } } };
+		return true;
+	case Ktx2::R8G8B8A8Unorm:
+	case Ktx2::R8G8B8A8Srgb:
+		description = { ModelRGBSDA, 1, 4, vkFormat == Ktx2::R8G8B8A8Srgb,
+			{ { 0, 8, 0, 255 }, { 8, 8, 1, 255 }, { 16, 8, 2, 255 }, { 24, 8, Alpha, 255 } } };
+		return true;
+	case Ktx2::BC1RgbUnorm:
+	case Ktx2::BC1RgbSrgb:
+		description = { ModelBC1A, 4, 8, vkFormat == Ktx2::BC1RgbSrgb, { { 0, 64, 0, Full } } };
+		return true;
+	case Ktx2::BC4Unorm:
+		description = { ModelBC4, 4, 8, false, { { 0, 64, 0, Full } } };
+		return true;
+	case Ktx2::BC5Unorm:
+		description = { ModelBC5, 4, 16, false, { { 0, 64, 0, Full }, { 64, 64, 1, Full } } };
+		return true;
+	case Ktx2::BC7Unorm:
+	case Ktx2::BC7Srgb:
+		description = { ModelBC7, 4, 16, vkFormat == Ktx2::BC7Srgb, { { 0, 128, 0, Full } } };
+		return true;
+	default:
+		return false;
+	}
+}
+
+// The data format descriptor, made of a single basic descriptor block
+std::vector<unsigned char> dataFormatDescriptor(const FormatDescription& description) {
+	constexpr uint32_t PrimariesBT709 = 1;
+	constexpr uint32_t TransferLinear = 1;
+	constexpr uint32_t TransferSRGB = 2;
+	uint32_t blockSize = 24 + 16 * static_cast<uint32_t>(description.samples.size());
+
+	std::vector<unsigned char> dfd;
+	appendU32(dfd, 4 + blockSize); // total size, including this word
+	appendU32(dfd, 0); // Khronos vendor, basic descriptor type
+	appendU32(dfd, 2 | (blockSize << 16)); // version 1.3 of the specification
+	uint32_t transfer = description.srgb ? TransferSRGB : TransferLinear;
+	appendU32(dfd, description.colorModel | (PrimariesBT709 << 8) | (transfer << 16));
+	uint32_t dimension = description.blockSize - 1; // stored minus one
+	appendU32(dfd, dimension | (dimension << 8));
+	appendU32(dfd, description.blockBytes); // bytes of plane 0
+	appendU32(dfd, 0);
+	for (const Sample& sample : description.samples) {
+		appendU32(dfd, sample.bitOffset | ((sample.bitLength - 1) << 16) | (sample.channel << 24));
+		appendU32(dfd, 0); // sample position
+		appendU32(dfd, 0); // lower value
+		appendU32(dfd, sample.upper);
+	}
+	return dfd;
+}
+
+} // namespace
+
+bool Ktx2::parse(const unsigned char* data, size_t size, Info& info, std::string& error) {
+	if (size < HeaderSize || std::memcmp(data, Identifier, sizeof(Identifier)) != 0) {
+		error = "not a KTX2 file";
+		return false;
+	}
+
+	uint32_t vkFormat = readU32(data + 12);
+	uint32_t width = readU32(data + 20);
+	uint32_t height = readU32(data + 24);
+	uint32_t depth = readU32(data + 28);
+	uint32_t layerCount = readU32(data + 32);
+	uint32_t faceCount = readU32(data + 36);
+	uint32_t levelCount = readU32(data + 40);
+	uint32_t supercompression = readU32(data + 44);
+
+	if (vkFormat == 0 || supercompression != 0) {
+		error = "supercompressed textures are not supported";
+		return false;
+	}
+	if (width == 0 || height == 0 || depth != 0 || layerCount > 1 || faceCount != 1) {
+		error = "only 2D textures are supported";
+		return false;
+	}
+
+	// A level count of 0 asks the loader to generate the mip levels, which we
+	// do not do here since the point of KTX2 files is to ship them.
+	levelCount = std::max(levelCount, 1u);
+	if (levelCount > 32 || (size - HeaderSize) / LevelIndexEntrySize < levelCount) {
+		error = "truncated level index";
+		return false;
+	}
+
+	info.vkFormat = vkFormat;
+	info.width = width;
+	info.height = height;
+	info.levels.resize(levelCount);
+	for (uint32_t level = 0; level < levelCount; ++level) {
+		const unsigned char* entry = data + HeaderSize + level * LevelIndexEntrySize;
+		Level& l = info.levels[level];
+		l.offset = readU64(entry);
+		l.size = readU64(entry + 8);
+		if (l.offset > size || l.size > size - l.offset) {
+			error = "level " + std::to_string(level) + " is outside of the file";
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Ktx2::write(const std::filesystem::path& path, uint32_t vkFormat, uint32_t width, uint32_t height, const std::vector<LevelData>& levels) {
+	FormatDescription description;
+	if (levels.empty() || !describe(vkFormat, description)) return false;
+
+	uint32_t levelCount = static_cast<uint32_t>(levels.size());
+	std::vector<unsigned char> dfd = dataFormatDescriptor(description);
+	size_t dfdOffset = HeaderSize + levelCount * LevelIndexEntrySize;
+
+	// Levels are stored from the smallest to the largest, as the specification
+	// recommends for streaming, each aligned to lcm(block bytes, 4).
+	size_t alignment = std::lcm(description.blockBytes, 4u);
+	std::vector<uint64_t> offsets(levelCount);
+	uint64_t end = dfdOffset + dfd.size();
+	for (uint32_t level = levelCount; level-- > 0;) {
+		end = (end + alignment - 1) / alignment * alignment;
+		offsets[level] = end;
+		end += levels[level].size;
+	}
+
+	std::vector<unsigned char> header(Identifier, Identifier + sizeof(Identifier));
+	appendU32(header, vkFormat);
+	appendU32(header, 1); // type size, for formats made of bytes or blocks
+	appendU32(header, width);
+	appendU32(header, height);
+	appendU32(header, 0); // depth
+	appendU32(header, 0); // layer count, 0 when not an array
+	appendU32(header, 1); // face count
+	appendU32(header, levelCount);
+	appendU32(header, 0); // no supercompression
+	appendU32(header, static_cast<uint32_t>(dfdOffset));
+	appendU32(header, static_cast<uint32_t>(dfd.size()));
+	appendU32(header, 0); // no key/value data
+	appendU32(header, 0);
+	appendU64(header, 0); // no supercompression global data
+	appendU64(header, 0);
+	for (uint32_t level = 0; level < levelCount; ++level) {
+		appendU64(header, offsets[level]);
+		appendU64(header, levels[level].size);
+		appendU64(header, levels[level].size); // uncompressed size
+	}
+	header.insert(header.end(), dfd.begin(), dfd.end());
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file.is_open()) return false;
+	file.write(reinterpret_cast<const char*>(header.data()), header.size());
+	uint64_t position = header.size();
+	const char padding[16] = {};
+	for (uint32_t level = levelCount; level-- > 0;) {
+		file.write(padding, offsets[level] - position);
+		file.write(reinterpret_cast<const char*>(levels[level].data), levels[level].size);
+		position = offsets[level] + levels[level].size;
+	}
+	return static_cast<bool>(file);
+}
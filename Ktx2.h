@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Reading and writing of KTX2 files (Khronos Texture 2.0), limited to what the
+// application uses: 2D textures with mip levels, without supercompression.
+//
+// The level data of a file is stored exactly as the GPU expects it (rows of
+// texels or of blocks, tightly packed), so it can be uploaded without any
+// decoding. Mapping VkFormat values to WebGPU formats is left to the Loader.
+class Ktx2
+{
+public:
+	// Values of VkFormat that the Loader knows how to load
+	enum VkFormat : uint32_t {
+		R8Unorm = 9,
+		R8G8Unorm = 16,
+		R8G8B8A8Unorm = 37,
+		R8G8B8A8Srgb = 43,
+		B8G8R8A8Unorm = 44,
+		B8G8R8A8Srgb = 50,
+		R16G16B16A16Sfloat = 97,
+		R32G32B32A32Sfloat = 109,
+		BC1RgbUnorm = 131,
+		BC1RgbSrgb = 132,
+		BC1RgbaUnorm = 133,
+		BC1RgbaSrgb = 134,
+		BC3Unorm = 137,
+		BC3Srgb = 138,
+		BC4Unorm = 139,
+		BC5Unorm = 141,
+		BC7Unorm = 145,
+		BC7Srgb = 146,
+	};
+
+	// Where the data of a mip level is in the file
+	struct Level {
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct Info {
+		uint32_t vkFormat = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::vector<Level> levels; // level 0 first
+	};
+
+	// Texels per side of the blocks of a format: 4 for the BC formats
+	// (VkFormat 131 to 146), 1 for the others
+	static uint32_t blockSize(uint32_t vkFormat) { return vkFormat >= BC1RgbUnorm && vkFormat <= BC7Srgb ? 4 : 1; }
+
+	// Check that `data` (a whole file) is a KTX2 2D texture and fill `info`.
+	// On failure, `error` tells why.
+	static bool parse(const unsigned char* data, size_t size, Info& info, std::string& error);
+
+	struct LevelData {
+		const unsigned char* data;
+		size_t size;
+	};
+
+	// Write a 2D texture, levels[0] being level 0. Only the formats written by
+	// the texture cooker are supported: R8, RG8, RGBA8, BC1 (RGB), BC4, BC5
+	// and BC7.
+	static bool write(const std::filesystem::path& path, uint32_t vkFormat, uint32_t width, uint32_t height, const std::vector<LevelData>& levels);
+};
@@ -1,5 +1,145 @@
 #include "Loader.h"
 
+#include "Ktx2.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+MipGenerator* Loader::s_mipGenerator = nullptr;
+UploadManager* Loader::s_uploadManager = nullptr;
+Loader::TextureQuality Loader::s_textureQuality;
+
+namespace {
+	const char* formatName(BlockCompression::Format format) {
+		switch (format) {
+		case BlockCompression::Format::BC1: return "bc1";
+		case BlockCompression::Format::BC5: return "bc5";
+		default: return "bc7";
+		}
+	}
+
+	const char* kindName(MipFilter::TextureKind kind) {
+		switch (kind) {
+		case MipFilter::TextureKind::Normal: return "normal";
+		case MipFilter::TextureKind::Mask: return "mask";
+		default: return "albedo";
+		}
+	}
+
+	// Colors are stored sRGB encoded, the GPU decodes them when sampling
+	uint32_t vkFormat(BlockCompression::Format format, MipFilter::TextureKind kind) {
+		bool srgb = kind == MipFilter::TextureKind::Albedo;
+		switch (format) {
+		case BlockCompression::Format::BC1: return srgb ? Ktx2::BC1RgbSrgb : Ktx2::BC1RgbUnorm;
+		case BlockCompression::Format::BC5: return Ktx2::BC5Unorm;
+		default: return srgb ? Ktx2::BC7Srgb : Ktx2::BC7Unorm;
+		}
+	}
+
+	uint32_t vkFormat(TextureFormat format) {
+		switch (format) {
+		case TextureFormat::R8Unorm: return Ktx2::R8Unorm;
+		case TextureFormat::RG8Unorm: return Ktx2::R8G8Unorm;
+		case TextureFormat::RGBA8UnormSrgb: return Ktx2::R8G8B8A8Srgb;
+		default: return Ktx2::R8G8B8A8Unorm;
+		}
+	}
+
+	const char* formatName(TextureFormat format) {
+		switch (format) {
+		case TextureFormat::R8Unorm: return "r8";
+		case TextureFormat::RG8Unorm: return "rg8";
+		case TextureFormat::RGBA8UnormSrgb: return "rgba8 srgb";
+		default: return "rgba8";
+		}
+	}
+
+	// Bytes of a texel of the formats returned by Loader::uncompressedFormat
+	uint32_t bytesPerTexel(TextureFormat format) {
+		switch (format) {
+		case TextureFormat::R8Unorm: return 1;
+		case TextureFormat::RG8Unorm: return 2;
+		default: return 4;
+		}
+	}
+
+	// Keep the first `bytesPerTexel` channels of RGBA8 texels
+	void packTexels(const unsigned char* pixels, size_t texelCount, uint32_t bytesPerTexel, unsigned char* packed) {
+		if (bytesPerTexel == 4) {
+			std::memcpy(packed, pixels, 4 * texelCount);
+			return;
+		}
+		for (size_t i = 0; i < texelCount; ++i) {
+			for (uint32_t channel = 0; channel < bytesPerTexel; ++channel) {
+				packed[i * bytesPerTexel + channel] = pixels[4 * i + channel];
+			}
+		}
+	}
+
+	// How the formats found in KTX2 files are uploaded
+	struct Ktx2Format {
+		uint32_t vkFormat;
+		TextureFormat format;
+		uint32_t blockSize; // texels per side, 4 for block compressed formats
+		uint32_t blockBytes;
+	};
+
+	const Ktx2Format ktx2Formats[] = {
+		{ Ktx2::R8Unorm, TextureFormat::R8Unorm, 1, 1 },
+		{ Ktx2::R8G8Unorm, TextureFormat::RG8Unorm, 1, 2 },
+		{ Ktx2::R8G8B8A8Unorm, TextureFormat::RGBA8Unorm, 1, 4 },
+		{ Ktx2::R8G8B8A8Srgb, TextureFormat::RGBA8UnormSrgb, 1, 4 },
+		{ Ktx2::B8G8R8A8Unorm, TextureFormat::BGRA8Unorm, 1, 4 },
+		{ Ktx2::B8G8R8A8Srgb, TextureFormat::BGRA8UnormSrgb, 1, 4 },
+		{ Ktx2::R16G16B16A16Sfloat, TextureFormat::RGBA16Float, 1, 8 },
+		{ Ktx2::R32G32B32A32Sfloat, TextureFormat::RGBA32Float, 1, 16 },
+		// WebGPU has no BC1 without alpha, the alpha of 3-color blocks is
+		// simply ignored by the shaders.
+		{ Ktx2::BC1RgbUnorm, TextureFormat::BC1RGBAUnorm, 4, 8 },
+		{ Ktx2::BC1RgbSrgb, TextureFormat::BC1RGBAUnormSrgb, 4, 8 },
+		{ Ktx2::BC1RgbaUnorm, TextureFormat::BC1RGBAUnorm, 4, 8 },
+		{ Ktx2::BC1RgbaSrgb, TextureFormat::BC1RGBAUnormSrgb, 4, 8 },
+		{ Ktx2::BC3Unorm, TextureFormat::BC3RGBAUnorm, 4, 16 },
+		{ Ktx2::BC3Srgb, TextureFormat::BC3RGBAUnormSrgb, 4, 16 },
+		{ Ktx2::BC4Unorm, TextureFormat::BC4RUnorm, 4, 8 },
+		{ Ktx2::BC5Unorm, TextureFormat::BC5RGUnorm, 4, 16 },
+		{ Ktx2::BC7Unorm, TextureFormat::BC7RGBAUnorm, 4, 16 },
+		{ Ktx2::BC7Srgb, TextureFormat::BC7RGBAUnormSrgb, 4, 16 },
+	};
+
+	const Ktx2Format* findKtx2Format(uint32_t vkFormat) {
+		for (const Ktx2Format& format : ktx2Formats) {
+			if (format.vkFormat == vkFormat) return &format;
+		}
+		return nullptr;
+	}
+
+	// Level of a KTX2 file closest to `wanted` that a texture can start at,
+	// coarser first: block compressed textures start at whole blocks
+	uint32_t ktx2FirstLevel(const Ktx2::Info& info, uint32_t wanted) {
+		const Ktx2Format* format = findKtx2Format(info.vkFormat);
+		uint32_t levelCount = static_cast<uint32_t>(info.levels.size());
+		if (format == nullptr || levelCount == 0) return 0;
+		auto wholeBlocks = [&](uint32_t level) {
+			return MipFilter::mipLevelSize(info.width, level) % format->blockSize == 0
+				&& MipFilter::mipLevelSize(info.height, level) % format->blockSize == 0;
+		};
+		wanted = std::min(wanted, levelCount - 1);
+		for (uint32_t level = wanted; level < levelCount; ++level) {
+			if (wholeBlocks(level)) return level;
+		}
+		for (uint32_t level = wanted; level-- > 0;) {
+			if (wholeBlocks(level)) return level;
+		}
+		return 0;
+	}
+} // namespace
+
 bool Loader::loadGeometry(const fs::path& path, std::vector<float>& pointData, std::vector<uint16_t>& indexData, int dimensions)
 {
 	std::ifstream file(path);
@@ -57,17 +197,132 @@ bool Loader::loadGeometry(const fs::path& path, std::vector<float>& pointData, s
 	return true;
 }
 
+bool Loader::forEachPoint(const fs::path& path, int dimensions, const std::function<void(const double* values)>& onPoint)
+{
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	bool inPoints = false;
+	std::vector<double> values(dimensions + 3);
+	std::string line;
+	while (getline(file, line)) {
+		// overcome the `CRLF` problem
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+
+		if (line.empty() || line[0] == '#') {
+			// Do nothing, this is a comment
+		}
+		else if (line[0] == '[') {
+			inPoints = line == "[points]";
+		}
+		else if (inPoints) {
+			// strtod is much faster than istringstream on the huge files this is meant for
+			const char* cursor = line.c_str();
+			for (double& value : values) {
+				char* end = nullptr;
+				value = std::strtod(cursor, &end);
+				cursor = end;
+			}
+			onPoint(values.data());
+		}
+	}
+	return true;
+}
+
+namespace {
+	// OBJ files are Y-up, convert to our Z-up frame
+	glm::vec3 objPosition(const tinyobj::attrib_t& attrib, const tinyobj::index_t& idx) {
+		return {
+			attrib.vertices[3 * idx.vertex_index + 0],
+			-attrib.vertices[3 * idx.vertex_index + 2], // Add a minus to avoid mirroring
+			attrib.vertices[3 * idx.vertex_index + 1]
+		};
+	}
+
+	// Also apply the transform to normals!!
+	glm::vec3 objNormal(const tinyobj::attrib_t& attrib, const tinyobj::index_t& idx) {
+		return {
+			attrib.normals[3 * idx.normal_index + 0],
+			-attrib.normals[3 * idx.normal_index + 2],
+			attrib.normals[3 * idx.normal_index + 1]
+		};
+	}
+
+	glm::vec3 objColor(const tinyobj::attrib_t& attrib, const tinyobj::index_t& idx) {
+		return {
+			attrib.colors[3 * idx.vertex_index + 0],
+			attrib.colors[3 * idx.vertex_index + 1],
+			attrib.colors[3 * idx.vertex_index + 2]
+		};
+	}
+
+	glm::vec2 objUv(const tinyobj::attrib_t& attrib, const tinyobj::index_t& idx) {
+		return {
+			attrib.texcoords[2 * idx.texcoord_index + 0],
+			1 - attrib.texcoords[2 * idx.texcoord_index + 1]
+		};
+	}
+
+	// Rigid frame of a shape, built from its first non-degenerate triangle:
+	// origin on the first corner, X along the first edge, Z along the face
+	// normal. Two shapes that are rigid transforms of each other (with the
+	// same vertex order) have the same geometry when expressed in their frames.
+	bool shapeFrame(const tinyobj::attrib_t& attrib, const tinyobj::shape_t& shape, glm::mat4x4& frame) {
+		const std::vector<tinyobj::index_t>& indices = shape.mesh.indices;
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			glm::vec3 p0 = objPosition(attrib, indices[i + 0]);
+			glm::vec3 e1 = objPosition(attrib, indices[i + 1]) - p0;
+			glm::vec3 e2 = objPosition(attrib, indices[i + 2]) - p0;
+			glm::vec3 n = glm::cross(e1, e2);
+			float scale = glm::length(e1) * glm::length(e2);
+			if (scale == 0.0f || glm::length(n) < 1e-4f * scale) continue;
+
+			glm::vec3 x = glm::normalize(e1);
+			glm::vec3 z = glm::normalize(n);
+			glm::vec3 y = glm::cross(z, x);
+			frame = glm::mat4x4(glm::vec4(x, 0.0f), glm::vec4(y, 0.0f), glm::vec4(z, 0.0f), glm::vec4(p0, 1.0f));
+			return true;
+		}
+		return false;
+	}
+
+	// A shape expressed in its own frame, see shapeFrame()
+	struct CanonicalShape {
+		glm::mat4x4 frame;
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec3> normals;
+		uint64_t hash = 0;
+	};
+
+	void hashCombine(uint64_t& hash, uint64_t value) {
+		hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+	}
+} // namespace
+
+namespace {
+	// Read-only stream over bytes already in memory, to parse files without copying them
+	struct MemoryStreamBuffer : std::streambuf {
+		MemoryStreamBuffer(const unsigned char* data, size_t size) {
+			char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+			setg(begin, begin, begin + size);
+		}
+	};
+} // namespace
+
 bool Loader::loadGeometryFromObj(const fs::path& path, std::vector<VertexAttributes>& thisVertexData)
 {
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
+	ObjGeometry geometry;
 
 	std::string warn;
 	std::string err;
 
 	// Call the core loading procedure of TinyOBJLoader
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, path.string().c_str());
+	std::vector<tinyobj::material_t> materials;
+	bool ret = tinyobj::LoadObj(&geometry.attrib, &geometry.shapes, &materials, &warn, &err, path.string().c_str());
 
 	// Check errors
 	if (!warn.empty()) {
@@ -82,44 +337,186 @@ bool Loader::loadGeometryFromObj(const fs::path& path, std::vector<VertexAttribu
 		return false;
 	}
 
+	for (const auto& shape : geometry.shapes) {
+		geometry.vertexCount += shape.mesh.indices.size();
+	}
+	thisVertexData.resize(geometry.vertexCount);
+	writeVertices(geometry, thisVertexData.data());
+	return true;
+}
+
+bool Loader::parseObj(const std::vector<unsigned char>& objBytes, const fs::path& materialDir, ObjGeometry& geometry)
+{
+	std::string warn;
+	std::string err;
+
+	MemoryStreamBuffer buffer(objBytes.data(), objBytes.size());
+	std::istream stream(&buffer);
+	// Materials (if any) are still read from disk, relative to the OBJ file
+	tinyobj::MaterialFileReader materialReader(materialDir.string() + "/");
+	std::vector<tinyobj::material_t> materials;
+	bool ret = tinyobj::LoadObj(&geometry.attrib, &geometry.shapes, &materials, &warn, &err, &stream, &materialReader);
+
+	// Check errors
+	if (!warn.empty()) {
+		std::cout << warn << std::endl;
+	}
+
+	if (!err.empty()) {
+		std::cerr << err << std::endl;
+	}
+
+	if (!ret) {
+		return false;
+	}
+
+	geometry.vertexCount = 0;
+	for (const auto& shape : geometry.shapes) {
+		geometry.vertexCount += shape.mesh.indices.size();
+	}
+	return true;
+}
+
+void Loader::writeVertices(const ObjGeometry& geometry, VertexAttributes* vertices)
+{
+	const tinyobj::attrib_t& attrib = geometry.attrib;
+
 	// Filling in vertexData:
-	thisVertexData.clear();
-	for (const auto& shape : shapes) {
-		size_t offset = thisVertexData.size();
-		thisVertexData.resize(offset + shape.mesh.indices.size());
+	size_t offset = 0;
+	for (size_t s = 0; s < geometry.shapes.size(); ++s) {
+		if (!geometry.writtenShapes.empty() && !geometry.writtenShapes[s]) continue;
+		const tinyobj::shape_t& shape = geometry.shapes[s];
 
 		for (size_t i = 0; i < shape.mesh.indices.size(); ++i) {
 			const tinyobj::index_t& idx = shape.mesh.indices[i];
+			vertices[offset + i].position = objPosition(attrib, idx);
+			vertices[offset + i].normal = objNormal(attrib, idx);
+			vertices[offset + i].color = objColor(attrib, idx);
+			vertices[offset + i].uv = objUv(attrib, idx);
+		}
+		offset += shape.mesh.indices.size();
+	}
 
-			thisVertexData[offset + i].position = {
-				attrib.vertices[3 * idx.vertex_index + 0],
-				-attrib.vertices[3 * idx.vertex_index + 2], // Add a minus to avoid mirroring
-				attrib.vertices[3 * idx.vertex_index + 1]
-			};
+	populateTextureFrameAttributes(vertices, geometry.vertexCount);
+}
+
+size_t Loader::findInstances(ObjGeometry& geometry)
+{
+	const tinyobj::attrib_t& attrib = geometry.attrib;
+	const size_t shapeCount = geometry.shapes.size();
 
-			// Also apply the transform to normals!!
-			thisVertexData[offset + i].normal = {
-				attrib.normals[3 * idx.normal_index + 0],
-				-attrib.normals[3 * idx.normal_index + 2],
-				attrib.normals[3 * idx.normal_index + 1]
-			};
+	// Geometry is compared up to a fraction of the size of the whole model
+	glm::vec3 boundsMin(std::numeric_limits<float>::max());
+	glm::vec3 boundsMax(std::numeric_limits<float>::lowest());
+	for (size_t i = 0; i + 2 < attrib.vertices.size(); i += 3) {
+		glm::vec3 p(attrib.vertices[i], attrib.vertices[i + 1], attrib.vertices[i + 2]);
+		boundsMin = glm::min(boundsMin, p);
+		boundsMax = glm::max(boundsMax, p);
+	}
+	if (attrib.vertices.empty()) return 0;
+	const float tolerance = std::max(1e-5f * glm::length(boundsMax - boundsMin), 1e-7f);
+	const float normalTolerance = 1e-3f;
+	const float attributeTolerance = 1e-5f;
 
-			thisVertexData[offset + i].color = {
-				attrib.colors[3 * idx.vertex_index + 0],
-				attrib.colors[3 * idx.vertex_index + 1],
-				attrib.colors[3 * idx.vertex_index + 2]
-			};
+	// Express each shape in its own frame and hash the quantized result. The
+	// hash only selects candidates, they are then compared with a tolerance.
+	std::vector<CanonicalShape> canonical(shapeCount);
+	std::vector<bool> hasFrame(shapeCount, false);
+	for (size_t s = 0; s < shapeCount; ++s) {
+		const tinyobj::shape_t& shape = geometry.shapes[s];
+		CanonicalShape& c = canonical[s];
+		if (shape.mesh.indices.size() % 3 != 0 || !shapeFrame(attrib, shape, c.frame)) continue;
+		hasFrame[s] = true;
 
-			thisVertexData[offset + i].uv = {
-				attrib.texcoords[2 * idx.texcoord_index + 0],
-				1 - attrib.texcoords[2 * idx.texcoord_index + 1]
-			};
+		glm::mat4x4 toLocal = glm::inverse(c.frame);
+		c.positions.reserve(shape.mesh.indices.size());
+		c.normals.reserve(shape.mesh.indices.size());
+		hashCombine(c.hash, shape.mesh.indices.size());
+		for (const tinyobj::index_t& idx : shape.mesh.indices) {
+			glm::vec3 local = glm::vec3(toLocal * glm::vec4(objPosition(attrib, idx), 1.0f));
+			c.positions.push_back(local);
+			c.normals.push_back(glm::vec3(toLocal * glm::vec4(objNormal(attrib, idx), 0.0f)));
+			// Rounding rather than flooring keeps the many coordinates that
+			// are zero by construction (first triangle) away from a cell edge
+			for (int k = 0; k < 3; ++k) {
+				hashCombine(c.hash, static_cast<uint64_t>(std::llround(local[k] / (64.0f * tolerance))));
+			}
 		}
 	}
 
-	populateTextureFrameAttributes(thisVertexData);
+	auto sameShape = [&](size_t a, size_t b) {
+		const CanonicalShape& ca = canonical[a];
+		const CanonicalShape& cb = canonical[b];
+		if (ca.positions.size() != cb.positions.size()) return false;
+		const std::vector<tinyobj::index_t>& ia = geometry.shapes[a].mesh.indices;
+		const std::vector<tinyobj::index_t>& ib = geometry.shapes[b].mesh.indices;
+		for (size_t i = 0; i < ca.positions.size(); ++i) {
+			if (glm::length(ca.positions[i] - cb.positions[i]) > tolerance) return false;
+			if (glm::length(ca.normals[i] - cb.normals[i]) > normalTolerance) return false;
+			if (glm::length(objUv(attrib, ia[i]) - objUv(attrib, ib[i])) > attributeTolerance) return false;
+			if (glm::length(objColor(attrib, ia[i]) - objColor(attrib, ib[i])) > attributeTolerance) return false;
+		}
+		return true;
+	};
 
-	return true;
+	// Assign each shape to the first earlier shape it is a copy of
+	std::vector<size_t> prototypeOf(shapeCount);
+	std::vector<std::vector<size_t>> instancesOf(shapeCount);
+	std::unordered_map<uint64_t, std::vector<size_t>> prototypesByHash;
+	size_t instanceCount = 0;
+	for (size_t s = 0; s < shapeCount; ++s) {
+		prototypeOf[s] = s;
+		if (hasFrame[s]) {
+			std::vector<size_t>& candidates = prototypesByHash[canonical[s].hash];
+			for (size_t candidate : candidates) {
+				if (sameShape(candidate, s)) {
+					prototypeOf[s] = candidate;
+					break;
+				}
+			}
+			if (prototypeOf[s] == s) candidates.push_back(s);
+		}
+		instancesOf[prototypeOf[s]].push_back(s);
+		if (prototypeOf[s] != s) ++instanceCount;
+	}
+
+	// Lay out written shapes and ranges. Consecutive shapes drawn once share
+	// a single range with an identity transform.
+	geometry.writtenShapes.assign(shapeCount, false);
+	geometry.ranges.clear();
+	geometry.vertexCount = 0;
+	bool extendStaticRange = false;
+	for (size_t s = 0; s < shapeCount; ++s) {
+		if (prototypeOf[s] != s) continue;
+		geometry.writtenShapes[s] = true;
+
+		uint32_t firstVertex = static_cast<uint32_t>(geometry.vertexCount);
+		uint32_t vertexCount = static_cast<uint32_t>(geometry.shapes[s].mesh.indices.size());
+		geometry.vertexCount += vertexCount;
+
+		if (instancesOf[s].size() == 1) {
+			if (extendStaticRange) {
+				geometry.ranges.back().vertexCount += vertexCount;
+			}
+			else {
+				geometry.ranges.push_back({ firstVertex, vertexCount, { glm::mat4x4(1.0f) } });
+				extendStaticRange = true;
+			}
+			continue;
+		}
+
+		// Prototype vertices are written where they are, so the transform of
+		// an instance maps the prototype frame to the instance frame.
+		InstancedRange range = { firstVertex, vertexCount, {} };
+		glm::mat4x4 fromPrototype = glm::inverse(canonical[s].frame);
+		for (size_t instance : instancesOf[s]) {
+			range.transforms.push_back(instance == s ? glm::mat4x4(1.0f) : canonical[instance].frame * fromPrototype);
+		}
+		geometry.ranges.push_back(std::move(range));
+		extendStaticRange = false;
+	}
+
+	return instanceCount;
 }
 
 ShaderModule Loader::loadShaderModule(const fs::path& path, Device thisdevice)
@@ -143,56 +540,457 @@ ShaderModule Loader::loadShaderModule(const fs::path& path, Device thisdevice)
 	return thisdevice.createShaderModule(shaderDesc);
 }
 
-Texture Loader::loadTexture(const fs::path& path, Device device, TextureView* pTextureView = nullptr)
+Texture Loader::loadTexture(const fs::path& path, Device device, TextureView* pTextureView, MipFilter::TextureKind kind)
+{
+	PreparedTexture prepared;
+	if (!prepareTexture(path, device, kind, prepared)) return nullptr;
+	return createPreparedTexture(prepared, device, pTextureView, kind);
+}
+
+bool Loader::prepareTexture(const fs::path& path, Device device, MipFilter::TextureKind kind, PreparedTexture& prepared)
+{
+	if (path.extension() == ".ktx2") {
+		return prepareTexture(path, nullptr, 0, device, kind, prepared);
+	}
+	MappedFile file;
+	if (!file.Open(path)) return false;
+	return prepareTexture(path, file.GetData(), file.GetSize(), device, kind, prepared);
+}
+
+bool Loader::prepareTexture(const fs::path& path, const unsigned char* data, size_t size, Device device,
+	MipFilter::TextureKind kind, PreparedTexture& prepared)
+{
+	// Mip levels are baked in the file, `kind` has nothing to filter. KTX2
+	// files are mapped rather than read when the texture is created, so only
+	// the pages of the levels the quality tier keeps are loaded, and they go
+	// to writeTexture without another copy.
+	if (path.extension() == ".ktx2") {
+		prepared.ktx2Path = path;
+		return true;
+	}
+
+	// Block compressed textures take 4 to 8 times less memory and bandwidth.
+	// The image is only decoded again the first time, to cook it.
+	if (device.hasFeature(FeatureName::TextureCompressionBC)) {
+		prepared.ktx2Path = compressedTexturePath(path, kind);
+		if (!prepared.ktx2Path.empty()) return true;
+	}
+
+	if (!decodeImage(data, size, prepared.image)) return false;
+
+	// Lower quality tiers never create the finer levels
+	uint32_t firstLevel = firstLoadedLevel(prepared.image.width, prepared.image.height);
+	return firstLevel == 0 || downsampleImage(prepared.image, firstLevel, kind);
+}
+
+Texture Loader::createPreparedTexture(const PreparedTexture& prepared, Device device, TextureView* pTextureView, MipFilter::TextureKind kind)
+{
+	TextureDescriptor textureDesc;
+	Texture texture = nullptr;
+	if (!prepared.ktx2Path.empty()) {
+		texture = loadKtx2Texture(prepared.ktx2Path, device, textureDesc);
+	}
+	else if (prepared.image.pixels) {
+		texture = createImageTexture(prepared.image, device, kind, textureDesc);
+	}
+	if (!texture) return nullptr;
+
+	if (pTextureView) {
+		*pTextureView = createTextureView(texture, textureDesc);
+	}
+
+	return texture;
+}
+
+bool Loader::decodeImage(const fs::path& path, DecodedImage& image)
 {
+	MappedFile file;
+	if (!file.Open(path)) return false;
+	return decodeImage(file.GetData(), file.GetSize(), image);
+}
+
+bool Loader::decodeImage(const unsigned char* data, size_t size, DecodedImage& image)
+{
+	// stb_image keeps no state between calls besides its thread local error
+	// message, so decoding from memory is safe on the worker threads
 	int width, height, channels;
-	unsigned char* pixelData = stbi_load(path.string().c_str(), &width, &height, &channels, 4 /* force 4 channels */);
+	unsigned char* pixelData = stbi_load_from_memory(data, static_cast<int>(size), &width, &height, &channels, 4 /* force 4 channels */);
 	// If data is null, loading failed.
-	if (nullptr == pixelData) return nullptr;
+	if (nullptr == pixelData) return false;
+
+	image.pixels = std::shared_ptr<unsigned char>(pixelData, stbi_image_free);
+	image.width = static_cast<uint32_t>(width);
+	image.height = static_cast<uint32_t>(height);
+
+	// Files often store more channels than their content uses, like masks
+	// saved as RGB or opaque images with an alpha channel
+	bool gray = true;
+	bool opaque = true;
+	size_t texelCount = static_cast<size_t>(width) * height;
+	for (size_t i = 0; i < texelCount && (gray || opaque); ++i) {
+		const unsigned char* texel = pixelData + 4 * i;
+		gray = gray && texel[0] == texel[1] && texel[0] == texel[2];
+		opaque = opaque && texel[3] == 255;
+	}
+	image.channels = !opaque ? 4 : gray ? 1 : 3;
+	return true;
+}
+
+bool Loader::downsampleImage(DecodedImage& image, uint32_t level, MipFilter::TextureKind kind)
+{
+	if (level == 0) return true;
+	if (level >= MipFilter::mipLevelCount(image.width, image.height)) return false;
+
+	// Filtered through the whole chain rather than in one go, so that each
+	// level is the same as when it is built from the previous one
+	uint32_t width = MipFilter::mipLevelSize(image.width, level);
+	uint32_t height = MipFilter::mipLevelSize(image.height, level);
+	std::shared_ptr<unsigned char> pixels(new unsigned char[4 * static_cast<size_t>(width) * height], std::default_delete<unsigned char[]>());
+	MipFilter::ScratchArena scratch;
+	MipFilter::buildMipChain(image.pixels.get(), image.width, image.height, level + 1, kind, scratch,
+		[&](uint32_t bandLevel, uint32_t levelWidth, uint32_t /* levelHeight */, uint32_t firstRow, uint32_t rowCount, const unsigned char* rows) {
+			if (bandLevel != level) return;
+			std::memcpy(pixels.get() + 4 * static_cast<size_t>(firstRow) * levelWidth, rows, 4 * static_cast<size_t>(levelWidth) * rowCount);
+		});
+
+	// The full resolution pixels are freed with their last copy
+	image.pixels = pixels;
+	image.width = width;
+	image.height = height;
+	return true;
+}
 
-	// Use the width, height, channels and data variables here
+Texture Loader::createPlaceholderTexture(Device device, MipFilter::TextureKind kind, TextureView* pTextureView)
+{
+	// Same format as the texture once loaded (for a single channel mask)
 	TextureDescriptor textureDesc;
 	textureDesc.dimension = TextureDimension::_2D;
-	textureDesc.format = TextureFormat::RGBA8Unorm; // by convention for bmp, png and jpg file. Be careful with other formats.
-	textureDesc.size = { (unsigned int)width, (unsigned int)height, 1 };
-	textureDesc.mipLevelCount = bit_width(std::max(textureDesc.size.width, textureDesc.size.height));
+	textureDesc.format = uncompressedFormat(kind, 1);
+	textureDesc.size = { 1, 1, 1 };
+	textureDesc.mipLevelCount = 1;
 	textureDesc.sampleCount = 1;
-	textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst;
+	textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst | TextureUsage::CopySrc;
 	textureDesc.viewFormatCount = 0;
 	textureDesc.viewFormats = nullptr;
 	Texture texture = device.createTexture(textureDesc);
 
-	// Upload data to the GPU texture
-	writeMipMaps(device, texture, textureDesc.size, textureDesc.mipLevelCount, pixelData);
+	unsigned char texel[4] = { 128, 128, 128, 255 };
+	if (kind == MipFilter::TextureKind::Mask) texel[0] = 255;
 
-	stbi_image_free(pixelData);
-	// (Do not use data after this)
+	// Written right away rather than staged by the upload manager, so that
+	// the texture can be destroyed as soon as the real one replaces it
+	ImageCopyTexture destination;
+	destination.texture = texture;
+	destination.mipLevel = 0;
+	destination.origin = { 0, 0, 0 };
+	destination.aspect = TextureAspect::All;
+	TextureDataLayout source;
+	source.offset = 0;
+	source.bytesPerRow = bytesPerTexel(textureDesc.format);
+	source.rowsPerImage = 1;
+	Queue queue = device.getQueue();
+	queue.writeTexture(destination, texel, source.bytesPerRow, source, textureDesc.size);
+	queue.release();
 
 	if (pTextureView) {
-		TextureViewDescriptor textureViewDesc;
-		textureViewDesc.aspect = TextureAspect::All;
-		textureViewDesc.baseArrayLayer = 0;
-		textureViewDesc.arrayLayerCount = 1;
-		textureViewDesc.baseMipLevel = 0;
-		textureViewDesc.mipLevelCount = textureDesc.mipLevelCount;
-		textureViewDesc.dimension = TextureViewDimension::_2D;
-		textureViewDesc.format = textureDesc.format;
-		*pTextureView = texture.createView(textureViewDesc);
+		*pTextureView = createTextureView(texture, textureDesc);
 	}
 
 	return texture;
 }
 
-uint32_t Loader::bit_width(uint32_t m)
+TextureView Loader::createTextureView(Texture texture, const TextureDescriptor& textureDesc)
 {
-	if (m == 0) return 0;
-	else { uint32_t w = 0; while (m >>= 1) ++w; return w; }
+	TextureViewDescriptor textureViewDesc;
+	textureViewDesc.aspect = TextureAspect::All;
+	textureViewDesc.baseArrayLayer = 0;
+	textureViewDesc.arrayLayerCount = 1;
+	textureViewDesc.baseMipLevel = 0;
+	textureViewDesc.mipLevelCount = textureDesc.mipLevelCount;
+	textureViewDesc.dimension = TextureViewDimension::_2D;
+	textureViewDesc.format = textureDesc.format;
+	return texture.createView(textureViewDesc);
 }
 
-void Loader::writeMipMaps(Device device, Texture texture, Extent3D textureSize, uint32_t mipLevelCount, const unsigned char* pixelData)
+Texture Loader::createImageTexture(const DecodedImage& image, Device device, MipFilter::TextureKind kind, TextureDescriptor& textureDesc)
 {
-	Queue queue = device.getQueue();
+	textureDesc.dimension = TextureDimension::_2D;
+	textureDesc.format = uncompressedFormat(kind, image.channels);
+	textureDesc.size = { image.width, image.height, 1 };
+	textureDesc.mipLevelCount = MipFilter::mipLevelCount(textureDesc.size.width, textureDesc.size.height); // down to 1x1
+	textureDesc.sampleCount = 1;
+	textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst | TextureUsage::CopySrc;
+	// The mip generator writes RGBA8Unorm levels as storage textures, copies
+	// sRGB ones and renders the others (see MipGenerator)
+	if (usesMipGenerator(textureDesc.format) && textureDesc.format == TextureFormat::RGBA8Unorm) {
+		textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst | TextureUsage::CopySrc | TextureUsage::StorageBinding;
+	}
+	else if (usesMipGenerator(textureDesc.format) && textureDesc.format != TextureFormat::RGBA8UnormSrgb) {
+		textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst | TextureUsage::CopySrc | TextureUsage::RenderAttachment;
+	}
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	Texture texture = device.createTexture(textureDesc);
+
+	// Upload data to the GPU texture
+	writeMipMaps(device, texture, textureDesc.format, textureDesc.size, textureDesc.mipLevelCount, kind, image.pixels.get());
+
+	return texture;
+}
+
+namespace {
+	// Cook the image decoded from `imagePath` and its mip levels, filtered
+	// according to `kind`, into a KTX2 file. Each level takes
+	// levelSize(width, height) bytes, written by encodeLevel() from its RGBA8
+	// pixels once they are all built.
+	bool cookKtx2(const Loader::DecodedImage& image, const fs::path& imagePath, const fs::path& cookedPath, MipFilter::TextureKind kind,
+		uint32_t vkFormat, const char* formatName,
+		const std::function<size_t(uint32_t width, uint32_t height)>& levelSize,
+		const std::function<void(const unsigned char* pixels, uint32_t width, uint32_t height, unsigned char* levelData)>& encodeLevel)
+	{
+		const unsigned char* pixelData = image.pixels.get();
+
+		uint32_t levelWidth0 = image.width;
+		uint32_t levelHeight0 = image.height;
+		uint32_t mipLevelCount = MipFilter::mipLevelCount(levelWidth0, levelHeight0);
+		std::vector<Ktx2::LevelData> levels(mipLevelCount);
+		std::vector<size_t> levelOffsets(mipLevelCount);
+		size_t totalSize = 0;
+		for (uint32_t level = 0; level < mipLevelCount; ++level) {
+			levelOffsets[level] = totalSize;
+			levels[level].size = levelSize(MipFilter::mipLevelSize(levelWidth0, level), MipFilter::mipLevelSize(levelHeight0, level));
+			totalSize += levels[level].size;
+		}
+		std::vector<unsigned char> cooked(totalSize);
+		for (uint32_t level = 0; level < mipLevelCount; ++level) {
+			levels[level].data = cooked.data() + levelOffsets[level];
+		}
+
+		// Level 0 is encoded from the image, the next ones as soon as they are
+		// built. Blocks span 4 rows, so levels are encoded whole rather than by
+		// band of rows.
+		encodeLevel(pixelData, levelWidth0, levelHeight0, cooked.data());
+		std::vector<unsigned char> levelPixels;
+		MipFilter::ScratchArena scratch;
+		MipFilter::buildMipChain(pixelData, levelWidth0, levelHeight0, mipLevelCount, kind, scratch,
+			[&](uint32_t level, uint32_t levelWidth, uint32_t levelHeight, uint32_t firstRow, uint32_t rowCount, const unsigned char* rows) {
+				levelPixels.resize(4 * static_cast<size_t>(levelWidth) * levelHeight);
+				std::memcpy(&levelPixels[4 * static_cast<size_t>(firstRow) * levelWidth], rows, 4 * static_cast<size_t>(levelWidth) * rowCount);
+				if (firstRow + rowCount == levelHeight) {
+					encodeLevel(levelPixels.data(), levelWidth, levelHeight, cooked.data() + levelOffsets[level]);
+				}
+			});
+
+		// Written aside then renamed, so that an interrupted cook does not leave
+		// a cooked texture that looks up to date
+		fs::path partialPath = fs::path(cookedPath).concat(".partial");
+		if (!Ktx2::write(partialPath, vkFormat, levelWidth0, levelHeight0, levels)) return false;
+		std::error_code error;
+		fs::rename(partialPath, cookedPath, error);
+		if (error) return false;
+
+		std::cout << "Cooked " << imagePath << " into " << formatName << " with " << mipLevelCount << " mip levels" << std::endl;
+		return true;
+	}
+
+	// Whether the file cooked from an image is missing or older than the image
+	bool needsCooking(const fs::path& imagePath, const fs::path& cookedPath) {
+		std::error_code error;
+		return !fs::exists(cookedPath, error) || fs::last_write_time(cookedPath, error) < fs::last_write_time(imagePath, error);
+	}
+} // namespace
+
+fs::path Loader::compressedTexturePath(const fs::path& path, MipFilter::TextureKind kind)
+{
+	// BC textures are made of whole blocks of 4x4 texels
+	int width, height, channels;
+	if (!stbi_info(path.string().c_str(), &width, &height, &channels)) return {};
+	if (width % 4 != 0 || height % 4 != 0) return {};
+
+	// Cook the image again if it changed since
+	BlockCompression::Format format = compressedFormat(kind);
+	fs::path cookedPath = cookedTexturePath(path, kind, format);
+	if (needsCooking(path, cookedPath) && !cookTexture(path, cookedPath, kind, format)) return {};
+	return cookedPath;
+}
+
+Texture Loader::loadKtx2Texture(const fs::path& path, Device device, TextureDescriptor& textureDesc)
+{
+	MappedFile file;
+	if (!file.Open(path)) return nullptr;
+
+	// Levels dropped by the quality tier are not even read from the file
+	uint32_t firstLevel = 0;
+	Ktx2::Info info;
+	std::string error;
+	if (Ktx2::parse(file.GetData(), file.GetSize(), info, error)) {
+		firstLevel = ktx2FirstLevel(info, firstLoadedLevel(info.width, info.height));
+	}
+	return createKtx2Texture(file.GetData(), file.GetSize(), path, device, textureDesc, firstLevel);
+}
+
+Texture Loader::createKtx2Texture(const unsigned char* data, size_t size, const fs::path& path, Device device, TextureDescriptor& textureDesc, uint32_t firstLevel)
+{
+	Ktx2::Info info;
+	std::string error;
+	if (!Ktx2::parse(data, size, info, error)) {
+		std::cerr << "Cannot load " << path << ": " << error << std::endl;
+		return nullptr;
+	}
+	const Ktx2Format* format = findKtx2Format(info.vkFormat);
+	if (format == nullptr) {
+		std::cerr << "Cannot load " << path << ": unsupported VkFormat " << info.vkFormat << std::endl;
+		return nullptr;
+	}
+	if (format->blockSize > 1 && !device.hasFeature(FeatureName::TextureCompressionBC)) {
+		std::cerr << "Cannot load " << path << ": the device does not support BC compression" << std::endl;
+		return nullptr;
+	}
+	uint32_t levelCount = static_cast<uint32_t>(info.levels.size());
+	if (levelCount > MipFilter::mipLevelCount(info.width, info.height) || firstLevel >= levelCount) {
+		std::cerr << "Cannot load " << path << ": invalid level count" << std::endl;
+		return nullptr;
+	}
+	// The first level of a block compressed texture is made of whole blocks
+	uint32_t width = MipFilter::mipLevelSize(info.width, firstLevel);
+	uint32_t height = MipFilter::mipLevelSize(info.height, firstLevel);
+	if (width % format->blockSize != 0 || height % format->blockSize != 0) {
+		std::cerr << "Cannot load " << path << ": level " << firstLevel << " is not made of whole blocks" << std::endl;
+		return nullptr;
+	}
+	for (uint32_t level = firstLevel; level < levelCount; ++level) {
+		uint64_t blocksWide = (MipFilter::mipLevelSize(info.width, level) + format->blockSize - 1) / format->blockSize;
+		uint64_t blocksHigh = (MipFilter::mipLevelSize(info.height, level) + format->blockSize - 1) / format->blockSize;
+		if (info.levels[level].size < blocksWide * blocksHigh * format->blockBytes) {
+			std::cerr << "Cannot load " << path << ": level " << level << " is truncated" << std::endl;
+			return nullptr;
+		}
+	}
+
+	textureDesc.dimension = TextureDimension::_2D;
+	textureDesc.format = format->format;
+	textureDesc.size = { width, height, 1 };
+	textureDesc.mipLevelCount = levelCount - firstLevel;
+	textureDesc.sampleCount = 1;
+	textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst | TextureUsage::CopySrc;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	Texture texture = device.createTexture(textureDesc);
+
+	ImageCopyTexture destination;
+	destination.texture = texture;
+	destination.origin = { 0, 0, 0 };
+	destination.aspect = TextureAspect::All;
+
+	// Levels are tightly packed rows of texels (or of blocks), which is a
+	// valid layout for writeTexture, so they are passed straight from the
+	// mapping. They are copied before returning, and only the pages of the
+	// file that are read get loaded.
+	TextureDataLayout source;
+	source.offset = 0;
+
+	for (uint32_t level = firstLevel; level < levelCount; ++level) {
+		uint32_t blocksWide = (MipFilter::mipLevelSize(info.width, level) + format->blockSize - 1) / format->blockSize;
+		uint32_t blocksHigh = (MipFilter::mipLevelSize(info.height, level) + format->blockSize - 1) / format->blockSize;
+		destination.mipLevel = level - firstLevel;
+		source.bytesPerRow = blocksWide * format->blockBytes;
+		source.rowsPerImage = blocksHigh;
+		// Copies are made of whole blocks, even for levels smaller than a block
+		Extent3D copySize = { format->blockSize * blocksWide, format->blockSize * blocksHigh, 1 };
+		writeTexture(device, destination, data + info.levels[level].offset, static_cast<size_t>(blocksHigh) * source.bytesPerRow, source, copySize);
+	}
+
+	return texture;
+}
+
+bool Loader::cookTexture(const fs::path& imagePath, const fs::path& cookedPath, MipFilter::TextureKind kind, BlockCompression::Format format)
+{
+	DecodedImage image;
+	if (!decodeImage(imagePath, image)) return false;
+	return cookKtx2(image, imagePath, cookedPath, kind, vkFormat(format, kind), formatName(format),
+		[format](uint32_t width, uint32_t height) {
+			return BlockCompression::encodedSize(width, height, format);
+		},
+		[format](const unsigned char* pixels, uint32_t width, uint32_t height, unsigned char* levelData) {
+			BlockCompression::encodeImage(pixels, width, height, format, levelData);
+		});
+}
+
+bool Loader::cookUncompressedTexture(const fs::path& imagePath, const fs::path& cookedPath, MipFilter::TextureKind kind)
+{
+	DecodedImage image;
+	if (!decodeImage(imagePath, image)) return false;
+	TextureFormat format = uncompressedFormat(kind, image.channels);
+	uint32_t texelBytes = bytesPerTexel(format);
+	return cookKtx2(image, imagePath, cookedPath, kind, vkFormat(format), formatName(format),
+		[texelBytes](uint32_t width, uint32_t height) {
+			return texelBytes * static_cast<size_t>(width) * height;
+		},
+		[texelBytes](const unsigned char* pixels, uint32_t width, uint32_t height, unsigned char* levelData) {
+			packTexels(pixels, static_cast<size_t>(width) * height, texelBytes, levelData);
+		});
+}
+
+fs::path Loader::cookedTexturePath(const fs::path& imagePath, MipFilter::TextureKind kind, BlockCompression::Format format)
+{
+	return fs::path(imagePath).concat(std::string(".") + kindName(kind) + "." + formatName(format) + ".ktx2");
+}
+
+fs::path Loader::streamableTexturePath(const fs::path& path, Device device, MipFilter::TextureKind kind)
+{
+	if (path.extension() == ".ktx2") return path;
+
+	// Block compressed when possible, like loadTexture() does
+	if (device.hasFeature(FeatureName::TextureCompressionBC)) {
+		fs::path cookedPath = compressedTexturePath(path, kind);
+		if (!cookedPath.empty()) return cookedPath;
+	}
+
+	// Levels are filtered differently for each kind, and the same image may
+	// be cooked for several kinds at once on different threads. The format
+	// depends on the content of the image, see uncompressedFormat().
+	fs::path cookedPath = fs::path(path).concat(std::string(".") + kindName(kind) + ".uncompressed.ktx2");
+	if (needsCooking(path, cookedPath) && !cookUncompressedTexture(path, cookedPath, kind)) return {};
+	return cookedPath;
+}
+
+TextureFormat Loader::uncompressedFormat(MipFilter::TextureKind kind, uint32_t channels)
+{
+	switch (kind) {
+	case MipFilter::TextureKind::Albedo: return TextureFormat::RGBA8UnormSrgb;
+	case MipFilter::TextureKind::Normal: return TextureFormat::RG8Unorm;
+	default: return channels == 1 ? TextureFormat::R8Unorm : TextureFormat::RGBA8Unorm;
+	}
+}
 
+BlockCompression::Format Loader::compressedFormat(MipFilter::TextureKind kind)
+{
+	switch (kind) {
+	case MipFilter::TextureKind::Albedo: return BlockCompression::Format::BC7;
+	case MipFilter::TextureKind::Normal: return BlockCompression::Format::BC5;
+	default: return BlockCompression::Format::BC1;
+	}
+}
+
+uint32_t Loader::blockSize(TextureFormat format)
+{
+	switch (format) {
+	case TextureFormat::BC1RGBAUnorm:
+	case TextureFormat::BC1RGBAUnormSrgb:
+	case TextureFormat::BC3RGBAUnorm:
+	case TextureFormat::BC3RGBAUnormSrgb:
+	case TextureFormat::BC4RUnorm:
+	case TextureFormat::BC5RGUnorm:
+	case TextureFormat::BC7RGBAUnorm:
+	case TextureFormat::BC7RGBAUnormSrgb:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+void Loader::writeMipMaps(Device device, Texture texture, TextureFormat format, Extent3D textureSize, uint32_t mipLevelCount, MipFilter::TextureKind kind, const unsigned char* pixelData)
+{
 	// Arguments telling which part of the texture we upload to
 	ImageCopyTexture destination;
 	destination.texture = texture;
@@ -203,54 +1001,96 @@ void Loader::writeMipMaps(Device device, Texture texture, Extent3D textureSize,
 	TextureDataLayout source;
 	source.offset = 0;
 
-	// Create image data
-	Extent3D mipLevelSize = textureSize;
-	std::vector<unsigned char> previousLevelPixels;
-	Extent3D previousMipLevelSize;
-	for (uint32_t level = 0; level < mipLevelCount; ++level) {
-		// Pixel data for the current level
-		std::vector<unsigned char> pixels(4 * mipLevelSize.width * mipLevelSize.height);
-		if (level == 0) {
-			// We cannot really avoid this copy since we need this
-			// in previousLevelPixels at the next iteration
-			memcpy(pixels.data(), pixelData, pixels.size());
-		}
-		else {
-			// Create mip level data
-			for (uint32_t i = 0; i < mipLevelSize.width; ++i) {
-				for (uint32_t j = 0; j < mipLevelSize.height; ++j) {
-					unsigned char* p = &pixels[4 * (j * mipLevelSize.width + i)];
-					// Get the corresponding 4 pixels from the previous level
-					unsigned char* p00 = &previousLevelPixels[4 * ((2 * j + 0) * previousMipLevelSize.width + (2 * i + 0))];
-					unsigned char* p01 = &previousLevelPixels[4 * ((2 * j + 0) * previousMipLevelSize.width + (2 * i + 1))];
-					unsigned char* p10 = &previousLevelPixels[4 * ((2 * j + 1) * previousMipLevelSize.width + (2 * i + 0))];
-					unsigned char* p11 = &previousLevelPixels[4 * ((2 * j + 1) * previousMipLevelSize.width + (2 * i + 1))];
-					// Average
-					p[0] = (p00[0] + p01[0] + p10[0] + p11[0]) / 4;
-					p[1] = (p00[1] + p01[1] + p10[1] + p11[1]) / 4;
-					p[2] = (p00[2] + p01[2] + p10[2] + p11[2]) / 4;
-					p[3] = (p00[3] + p01[3] + p10[3] + p11[3]) / 4;
-				}
-			}
+	// Pixels are decoded and filtered in RGBA8, then only the channels of the
+	// texture format are uploaded
+	uint32_t texelBytes = bytesPerTexel(format);
+	thread_local std::vector<unsigned char> packed;
+	auto writeRows = [&](uint32_t level, uint32_t width, uint32_t firstRow, uint32_t rowCount, const unsigned char* rows) {
+		size_t texelCount = static_cast<size_t>(width) * rowCount;
+		if (texelBytes != 4) {
+			packed.resize(texelBytes * texelCount);
+			packTexels(rows, texelCount, texelBytes, packed.data());
+			rows = packed.data();
 		}
-
-		// Upload data to the GPU texture
 		destination.mipLevel = level;
-		source.bytesPerRow = 4 * mipLevelSize.width;
-		source.rowsPerImage = mipLevelSize.height;
-		queue.writeTexture(destination, pixels.data(), pixels.size(), source, mipLevelSize);
+		destination.origin = { 0, firstRow, 0 };
+		source.bytesPerRow = texelBytes * width;
+		source.rowsPerImage = rowCount;
+		writeTexture(device, destination, rows, texelBytes * texelCount, source, { width, rowCount, 1 });
+	};
 
-		previousLevelPixels = std::move(pixels);
-		previousMipLevelSize = mipLevelSize;
-		mipLevelSize.width /= 2;
-		mipLevelSize.height /= 2;
+	// Level 0 is uploaded as is
+	writeRows(0, textureSize.width, 0, textureSize.height, pixelData);
+
+	// Other levels are either computed on the GPU from level 0, which must
+	// then be in the texture before the mip generator runs (formats other
+	// than RGBA8Unorm start from the RGBA8 pixels instead)...
+	if (usesMipGenerator(format)) {
+		if (s_uploadManager) s_uploadManager->Flush();
+		s_mipGenerator->Generate(texture, textureSize, mipLevelCount, kind, pixelData);
+		return;
 	}
 
+	// ...or built in bands on the worker threads, and each band is
+	// uploaded as soon as it is ready. They use two scratch buffers that the
+	// next textures loaded on this thread reuse.
+	thread_local MipFilter::ScratchArena scratch;
+	MipFilter::buildMipChain(pixelData, textureSize.width, textureSize.height, mipLevelCount, kind, scratch,
+		[&](uint32_t level, uint32_t width, uint32_t /* height */, uint32_t firstRow, uint32_t rowCount, const unsigned char* rows) {
+			writeRows(level, width, firstRow, rowCount, rows);
+		});
+}
+
+bool Loader::usesMipGenerator(TextureFormat format)
+{
+	// Every format of uncompressedFormat(), built in an RGBA8Unorm scratch
+	// texture when it cannot be a storage texture
+	return s_mipGenerator != nullptr && s_mipGenerator->Supports(format);
+}
+
+void Loader::writeTexture(Device device, const ImageCopyTexture& destination, const void* data, size_t dataSize, const TextureDataLayout& layout, const Extent3D& writeSize)
+{
+	if (s_uploadManager) {
+		s_uploadManager->WriteTexture(destination, data, dataSize, layout, writeSize);
+		return;
+	}
+	Queue queue = device.getQueue();
+	queue.writeTexture(destination, data, dataSize, layout, writeSize);
 	queue.release();
 }
 
-void Loader::populateTextureFrameAttributes(std::vector<VertexAttributes>& vertexData) {
-	size_t triangleCount = vertexData.size() / 3;
+void Loader::setUploadManager(UploadManager* uploadManager)
+{
+	s_uploadManager = uploadManager;
+}
+
+void Loader::setMipGenerator(MipGenerator* mipGenerator)
+{
+	s_mipGenerator = mipGenerator;
+}
+
+void Loader::setTextureQuality(const TextureQuality& quality)
+{
+	s_textureQuality = quality;
+}
+
+const Loader::TextureQuality& Loader::getTextureQuality()
+{
+	return s_textureQuality;
+}
+
+uint32_t Loader::firstLoadedLevel(uint32_t width, uint32_t height)
+{
+	uint32_t lastLevel = MipFilter::mipLevelCount(width, height) - 1;
+	uint32_t level = s_textureQuality.skippedLevels;
+	while (level < lastLevel && std::max(MipFilter::mipLevelSize(width, level), MipFilter::mipLevelSize(height, level)) > s_textureQuality.maxSize) {
+		++level;
+	}
+	return std::min(level, lastLevel);
+}
+
+void Loader::populateTextureFrameAttributes(VertexAttributes* vertexData, size_t vertexCount) {
+	size_t triangleCount = vertexCount / 3;
 	// We compute the local texture frame per triangle
 	for (int t = 0; t < (int)triangleCount; ++t) {
 		VertexAttributes* v = &vertexData[3 * t];
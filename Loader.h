@@ -2,6 +2,8 @@
 
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <memory>
 #include <sstream>
 #include <string>
 
@@ -20,6 +22,11 @@ namespace fs = std::filesystem;
 
 #include "stb_image.h"
 
+#include "BlockCompression.h"
+#include "MipFilter.h"
+#include "MipGenerator.h"
+#include "UploadManager.h"
+
 class Loader
 {
 public:
@@ -36,23 +43,176 @@ public:
 		glm::vec2 uv;
 	};
 
+	// RGBA8 pixels of an image, freed with the last copy of the struct
+	struct DecodedImage {
+		std::shared_ptr<unsigned char> pixels;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		// Channels the content uses: 1 when red, green and blue are equal in
+		// all the pixels, 4 when some are not opaque, 3 otherwise
+		uint32_t channels = 4;
+	};
+
+	// What loadTexture() does with the CPU only, before it creates the texture
+	struct PreparedTexture {
+		fs::path ktx2Path; // the texture is loaded from this file if it is set...
+		DecodedImage image; // ...otherwise from these pixels
+	};
+
+	// Texture quality tier, see setTextureQuality()
+	struct TextureQuality {
+		// Finest mip levels every texture drops at load: 0 for full quality,
+		// 1 for a quarter of the memory, 2 for a sixteenth...
+		uint32_t skippedLevels = 0;
+		// Textures whose level 0 is larger drop more levels, typically the
+		// maxTextureDimension2D of the device
+		uint32_t maxSize = 8192;
+	};
+
+	// A run of vertices drawn once per transform
+	struct InstancedRange {
+		uint32_t firstVertex = 0;
+		uint32_t vertexCount = 0;
+		std::vector<glm::mat4x4> transforms; // in model space
+	};
+
+	// OBJ content as parsed by TinyOBJLoader, before conversion to VertexAttributes
+	struct ObjGeometry {
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+		size_t vertexCount = 0; // one per triangle corner, geometry is not indexed
+
+		// Set by findInstances(): shapes that are rigid copies of a previous
+		// one are not written, and ranges lists what to draw with which
+		// transforms. Both empty means every shape is written and drawn once.
+		std::vector<bool> writtenShapes;
+		std::vector<InstancedRange> ranges;
+	};
+
 	static bool loadGeometry(const fs::path& path, std::vector<float>& pointData, std::vector<uint16_t>& indexData, int dimensions);
+	// Same format as loadGeometry, but the [points] section is streamed line by line
+	// (dimensions + 3 values each) so that files larger than memory can be read.
+	static bool forEachPoint(const fs::path& path, int dimensions, const std::function<void(const double* values)>& onPoint);
 	static bool loadGeometryFromObj(const fs::path& path, std::vector<VertexAttributes>& thisVertexData);
+	// Parse the content of an OBJ file already read in memory (see AsyncFileReader),
+	// then convert it with writeVertices() straight into its final destination,
+	// typically a vertex buffer mapped at creation.
+	static bool parseObj(const std::vector<unsigned char>& objBytes, const fs::path& materialDir, ObjGeometry& geometry);
+	static void writeVertices(const ObjGeometry& geometry, VertexAttributes* vertices);
+	// Fill in the tangent and bitangent of triangles whose other attributes are set
+	static void populateTextureFrameAttributes(VertexAttributes* vertexData, size_t vertexCount);
+	// Detect shapes that are rigid transforms (rotation and translation) of each
+	// other, to keep a single copy of them drawn with instancing. Returns the
+	// number of shapes that became instances.
+	static size_t findInstances(ObjGeometry& geometry);
 	static ShaderModule loadShaderModule(const fs::path& path, Device device);
-	static Texture loadTexture(const fs::path& path, Device device, TextureView* pTextureView);
+	// `kind` tells how the mip levels are filtered. When the device supports
+	// BC compression, the image is cooked into compressedFormat(kind) the
+	// first time it is loaded, and the cooked texture is loaded instead.
+	// KTX2 files (.ktx2) are loaded as is, with the mip levels they contain.
+	// Textures can be copied from, for TextureArrays to pack them.
+	static Texture loadTexture(const fs::path& path, Device device, TextureView* pTextureView = nullptr,
+		MipFilter::TextureKind kind = MipFilter::TextureKind::Albedo);
+	// loadTexture() in two steps: prepareTexture() decodes or cooks the image
+	// and can run on any thread (images are decoded from memory, which stb_image
+	// supports on several threads at once), then createPreparedTexture()
+	// creates and uploads the texture on the thread that owns the device.
+	static bool prepareTexture(const fs::path& path, Device device, MipFilter::TextureKind kind, PreparedTexture& prepared);
+	// Same, for an image file whose bytes were already read (by the
+	// AsyncFileReader). KTX2 files, and the files BC textures are cooked
+	// into, are still mapped when the texture is created.
+	static bool prepareTexture(const fs::path& path, const unsigned char* data, size_t size, Device device,
+		MipFilter::TextureKind kind, PreparedTexture& prepared);
+	static Texture createPreparedTexture(const PreparedTexture& prepared, Device device, TextureView* pTextureView = nullptr,
+		MipFilter::TextureKind kind = MipFilter::TextureKind::Albedo);
+	// Decode an image file (png, jpg...) into RGBA8 pixels, thread-safe. The
+	// channels it really uses are counted for uncompressedFormat().
+	static bool decodeImage(const fs::path& path, DecodedImage& image);
+	static bool decodeImage(const unsigned char* data, size_t size, DecodedImage& image);
+	// 1x1 texture standing for a texture of `kind` while it loads: mid grey
+	// for colors, a flat normal for normal maps and white for masks
+	static Texture createPlaceholderTexture(Device device, MipFilter::TextureKind kind, TextureView* pTextureView = nullptr);
+	// View of all the mip levels of a texture created as described by `textureDesc`
+	static TextureView createTextureView(Texture texture, const TextureDescriptor& textureDesc);
+	// Encode an image and its mip levels, filtered according to `kind`, into
+	// a block compressed KTX2 file. Blocks are encoded on the worker threads.
+	static bool cookTexture(const fs::path& imagePath, const fs::path& cookedPath, MipFilter::TextureKind kind, BlockCompression::Format format);
+	// Same, without compression (in uncompressedFormat()), for devices without BC support
+	static bool cookUncompressedTexture(const fs::path& imagePath, const fs::path& cookedPath, MipFilter::TextureKind kind);
+	// Where the texture cooked from `imagePath` for `kind` in `format` is stored
+	static fs::path cookedTexturePath(const fs::path& imagePath, MipFilter::TextureKind kind, BlockCompression::Format format);
+	// KTX2 file the mip levels of the texture at `path` can be read from one
+	// by one: the file itself for .ktx2 files, otherwise the image cooked as
+	// loadTexture() would load it (or in uncompressedFormat() when it would
+	// not be compressed). Empty if the image cannot be read.
+	static fs::path streamableTexturePath(const fs::path& path, Device device, MipFilter::TextureKind kind);
+	// Texture of a KTX2 file already in memory, with its levels from
+	// `firstLevel` only (level firstLevel of the file is level 0 of the
+	// texture). Returns nullptr if the file is invalid, its format is not
+	// supported by the device, or firstLevel is not made of whole blocks.
+	static Texture createKtx2Texture(const unsigned char* data, size_t size, const fs::path& path, Device device,
+		TextureDescriptor& textureDesc, uint32_t firstLevel = 0);
+	// Format of the textures loaded without compression, from what they hold
+	// and how many channels they use: sRGB RGBA8 for colors, RG8 for normal
+	// maps (the shader rebuilds Z) and R8 for single channel masks. Other
+	// masks stay in RGBA8.
+	static TextureFormat uncompressedFormat(MipFilter::TextureKind kind, uint32_t channels);
+	// BC7 for colors, BC5 for normal maps and BC1 for masks (colors in sRGB)
+	static BlockCompression::Format compressedFormat(MipFilter::TextureKind kind);
+	// Texels per side of the blocks of a format, 4 for the block compressed
+	// ones and 1 otherwise
+	static uint32_t blockSize(TextureFormat format);
+
+	// When set, textures loaded afterwards only upload their level 0 and the
+	// other levels are built on the GPU (nullptr to build them on the CPU).
+	static void setMipGenerator(MipGenerator* mipGenerator);
+	// When set, texels are staged by the upload manager and only written to
+	// the textures by its next flush (nullptr to write them right away).
+	static void setUploadManager(UploadManager* uploadManager);
+	// Textures loaded afterwards start at firstLoadedLevel(): decoded images
+	// are downsampled once right after decoding, and KTX2 files (cooked or
+	// streamed) skip their finer levels. Either way the finer levels are
+	// never allocated on the GPU.
+	static void setTextureQuality(const TextureQuality& quality);
+	static const TextureQuality& getTextureQuality();
+	// Finest level of a width x height texture kept by the quality tier, at
+	// most the last level of its mip chain
+	static uint32_t firstLoadedLevel(uint32_t width, uint32_t height);
+	// Replace `image` by its level `level`, filtered according to `kind` on
+	// the worker threads. Levels in between are only kept one at a time.
+	static bool downsampleImage(DecodedImage& image, uint32_t level, MipFilter::TextureKind kind);
 
 	static glm::mat3x3 computeTBN(const VertexAttributes corners[3], const glm::vec3& expectedN);
 	
 private:
-	static uint32_t bit_width(uint32_t m); 
+	// Texture of a decoded image in uncompressedFormat(), with mip levels
+	// built at load time
+	static Texture createImageTexture(const DecodedImage& image, Device device, MipFilter::TextureKind kind, TextureDescriptor& textureDesc);
+	// Cook the image into compressedFormat(kind) if needed. Returns an empty
+	// path if the image cannot be compressed (its size must be a multiple of 4).
+	static fs::path compressedTexturePath(const fs::path& path, MipFilter::TextureKind kind);
+	// Texture of a KTX2 file, each level uploaded straight from the file
+	// mapped in memory (see createKtx2Texture).
+	static Texture loadKtx2Texture(const fs::path& path, Device device, TextureDescriptor& textureDesc);
 
 	static void writeMipMaps(
 		Device device,
 		Texture texture,
+		TextureFormat format,
 		Extent3D textureSize,
-		[[maybe_unused]] uint32_t mipLevelCount, // not used yet
+		uint32_t mipLevelCount,
+		MipFilter::TextureKind kind,
 		const unsigned char* pixelData);
 
-	static void populateTextureFrameAttributes(std::vector<VertexAttributes>& vertexData);
+	// Whether the mip generator can build the levels of a texture in `format`
+	static bool usesMipGenerator(TextureFormat format);
+
+	// Same as Queue::writeTexture, through the upload manager when there is one
+	static void writeTexture(Device device, const ImageCopyTexture& destination, const void* data, size_t dataSize,
+		const TextureDataLayout& layout, const Extent3D& writeSize);
+
+	static MipGenerator* s_mipGenerator;
+	static UploadManager* s_uploadManager;
+	static TextureQuality s_textureQuality;
 };
 
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+// Read-only view of a whole file mapped in memory, so that its bytes can be
+// handed to the GPU without being copied into an intermediate buffer first.
+// Pages are only read from disk when touched.
+//
+// Emscripten has no real memory mapping, the file is read into memory there.
+class MappedFile {
+public:
+	MappedFile() = default;
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Return false if the file cannot be opened or is empty
+	bool Open(const std::filesystem::path& path);
+	void Close();
+
+	bool IsOpen() const { return m_data != nullptr; }
+	const unsigned char* GetData() const { return m_data; }
+	size_t GetSize() const { return m_size; }
+
+private:
+	const unsigned char* m_data = nullptr;
+	size_t m_size = 0;
+#if defined(_WIN32)
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+#elif defined(__EMSCRIPTEN__)
+	std::vector<unsigned char> m_bytes;
+#endif
+};
@@ -0,0 +1,114 @@
+// Measure the CPU side of mip chain generation (see MipFilter), on one thread
+// and on the shared ThreadPool. Built only with -DBUILD_BENCHMARKS=ON.
+//
+// Usage: MipBenchmark [image ...]
+// Without argument, runs on fourareen2K_albedo.jpg and generated 4K and 8K
+// images.
+
+#include "MipFilter.h"
+#include "ThreadPool.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+	// Written after each run so that the work is not optimized out
+	volatile size_t g_sink = 0;
+
+	struct Image {
+		std::string name;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::vector<unsigned char> pixels;
+	};
+
+	bool loadImage(const std::string& path, Image& image) {
+		int width, height, channels;
+		unsigned char* pixelData = stbi_load(path.c_str(), &width, &height, &channels, 4);
+		if (nullptr == pixelData) return false;
+		image.name = path;
+		image.width = static_cast<uint32_t>(width);
+		image.height = static_cast<uint32_t>(height);
+		image.pixels.assign(pixelData, pixelData + 4 * static_cast<size_t>(width) * height);
+		stbi_image_free(pixelData);
+		return true;
+	}
+
+	// Smooth gradients with some noise, so that no kernel can take a shortcut
+	Image generateImage(uint32_t size) {
+		Image image;
+		image.name = "generated " + std::to_string(size) + "x" + std::to_string(size);
+		image.width = image.height = size;
+		image.pixels.resize(4 * static_cast<size_t>(size) * size);
+		uint32_t seed = 12345;
+		for (uint32_t j = 0; j < size; ++j) {
+			for (uint32_t i = 0; i < size; ++i) {
+				seed = seed * 1664525u + 1013904223u;
+				unsigned char* p = &image.pixels[4 * (static_cast<size_t>(j) * size + i)];
+				p[0] = static_cast<unsigned char>(i * 255 / size);
+				p[1] = static_cast<unsigned char>(j * 255 / size);
+				p[2] = static_cast<unsigned char>(seed >> 24);
+				p[3] = 255;
+			}
+		}
+		return image;
+	}
+
+	// Best of a few runs, in milliseconds
+	double timeMipChain(const Image& image, bool multithreaded) {
+		MipFilter::ScratchArena scratch;
+		double best = 1e30;
+		for (int run = 0; run < 5; ++run) {
+			size_t checksum = 0;
+			auto start = std::chrono::steady_clock::now();
+			MipFilter::buildMipChain(image.pixels.data(), image.width, image.height, MipFilter::mipLevelCount(image.width, image.height), MipFilter::TextureKind::Albedo, scratch,
+				[&](uint32_t, uint32_t, uint32_t, uint32_t, uint32_t rowCount, const unsigned char* rows) {
+					// Stands for the texture upload
+					checksum += rows[0] + rowCount;
+				}, multithreaded);
+			auto end = std::chrono::steady_clock::now();
+			best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+			g_sink = checksum;
+		}
+		return best;
+	}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	std::vector<Image> images;
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			Image image;
+			if (!loadImage(argv[i], image)) {
+				std::cerr << "Could not load " << argv[i] << std::endl;
+				return 1;
+			}
+			images.push_back(std::move(image));
+		}
+	}
+	else {
+		Image image;
+		if (loadImage(RESOURCE_DIR "/fourareen2K_albedo.jpg", image)) {
+			images.push_back(std::move(image));
+		}
+		images.push_back(generateImage(4096));
+		images.push_back(generateImage(8192));
+	}
+
+	std::cout << "Kernel: " << MipFilter::instructionSet()
+		<< ", worker threads: " << ThreadPool::Shared().GetThreadCount() << std::endl;
+	for (const Image& image : images) {
+		double single = timeMipChain(image, false);
+		double multi = timeMipChain(image, true);
+		std::cout << image.name << " (" << image.width << "x" << image.height << "): "
+			<< single << " ms on one thread, " << multi << " ms on the pool (x" << single / multi << ")" << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,447 @@
+#include "MipFilter.h"
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || ((defined(__i386__) || defined(_M_IX86)) && (defined(__SSE2__) || _M_IX86_FP >= 2))
+#  define MIP_FILTER_SSE2
+#  include <immintrin.h>
+#  if defined(_MSC_VER) && !defined(__clang__)
+#    include <intrin.h>
+#    define MIP_FILTER_TARGET_AVX2
+#  else
+#    define MIP_FILTER_TARGET_AVX2 __attribute__((target("avx2")))
+#  endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#  define MIP_FILTER_NEON
+#  include <arm_neon.h>
+#endif
+
+namespace {
+	// Downsample the 2 source rows `row0` and `row1` into `width` destination
+	// pixels, starting at pixel `begin`.
+	void downsampleRowScalar(const unsigned char* row0, const unsigned char* row1, unsigned char* destination, uint32_t begin, uint32_t width) {
+		for (uint32_t i = begin; i < width; ++i) {
+			const unsigned char* p0 = row0 + 8 * i;
+			const unsigned char* p1 = row1 + 8 * i;
+			unsigned char* p = destination + 4 * i;
+			for (int c = 0; c < 4; ++c) {
+				// Rounded average, the SIMD kernels give the exact same result
+				p[c] = static_cast<unsigned char>((p0[c] + p0[4 + c] + p1[c] + p1[4 + c] + 2) / 4);
+			}
+		}
+	}
+
+	// The vectorized kernels process as many pixels as they can and return
+	// the number of destination pixels written, the caller finishes the row.
+	using RowKernel = uint32_t(*)(const unsigned char* row0, const unsigned char* row1, unsigned char* destination, uint32_t width);
+
+#ifdef MIP_FILTER_SSE2
+	// 16 source pixels (8 of each row) to 4 destination pixels per iteration
+	uint32_t downsampleRowSse2(const unsigned char* row0, const unsigned char* row1, unsigned char* destination, uint32_t width) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bias = _mm_set1_epi16(2);
+		uint32_t i = 0;
+		for (; i + 4 <= width; i += 4) {
+			__m128 a0 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 8 * i)));
+			__m128 a1 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 8 * i + 16)));
+			__m128 b0 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 8 * i)));
+			__m128 b1 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 8 * i + 16)));
+
+			// Split even and odd pixels so that horizontal neighbors line up
+			__m128i aEven = _mm_castps_si128(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i aOdd = _mm_castps_si128(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1)));
+			__m128i bEven = _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i bOdd = _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1)));
+
+			// Sum the 4 pixels of each block on 16 bits
+			__m128i lo = _mm_add_epi16(
+				_mm_add_epi16(_mm_unpacklo_epi8(aEven, zero), _mm_unpacklo_epi8(aOdd, zero)),
+				_mm_add_epi16(_mm_unpacklo_epi8(bEven, zero), _mm_unpacklo_epi8(bOdd, zero)));
+			__m128i hi = _mm_add_epi16(
+				_mm_add_epi16(_mm_unpackhi_epi8(aEven, zero), _mm_unpackhi_epi8(aOdd, zero)),
+				_mm_add_epi16(_mm_unpackhi_epi8(bEven, zero), _mm_unpackhi_epi8(bOdd, zero)));
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, bias), 2);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, bias), 2);
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 4 * i), _mm_packus_epi16(lo, hi));
+		}
+		return i;
+	}
+
+	// Same as the SSE2 kernel with twice as many pixels per iteration
+	MIP_FILTER_TARGET_AVX2
+	uint32_t downsampleRowAvx2(const unsigned char* row0, const unsigned char* row1, unsigned char* destination, uint32_t width) {
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i bias = _mm256_set1_epi16(2);
+		uint32_t i = 0;
+		for (; i + 8 <= width; i += 8) {
+			__m256 a0 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + 8 * i)));
+			__m256 a1 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + 8 * i + 32)));
+			__m256 b0 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + 8 * i)));
+			__m256 b1 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + 8 * i + 32)));
+
+			// Shuffles work within 128-bit lanes, so this gives destination
+			// pixels in the order 0 1 4 5 | 2 3 6 7
+			__m256i aEven = _mm256_castps_si256(_mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0)));
+			__m256i aOdd = _mm256_castps_si256(_mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1)));
+			__m256i bEven = _mm256_castps_si256(_mm256_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+			__m256i bOdd = _mm256_castps_si256(_mm256_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1)));
+
+			__m256i lo = _mm256_add_epi16(
+				_mm256_add_epi16(_mm256_unpacklo_epi8(aEven, zero), _mm256_unpacklo_epi8(aOdd, zero)),
+				_mm256_add_epi16(_mm256_unpacklo_epi8(bEven, zero), _mm256_unpacklo_epi8(bOdd, zero)));
+			__m256i hi = _mm256_add_epi16(
+				_mm256_add_epi16(_mm256_unpackhi_epi8(aEven, zero), _mm256_unpackhi_epi8(aOdd, zero)),
+				_mm256_add_epi16(_mm256_unpackhi_epi8(bEven, zero), _mm256_unpackhi_epi8(bOdd, zero)));
+			lo = _mm256_srli_epi16(_mm256_add_epi16(lo, bias), 2);
+			hi = _mm256_srli_epi16(_mm256_add_epi16(hi, bias), 2);
+
+			// Packing is per lane too (0 1 4 5 | 2 3 6 7), put pixels back in order
+			__m256i packed = _mm256_packus_epi16(lo, hi);
+			packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + 4 * i), packed);
+		}
+		return i;
+	}
+
+	bool cpuHasAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+		__cpuid(info, 1);
+		bool osSavesYmm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+		__cpuidex(info, 7, 0);
+		return osSavesYmm && (info[1] & (1 << 5));
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif // MIP_FILTER_SSE2
+
+#ifdef MIP_FILTER_NEON
+	// 16 source pixels (8 of each row) to 4 destination pixels per iteration
+	uint32_t downsampleRowNeon(const unsigned char* row0, const unsigned char* row1, unsigned char* destination, uint32_t width) {
+		uint32_t i = 0;
+		for (; i + 4 <= width; i += 4) {
+			// Deinterleaving loads split even and odd pixels
+			uint32x4x2_t a = vld2q_u32(reinterpret_cast<const uint32_t*>(row0 + 8 * i));
+			uint32x4x2_t b = vld2q_u32(reinterpret_cast<const uint32_t*>(row1 + 8 * i));
+			uint8x16_t aEven = vreinterpretq_u8_u32(a.val[0]);
+			uint8x16_t aOdd = vreinterpretq_u8_u32(a.val[1]);
+			uint8x16_t bEven = vreinterpretq_u8_u32(b.val[0]);
+			uint8x16_t bOdd = vreinterpretq_u8_u32(b.val[1]);
+
+			uint16x8_t lo = vaddq_u16(
+				vaddl_u8(vget_low_u8(aEven), vget_low_u8(aOdd)),
+				vaddl_u8(vget_low_u8(bEven), vget_low_u8(bOdd)));
+			uint16x8_t hi = vaddq_u16(
+				vaddl_u8(vget_high_u8(aEven), vget_high_u8(aOdd)),
+				vaddl_u8(vget_high_u8(bEven), vget_high_u8(bOdd)));
+
+			// Rounding shift, i.e. (sum + 2) / 4
+			vst1q_u8(destination + 4 * i, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+		}
+		return i;
+	}
+#endif // MIP_FILTER_NEON
+
+	struct Kernel {
+		RowKernel rowKernel;
+		const char* name;
+	};
+
+	// Picked once for the CPU we run on
+	const Kernel& kernel() {
+		static const Kernel selected = []() -> Kernel {
+#if defined(MIP_FILTER_SSE2)
+			if (cpuHasAvx2()) return { downsampleRowAvx2, "AVX2" };
+			return { downsampleRowSse2, "SSE2" };
+#elif defined(MIP_FILTER_NEON)
+			return { downsampleRowNeon, "NEON" };
+#else
+			return { nullptr, "scalar" };
+#endif
+		}();
+		return selected;
+	}
+
+	// RGBA as 4 floats, the unit of work of the linear space filter
+#if defined(MIP_FILTER_SSE2)
+	using Float4 = __m128;
+	inline Float4 load4(const float* p) { return _mm_loadu_ps(p); }
+	inline void store4(float* p, Float4 v) { _mm_storeu_ps(p, v); }
+	inline Float4 splat4(float x) { return _mm_set1_ps(x); }
+	inline Float4 add4(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+	inline Float4 mul4(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+#elif defined(MIP_FILTER_NEON)
+	using Float4 = float32x4_t;
+	inline Float4 load4(const float* p) { return vld1q_f32(p); }
+	inline void store4(float* p, Float4 v) { vst1q_f32(p, v); }
+	inline Float4 splat4(float x) { return vdupq_n_f32(x); }
+	inline Float4 add4(Float4 a, Float4 b) { return vaddq_f32(a, b); }
+	inline Float4 mul4(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+#else
+	struct Float4 { float v[4]; };
+	inline Float4 load4(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+	inline void store4(float* p, Float4 a) { for (int c = 0; c < 4; ++c) p[c] = a.v[c]; }
+	inline Float4 splat4(float x) { return { { x, x, x, x } }; }
+	inline Float4 add4(Float4 a, Float4 b) { for (int c = 0; c < 4; ++c) a.v[c] += b.v[c]; return a; }
+	inline Float4 mul4(Float4 a, Float4 b) { for (int c = 0; c < 4; ++c) a.v[c] *= b.v[c]; return a; }
+#endif
+
+	// Source texels and weights of destination texel `i` along an axis of
+	// `size` source texels. Even sizes use a 2-tap box. Odd sizes use the 3
+	// taps that exactly cover the size / (size / 2) source texels under the
+	// destination texel, as in "Non-Power-of-Two Mipmapping" (NVIDIA, 2005).
+	struct Taps {
+		uint32_t first;
+		uint32_t count;
+		float weights[3];
+	};
+
+	Taps taps(uint32_t i, uint32_t size) {
+		if (size == 1) return { 0, 1, { 1.0f, 0.0f, 0.0f } };
+		if (size % 2 == 0) return { 2 * i, 2, { 0.5f, 0.5f, 0.0f } };
+		uint32_t half = size / 2;
+		float n = static_cast<float>(size);
+		return { 2 * i, 3, { (half - i) / n, half / n, (i + 1) / n } };
+	}
+
+	// Lookup tables from texel bytes to filtered values and back. Linear
+	// values also have a 14-bit fixed point version, so that the sum of 4 of
+	// them fits on 16 bits and indexes linearToSrgb once divided by 4.
+	constexpr int LinearToSrgbSize = 1 << 14;
+	struct Tables {
+		std::array<float, 256> srgbToLinear;
+		std::array<uint16_t, 256> srgbToLinearFixed;
+		std::array<float, 256> unorm;
+		std::array<float, 256> snorm;
+		std::array<unsigned char, LinearToSrgbSize> linearToSrgb;
+
+		Tables() {
+			for (int v = 0; v < 256; ++v) {
+				float x = v / 255.0f;
+				srgbToLinear[v] = x <= 0.04045f ? x / 12.92f : std::pow((x + 0.055f) / 1.055f, 2.4f);
+				srgbToLinearFixed[v] = static_cast<uint16_t>(std::lround(srgbToLinear[v] * (LinearToSrgbSize - 1)));
+				unorm[v] = x;
+				snorm[v] = 2.0f * x - 1.0f;
+			}
+			for (int i = 0; i < LinearToSrgbSize; ++i) {
+				float x = i / static_cast<float>(LinearToSrgbSize - 1);
+				float y = x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+				linearToSrgb[i] = static_cast<unsigned char>(std::lround(255.0f * y));
+			}
+		}
+	};
+
+	const Tables& tables() {
+		static const Tables instance;
+		return instance;
+	}
+
+	unsigned char encodeUnorm(float x) {
+		return static_cast<unsigned char>(255.0f * std::clamp(x, 0.0f, 1.0f) + 0.5f);
+	}
+
+	// Fast path for sRGB colors of even size: 2x2 average in linear fixed point
+	void downsampleSrgbRows(const unsigned char* source, uint32_t width, unsigned char* destination, uint32_t rowBegin, uint32_t rowEnd) {
+		const Tables& t = tables();
+		uint32_t destinationWidth = width / 2;
+		for (uint32_t j = rowBegin; j < rowEnd; ++j) {
+			const unsigned char* row0 = source + 4 * static_cast<size_t>(2 * j + 0) * width;
+			const unsigned char* row1 = source + 4 * static_cast<size_t>(2 * j + 1) * width;
+			unsigned char* row = destination + 4 * static_cast<size_t>(j) * destinationWidth;
+			for (uint32_t i = 0; i < destinationWidth; ++i) {
+				const unsigned char* p0 = row0 + 8 * i;
+				const unsigned char* p1 = row1 + 8 * i;
+				unsigned char* p = row + 4 * i;
+				for (int c = 0; c < 3; ++c) {
+					uint32_t sum = t.srgbToLinearFixed[p0[c]] + t.srgbToLinearFixed[p0[4 + c]]
+						+ t.srgbToLinearFixed[p1[c]] + t.srgbToLinearFixed[p1[4 + c]];
+					p[c] = t.linearToSrgb[(sum + 2) / 4];
+				}
+				p[3] = static_cast<unsigned char>((p0[3] + p0[7] + p1[3] + p1[7] + 2) / 4);
+			}
+		}
+	}
+
+	void decodeRow(const unsigned char* row, uint32_t width, MipFilter::TextureKind kind, float* decoded) {
+		const Tables& t = tables();
+		const std::array<float, 256>& rgb = kind == MipFilter::TextureKind::Albedo ? t.srgbToLinear
+			: kind == MipFilter::TextureKind::Normal ? t.snorm : t.unorm;
+		for (uint32_t i = 0; i < 4 * width; i += 4) {
+			decoded[i + 0] = rgb[row[i + 0]];
+			decoded[i + 1] = rgb[row[i + 1]];
+			decoded[i + 2] = rgb[row[i + 2]];
+			decoded[i + 3] = t.unorm[row[i + 3]];
+		}
+	}
+
+	void encodeRow(const float* values, uint32_t width, MipFilter::TextureKind kind, unsigned char* row) {
+		const Tables& t = tables();
+		for (uint32_t i = 0; i < 4 * width; i += 4) {
+			const float* v = values + i;
+			unsigned char* p = row + i;
+			switch (kind) {
+			case MipFilter::TextureKind::Albedo:
+				for (int c = 0; c < 3; ++c) {
+					float x = std::clamp(v[c], 0.0f, 1.0f);
+					p[c] = t.linearToSrgb[static_cast<int>(x * (LinearToSrgbSize - 1) + 0.5f)];
+				}
+				break;
+			case MipFilter::TextureKind::Normal: {
+				// Averaging shortens normals, bring them back to unit length
+				float length = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+				float scale = length > 1e-6f ? 1.0f / length : 0.0f;
+				for (int c = 0; c < 3; ++c) {
+					p[c] = encodeUnorm(0.5f * v[c] * scale + 0.5f);
+				}
+				break;
+			}
+			case MipFilter::TextureKind::Mask:
+				for (int c = 0; c < 3; ++c) {
+					p[c] = encodeUnorm(v[c]);
+				}
+				break;
+			}
+			p[3] = encodeUnorm(v[3]);
+		}
+	}
+} // namespace
+
+unsigned char* MipFilter::ScratchArena::Get(uint32_t level, size_t size)
+{
+	std::vector<unsigned char>& buffer = m_buffers[level % 2];
+	if (buffer.size() < size) buffer.resize(size);
+	return buffer.data();
+}
+
+uint32_t MipFilter::mipLevelCount(uint32_t width, uint32_t height)
+{
+	uint32_t count = 1;
+	for (uint32_t size = std::max(width, height); size > 1; size /= 2) ++count;
+	return count;
+}
+
+uint32_t MipFilter::mipLevelSize(uint32_t size, uint32_t level)
+{
+	return std::max<uint32_t>(1, size >> level);
+}
+
+void MipFilter::downsampleRows(const unsigned char* source, uint32_t width, uint32_t height, unsigned char* destination,
+	uint32_t rowBegin, uint32_t rowEnd, TextureKind kind)
+{
+	uint32_t destinationWidth = mipLevelSize(width, 1);
+	rowEnd = std::min(rowEnd, mipLevelSize(height, 1));
+
+	// Most levels have even sizes and have faster integer paths
+	bool evenSize = width % 2 == 0 && height % 2 == 0;
+	if (evenSize && kind == TextureKind::Mask) {
+		downsample2x2Rows(source, width, height, destination, rowBegin, rowEnd);
+		return;
+	}
+	if (evenSize && kind == TextureKind::Albedo) {
+		downsampleSrgbRows(source, width, destination, rowBegin, rowEnd);
+		return;
+	}
+
+	// One source row decoded to linear values, and the destination row
+	// being accumulated, as 4 floats per texel
+	thread_local std::vector<float> decoded;
+	thread_local std::vector<float> accumulated;
+	thread_local std::vector<Taps> columnTaps;
+	decoded.resize(4 * static_cast<size_t>(width));
+	accumulated.resize(4 * static_cast<size_t>(destinationWidth));
+	columnTaps.resize(destinationWidth);
+	for (uint32_t i = 0; i < destinationWidth; ++i) {
+		columnTaps[i] = taps(i, width);
+	}
+
+	for (uint32_t j = rowBegin; j < rowEnd; ++j) {
+		std::fill(accumulated.begin(), accumulated.end(), 0.0f);
+
+		// Filter each source row horizontally, then add it with its vertical weight
+		Taps rowTaps = taps(j, height);
+		for (uint32_t t = 0; t < rowTaps.count; ++t) {
+			decodeRow(source + 4 * static_cast<size_t>(rowTaps.first + t) * width, width, kind, decoded.data());
+			Float4 rowWeight = splat4(rowTaps.weights[t]);
+
+			for (uint32_t i = 0; i < destinationWidth; ++i) {
+				const Taps& column = columnTaps[i];
+				Float4 sum = mul4(load4(&decoded[4 * column.first]), splat4(column.weights[0]));
+				for (uint32_t k = 1; k < column.count; ++k) {
+					sum = add4(sum, mul4(load4(&decoded[4 * (column.first + k)]), splat4(column.weights[k])));
+				}
+				float* texel = &accumulated[4 * i];
+				store4(texel, add4(load4(texel), mul4(sum, rowWeight)));
+			}
+		}
+
+		encodeRow(accumulated.data(), destinationWidth, kind, destination + 4 * static_cast<size_t>(j) * destinationWidth);
+	}
+}
+
+void MipFilter::downsample2x2(const unsigned char* source, uint32_t width, uint32_t height, unsigned char* destination)
+{
+	downsample2x2Rows(source, width, height, destination, 0, height / 2);
+}
+
+void MipFilter::downsample2x2Rows(const unsigned char* source, uint32_t width, uint32_t height, unsigned char* destination, uint32_t rowBegin, uint32_t rowEnd)
+{
+	RowKernel rowKernel = kernel().rowKernel;
+	uint32_t destinationWidth = width / 2;
+	rowEnd = std::min(rowEnd, height / 2);
+	for (uint32_t j = rowBegin; j < rowEnd; ++j) {
+		const unsigned char* row0 = source + 4 * static_cast<size_t>(2 * j + 0) * width;
+		const unsigned char* row1 = source + 4 * static_cast<size_t>(2 * j + 1) * width;
+		unsigned char* row = destination + 4 * static_cast<size_t>(j) * destinationWidth;
+		uint32_t done = rowKernel ? rowKernel(row0, row1, row, destinationWidth) : 0;
+		downsampleRowScalar(row0, row1, row, done, destinationWidth);
+	}
+}
+
+void MipFilter::buildMipChain(const unsigned char* image, uint32_t width, uint32_t height, uint32_t levelCount, TextureKind kind,
+	ScratchArena& scratch, const BandCallback& onBand, bool multithreaded)
+{
+	// Bands of about 64K pixels: big enough to amortize scheduling, small
+	// enough to give all the workers something to do on a 2K level
+	constexpr uint32_t BandPixels = 1 << 16;
+
+	const unsigned char* previousPixels = image;
+	uint32_t previousWidth = width;
+	uint32_t previousHeight = height;
+	for (uint32_t level = 1; level < levelCount; ++level) {
+		uint32_t levelWidth = mipLevelSize(previousWidth, 1);
+		uint32_t levelHeight = mipLevelSize(previousHeight, 1);
+		unsigned char* pixels = scratch.Get(level, 4 * static_cast<size_t>(levelWidth) * levelHeight);
+		size_t rowBytes = 4 * static_cast<size_t>(levelWidth);
+
+		auto build = [&](size_t rowBegin, size_t rowEnd) {
+			downsampleRows(previousPixels, previousWidth, previousHeight, pixels, (uint32_t)rowBegin, (uint32_t)rowEnd, kind);
+		};
+		auto consume = [&](size_t rowBegin, size_t rowEnd) {
+			onBand(level, levelWidth, levelHeight, (uint32_t)rowBegin, (uint32_t)(rowEnd - rowBegin), pixels + rowBegin * rowBytes);
+		};
+
+		size_t bandRows = std::max<size_t>(1, BandPixels / std::max<uint32_t>(levelWidth, 1));
+		if (multithreaded && bandRows < levelHeight) {
+			ThreadPool::Shared().ParallelForOrdered(0, levelHeight, bandRows, build, consume);
+		}
+		else {
+			build(0, levelHeight);
+			consume(0, levelHeight);
+		}
+
+		previousPixels = pixels;
+		previousWidth = levelWidth;
+		previousHeight = levelHeight;
+	}
+}
+
+const char* MipFilter::instructionSet()
+{
+	return kernel().name;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Downsampling kernels used to build mip chains on the CPU.
+//
+// Images are RGBA8 with tightly packed rows. Each level is produced row by
+// row (so that reads and writes are sequential) by a vectorized kernel:
+// AVX2 when the CPU supports it, SSE2 or NEON otherwise, and a scalar loop
+// for the remaining pixels and on other targets.
+//
+// Colors are averaged in linear space and normal maps are renormalized, in
+// which case pixels are filtered as 4 floats at once. Levels of odd size use
+// a 3-tap filter so that no row or column of the previous level is dropped.
+class MipFilter
+{
+public:
+	// How texel values must be filtered
+	enum class TextureKind {
+		Albedo, // sRGB encoded color, linear alpha
+		Normal, // tangent space vector mapped to [0, 1]
+		Mask, // linear data (roughness, occlusion, masks...)
+	};
+
+	// Memory for the levels being built, reused from one level to the next
+	// (level N is read from one buffer while level N + 1 is written to the
+	// other) and from one texture to the next, so that building a mip chain
+	// does not allocate once warmed up.
+	class ScratchArena {
+	public:
+		// Buffer for level `level` (>= 1) of at least `size` bytes
+		unsigned char* Get(uint32_t level, size_t size);
+
+	private:
+		std::vector<unsigned char> m_buffers[2];
+	};
+
+	// Number of levels of a full mip chain, down to 1x1
+	static uint32_t mipLevelCount(uint32_t width, uint32_t height);
+	// Size of level `level` along an axis of `size` texels at level 0
+	static uint32_t mipLevelSize(uint32_t size, uint32_t level);
+
+	// Build destination rows [rowBegin, rowEnd) of the level following
+	// `source` (width x height), which is mipLevelSize(width, 1) x
+	// mipLevelSize(height, 1), filtering texels according to `kind`.
+	static void downsampleRows(const unsigned char* source, uint32_t width, uint32_t height, unsigned char* destination,
+		uint32_t rowBegin, uint32_t rowEnd, TextureKind kind);
+
+	// Plain average of each 2x2 block of `source` (width x height) into one
+	// pixel of `destination`, which is (width / 2) x (height / 2). This is the
+	// fast path of downsampleRows for masks of even size.
+	static void downsample2x2(const unsigned char* source, uint32_t width, uint32_t height, unsigned char* destination);
+	// Same, only for destination rows [rowBegin, rowEnd)
+	static void downsample2x2Rows(const unsigned char* source, uint32_t width, uint32_t height, unsigned char* destination, uint32_t rowBegin, uint32_t rowEnd);
+
+	// Called for a band of rows of a level: `rows` points to row `firstRow`
+	// of a level of size width x height.
+	using BandCallback = std::function<void(uint32_t level, uint32_t width, uint32_t height, uint32_t firstRow, uint32_t rowCount, const unsigned char* rows)>;
+
+	// Build levels 1 to levelCount - 1 of the mip chain of `image` (level 0).
+	// Large levels are split into bands of rows built on the shared
+	// ThreadPool, and onBand is called on the calling thread for each band,
+	// in order, as soon as it is ready. Pixels passed to onBand stay valid
+	// until the level after the next one is built.
+	static void buildMipChain(const unsigned char* image, uint32_t width, uint32_t height, uint32_t levelCount, TextureKind kind,
+		ScratchArena& scratch, const BandCallback& onBand, bool multithreaded = true);
+
+	// Name of the kernel picked for this CPU, for logs
+	static const char* instructionSet();
+};
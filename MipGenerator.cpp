@@ -0,0 +1,432 @@
+#include "MipGenerator.h"
+
+#include "Loader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace {
+	// @workgroup_size of cs_main in mipmap.wgsl
+	constexpr uint32_t TileSize = 16;
+	// @binding of levelTexels in mipmap.wgsl
+	constexpr uint32_t RenderSourceBinding = 6;
+} // namespace
+
+bool MipGenerator::Init(Device device)
+{
+	m_device = device;
+	m_queue = m_device.getQueue();
+
+	ShaderModule shaderModule = Loader::loadShaderModule(RESOURCE_DIR "/mipmap.wgsl", m_device);
+	if (shaderModule == nullptr) return false;
+
+	// The source level is read with textureLoad, each level written is a
+	// write-only storage texture
+	std::vector<BindGroupLayoutEntry> bindingLayoutEntries(2 + MaxLevelsPerDispatch, Default);
+	bindingLayoutEntries[0].binding = 0;
+	bindingLayoutEntries[0].visibility = ShaderStage::Compute;
+	bindingLayoutEntries[0].texture.sampleType = TextureSampleType::Float;
+	bindingLayoutEntries[0].texture.viewDimension = TextureViewDimension::_2D;
+
+	for (uint32_t k = 1; k <= MaxLevelsPerDispatch; ++k) {
+		bindingLayoutEntries[k].binding = k;
+		bindingLayoutEntries[k].visibility = ShaderStage::Compute;
+		bindingLayoutEntries[k].storageTexture.access = StorageTextureAccess::WriteOnly;
+		bindingLayoutEntries[k].storageTexture.format = TextureFormat::RGBA8Unorm;
+		bindingLayoutEntries[k].storageTexture.viewDimension = TextureViewDimension::_2D;
+	}
+
+	BindGroupLayoutEntry& paramsEntry = bindingLayoutEntries[1 + MaxLevelsPerDispatch];
+	paramsEntry.binding = 1 + MaxLevelsPerDispatch;
+	paramsEntry.visibility = ShaderStage::Compute;
+	paramsEntry.buffer.type = BufferBindingType::Uniform;
+	paramsEntry.buffer.minBindingSize = sizeof(Params);
+
+	BindGroupLayoutDescriptor bindGroupLayoutDesc{};
+	bindGroupLayoutDesc.entryCount = (uint32_t)bindingLayoutEntries.size();
+	bindGroupLayoutDesc.entries = bindingLayoutEntries.data();
+	m_bindGroupLayout = m_device.createBindGroupLayout(bindGroupLayoutDesc);
+
+	PipelineLayoutDescriptor layoutDesc;
+	layoutDesc.bindGroupLayoutCount = 1;
+	layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)&m_bindGroupLayout;
+	PipelineLayout layout = m_device.createPipelineLayout(layoutDesc);
+
+	ComputePipelineDescriptor pipelineDesc;
+	pipelineDesc.label = "Mip generation";
+	pipelineDesc.layout = layout;
+	pipelineDesc.compute.module = shaderModule;
+	pipelineDesc.compute.entryPoint = "cs_main";
+	pipelineDesc.compute.constantCount = 0;
+	pipelineDesc.compute.constants = nullptr;
+	m_pipeline = m_device.createComputePipeline(pipelineDesc);
+	layout.release();
+
+	// Levels of formats with fewer channels are rendered from the scratch
+	// texture, read with textureLoad
+	BindGroupLayoutEntry renderSourceEntry = Default;
+	renderSourceEntry.binding = RenderSourceBinding;
+	renderSourceEntry.visibility = ShaderStage::Fragment;
+	renderSourceEntry.texture.sampleType = TextureSampleType::Float;
+	renderSourceEntry.texture.viewDimension = TextureViewDimension::_2D;
+	bindGroupLayoutDesc.entryCount = 1;
+	bindGroupLayoutDesc.entries = &renderSourceEntry;
+	m_renderBindGroupLayout = m_device.createBindGroupLayout(bindGroupLayoutDesc);
+	m_rg8Pipeline = CreateRenderPipeline(shaderModule, TextureFormat::RG8Unorm);
+	m_r8Pipeline = CreateRenderPipeline(shaderModule, TextureFormat::R8Unorm);
+
+	shaderModule.release();
+
+	BufferDescriptor bufferDesc;
+	bufferDesc.label = "Mip generation parameters";
+	bufferDesc.size = MaxDispatches * ParamStride;
+	bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+	bufferDesc.mappedAtCreation = false;
+	m_paramBuffer = m_device.createBuffer(bufferDesc);
+
+	// Never written, the shader only stores to the levels of the dispatch
+	TextureDescriptor textureDesc;
+	textureDesc.dimension = TextureDimension::_2D;
+	textureDesc.format = TextureFormat::RGBA8Unorm;
+	textureDesc.size = { 1, 1, 1 };
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.usage = TextureUsage::StorageBinding;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	for (size_t k = 0; k < m_unusedOutputs.size(); ++k) {
+		m_unusedOutputs[k] = m_device.createTexture(textureDesc);
+		m_unusedOutputViews[k] = CreateLevelView(m_unusedOutputs[k], 0);
+	}
+
+	return m_pipeline != nullptr;
+}
+
+void MipGenerator::Terminate()
+{
+	if (m_device == nullptr) return;
+
+	for (size_t k = 0; k < m_unusedOutputs.size(); ++k) {
+		m_unusedOutputViews[k].release();
+		m_unusedOutputs[k].destroy();
+		m_unusedOutputs[k].release();
+	}
+	m_paramBuffer.destroy();
+	m_paramBuffer.release();
+	if (m_rg8Pipeline) m_rg8Pipeline.release();
+	if (m_r8Pipeline) m_r8Pipeline.release();
+	m_renderBindGroupLayout.release();
+	m_pipeline.release();
+	m_bindGroupLayout.release();
+	m_queue.release();
+
+	m_rg8Pipeline = nullptr;
+	m_r8Pipeline = nullptr;
+	m_pipeline = nullptr;
+	m_device = nullptr;
+}
+
+uint32_t MipGenerator::LevelsPerDispatch(Extent3D size, uint32_t mipLevelCount, uint32_t sourceLevel)
+{
+	// The first level can have any size, the next ones are built from 2x2
+	// texels of the previous one, so that one must have an even size.
+	uint32_t count = 1;
+	while (count < MaxLevelsPerDispatch && sourceLevel + count + 1 < mipLevelCount) {
+		uint32_t width = MipFilter::mipLevelSize(size.width, sourceLevel + count);
+		uint32_t height = MipFilter::mipLevelSize(size.height, sourceLevel + count);
+		if (width % 2 != 0 || height % 2 != 0) break;
+		++count;
+	}
+	return count;
+}
+
+bool MipGenerator::Supports(TextureFormat format) const
+{
+	switch (format) {
+	case TextureFormat::RGBA8Unorm:
+	case TextureFormat::RGBA8UnormSrgb:
+		return m_pipeline != nullptr;
+	case TextureFormat::RG8Unorm:
+		return m_pipeline != nullptr && m_rg8Pipeline != nullptr;
+	case TextureFormat::R8Unorm:
+		return m_pipeline != nullptr && m_r8Pipeline != nullptr;
+	default:
+		return false;
+	}
+}
+
+void MipGenerator::Generate(Texture texture, Extent3D size, uint32_t mipLevelCount, MipFilter::TextureKind kind, const unsigned char* level0)
+{
+	if (mipLevelCount < 2) return;
+	if (texture.getFormat() == TextureFormat::RGBA8Unorm) {
+		GenerateLevels(texture, size, mipLevelCount, kind);
+		return;
+	}
+
+	// The scratch texture holds the same bytes as an RGBA8 texture would, so
+	// that the shader filters them as it does in place
+	TextureDescriptor textureDesc;
+	textureDesc.label = "Mip generation scratch";
+	textureDesc.dimension = TextureDimension::_2D;
+	textureDesc.format = TextureFormat::RGBA8Unorm;
+	textureDesc.size = { size.width, size.height, 1 };
+	textureDesc.mipLevelCount = mipLevelCount;
+	textureDesc.sampleCount = 1;
+	textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::StorageBinding | TextureUsage::CopyDst | TextureUsage::CopySrc;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	Texture scratch = m_device.createTexture(textureDesc);
+
+	ImageCopyTexture destination;
+	destination.texture = scratch;
+	destination.mipLevel = 0;
+	destination.origin = { 0, 0, 0 };
+	destination.aspect = TextureAspect::All;
+	TextureDataLayout source;
+	source.offset = 0;
+	source.bytesPerRow = 4 * size.width;
+	source.rowsPerImage = size.height;
+	m_queue.writeTexture(destination, level0, 4 * static_cast<size_t>(size.width) * size.height, source, textureDesc.size);
+
+	GenerateLevels(scratch, size, mipLevelCount, kind);
+	TransferLevels(scratch, texture, size, mipLevelCount);
+
+	// Freed once the submitted work is done with it
+	scratch.destroy();
+	scratch.release();
+}
+
+void MipGenerator::GenerateLevels(Texture texture, Extent3D size, uint32_t mipLevelCount, MipFilter::TextureKind kind)
+{
+	// Split the chain into dispatches
+	std::vector<uint32_t> sourceLevels;
+	for (uint32_t level = 0; level + 1 < mipLevelCount; level += LevelsPerDispatch(size, mipLevelCount, level)) {
+		sourceLevels.push_back(level);
+	}
+
+	// The parameter buffer holds MaxDispatches of them. A chain that needs
+	// more (odd sizes cut it into many dispatches) is submitted in batches,
+	// the queue writing the parameters of a batch after the previous one ran.
+	for (size_t first = 0; first < sourceLevels.size(); first += MaxDispatches) {
+		size_t last = std::min(first + MaxDispatches, sourceLevels.size());
+		std::vector<uint32_t> batch(sourceLevels.begin() + first, sourceLevels.begin() + last);
+		GenerateBatch(texture, size, mipLevelCount, kind, batch);
+	}
+}
+
+void MipGenerator::GenerateBatch(Texture texture, Extent3D size, uint32_t mipLevelCount, MipFilter::TextureKind kind, const std::vector<uint32_t>& sourceLevels)
+{
+	// Upload the parameters of all the dispatches at once
+	std::vector<unsigned char> paramData(sourceLevels.size() * ParamStride);
+	for (size_t dispatch = 0; dispatch < sourceLevels.size(); ++dispatch) {
+		Params params = {};
+		params.levelCount = LevelsPerDispatch(size, mipLevelCount, sourceLevels[dispatch]);
+		params.kind = static_cast<uint32_t>(kind);
+		std::memcpy(&paramData[dispatch * ParamStride], &params, sizeof(Params));
+	}
+	m_queue.writeBuffer(m_paramBuffer, 0, paramData.data(), paramData.size());
+
+	CommandEncoderDescriptor encoderDesc = {};
+	encoderDesc.label = "Mip generation";
+	CommandEncoder encoder = m_device.createCommandEncoder(encoderDesc);
+
+	ComputePassDescriptor computePassDesc = {};
+	computePassDesc.label = "Mip generation";
+	computePassDesc.timestampWrites = nullptr;
+	ComputePassEncoder computePass = encoder.beginComputePass(computePassDesc);
+	computePass.setPipeline(m_pipeline);
+
+	// Kept alive until the commands are submitted
+	std::vector<TextureView> views;
+	std::vector<BindGroup> bindGroups;
+	for (uint32_t dispatch = 0; dispatch < sourceLevels.size(); ++dispatch) {
+		uint32_t sourceLevel = sourceLevels[dispatch];
+		uint32_t levelCount = LevelsPerDispatch(size, mipLevelCount, sourceLevel);
+
+		std::vector<BindGroupEntry> bindings(2 + MaxLevelsPerDispatch);
+		bindings[0].binding = 0;
+		bindings[0].textureView = CreateLevelView(texture, sourceLevel);
+		views.push_back(bindings[0].textureView);
+
+		for (uint32_t k = 1; k <= MaxLevelsPerDispatch; ++k) {
+			bindings[k].binding = k;
+			if (k <= levelCount) {
+				bindings[k].textureView = CreateLevelView(texture, sourceLevel + k);
+				views.push_back(bindings[k].textureView);
+			}
+			else {
+				bindings[k].textureView = m_unusedOutputViews[k - 2];
+			}
+		}
+
+		BindGroupEntry& paramsBinding = bindings[1 + MaxLevelsPerDispatch];
+		paramsBinding.binding = 1 + MaxLevelsPerDispatch;
+		paramsBinding.buffer = m_paramBuffer;
+		paramsBinding.offset = dispatch * ParamStride;
+		paramsBinding.size = sizeof(Params);
+
+		BindGroupDescriptor bindGroupDesc;
+		bindGroupDesc.layout = m_bindGroupLayout;
+		bindGroupDesc.entryCount = (uint32_t)bindings.size();
+		bindGroupDesc.entries = bindings.data();
+		bindGroups.push_back(m_device.createBindGroup(bindGroupDesc));
+
+		// One workgroup per tile of the first level written
+		uint32_t width = MipFilter::mipLevelSize(size.width, sourceLevel + 1);
+		uint32_t height = MipFilter::mipLevelSize(size.height, sourceLevel + 1);
+		computePass.setBindGroup(0, bindGroups.back(), 0, nullptr);
+		computePass.dispatchWorkgroups((width + TileSize - 1) / TileSize, (height + TileSize - 1) / TileSize, 1);
+	}
+
+	computePass.end();
+	computePass.release();
+
+	CommandBufferDescriptor cmdBufferDescriptor = {};
+	cmdBufferDescriptor.label = "Mip generation";
+	CommandBuffer command = encoder.finish(cmdBufferDescriptor);
+	encoder.release();
+	m_queue.submit(1, &command);
+	command.release();
+
+	for (BindGroup bindGroup : bindGroups) bindGroup.release();
+	for (TextureView view : views) view.release();
+}
+
+void MipGenerator::TransferLevels(Texture scratch, Texture texture, Extent3D size, uint32_t mipLevelCount)
+{
+	TextureFormat format = texture.getFormat();
+
+	CommandEncoderDescriptor encoderDesc = {};
+	encoderDesc.label = "Mip level transfer";
+	CommandEncoder encoder = m_device.createCommandEncoder(encoderDesc);
+
+	// Kept alive until the commands are submitted
+	std::vector<TextureView> views;
+	std::vector<BindGroup> bindGroups;
+	for (uint32_t level = 1; level < mipLevelCount; ++level) {
+		uint32_t width = MipFilter::mipLevelSize(size.width, level);
+		uint32_t height = MipFilter::mipLevelSize(size.height, level);
+
+		// Textures that only differ by their sRGB-ness can be copied
+		if (format == TextureFormat::RGBA8UnormSrgb) {
+			ImageCopyTexture source;
+			source.texture = scratch;
+			source.mipLevel = level;
+			source.origin = { 0, 0, 0 };
+			source.aspect = TextureAspect::All;
+			ImageCopyTexture destination = source;
+			destination.texture = texture;
+			encoder.copyTextureToTexture(source, destination, { width, height, 1 });
+			continue;
+		}
+
+		// The others drop the channels they do not have when rendered to
+		BindGroupEntry binding;
+		binding.binding = RenderSourceBinding;
+		binding.textureView = CreateLevelView(scratch, level);
+		views.push_back(binding.textureView);
+		BindGroupDescriptor bindGroupDesc;
+		bindGroupDesc.layout = m_renderBindGroupLayout;
+		bindGroupDesc.entryCount = 1;
+		bindGroupDesc.entries = &binding;
+		bindGroups.push_back(m_device.createBindGroup(bindGroupDesc));
+
+		RenderPassColorAttachment colorAttachment = {};
+		colorAttachment.view = CreateLevelView(texture, level, format);
+		views.push_back(colorAttachment.view);
+		colorAttachment.resolveTarget = nullptr;
+		colorAttachment.loadOp = LoadOp::Clear;
+		colorAttachment.storeOp = StoreOp::Store;
+		colorAttachment.clearValue = WGPUColor{ 0.0, 0.0, 0.0, 0.0 };
+#ifndef WEBGPU_BACKEND_WGPU
+		colorAttachment.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
+#endif // NOT WEBGPU_BACKEND_WGPU
+
+		RenderPassDescriptor renderPassDesc = {};
+		renderPassDesc.label = "Mip level transfer";
+		renderPassDesc.colorAttachmentCount = 1;
+		renderPassDesc.colorAttachments = &colorAttachment;
+		renderPassDesc.depthStencilAttachment = nullptr;
+		renderPassDesc.timestampWrites = nullptr;
+		RenderPassEncoder renderPass = encoder.beginRenderPass(renderPassDesc);
+		renderPass.setPipeline(format == TextureFormat::RG8Unorm ? m_rg8Pipeline : m_r8Pipeline);
+		renderPass.setBindGroup(0, bindGroups.back(), 0, nullptr);
+		// One triangle covering the level
+		renderPass.draw(3, 1, 0, 0);
+		renderPass.end();
+		renderPass.release();
+	}
+
+	CommandBufferDescriptor cmdBufferDescriptor = {};
+	cmdBufferDescriptor.label = "Mip level transfer";
+	CommandBuffer command = encoder.finish(cmdBufferDescriptor);
+	encoder.release();
+	m_queue.submit(1, &command);
+	command.release();
+
+	for (BindGroup bindGroup : bindGroups) bindGroup.release();
+	for (TextureView view : views) view.release();
+}
+
+RenderPipeline MipGenerator::CreateRenderPipeline(ShaderModule shaderModule, TextureFormat format)
+{
+	PipelineLayoutDescriptor layoutDesc;
+	layoutDesc.bindGroupLayoutCount = 1;
+	layoutDesc.bindGroupLayouts = (WGPUBindGroupLayout*)&m_renderBindGroupLayout;
+	PipelineLayout layout = m_device.createPipelineLayout(layoutDesc);
+
+	ColorTargetState colorTarget;
+	colorTarget.format = format;
+	colorTarget.blend = nullptr;
+	colorTarget.writeMask = ColorWriteMask::All;
+
+	FragmentState fragmentState;
+	fragmentState.module = shaderModule;
+	fragmentState.entryPoint = "fs_level";
+	fragmentState.constantCount = 0;
+	fragmentState.constants = nullptr;
+	fragmentState.targetCount = 1;
+	fragmentState.targets = &colorTarget;
+
+	RenderPipelineDescriptor pipelineDesc;
+	pipelineDesc.label = "Mip level transfer";
+	pipelineDesc.layout = layout;
+	pipelineDesc.vertex.bufferCount = 0;
+	pipelineDesc.vertex.buffers = nullptr;
+	pipelineDesc.vertex.module = shaderModule;
+	pipelineDesc.vertex.entryPoint = "vs_level";
+	pipelineDesc.vertex.constantCount = 0;
+	pipelineDesc.vertex.constants = nullptr;
+	pipelineDesc.primitive.topology = PrimitiveTopology::TriangleList;
+	pipelineDesc.primitive.stripIndexFormat = IndexFormat::Undefined;
+	pipelineDesc.primitive.frontFace = FrontFace::CCW;
+	pipelineDesc.primitive.cullMode = CullMode::None;
+	pipelineDesc.fragment = &fragmentState;
+	pipelineDesc.depthStencil = nullptr;
+	pipelineDesc.multisample.count = 1;
+	pipelineDesc.multisample.mask = ~0u;
+	pipelineDesc.multisample.alphaToCoverageEnabled = false;
+	RenderPipeline pipeline = m_device.createRenderPipeline(pipelineDesc);
+
+	layout.release();
+	return pipeline;
+}
+
+TextureView MipGenerator::CreateLevelView(Texture texture, uint32_t level) const
+{
+	return CreateLevelView(texture, level, TextureFormat::RGBA8Unorm);
+}
+
+TextureView MipGenerator::CreateLevelView(Texture texture, uint32_t level, TextureFormat format) const
+{
+	TextureViewDescriptor textureViewDesc;
+	textureViewDesc.aspect = TextureAspect::All;
+	textureViewDesc.baseArrayLayer = 0;
+	textureViewDesc.arrayLayerCount = 1;
+	textureViewDesc.baseMipLevel = level;
+	textureViewDesc.mipLevelCount = 1;
+	textureViewDesc.dimension = TextureViewDimension::_2D;
+	textureViewDesc.format = format;
+	return texture.createView(textureViewDesc);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "MipFilter.h"
+
+// Builds mip chains on the GPU with the compute shader resources/mipmap.wgsl,
+// so that loading a texture only costs decoding and uploading level 0.
+//
+// Each dispatch writes up to MaxLevelsPerDispatch levels: the first one from
+// the previous level in the texture, the next ones from workgroup memory.
+// A chain of levels stops at the first level of odd size, which starts a new
+// dispatch, so that every level uses the same filter as MipFilter.
+//
+// Only RGBA8Unorm textures can be storage textures. The levels of the other
+// formats the loader creates are built in an RGBA8Unorm scratch texture, then
+// copied into sRGB textures (same bytes) or rendered into textures with fewer
+// channels, which keep the first ones.
+class MipGenerator {
+public:
+	static constexpr uint32_t MaxLevelsPerDispatch = 4;
+
+	// Return false if the pipeline could not be created, in which case mip
+	// levels must be built on the CPU.
+	bool Init(wgpu::Device device);
+	void Terminate();
+	bool IsInitialized() const { return m_pipeline != nullptr; }
+
+	// Whether Generate() can fill textures of `format`: RGBA8Unorm (with the
+	// StorageBinding usage), RGBA8UnormSrgb (CopyDst), RG8Unorm and R8Unorm
+	// (RenderAttachment)
+	bool Supports(wgpu::TextureFormat format) const;
+
+	// Fill levels 1 to mipLevelCount - 1 of `texture` from its level 0,
+	// filtering texels according to `kind`. RGBA8Unorm textures are filtered
+	// in place, other formats from `level0`, the RGBA8 texels of level 0. The
+	// work is submitted to the queue right away.
+	void Generate(wgpu::Texture texture, wgpu::Extent3D size, uint32_t mipLevelCount, MipFilter::TextureKind kind,
+		const unsigned char* level0 = nullptr);
+
+	// Number of levels a dispatch reading level `sourceLevel` writes
+	static uint32_t LevelsPerDispatch(wgpu::Extent3D size, uint32_t mipLevelCount, uint32_t sourceLevel);
+
+private:
+	// Matches Params in mipmap.wgsl
+	struct Params {
+		uint32_t levelCount;
+		uint32_t kind;
+		uint32_t pad[2];
+	};
+
+	// Dispatch parameters are 256 bytes apart in m_paramBuffer, the largest
+	// minUniformBufferOffsetAlignment allowed.
+	static constexpr uint64_t ParamStride = 256;
+	// Dispatches per submission, enough for a 64K texture with one level each
+	static constexpr uint32_t MaxDispatches = 16;
+
+	// Fill the levels of an RGBA8Unorm texture in place
+	void GenerateLevels(wgpu::Texture texture, wgpu::Extent3D size, uint32_t mipLevelCount, MipFilter::TextureKind kind);
+	// Record and submit the dispatches starting at `sourceLevels`, at most MaxDispatches
+	void GenerateBatch(wgpu::Texture texture, wgpu::Extent3D size, uint32_t mipLevelCount, MipFilter::TextureKind kind,
+		const std::vector<uint32_t>& sourceLevels);
+	// Copy or render levels 1 to mipLevelCount - 1 of the RGBA8Unorm `scratch`
+	// into `texture`
+	void TransferLevels(wgpu::Texture scratch, wgpu::Texture texture, wgpu::Extent3D size, uint32_t mipLevelCount);
+	wgpu::RenderPipeline CreateRenderPipeline(wgpu::ShaderModule shaderModule, wgpu::TextureFormat format);
+	wgpu::TextureView CreateLevelView(wgpu::Texture texture, uint32_t level) const;
+	wgpu::TextureView CreateLevelView(wgpu::Texture texture, uint32_t level, wgpu::TextureFormat format) const;
+
+	wgpu::Device m_device = nullptr;
+	wgpu::Queue m_queue = nullptr;
+	wgpu::BindGroupLayout m_bindGroupLayout = nullptr;
+	wgpu::ComputePipeline m_pipeline = nullptr;
+	wgpu::Buffer m_paramBuffer = nullptr;
+
+	// Render a level of the scratch texture into an RG8Unorm or R8Unorm level
+	wgpu::BindGroupLayout m_renderBindGroupLayout = nullptr;
+	wgpu::RenderPipeline m_rg8Pipeline = nullptr;
+	wgpu::RenderPipeline m_r8Pipeline = nullptr;
+
+	// Bound to the outputs that a dispatch writing fewer levels leaves unused
+	std::array<wgpu::Texture, MaxLevelsPerDispatch - 1> m_unusedOutputs;
+	std::array<wgpu::TextureView, MaxLevelsPerDispatch - 1> m_unusedOutputViews;
+};
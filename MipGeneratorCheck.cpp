@@ -0,0 +1,330 @@
+// Check the mip chains built on the GPU by MipGenerator against the ones built
+// on the CPU by MipFilter. By default this runs on the software adapter of the
+// WebGPU implementation (SwiftShader, lavapipe, WARP...), so that it gives the
+// same answer on any machine. Built only with -DBUILD_GPU_CHECKS=ON.
+//
+// Usage: MipGeneratorCheck [--hardware] [image ...]
+// Without image, checks fourareen2K_albedo.jpg and generated images of even
+// and odd sizes. Each image is checked as an albedo, a normal map and a mask,
+// in the formats the loader creates for them (Loader::uncompressedFormat).
+// Returns 1 if a texel of a level differs by more than MaxDifference.
+
+#include "Loader.h"
+#include "Helper.h"
+#include "MipFilter.h"
+#include "MipGenerator.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+	// The CPU converts sRGB with lookup tables and the GPU with pow(), which
+	// round a few values differently, and a difference of one step in a level
+	// may carry over to the next ones.
+	constexpr int MaxDifference = 2;
+
+	struct Image {
+		std::string name;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		std::vector<unsigned char> pixels;
+	};
+
+	bool loadImage(const std::string& path, Image& image) {
+		int width, height, channels;
+		unsigned char* pixelData = stbi_load(path.c_str(), &width, &height, &channels, 4);
+		if (nullptr == pixelData) return false;
+		image.name = path;
+		image.width = static_cast<uint32_t>(width);
+		image.height = static_cast<uint32_t>(height);
+		image.pixels.assign(pixelData, pixelData + 4 * static_cast<size_t>(width) * height);
+		stbi_image_free(pixelData);
+		return true;
+	}
+
+	// Gradients with some noise, so that every rounding path gets exercised
+	Image generateImage(uint32_t width, uint32_t height) {
+		Image image;
+		image.name = "generated " + std::to_string(width) + "x" + std::to_string(height);
+		image.width = width;
+		image.height = height;
+		image.pixels.resize(4 * static_cast<size_t>(width) * height);
+		uint32_t seed = 12345;
+		for (uint32_t j = 0; j < height; ++j) {
+			for (uint32_t i = 0; i < width; ++i) {
+				seed = seed * 1664525u + 1013904223u;
+				unsigned char* p = &image.pixels[4 * (static_cast<size_t>(j) * width + i)];
+				p[0] = static_cast<unsigned char>(i * 255 / width);
+				p[1] = static_cast<unsigned char>(j * 255 / height);
+				p[2] = static_cast<unsigned char>(seed >> 24);
+				p[3] = static_cast<unsigned char>(seed >> 16);
+			}
+		}
+		return image;
+	}
+
+	const char* kindName(MipFilter::TextureKind kind) {
+		switch (kind) {
+		case MipFilter::TextureKind::Albedo: return "albedo";
+		case MipFilter::TextureKind::Normal: return "normal";
+		default: return "mask";
+		}
+	}
+
+	const char* formatName(TextureFormat format) {
+		switch (format) {
+		case TextureFormat::R8Unorm: return "r8";
+		case TextureFormat::RG8Unorm: return "rg8";
+		case TextureFormat::RGBA8UnormSrgb: return "rgba8 srgb";
+		default: return "rgba8";
+		}
+	}
+
+	uint32_t bytesPerTexel(TextureFormat format) {
+		switch (format) {
+		case TextureFormat::R8Unorm: return 1;
+		case TextureFormat::RG8Unorm: return 2;
+		default: return 4;
+		}
+	}
+
+	// Keep the first `texelBytes` channels of RGBA8 texels
+	std::vector<unsigned char> packTexels(const std::vector<unsigned char>& pixels, uint32_t texelBytes) {
+		std::vector<unsigned char> packed(pixels.size() / 4 * texelBytes);
+		for (size_t i = 0; i < pixels.size() / 4; ++i) {
+			std::memcpy(&packed[i * texelBytes], &pixels[4 * i], texelBytes);
+		}
+		return packed;
+	}
+
+	// Copy level `level` of `texture` back to the CPU, with tightly packed rows
+	std::vector<unsigned char> readLevel(Device device, Texture texture, uint32_t level, uint32_t width, uint32_t height, uint32_t texelBytes) {
+		// Rows of a texture to buffer copy are 256 bytes aligned
+		uint32_t bytesPerRow = (texelBytes * width + 255) / 256 * 256;
+
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = "Mip level readback";
+		bufferDesc.size = static_cast<uint64_t>(bytesPerRow) * height;
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::MapRead;
+		bufferDesc.mappedAtCreation = false;
+		Buffer buffer = device.createBuffer(bufferDesc);
+
+		ImageCopyTexture source;
+		source.texture = texture;
+		source.mipLevel = level;
+		source.origin = { 0, 0, 0 };
+		source.aspect = TextureAspect::All;
+
+		ImageCopyBuffer destination;
+		destination.buffer = buffer;
+		destination.layout.offset = 0;
+		destination.layout.bytesPerRow = bytesPerRow;
+		destination.layout.rowsPerImage = height;
+
+		CommandEncoderDescriptor encoderDesc = {};
+		encoderDesc.label = "Mip level readback";
+		CommandEncoder encoder = device.createCommandEncoder(encoderDesc);
+		encoder.copyTextureToBuffer(source, destination, { width, height, 1 });
+		CommandBufferDescriptor cmdBufferDescriptor = {};
+		CommandBuffer command = encoder.finish(cmdBufferDescriptor);
+		encoder.release();
+		Queue queue = device.getQueue();
+		queue.submit(1, &command);
+		command.release();
+		queue.release();
+
+		bool done = false;
+		bool success = false;
+		auto callbackHandle = buffer.mapAsync(MapMode::Read, 0, bufferDesc.size, [&](BufferMapAsyncStatus status) {
+			done = true;
+			success = status == BufferMapAsyncStatus::Success;
+			});
+		while (!done) {
+			Helper::wgpuPollEvents(device, true);
+		}
+
+		std::vector<unsigned char> pixels;
+		if (success) {
+			size_t rowBytes = static_cast<size_t>(texelBytes) * width;
+			pixels.resize(rowBytes * height);
+			const unsigned char* mapped = static_cast<const unsigned char*>(buffer.getConstMappedRange(0, bufferDesc.size));
+			for (uint32_t j = 0; j < height; ++j) {
+				std::memcpy(&pixels[j * rowBytes], mapped + static_cast<size_t>(j) * bytesPerRow, rowBytes);
+			}
+			buffer.unmap();
+		}
+		buffer.destroy();
+		buffer.release();
+		return pixels;
+	}
+
+	// Return false if a level differs too much
+	bool checkImage(Device device, MipGenerator& generator, const Image& image, MipFilter::TextureKind kind, TextureFormat format) {
+		uint32_t mipLevelCount = MipFilter::mipLevelCount(image.width, image.height);
+
+		// Reference levels, from the CPU
+		std::vector<std::vector<unsigned char>> expected(mipLevelCount);
+		MipFilter::ScratchArena scratch;
+		MipFilter::buildMipChain(image.pixels.data(), image.width, image.height, mipLevelCount, kind, scratch,
+			[&](uint32_t level, uint32_t width, uint32_t height, uint32_t firstRow, uint32_t rowCount, const unsigned char* rows) {
+				expected[level].resize(4 * static_cast<size_t>(width) * height);
+				std::memcpy(&expected[level][4 * static_cast<size_t>(firstRow) * width], rows, 4 * static_cast<size_t>(width) * rowCount);
+			});
+
+		// Same levels, from the GPU, with the usages the loader gives textures
+		// of this format
+		uint32_t texelBytes = bytesPerTexel(format);
+		TextureDescriptor textureDesc;
+		textureDesc.dimension = TextureDimension::_2D;
+		textureDesc.format = format;
+		textureDesc.size = { image.width, image.height, 1 };
+		textureDesc.mipLevelCount = mipLevelCount;
+		textureDesc.sampleCount = 1;
+		if (format == TextureFormat::RGBA8Unorm) {
+			textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::StorageBinding | TextureUsage::CopyDst | TextureUsage::CopySrc;
+		}
+		else if (format == TextureFormat::RGBA8UnormSrgb) {
+			textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst | TextureUsage::CopySrc;
+		}
+		else {
+			textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::RenderAttachment | TextureUsage::CopyDst | TextureUsage::CopySrc;
+		}
+		textureDesc.viewFormatCount = 0;
+		textureDesc.viewFormats = nullptr;
+		Texture texture = device.createTexture(textureDesc);
+
+		ImageCopyTexture destination;
+		destination.texture = texture;
+		destination.mipLevel = 0;
+		destination.origin = { 0, 0, 0 };
+		destination.aspect = TextureAspect::All;
+		TextureDataLayout source;
+		source.offset = 0;
+		source.bytesPerRow = texelBytes * image.width;
+		source.rowsPerImage = image.height;
+		std::vector<unsigned char> level0 = packTexels(image.pixels, texelBytes);
+		Queue queue = device.getQueue();
+		queue.writeTexture(destination, level0.data(), level0.size(), source, textureDesc.size);
+		queue.release();
+
+		generator.Generate(texture, textureDesc.size, mipLevelCount, kind, image.pixels.data());
+
+		bool success = true;
+		for (uint32_t level = 1; level < mipLevelCount; ++level) {
+			uint32_t width = MipFilter::mipLevelSize(image.width, level);
+			uint32_t height = MipFilter::mipLevelSize(image.height, level);
+			std::vector<unsigned char> actual = readLevel(device, texture, level, width, height, texelBytes);
+			expected[level] = packTexels(expected[level], texelBytes);
+			if (actual.size() != expected[level].size()) {
+				std::cout << "  level " << level << ": could not read back" << std::endl;
+				success = false;
+				continue;
+			}
+
+			int maxDifference = 0;
+			size_t differentCount = 0;
+			for (size_t k = 0; k < actual.size(); ++k) {
+				int difference = std::abs(static_cast<int>(actual[k]) - static_cast<int>(expected[level][k]));
+				maxDifference = std::max(maxDifference, difference);
+				if (difference != 0) ++differentCount;
+			}
+			if (maxDifference > MaxDifference) success = false;
+			std::cout << "  level " << level << " (" << width << "x" << height << "): max difference " << maxDifference
+				<< ", " << differentCount << " of " << actual.size() << " values differ"
+				<< (maxDifference > MaxDifference ? "  <-- FAILED" : "") << std::endl;
+		}
+
+		texture.destroy();
+		texture.release();
+		return success;
+	}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	bool hardware = false;
+	std::vector<Image> images;
+	for (int i = 1; i < argc; ++i) {
+		if (std::string(argv[i]) == "--hardware") {
+			hardware = true;
+			continue;
+		}
+		Image image;
+		if (!loadImage(argv[i], image)) {
+			std::cerr << "Could not load " << argv[i] << std::endl;
+			return 1;
+		}
+		images.push_back(std::move(image));
+	}
+	if (images.empty()) {
+		Image image;
+		if (loadImage(RESOURCE_DIR "/fourareen2K_albedo.jpg", image)) {
+			images.push_back(std::move(image));
+		}
+		images.push_back(generateImage(256, 256));
+		images.push_back(generateImage(255, 129));
+		images.push_back(generateImage(1000, 600));
+		images.push_back(generateImage(1, 37));
+	}
+
+	Instance instance = wgpuCreateInstance(nullptr);
+	RequestAdapterOptions adapterOpts = {};
+	adapterOpts.forceFallbackAdapter = !hardware;
+	Adapter adapter = instance.requestAdapter(adapterOpts);
+	if (adapter == nullptr) {
+		std::cerr << "No " << (hardware ? "hardware" : "software") << " adapter available" << std::endl;
+		return 1;
+	}
+	AdapterProperties properties = {};
+	adapter.getProperties(&properties);
+	std::cout << "Adapter: " << (properties.name ? properties.name : "unknown") << std::endl;
+
+	DeviceDescriptor deviceDesc = {};
+	deviceDesc.label = "Mip generation check";
+	deviceDesc.requiredFeatureCount = 0;
+	deviceDesc.requiredLimits = nullptr; // the defaults are enough
+	deviceDesc.defaultQueue.label = "The default queue";
+	Device device = adapter.requestDevice(deviceDesc);
+
+	bool deviceError = false;
+	auto errorCallbackHandle = device.setUncapturedErrorCallback([&](ErrorType type, char const* message) {
+		std::cout << "Uncaptured device error: type " << type;
+		if (message) std::cout << " (" << message << ")";
+		std::cout << std::endl;
+		deviceError = true;
+		});
+
+	MipGenerator generator;
+	if (!generator.Init(device)) {
+		std::cerr << "Could not create the mip generation pipeline" << std::endl;
+		return 1;
+	}
+
+	bool success = true;
+	const MipFilter::TextureKind kinds[] = { MipFilter::TextureKind::Albedo, MipFilter::TextureKind::Normal, MipFilter::TextureKind::Mask };
+	for (const Image& image : images) {
+		for (MipFilter::TextureKind kind : kinds) {
+			// Masks are single channel when the image is
+			std::vector<TextureFormat> formats = { Loader::uncompressedFormat(kind, 4) };
+			if (kind == MipFilter::TextureKind::Mask) formats.push_back(Loader::uncompressedFormat(kind, 1));
+			for (TextureFormat format : formats) {
+				std::cout << image.name << " (" << image.width << "x" << image.height << ") as " << kindName(kind)
+					<< " in " << formatName(format) << ":" << std::endl;
+				success = checkImage(device, generator, image, kind, format) && success;
+			}
+		}
+	}
+	success = success && !deviceError;
+
+	generator.Terminate();
+	device.release();
+	adapter.release();
+	instance.release();
+
+	std::cout << (success ? "GPU and CPU mip chains match" : "GPU and CPU mip chains differ") << std::endl;
+	return success ? 0 : 1;
+}
@@ -0,0 +1,649 @@
+#include "PointCloud.h"
+
+#include "AsyncFileReader.h"
+#include "Frustum.h"
+#include "Loader.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <queue>
+
+using namespace wgpu;
+namespace fs = std::filesystem;
+
+namespace {
+	constexpr uint32_t HierarchyMagic = 0x544F4350; // "PCOT"
+	constexpr uint32_t HierarchyVersion = 1;
+
+	// Cells per axis of the grid used to pick the points kept by a node
+	constexpr uint32_t SamplingGridSize = 128;
+	// Past this depth, nodes keep all their points (e.g. many duplicates)
+	constexpr uint32_t MaxDepth = 20;
+	// The first pass splits the cloud in chunks of about this many points,
+	// each small enough to build its sub-octree in memory.
+	constexpr uint64_t TargetChunkPoints = 4000000;
+	constexpr uint32_t MaxChunkLevel = 4;
+	// Points buffered per chunk before they are appended to the chunk file
+	constexpr size_t ChunkFlushPoints = 8192;
+
+	using Point = PointCloud::Point;
+
+	uint32_t packColor(double r, double g, double b) {
+		auto toByte = [](double c) { return static_cast<uint32_t>(std::clamp(c, 0.0, 1.0) * 255.0 + 0.5); };
+		return toByte(r) | (toByte(g) << 8) | (toByte(b) << 16) | (255u << 24);
+	}
+
+	fs::path nodeFilePath(const fs::path& cacheDir, const std::string& name) {
+		return cacheDir / "nodes" / (name + ".bin");
+	}
+
+	bool readPoints(const fs::path& path, std::vector<Point>& points) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) return false;
+		file.seekg(0, std::ios::end);
+		size_t size = file.tellg();
+		file.seekg(0);
+		points.resize(size / sizeof(Point));
+		file.read(reinterpret_cast<char*>(points.data()), points.size() * sizeof(Point));
+		return static_cast<bool>(file);
+	}
+
+	bool writePoints(const fs::path& path, const std::vector<Point>& points, bool append = false) {
+		std::ofstream file(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+		file.write(reinterpret_cast<const char*>(points.data()), points.size() * sizeof(Point));
+		return static_cast<bool>(file);
+	}
+
+	int childIndex(const glm::vec3& position, const glm::vec3& center) {
+		return (position.x >= center.x ? 1 : 0)
+			| (position.y >= center.y ? 2 : 0)
+			| (position.z >= center.z ? 4 : 0);
+	}
+
+	glm::vec3 childMin(const glm::vec3& min, float size, int child) {
+		float half = 0.5f * size;
+		return min + glm::vec3(child & 1 ? half : 0, child & 2 ? half : 0, child & 4 ? half : 0);
+	}
+
+	// Marks the cells of a node-sized sampling grid that already hold a point.
+	class SamplingGrid {
+	public:
+		SamplingGrid(const glm::vec3& min, float size)
+			: m_min(min)
+			, m_cellsPerUnit(SamplingGridSize / size)
+			, m_occupied(SamplingGridSize * SamplingGridSize * SamplingGridSize, false)
+		{}
+
+		// Return true if the point is the first one in its cell
+		bool TryInsert(const glm::vec3& position) {
+			glm::uvec3 cell = glm::uvec3(glm::clamp((position - m_min) * m_cellsPerUnit, glm::vec3(0.0f), glm::vec3(SamplingGridSize - 1)));
+			size_t index = (cell.z * SamplingGridSize + cell.y) * SamplingGridSize + cell.x;
+			if (m_occupied[index]) return false;
+			m_occupied[index] = true;
+			return true;
+		}
+
+	private:
+		glm::vec3 m_min;
+		float m_cellsPerUnit;
+		std::vector<bool> m_occupied;
+	};
+
+	// Order in which `count` points are offered to a SamplingGrid: a stride
+	// through the whole list rather than its order, as files are often
+	// sorted (by scan line, by tile...) and the point budget of a node would
+	// otherwise fill up with the points listed first, in one corner of it
+	std::vector<size_t> scatteredOrder(size_t count) {
+		std::vector<size_t> order(count);
+		if (count == 0) return order;
+		// Close to the golden ratio of the count, and coprime with it so
+		// every index is visited once
+		size_t stride = static_cast<size_t>(count * 0.618) | 1;
+		while (std::gcd(stride, count) != 1) stride += 2;
+		size_t index = 0;
+		for (size_t& next : order) {
+			next = index;
+			index = (index + stride) % count;
+		}
+		return order;
+	}
+
+	// Node of the octree while it is being cooked
+	struct CookNode {
+		std::string name;
+		glm::vec3 min;
+		float size;
+		uint32_t level;
+		uint32_t pointCount = 0;
+		std::array<std::unique_ptr<CookNode>, 8> children;
+	};
+
+	CookNode* getOrCreateChild(CookNode& node, int child) {
+		if (!node.children[child]) {
+			auto created = std::make_unique<CookNode>();
+			created->name = node.name + char('0' + child);
+			created->min = childMin(node.min, node.size, child);
+			created->size = 0.5f * node.size;
+			created->level = node.level + 1;
+			node.children[child] = std::move(created);
+		}
+		return node.children[child].get();
+	}
+
+	// Keep a subsample of `points` in `node` and recursively hand the rest to
+	// its children, writing one file per node. False if a file could not be
+	// written.
+	bool buildSubtree(CookNode& node, std::vector<Point>&& points, uint32_t maxNodePoints, const fs::path& cacheDir) {
+		if (points.size() <= maxNodePoints || node.level >= MaxDepth) {
+			node.pointCount = static_cast<uint32_t>(points.size());
+			return writePoints(nodeFilePath(cacheDir, node.name), points);
+		}
+
+		SamplingGrid grid(node.min, node.size);
+		glm::vec3 center = node.min + 0.5f * node.size;
+		std::vector<Point> kept;
+		std::array<std::vector<Point>, 8> childPoints;
+		for (size_t index : scatteredOrder(points.size())) {
+			const Point& point = points[index];
+			if (kept.size() < maxNodePoints && grid.TryInsert(point.position)) {
+				kept.push_back(point);
+			}
+			else {
+				childPoints[childIndex(point.position, center)].push_back(point);
+			}
+		}
+		points = {};
+
+		node.pointCount = static_cast<uint32_t>(kept.size());
+		bool written = writePoints(nodeFilePath(cacheDir, node.name), kept);
+
+		for (int child = 0; child < 8; ++child) {
+			if (childPoints[child].empty()) continue;
+			written = buildSubtree(*getOrCreateChild(node, child), std::move(childPoints[child]), maxNodePoints, cacheDir) && written;
+		}
+		return written;
+	}
+
+	// Fill a node above the chunk level by pulling a subsample up from its
+	// children, which have been built already. False if a file could not be
+	// read or written.
+	bool pullUpFromChildren(CookNode& node, uint32_t maxNodePoints, const fs::path& cacheDir) {
+		std::array<std::vector<Point>, 8> childPoints;
+		std::array<std::vector<size_t>, 8> childOrders;
+		std::array<std::vector<bool>, 8> pulledUp;
+		size_t mostPoints = 0;
+		for (int child = 0; child < 8; ++child) {
+			if (!node.children[child]) continue;
+			if (!readPoints(nodeFilePath(cacheDir, node.children[child]->name), childPoints[child])) return false;
+			childOrders[child] = scatteredOrder(childPoints[child].size());
+			pulledUp[child].assign(childPoints[child].size(), false);
+			mostPoints = std::max(mostPoints, childPoints[child].size());
+		}
+
+		// Children take turns, so that when the budget runs out all the
+		// octants of the node are covered, not just the first ones
+		SamplingGrid grid(node.min, node.size);
+		std::vector<Point> kept;
+		for (size_t turn = 0; turn < mostPoints && kept.size() < maxNodePoints; ++turn) {
+			for (int child = 0; child < 8 && kept.size() < maxNodePoints; ++child) {
+				if (turn >= childOrders[child].size()) continue;
+				size_t index = childOrders[child][turn];
+				if (grid.TryInsert(childPoints[child][index].position)) {
+					kept.push_back(childPoints[child][index]);
+					pulledUp[child][index] = true;
+				}
+			}
+		}
+
+		for (int child = 0; child < 8; ++child) {
+			if (!node.children[child]) continue;
+			std::vector<Point> remaining;
+			remaining.reserve(childPoints[child].size());
+			for (size_t i = 0; i < childPoints[child].size(); ++i) {
+				if (!pulledUp[child][i]) remaining.push_back(childPoints[child][i]);
+			}
+			node.children[child]->pointCount = static_cast<uint32_t>(remaining.size());
+			if (!writePoints(nodeFilePath(cacheDir, node.children[child]->name), remaining)) return false;
+		}
+
+		node.pointCount = static_cast<uint32_t>(kept.size());
+		return writePoints(nodeFilePath(cacheDir, node.name), kept);
+	}
+
+	bool pullUpRecursive(CookNode& node, uint32_t chunkLevel, uint32_t maxNodePoints, const fs::path& cacheDir) {
+		if (node.level >= chunkLevel) return true;
+		for (auto& child : node.children) {
+			if (child && !pullUpRecursive(*child, chunkLevel, maxNodePoints, cacheDir)) return false;
+		}
+		return pullUpFromChildren(node, maxNodePoints, cacheDir);
+	}
+} // namespace
+
+bool PointCloud::Cook(const fs::path& sourcePath, const fs::path& cacheDir, uint32_t maxNodePoints)
+{
+	// Pass 1: bounds of the cloud
+	glm::dvec3 boundsMin(std::numeric_limits<double>::max());
+	glm::dvec3 boundsMax(std::numeric_limits<double>::lowest());
+	uint64_t pointCount = 0;
+	bool success = Loader::forEachPoint(sourcePath, 3, [&](const double* values) {
+		glm::dvec3 position(values[0], values[1], values[2]);
+		boundsMin = glm::min(boundsMin, position);
+		boundsMax = glm::max(boundsMax, position);
+		++pointCount;
+	});
+	if (!success || pointCount == 0) {
+		std::cerr << "Could not read point cloud " << sourcePath << std::endl;
+		return false;
+	}
+
+	std::error_code error;
+	fs::remove_all(cacheDir, error);
+	fs::create_directories(cacheDir / "nodes");
+	fs::create_directories(cacheDir / "chunks");
+
+	glm::dvec3 origin = boundsMin;
+	glm::dvec3 extent = boundsMax - boundsMin;
+	// Slightly enlarged so that points on the max faces fall inside
+	float rootSize = static_cast<float>(std::max({ extent.x, extent.y, extent.z, 1e-6 }) * 1.0001);
+
+	// Pass 2: distribute points in a grid of chunks at `chunkLevel`
+	uint32_t chunkLevel = 0;
+	while (chunkLevel < MaxChunkLevel && (pointCount >> (3 * chunkLevel)) > TargetChunkPoints) {
+		++chunkLevel;
+	}
+	uint32_t chunksPerAxis = 1u << chunkLevel;
+	float chunkSize = rootSize / chunksPerAxis;
+
+	auto chunkFilePath = [&](size_t chunk) { return cacheDir / "chunks" / (std::to_string(chunk) + ".bin"); };
+	std::vector<std::vector<Point>> chunkBuffers(chunksPerAxis * chunksPerAxis * chunksPerAxis);
+	std::vector<uint64_t> chunkCounts(chunkBuffers.size(), 0);
+	bool written = true;
+	Loader::forEachPoint(sourcePath, 3, [&](const double* values) {
+		Point point;
+		point.position = glm::vec3(glm::dvec3(values[0], values[1], values[2]) - origin);
+		point.color = packColor(values[3], values[4], values[5]);
+
+		glm::uvec3 cell = glm::min(glm::uvec3(point.position / chunkSize), glm::uvec3(chunksPerAxis - 1));
+		size_t chunk = (cell.z * chunksPerAxis + cell.y) * chunksPerAxis + cell.x;
+		chunkBuffers[chunk].push_back(point);
+		++chunkCounts[chunk];
+		if (chunkBuffers[chunk].size() >= ChunkFlushPoints) {
+			written = writePoints(chunkFilePath(chunk), chunkBuffers[chunk], true /* append */) && written;
+			chunkBuffers[chunk].clear();
+		}
+	});
+
+	// Create the top of the tree down to the non-empty chunks
+	CookNode root;
+	root.name = "r";
+	root.min = glm::vec3(0.0f);
+	root.size = rootSize;
+	root.level = 0;
+
+	std::vector<std::pair<size_t, CookNode*>> chunkNodes;
+	for (size_t chunk = 0; chunk < chunkBuffers.size(); ++chunk) {
+		if (chunkCounts[chunk] == 0) continue;
+		written = writePoints(chunkFilePath(chunk), chunkBuffers[chunk], true /* append */) && written;
+		chunkBuffers[chunk] = {};
+
+		uint32_t x = chunk % chunksPerAxis;
+		uint32_t y = (chunk / chunksPerAxis) % chunksPerAxis;
+		uint32_t z = chunk / (chunksPerAxis * chunksPerAxis);
+		CookNode* node = &root;
+		for (uint32_t level = 0; level < chunkLevel; ++level) {
+			uint32_t shift = chunkLevel - 1 - level;
+			int child = ((x >> shift) & 1) | (((y >> shift) & 1) << 1) | (((z >> shift) & 1) << 2);
+			node = getOrCreateChild(*node, child);
+		}
+		chunkNodes.emplace_back(chunk, node);
+	}
+
+	// Pass 3: build the sub-octree of each chunk in parallel
+	std::atomic<bool> subtreesWritten{ written };
+	ThreadPool::Shared().ParallelFor(0, chunkNodes.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			std::vector<Point> points;
+			if (!readPoints(chunkFilePath(chunkNodes[i].first), points)
+				|| !buildSubtree(*chunkNodes[i].second, std::move(points), maxNodePoints, cacheDir)) {
+				subtreesWritten = false;
+			}
+		}
+	});
+	fs::remove_all(cacheDir / "chunks", error);
+
+	// Pass 4: fill the levels above the chunks with subsamples of their children
+	if (!subtreesWritten || !pullUpRecursive(root, chunkLevel, maxNodePoints, cacheDir)) {
+		std::cerr << "Could not write the nodes of point cloud " << sourcePath << " to " << cacheDir << std::endl;
+		return false;
+	}
+
+	// Flatten the tree breadth first, so that parents come before children
+	std::vector<const CookNode*> ordered = { &root };
+	for (size_t i = 0; i < ordered.size(); ++i) {
+		for (const auto& child : ordered[i]->children) {
+			if (child) ordered.push_back(child.get());
+		}
+	}
+
+	// Written aside then renamed, so that an interrupted cook does not leave
+	// a hierarchy that IsCooked() accepts
+	fs::path hierarchyPath = cacheDir / "hierarchy.bin";
+	fs::path partialPath = fs::path(hierarchyPath).concat(".partial");
+	std::ofstream file(partialPath, std::ios::binary);
+	uint32_t header[3] = { HierarchyMagic, HierarchyVersion, static_cast<uint32_t>(ordered.size()) };
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(&origin), sizeof(origin));
+
+	int32_t nextChildIndex = 1;
+	for (const CookNode* node : ordered) {
+		uint8_t nameLength = static_cast<uint8_t>(node->name.size());
+		file.write(reinterpret_cast<const char*>(&nameLength), sizeof(nameLength));
+		file.write(node->name.data(), nameLength);
+		file.write(reinterpret_cast<const char*>(&node->min), sizeof(node->min));
+		file.write(reinterpret_cast<const char*>(&node->size), sizeof(node->size));
+		file.write(reinterpret_cast<const char*>(&node->pointCount), sizeof(node->pointCount));
+
+		std::array<int32_t, 8> children;
+		for (int child = 0; child < 8; ++child) {
+			children[child] = node->children[child] ? nextChildIndex++ : -1;
+		}
+		file.write(reinterpret_cast<const char*>(children.data()), sizeof(children));
+	}
+	file.close();
+	if (!file) {
+		std::cerr << "Could not write " << partialPath << std::endl;
+		return false;
+	}
+	fs::rename(partialPath, hierarchyPath, error);
+	if (error) {
+		std::cerr << "Could not write " << hierarchyPath << std::endl;
+		return false;
+	}
+
+	std::cout << "Cooked point cloud " << sourcePath << ": " << pointCount << " points in " << ordered.size() << " nodes" << std::endl;
+	return true;
+}
+
+bool PointCloud::IsCooked(const fs::path& cacheDir)
+{
+	return fs::exists(cacheDir / "hierarchy.bin");
+}
+
+bool PointCloud::Open(const fs::path& cacheDir, Device device)
+{
+	std::ifstream file(cacheDir / "hierarchy.bin", std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	uint32_t header[3];
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	if (!file || header[0] != HierarchyMagic || header[1] != HierarchyVersion) {
+		std::cerr << "Invalid point cloud hierarchy in " << cacheDir << std::endl;
+		return false;
+	}
+	file.read(reinterpret_cast<char*>(&m_origin), sizeof(m_origin));
+
+	m_hierarchy.resize(header[2]);
+	for (NodeInfo& node : m_hierarchy) {
+		uint8_t nameLength = 0;
+		file.read(reinterpret_cast<char*>(&nameLength), sizeof(nameLength));
+		node.name.resize(nameLength);
+		file.read(node.name.data(), nameLength);
+		file.read(reinterpret_cast<char*>(&node.min), sizeof(node.min));
+		file.read(reinterpret_cast<char*>(&node.size), sizeof(node.size));
+		file.read(reinterpret_cast<char*>(&node.pointCount), sizeof(node.pointCount));
+		file.read(reinterpret_cast<char*>(node.children.data()), sizeof(node.children));
+	}
+	if (!file) {
+		std::cerr << "Truncated point cloud hierarchy in " << cacheDir << std::endl;
+		m_hierarchy.clear();
+		return false;
+	}
+
+	m_cacheDir = cacheDir;
+	m_device = device;
+	if (m_queue) m_queue.release();
+	m_queue = device.getQueue();
+	m_nodeStates = std::vector<NodeState>(m_hierarchy.size());
+	return true;
+}
+
+void PointCloud::Update(const glm::mat4x4& viewMatrix, const glm::mat4x4& projectionMatrix, glm::vec2 viewportSize)
+{
+	if (!IsOpen()) return;
+	++m_frame;
+
+	CollectLoadedNodes();
+
+	// Pick up the result of the previous traversal and start the next one
+	if (m_pendingTraversal.valid() && m_pendingTraversal.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+		m_visibleNodes = m_pendingTraversal.get();
+	}
+	if (!m_pendingTraversal.valid()) {
+		TraversalInput input;
+		input.modelView = viewMatrix * GetModelMatrix();
+		input.modelViewProjection = projectionMatrix * input.modelView;
+		// Projected size in pixels of a unit sized object at unit distance
+		input.pixelsPerUnitAtUnitDistance = projectionMatrix[1][1] * 0.5f * viewportSize.y;
+		input.settings = m_settings;
+
+		const std::vector<NodeInfo>* hierarchy = &m_hierarchy;
+		m_pendingTraversal = ThreadPool::Shared().Submit([hierarchy, input]() {
+			return Traverse(*hierarchy, input);
+		});
+	}
+
+	m_stats.visibleNodes = 0;
+	m_stats.visiblePoints = 0;
+	for (uint32_t index : m_visibleNodes) {
+		m_nodeStates[index].lastVisibleFrame = m_frame;
+		if (m_nodeStates[index].residency == Residency::Resident) {
+			++m_stats.visibleNodes;
+			m_stats.visiblePoints += m_nodeStates[index].pointCount;
+		}
+	}
+
+	RequestLoads();
+	EvictNodes();
+}
+
+void PointCloud::Draw(RenderPassEncoder renderPass, RenderMode mode) const
+{
+	for (uint32_t index : m_visibleNodes) {
+		const NodeState& state = m_nodeStates[index];
+		uint32_t pointCount = state.pointCount;
+		if (state.residency != Residency::Resident || pointCount == 0) continue;
+
+		renderPass.setVertexBuffer(0, state.vertexBuffer, 0, pointCount * sizeof(Point));
+		if (mode == RenderMode::Points) {
+			renderPass.draw(pointCount, 1, 0, 0);
+		}
+		else {
+			// Each point is an instance of a 2-triangle quad
+			renderPass.draw(6, pointCount, 0, 0);
+		}
+	}
+}
+
+void PointCloud::Terminate()
+{
+	if (m_pendingTraversal.valid()) m_pendingTraversal.wait();
+	for (NodeState& state : m_nodeStates) {
+		if (state.pendingPoints.valid()) state.pendingPoints.wait();
+		if (state.vertexBuffer) {
+			state.vertexBuffer.destroy();
+			state.vertexBuffer.release();
+		}
+	}
+	m_nodeStates.clear();
+	m_hierarchy.clear();
+	m_visibleNodes.clear();
+	if (m_queue) m_queue.release();
+	m_queue = nullptr;
+}
+
+glm::mat4x4 PointCloud::GetModelMatrix() const
+{
+	// Points are stored relative to the min corner of the root; center the
+	// cloud horizontally on the scene origin and put its bottom at z = 0.
+	if (!IsOpen()) return glm::mat4x4(1.0f);
+	const NodeInfo& root = m_hierarchy[0];
+	glm::vec3 pivot = root.min + glm::vec3(0.5f * root.size, 0.5f * root.size, 0.0f);
+	return glm::scale(glm::mat4x4(1.0f), glm::vec3(m_settings.scale)) * glm::translate(glm::mat4x4(1.0f), -pivot);
+}
+
+std::vector<uint32_t> PointCloud::Traverse(const std::vector<NodeInfo>& hierarchy, const TraversalInput& input)
+{
+	Frustum frustum(input.modelViewProjection);
+
+	// Visit the nodes from the largest on screen to the smallest
+	using Candidate = std::pair<float, uint32_t>; // projected size, node index
+	std::priority_queue<Candidate> candidates;
+	candidates.emplace(std::numeric_limits<float>::max(), 0);
+
+	std::vector<uint32_t> visible;
+	uint64_t pointCount = 0;
+	while (!candidates.empty()) {
+		auto [screenSize, index] = candidates.top();
+		candidates.pop();
+
+		const NodeInfo& node = hierarchy[index];
+		if (pointCount + node.pointCount > input.settings.pointBudget) break;
+		visible.push_back(index);
+		pointCount += node.pointCount;
+
+		if (screenSize < input.settings.minNodeScreenSize) continue;
+
+		for (int32_t childIndex : node.children) {
+			if (childIndex < 0) continue;
+			const NodeInfo& child = hierarchy[childIndex];
+			glm::vec3 center = child.min + 0.5f * child.size;
+			float radius = 0.5f * std::sqrt(3.0f) * child.size;
+			if (!frustum.IntersectsSphere(center, radius)) continue;
+
+			float distance = glm::length(glm::vec3(input.modelView * glm::vec4(center, 1.0f)));
+			float childScreenSize = distance > radius
+				? radius / distance * input.pixelsPerUnitAtUnitDistance
+				: std::numeric_limits<float>::max(); // camera is inside the node
+			candidates.emplace(childScreenSize, static_cast<uint32_t>(childIndex));
+		}
+	}
+
+	return visible;
+}
+
+void PointCloud::CollectLoadedNodes()
+{
+	uint32_t uploads = 0;
+	for (size_t index = 0; index < m_nodeStates.size() && uploads < m_settings.maxUploadsPerFrame; ++index) {
+		NodeState& state = m_nodeStates[index];
+		if (state.residency != Residency::Loading) continue;
+		if (state.pendingPoints.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+
+		std::vector<Point> points = state.pendingPoints.get();
+		--m_stats.pendingLoads;
+		if (points.size() < m_hierarchy[index].pointCount) {
+			// The read failed or the file is truncated: never drawn nor
+			// requested again
+			state.residency = Residency::Failed;
+			continue;
+		}
+		points.resize(m_hierarchy[index].pointCount);
+		if (!points.empty()) {
+			BufferDescriptor bufferDesc;
+			bufferDesc.label = m_hierarchy[index].name.c_str();
+			bufferDesc.size = points.size() * sizeof(Point);
+			bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Vertex;
+			bufferDesc.mappedAtCreation = false;
+			state.vertexBuffer = m_device.createBuffer(bufferDesc);
+			m_queue.writeBuffer(state.vertexBuffer, 0, points.data(), bufferDesc.size);
+			++uploads;
+		}
+
+		state.residency = Residency::Resident;
+		state.pointCount = static_cast<uint32_t>(points.size());
+		++m_stats.residentNodes;
+		m_stats.residentPoints += state.pointCount;
+	}
+}
+
+void PointCloud::RequestLoads()
+{
+	// Visible nodes are sorted coarsest first, which is also the load priority.
+	// The node files of a frame are submitted together so that their reads
+	// overlap.
+	std::vector<AsyncFileReader::Request> requests;
+	for (uint32_t index : m_visibleNodes) {
+		if (m_stats.pendingLoads >= m_settings.maxConcurrentLoads) break;
+
+		NodeState& state = m_nodeStates[index];
+		if (state.residency != Residency::Unloaded) continue;
+
+		auto promise = std::make_shared<std::promise<std::vector<Point>>>();
+		state.pendingPoints = promise->get_future();
+
+		AsyncFileReader::Request request;
+		request.path = nodeFilePath(m_cacheDir, m_hierarchy[index].name);
+		request.onComplete = [promise](AsyncFileReader::ReadResult&& result) {
+			std::vector<Point> points;
+			if (result.success) {
+				points.resize(result.bytes.size() / sizeof(Point));
+				std::memcpy(points.data(), result.bytes.data(), points.size() * sizeof(Point));
+			}
+			else {
+				std::cerr << "Could not load point cloud node " << result.path << std::endl;
+			}
+			promise->set_value(std::move(points));
+		};
+		requests.push_back(std::move(request));
+
+		state.residency = Residency::Loading;
+		++m_stats.pendingLoads;
+	}
+	if (!requests.empty()) {
+		AsyncFileReader::Shared().ReadBatch(std::move(requests));
+	}
+}
+
+void PointCloud::EvictNodes()
+{
+	// Keep a cache of up to twice the budget so that small camera moves do not
+	// cause reloads, then drop the nodes that have been invisible the longest.
+	uint64_t cacheBudget = 2 * static_cast<uint64_t>(m_settings.pointBudget);
+	if (m_stats.residentPoints <= cacheBudget) return;
+
+	std::vector<uint32_t> evictable;
+	for (uint32_t index = 0; index < m_nodeStates.size(); ++index) {
+		const NodeState& state = m_nodeStates[index];
+		if (state.residency == Residency::Resident && state.lastVisibleFrame != m_frame) {
+			evictable.push_back(index);
+		}
+	}
+	std::sort(evictable.begin(), evictable.end(), [this](uint32_t a, uint32_t b) {
+		return m_nodeStates[a].lastVisibleFrame < m_nodeStates[b].lastVisibleFrame;
+	});
+
+	for (uint32_t index : evictable) {
+		if (m_stats.residentPoints <= cacheBudget) break;
+		NodeState& state = m_nodeStates[index];
+		if (state.vertexBuffer) {
+			state.vertexBuffer.destroy();
+			state.vertexBuffer.release();
+			state.vertexBuffer = nullptr;
+		}
+		state.residency = Residency::Unloaded;
+		--m_stats.residentNodes;
+		m_stats.residentPoints -= state.pointCount;
+		state.pointCount = 0;
+	}
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/glm.hpp> // all types inspired from GLSL
+#include <glm/ext.hpp>
+
+#include <array>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <vector>
+
+// Out-of-core point cloud organized as an octree of point chunks, in the
+// spirit of Potree. Each node stores a spatially uniform subsample of the
+// points below it, so drawing the nodes picked by a screen-space traversal
+// gives a level of detail that stays within a fixed point budget.
+//
+// A `[points]` file (x y z r g b, see Loader::loadGeometry) is first cooked
+// into a cache directory holding the hierarchy and one file per node. Only
+// the nodes selected by the traversal are ever loaded in memory.
+class PointCloud {
+public:
+	// One point as stored on disk and in the GPU vertex buffers
+	struct Point {
+		glm::vec3 position; // relative to the octree origin
+		uint32_t color; // RGBA8, read as VertexFormat::Unorm8x4
+	};
+	static_assert(sizeof(Point) == 16);
+
+	enum class RenderMode {
+		Points, // one pixel per point (PointList topology)
+		Splats, // one screen-aligned disc per point (instanced quads)
+	};
+
+	struct Settings {
+		// Maximum number of points drawn per frame
+		uint32_t pointBudget = 3000000;
+		// Nodes whose projection is smaller than this (in pixels) are not refined
+		float minNodeScreenSize = 150.0f;
+		// Node files read in parallel on the worker threads
+		uint32_t maxConcurrentLoads = 8;
+		// Nodes uploaded to the GPU per frame, to avoid hitches
+		uint32_t maxUploadsPerFrame = 16;
+		// Scene units per point cloud unit
+		float scale = 1.0f;
+	};
+
+	// Uniforms of point_cloud.wgsl, next to the shared MyUniforms
+	struct Uniforms {
+		glm::mat4x4 modelMatrix;
+		glm::vec2 viewportSize;
+		float pointSize = 2.0f; // splat diameter, in pixels
+		float _pad[1];
+	};
+	static_assert(sizeof(Uniforms) % 16 == 0);
+
+	struct Stats {
+		uint32_t visibleNodes = 0;
+		uint64_t visiblePoints = 0;
+		uint32_t residentNodes = 0;
+		uint64_t residentPoints = 0;
+		uint32_t pendingLoads = 0;
+	};
+
+	// Build the octree cache for a `[points]` file. Runs in a few streaming
+	// passes over the source, so it does not need to fit in memory.
+	static bool Cook(const std::filesystem::path& sourcePath, const std::filesystem::path& cacheDir, uint32_t maxNodePoints = 20000);
+	static bool IsCooked(const std::filesystem::path& cacheDir);
+
+	bool Open(const std::filesystem::path& cacheDir, wgpu::Device device);
+
+	// Consume finished traversals and loads, and kick the next ones.
+	void Update(const glm::mat4x4& viewMatrix, const glm::mat4x4& projectionMatrix, glm::vec2 viewportSize);
+
+	// Issue the draw calls of the resident visible nodes. The pipeline matching
+	// `mode` must be set on the render pass.
+	void Draw(wgpu::RenderPassEncoder renderPass, RenderMode mode) const;
+
+	void Terminate();
+
+	bool IsOpen() const { return !m_hierarchy.empty(); }
+	glm::mat4x4 GetModelMatrix() const;
+	Settings& GetSettings() { return m_settings; }
+	const Stats& GetStats() const { return m_stats; }
+
+private:
+	// Persistent description of a node, as stored in the hierarchy file
+	struct NodeInfo {
+		std::string name; // "r" followed by the child index at each level
+		glm::vec3 min;
+		float size; // nodes are cubes
+		uint32_t pointCount = 0;
+		std::array<int32_t, 8> children; // -1 when absent
+	};
+
+	enum class Residency {
+		Unloaded,
+		Loading,
+		Resident,
+		Failed, // the node file could not be read, or is shorter than pointCount
+	};
+
+	struct NodeState {
+		Residency residency = Residency::Unloaded;
+		std::future<std::vector<Point>> pendingPoints;
+		wgpu::Buffer vertexBuffer = nullptr;
+		// Points in vertexBuffer, counted in Stats::residentPoints while resident
+		uint32_t pointCount = 0;
+		uint64_t lastVisibleFrame = 0;
+	};
+
+	// Camera snapshot handed to a traversal job
+	struct TraversalInput {
+		glm::mat4x4 modelView;
+		glm::mat4x4 modelViewProjection;
+		float pixelsPerUnitAtUnitDistance;
+		Settings settings;
+	};
+
+	static std::vector<uint32_t> Traverse(const std::vector<NodeInfo>& hierarchy, const TraversalInput& input);
+
+	void CollectLoadedNodes();
+	void RequestLoads();
+	void EvictNodes();
+
+private:
+	std::filesystem::path m_cacheDir;
+	wgpu::Device m_device = nullptr;
+	wgpu::Queue m_queue = nullptr;
+	Settings m_settings;
+	Stats m_stats;
+
+	glm::dvec3 m_origin = glm::dvec3(0.0);
+	std::vector<NodeInfo> m_hierarchy;
+	std::vector<NodeState> m_nodeStates;
+
+	// Nodes picked by the last finished traversal, coarsest first
+	std::vector<uint32_t> m_visibleNodes;
+	std::future<std::vector<uint32_t>> m_pendingTraversal;
+	uint64_t m_frame = 0;
+};
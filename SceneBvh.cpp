@@ -0,0 +1,655 @@
+#include "SceneBvh.h"
+#include "Frustum.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+namespace {
+	using Bounds = SceneBvh::Bounds;
+
+	// Candidate splits are the boundaries between bins of equal width along
+	// the centroids of the objects of a node
+	constexpr uint32_t BinCount = 16;
+	// Nodes of at most LeafSize objects are always leaves, those of more than
+	// MaxLeafSize never are, in between the SAH decides
+	constexpr uint32_t LeafSize = 4;
+	constexpr uint32_t MaxLeafSize = 16;
+	// Relative costs of visiting a node and of testing an object
+	constexpr float TraversalCost = 1.0f;
+	constexpr float IntersectionCost = 1.0f;
+	// Nodes of more objects than this are binned on the worker threads, by
+	// chunks of BinningGrain objects
+	constexpr uint32_t ParallelBinningSize = 1 << 14;
+	constexpr uint32_t BinningGrain = 1 << 13;
+	// Nodes of at most this many objects are built as a whole on one thread
+	constexpr uint32_t SubtreeSize = 1 << 12;
+	// Leaves refit per chunk on the worker threads
+	constexpr uint32_t RefitGrain = 1 << 10;
+	// Refits that make the SAH cost this many times higher ask for a rebuild
+	constexpr float RebuildCostRatio = 1.5f;
+
+	bool isFinite(const Bounds& bounds) {
+		for (int axis = 0; axis < 3; ++axis) {
+			if (!std::isfinite(bounds.min[axis]) || !std::isfinite(bounds.max[axis]) || bounds.min[axis] > bounds.max[axis]) return false;
+		}
+		return true;
+	}
+
+	void grow(Bounds& bounds, const glm::vec3& point) {
+		bounds.min = glm::min(bounds.min, point);
+		bounds.max = glm::max(bounds.max, point);
+	}
+
+	void grow(Bounds& bounds, const Bounds& other) {
+		bounds.min = glm::min(bounds.min, other.min);
+		bounds.max = glm::max(bounds.max, other.max);
+	}
+
+	// Half the surface area, to which the probability of a ray hitting the
+	// box is proportional
+	float halfArea(const Bounds& bounds) {
+		glm::vec3 size = bounds.max - bounds.min;
+		if (size.x < 0.0f || size.y < 0.0f || size.z < 0.0f) return 0.0f;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	struct Bin {
+		Bounds bounds; // of the objects
+		uint32_t count = 0;
+	};
+	using Bins = std::array<std::array<Bin, BinCount>, 3>;
+
+	// Objects [begin, end) of the build order
+	struct Range {
+		uint32_t begin = 0;
+		uint32_t end = 0;
+		Bounds bounds;
+		Bounds centroids;
+	};
+
+	// Run body(chunkBegin, chunkEnd) over chunks of `grain` items, on the
+	// worker threads if multithreaded
+	void forChunks(bool multithreaded, size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body) {
+		if (multithreaded) {
+			ThreadPool::Shared().ParallelFor(begin, end, grain, body);
+			return;
+		}
+		for (size_t chunkBegin = begin; chunkBegin < end; chunkBegin += grain) {
+			body(chunkBegin, std::min(chunkBegin + grain, end));
+		}
+	}
+
+	// An object to build the tree over. Partitions move the references
+	// themselves rather than indices, so that the objects of a node are
+	// contiguous in memory when it is binned.
+	struct Reference {
+		Bounds bounds;
+		glm::vec3 centroid;
+		uint32_t object;
+	};
+
+	struct Builder {
+		std::vector<Reference>& references;
+		bool multithreaded;
+	};
+
+	// Bin of a centroid along one axis. Binning and partitioning must agree
+	// on it, so both call this.
+	uint32_t binOf(float centroid, float centroidMin, float scale) {
+		int bin = static_cast<int>((centroid - centroidMin) * scale);
+		return static_cast<uint32_t>(std::clamp(bin, 0, static_cast<int>(BinCount) - 1));
+	}
+
+	glm::vec3 binScales(const Range& range) {
+		glm::vec3 extent = range.centroids.max - range.centroids.min;
+		glm::vec3 scale;
+		for (int axis = 0; axis < 3; ++axis) {
+			scale[axis] = extent[axis] > 0.0f ? static_cast<float>(BinCount) / extent[axis] : 0.0f;
+		}
+		return scale;
+	}
+
+	// Bounds of the centroids of the objects of a range, and of the objects
+	// themselves if withObjects
+	void computeBounds(const Builder& builder, Range& range, bool withObjects, bool parallel) {
+		auto boundChunk = [&](size_t chunkBegin, size_t chunkEnd, Range& chunk) {
+			for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+				const Reference& reference = builder.references[i];
+				if (withObjects) grow(chunk.bounds, reference.bounds);
+				grow(chunk.centroids, reference.centroid);
+			}
+		};
+		if (withObjects) range.bounds = Bounds();
+		range.centroids = Bounds();
+		if (!parallel) {
+			boundChunk(range.begin, range.end, range);
+			return;
+		}
+		std::vector<Range> chunks((range.end - range.begin + BinningGrain - 1) / BinningGrain);
+		forChunks(builder.multithreaded, range.begin, range.end, BinningGrain, [&](size_t chunkBegin, size_t chunkEnd) {
+			boundChunk(chunkBegin, chunkEnd, chunks[(chunkBegin - range.begin) / BinningGrain]);
+		});
+		for (const Range& chunk : chunks) {
+			if (withObjects) grow(range.bounds, chunk.bounds);
+			grow(range.centroids, chunk.centroids);
+		}
+	}
+
+	Bins binRange(const Builder& builder, const Range& range, bool parallel) {
+		glm::vec3 scale = binScales(range);
+		auto binChunk = [&](size_t chunkBegin, size_t chunkEnd, Bins& chunkBins) {
+			for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+				const Reference& reference = builder.references[i];
+				for (int axis = 0; axis < 3; ++axis) {
+					Bin& bin = chunkBins[axis][binOf(reference.centroid[axis], range.centroids.min[axis], scale[axis])];
+					grow(bin.bounds, reference.bounds);
+					++bin.count;
+				}
+			}
+		};
+		Bins bins;
+		if (!parallel) {
+			binChunk(range.begin, range.end, bins);
+			return bins;
+		}
+		// Each chunk fills its own bins, which are then merged
+		std::vector<Bins> chunks((range.end - range.begin + BinningGrain - 1) / BinningGrain);
+		forChunks(builder.multithreaded, range.begin, range.end, BinningGrain, [&](size_t chunkBegin, size_t chunkEnd) {
+			binChunk(chunkBegin, chunkEnd, chunks[(chunkBegin - range.begin) / BinningGrain]);
+		});
+		for (const Bins& chunk : chunks) {
+			for (int axis = 0; axis < 3; ++axis) {
+				for (uint32_t b = 0; b < BinCount; ++b) {
+					grow(bins[axis][b].bounds, chunk[axis][b].bounds);
+					bins[axis][b].count += chunk[axis][b].count;
+				}
+			}
+		}
+		return bins;
+	}
+
+	// Partition the objects of a range into two children, or return false if
+	// the range should be a leaf
+	bool splitRange(const Builder& builder, const Range& range, bool parallel, Range& left, Range& right) {
+		uint32_t count = range.end - range.begin;
+		if (count <= LeafSize) return false;
+
+		Bins bins = binRange(builder, range, parallel);
+
+		// SAH cost of splitting after each bin: sweep the bins from the left
+		// and from the right, growing the box of each side
+		float parentArea = std::max(halfArea(range.bounds), std::numeric_limits<float>::min());
+		int bestAxis = -1;
+		uint32_t bestBin = 0;
+		float bestCost = std::numeric_limits<float>::infinity();
+		for (int axis = 0; axis < 3; ++axis) {
+			if (range.centroids.max[axis] <= range.centroids.min[axis]) continue;
+			std::array<float, BinCount> rightCosts;
+			Bounds rightBounds;
+			uint32_t rightCount = 0;
+			for (uint32_t b = BinCount - 1; b > 0; --b) {
+				grow(rightBounds, bins[axis][b].bounds);
+				rightCount += bins[axis][b].count;
+				rightCosts[b - 1] = halfArea(rightBounds) * rightCount;
+			}
+			Bounds leftBounds;
+			uint32_t leftCount = 0;
+			for (uint32_t b = 0; b + 1 < BinCount; ++b) {
+				grow(leftBounds, bins[axis][b].bounds);
+				leftCount += bins[axis][b].count;
+				if (leftCount == 0 || leftCount == count) continue;
+				float cost = TraversalCost + IntersectionCost * (halfArea(leftBounds) * leftCount + rightCosts[b]) / parentArea;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
+
+		float leafCost = IntersectionCost * count;
+		if (bestCost >= leafCost && count <= MaxLeafSize) return false;
+
+		Reference* references = builder.references.data();
+		uint32_t middle;
+		if (bestAxis < 0) {
+			// All the centroids are at the same place, no bin boundary
+			// separates them: split in the middle
+			middle = range.begin + count / 2;
+			left.begin = range.begin;
+			left.end = middle;
+			right.begin = middle;
+			right.end = range.end;
+			computeBounds(builder, left, true, false);
+			computeBounds(builder, right, true, false);
+			return true;
+		}
+
+		float centroidMin = range.centroids.min[bestAxis];
+		float scale = binScales(range)[bestAxis];
+		Reference* split = std::partition(references + range.begin, references + range.end, [&](const Reference& reference) {
+			return binOf(reference.centroid[bestAxis], centroidMin, scale) <= bestBin;
+		});
+		middle = static_cast<uint32_t>(split - references);
+
+		// Boxes of the children are those of their bins, the centroids are
+		// gathered again to bin the children
+		left = Range();
+		right = Range();
+		left.begin = range.begin;
+		left.end = middle;
+		right.begin = middle;
+		right.end = range.end;
+		for (uint32_t b = 0; b < BinCount; ++b) {
+			grow(b <= bestBin ? left.bounds : right.bounds, bins[bestAxis][b].bounds);
+		}
+		computeBounds(builder, left, false, parallel);
+		computeBounds(builder, right, false, parallel);
+		return true;
+	}
+
+	// Build the subtree of a range on this thread, its root first. Returns
+	// the depth of the subtree.
+	template<typename NodeType>
+	uint32_t buildSubtree(const Builder& builder, const Range& root, std::vector<NodeType>& nodes) {
+		struct Item {
+			uint32_t node;
+			Range range;
+			uint32_t depth;
+		};
+		uint32_t maxDepth = 0;
+		nodes.assign(1, NodeType());
+		std::vector<Item> stack = { { 0, root, 1 } };
+		while (!stack.empty()) {
+			Item item = stack.back();
+			stack.pop_back();
+			nodes[item.node].min = item.range.bounds.min;
+			nodes[item.node].max = item.range.bounds.max;
+			maxDepth = std::max(maxDepth, item.depth);
+
+			Range left, right;
+			if (!splitRange(builder, item.range, false, left, right)) {
+				nodes[item.node].first = item.range.begin;
+				nodes[item.node].count = item.range.end - item.range.begin;
+				continue;
+			}
+			uint32_t child = static_cast<uint32_t>(nodes.size());
+			nodes.resize(nodes.size() + 2);
+			nodes[item.node].first = child;
+			nodes[item.node].count = 0;
+			// Left first, so that nodes are stored depth first
+			stack.push_back({ child + 1, right, item.depth + 1 });
+			stack.push_back({ child, left, item.depth + 1 });
+		}
+		return maxDepth;
+	}
+
+	// Clears the planes of `planeMask` the box is inside of, and returns
+	// whether it is outside of one of them
+	bool isOutside(const std::array<glm::vec4, 6>& planes, const glm::vec3& boxMin, const glm::vec3& boxMax, uint32_t& planeMask) {
+		for (uint32_t p = 0; p < 6; ++p) {
+			if (!(planeMask & (1u << p))) continue;
+			glm::vec3 normal = glm::vec3(planes[p]);
+			// Corners of the box the furthest along and against the normal
+			glm::vec3 positive = glm::mix(boxMin, boxMax, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+			glm::vec3 negative = glm::mix(boxMax, boxMin, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+			if (glm::dot(normal, positive) + planes[p].w < 0.0f) return true;
+			if (glm::dot(normal, negative) + planes[p].w >= 0.0f) planeMask &= ~(1u << p);
+		}
+		return false;
+	}
+
+	// Distance along the ray at which it enters the box, infinity if it does not
+	float rayEntry(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& boxMin, const glm::vec3& boxMax) {
+		glm::vec3 t0 = (boxMin - origin) * inverseDirection;
+		glm::vec3 t1 = (boxMax - origin) * inverseDirection;
+		glm::vec3 tNear = glm::min(t0, t1);
+		glm::vec3 tFar = glm::max(t0, t1);
+		float entry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		float exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+		return entry <= exit ? entry : std::numeric_limits<float>::infinity();
+	}
+} // namespace
+
+void SceneBvh::Build(const std::vector<Bounds>& bounds, bool multithreaded)
+{
+	uint32_t count = static_cast<uint32_t>(bounds.size());
+	m_bounds = bounds;
+	m_nodes.clear();
+	m_objects.clear();
+	m_unbounded.clear();
+	m_leaves.assign(count, InvalidIndex);
+	m_parents.clear();
+	m_dirtyLeaves.clear();
+	m_dirtyNodes.clear();
+	m_boundednessChanged = false;
+	m_weightedArea = 0.0;
+	m_stats = Stats();
+	m_stats.objectCount = count;
+
+	std::vector<Reference> references;
+	references.reserve(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		if (isFinite(bounds[i])) {
+			references.push_back({ bounds[i], 0.5f * (bounds[i].min + bounds[i].max), i });
+		}
+		else {
+			m_unbounded.push_back(i);
+		}
+	}
+	if (references.empty()) return;
+
+	Builder builder = { references, multithreaded };
+	Range root;
+	root.end = static_cast<uint32_t>(references.size());
+	computeBounds(builder, root, true, root.end > ParallelBinningSize);
+
+	// Top of the tree: few nodes of many objects, each binned on the worker
+	// threads, down to the subtrees small enough for one thread
+	struct Subtree {
+		uint32_t node;
+		Range range;
+		uint32_t depth;
+	};
+	std::vector<Subtree> subtrees;
+	std::vector<Subtree> stack = { { 0, root, 1 } };
+	m_nodes.resize(1);
+	while (!stack.empty()) {
+		Subtree item = stack.back();
+		stack.pop_back();
+		if (item.range.end - item.range.begin <= SubtreeSize) {
+			subtrees.push_back(item);
+			continue;
+		}
+		Node& node = m_nodes[item.node];
+		node.min = item.range.bounds.min;
+		node.max = item.range.bounds.max;
+		m_stats.depth = std::max(m_stats.depth, item.depth);
+
+		Range left, right;
+		if (!splitRange(builder, item.range, item.range.end - item.range.begin > ParallelBinningSize, left, right)) {
+			node.first = item.range.begin;
+			node.count = item.range.end - item.range.begin;
+			continue;
+		}
+		uint32_t child = static_cast<uint32_t>(m_nodes.size());
+		node.first = child;
+		node.count = 0;
+		m_nodes.resize(m_nodes.size() + 2);
+		stack.push_back({ child + 1, right, item.depth + 1 });
+		stack.push_back({ child, left, item.depth + 1 });
+	}
+
+	// Subtrees do not share objects, so they are built in parallel, each in
+	// its own array of nodes
+	std::vector<std::vector<Node>> subtreeNodes(subtrees.size());
+	std::vector<uint32_t> subtreeDepths(subtrees.size());
+	forChunks(builder.multithreaded, 0, subtrees.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			subtreeDepths[i] = buildSubtree(builder, subtrees[i].range, subtreeNodes[i]);
+		}
+	});
+
+	// The root of a subtree takes the place of its node of the top, the
+	// others are appended, in order so that children still follow parents
+	for (size_t i = 0; i < subtrees.size(); ++i) {
+		uint32_t offset = static_cast<uint32_t>(m_nodes.size()) - 1;
+		for (Node& node : subtreeNodes[i]) {
+			if (node.count == 0) node.first += offset;
+		}
+		m_nodes[subtrees[i].node] = subtreeNodes[i][0];
+		m_nodes.insert(m_nodes.end(), subtreeNodes[i].begin() + 1, subtreeNodes[i].end());
+		m_stats.depth = std::max(m_stats.depth, subtrees[i].depth + subtreeDepths[i] - 1);
+	}
+
+	m_objects.resize(references.size());
+	for (size_t k = 0; k < references.size(); ++k) {
+		m_objects[k] = references[k].object;
+	}
+
+	m_parents.assign(m_nodes.size(), InvalidIndex);
+	for (uint32_t i = 0; i < m_nodes.size(); ++i) {
+		const Node& node = m_nodes[i];
+		m_weightedArea += NodeCost(node);
+		if (node.count == 0) {
+			m_parents[node.first] = i;
+			m_parents[node.first + 1] = i;
+		}
+		for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+			m_leaves[m_objects[k]] = i;
+		}
+	}
+	m_dirtyNodes.assign(m_nodes.size(), 0);
+
+	m_stats.nodeCount = static_cast<uint32_t>(m_nodes.size());
+	m_stats.buildCost = m_stats.cost = GetCost();
+}
+
+void SceneBvh::SetBounds(uint32_t index, const Bounds& bounds)
+{
+	Bounds& current = m_bounds[index];
+	if (current.min == bounds.min && current.max == bounds.max) return;
+	current = bounds;
+
+	uint32_t leaf = m_leaves[index];
+	if (isFinite(bounds) != (leaf != InvalidIndex)) {
+		// Moves in or out of the tree, which only a build does
+		m_boundednessChanged = true;
+		return;
+	}
+	if (leaf != InvalidIndex && !m_dirtyNodes[leaf]) {
+		m_dirtyNodes[leaf] = 1;
+		m_dirtyLeaves.push_back(leaf);
+	}
+}
+
+void SceneBvh::Refit(bool multithreaded)
+{
+	if (m_dirtyLeaves.empty()) return;
+
+	// Leaves first, on the worker threads if there are many
+	size_t chunkCount = (m_dirtyLeaves.size() + RefitGrain - 1) / RefitGrain;
+	std::vector<double> chunkDeltas(chunkCount, 0.0);
+	forChunks(multithreaded, 0, m_dirtyLeaves.size(), RefitGrain, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			chunkDeltas[begin / RefitGrain] += UpdateNode(m_dirtyLeaves[i]);
+		}
+	});
+	for (double delta : chunkDeltas) {
+		m_weightedArea += delta;
+	}
+
+	// Then their ancestors, each once
+	std::vector<uint32_t> ancestors;
+	for (uint32_t leaf : m_dirtyLeaves) {
+		m_dirtyNodes[leaf] = 0;
+		for (uint32_t parent = m_parents[leaf]; parent != InvalidIndex && !m_dirtyNodes[parent]; parent = m_parents[parent]) {
+			m_dirtyNodes[parent] = 1;
+			ancestors.push_back(parent);
+		}
+	}
+	m_dirtyLeaves.clear();
+
+	// Children come after their parent, so going from the last node to the
+	// first updates children before parents. When many nodes moved, walking
+	// all the nodes is cheaper than sorting those that did.
+	if (ancestors.size() * 16 < m_nodes.size()) {
+		std::sort(ancestors.begin(), ancestors.end(), std::greater<uint32_t>());
+		for (uint32_t node : ancestors) {
+			m_weightedArea += UpdateNode(node);
+			m_dirtyNodes[node] = 0;
+		}
+	}
+	else {
+		for (uint32_t node = static_cast<uint32_t>(m_nodes.size()); node-- > 0;) {
+			if (!m_dirtyNodes[node]) continue;
+			m_weightedArea += UpdateNode(node);
+			m_dirtyNodes[node] = 0;
+		}
+	}
+
+	m_stats.cost = GetCost();
+}
+
+bool SceneBvh::NeedsRebuild() const
+{
+	return m_boundednessChanged || m_stats.cost > RebuildCostRatio * m_stats.buildCost;
+}
+
+void SceneBvh::Cull(const Frustum& frustum, std::vector<uint32_t>& visible)
+{
+	size_t firstVisible = visible.size();
+	visible.insert(visible.end(), m_unbounded.begin(), m_unbounded.end());
+	m_stats.testedNodes = 0;
+
+	const std::array<glm::vec4, 6>& planes = frustum.GetPlanes();
+	struct Item {
+		uint32_t node;
+		uint32_t planeMask; // planes the node is not known to be inside of
+	};
+	std::vector<Item> stack;
+	if (!m_nodes.empty()) stack.push_back({ 0, 0x3f });
+	while (!stack.empty()) {
+		Item item = stack.back();
+		stack.pop_back();
+		const Node& node = m_nodes[item.node];
+		if (item.planeMask != 0) {
+			++m_stats.testedNodes;
+			if (isOutside(planes, node.min, node.max, item.planeMask)) continue;
+		}
+		if (node.count == 0) {
+			stack.push_back({ node.first + 1, item.planeMask });
+			stack.push_back({ node.first, item.planeMask });
+			continue;
+		}
+		for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+			uint32_t object = m_objects[k];
+			uint32_t planeMask = item.planeMask;
+			if (planeMask == 0 || !isOutside(planes, m_bounds[object].min, m_bounds[object].max, planeMask)) {
+				visible.push_back(object);
+			}
+		}
+	}
+	m_stats.visibleObjects = static_cast<uint32_t>(visible.size() - firstVisible);
+}
+
+SceneBvh::RayHit SceneBvh::Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+	const std::function<float(uint32_t index)>& intersect) const
+{
+	RayHit hit;
+	hit.distance = maxDistance;
+	if (m_nodes.empty()) return hit;
+
+	// Zero components would give 0 * infinity = NaN where the ray starts on a
+	// face of a box, tiny ones give infinities of the right sign
+	glm::vec3 inverseDirection;
+	for (int axis = 0; axis < 3; ++axis) {
+		float d = direction[axis];
+		inverseDirection[axis] = 1.0f / (std::abs(d) < 1e-20f ? std::copysign(1e-20f, d) : d);
+	}
+
+	// Nearest child first, so that farther nodes are skipped once something
+	// closer than them is hit
+	struct Item {
+		uint32_t node;
+		float entry;
+	};
+	std::vector<Item> stack = { { 0, rayEntry(origin, inverseDirection, m_nodes[0].min, m_nodes[0].max) } };
+	while (!stack.empty()) {
+		Item item = stack.back();
+		stack.pop_back();
+		if (item.entry >= hit.distance) continue;
+		const Node& node = m_nodes[item.node];
+		if (node.count == 0) {
+			Item near = { node.first, rayEntry(origin, inverseDirection, m_nodes[node.first].min, m_nodes[node.first].max) };
+			Item far = { node.first + 1, rayEntry(origin, inverseDirection, m_nodes[node.first + 1].min, m_nodes[node.first + 1].max) };
+			if (far.entry < near.entry) std::swap(near, far);
+			if (far.entry < hit.distance) stack.push_back(far);
+			if (near.entry < hit.distance) stack.push_back(near);
+			continue;
+		}
+		for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+			uint32_t object = m_objects[k];
+			float distance = rayEntry(origin, inverseDirection, m_bounds[object].min, m_bounds[object].max);
+			if (distance >= hit.distance) continue;
+			// The object is in its box, so it cannot be hit before the box is
+			if (intersect) distance = intersect(object);
+			if (distance < hit.distance) {
+				hit.distance = distance;
+				hit.index = object;
+			}
+		}
+	}
+	if (hit.index == InvalidIndex) hit.distance = std::numeric_limits<float>::infinity();
+	return hit;
+}
+
+template<typename Overlaps>
+void SceneBvh::Query(const Overlaps& overlaps, std::vector<uint32_t>& results) const
+{
+	results.insert(results.end(), m_unbounded.begin(), m_unbounded.end());
+	std::vector<uint32_t> stack;
+	if (!m_nodes.empty()) stack.push_back(0);
+	while (!stack.empty()) {
+		const Node& node = m_nodes[stack.back()];
+		stack.pop_back();
+		if (!overlaps(node.min, node.max)) continue;
+		if (node.count == 0) {
+			stack.push_back(node.first + 1);
+			stack.push_back(node.first);
+			continue;
+		}
+		for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+			uint32_t object = m_objects[k];
+			if (overlaps(m_bounds[object].min, m_bounds[object].max)) results.push_back(object);
+		}
+	}
+}
+
+void SceneBvh::QueryBox(const Bounds& box, std::vector<uint32_t>& results) const
+{
+	Query([&](const glm::vec3& boxMin, const glm::vec3& boxMax) {
+		return glm::all(glm::lessThanEqual(boxMin, box.max)) && glm::all(glm::lessThanEqual(box.min, boxMax));
+	}, results);
+}
+
+void SceneBvh::QuerySphere(const glm::vec3& center, float radius, std::vector<uint32_t>& results) const
+{
+	Query([&](const glm::vec3& boxMin, const glm::vec3& boxMax) {
+		// Distance from the center to the closest point of the box
+		glm::vec3 offset = glm::clamp(center, boxMin, boxMax) - center;
+		return glm::dot(offset, offset) <= radius * radius;
+	}, results);
+}
+
+double SceneBvh::UpdateNode(uint32_t nodeIndex)
+{
+	Node& node = m_nodes[nodeIndex];
+	double oldCost = NodeCost(node);
+	Bounds bounds;
+	if (node.count == 0) {
+		grow(bounds, Bounds{ m_nodes[node.first].min, m_nodes[node.first].max });
+		grow(bounds, Bounds{ m_nodes[node.first + 1].min, m_nodes[node.first + 1].max });
+	}
+	for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+		grow(bounds, m_bounds[m_objects[k]]);
+	}
+	node.min = bounds.min;
+	node.max = bounds.max;
+	return NodeCost(node) - oldCost;
+}
+
+double SceneBvh::NodeCost(const Node& node) const
+{
+	float area = halfArea(Bounds{ node.min, node.max });
+	return static_cast<double>(area) * (node.count == 0 ? TraversalCost : IntersectionCost * node.count);
+}
+
+float SceneBvh::GetCost() const
+{
+	if (m_nodes.empty()) return 0.0f;
+	float rootArea = halfArea(Bounds{ m_nodes[0].min, m_nodes[0].max });
+	return rootArea > 0.0f ? static_cast<float>(m_weightedArea / rootArea) : 0.0f;
+}
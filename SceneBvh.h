@@ -0,0 +1,116 @@
+#pragma once
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+class Frustum;
+
+// Bounding volume hierarchy over the axis aligned boxes of the objects of a
+// scene, to find the objects in the view frustum, along a ray or in a region
+// without testing each of them.
+//
+// - Build() splits the objects recursively with the surface area heuristic
+//   (SAH), evaluated at the boundaries of a few bins along each axis. The top
+//   of the tree is binned on the worker threads, then the subtrees below it
+//   are built on one thread each.
+// - When objects move, SetBounds() then Refit() grows or shrinks the boxes
+//   of their leaves and of the ancestors of these only, keeping the topology.
+//   The tree gets worse as objects drift away from where it was built, which
+//   NeedsRebuild() tells from its SAH cost.
+// - Nodes are stored depth first, so that children come after their parent,
+//   and the objects of a subtree are contiguous.
+//
+// Objects whose box is not finite (unknown bounds) are kept out of the tree:
+// they are always visible and in range, and never hit by rays.
+class SceneBvh {
+public:
+	static constexpr uint32_t InvalidIndex = ~0u;
+
+	struct Bounds {
+		glm::vec3 min = glm::vec3(std::numeric_limits<float>::infinity());
+		glm::vec3 max = glm::vec3(-std::numeric_limits<float>::infinity());
+	};
+
+	struct RayHit {
+		uint32_t index = InvalidIndex; // of the object, InvalidIndex if none is hit
+		float distance = std::numeric_limits<float>::infinity();
+	};
+
+	struct Stats {
+		uint32_t objectCount = 0;
+		uint32_t nodeCount = 0;
+		uint32_t depth = 0;
+		float buildCost = 0.0f; // SAH cost when built
+		float cost = 0.0f; // SAH cost after the refits since
+		uint32_t testedNodes = 0; // by the last Cull()
+		uint32_t visibleObjects = 0; // by the last Cull()
+	};
+
+	// Build the tree over objects 0 to bounds.size() - 1, on the worker
+	// threads if multithreaded
+	void Build(const std::vector<Bounds>& bounds, bool multithreaded = true);
+	uint32_t GetCount() const { return static_cast<uint32_t>(m_bounds.size()); }
+
+	// Move an object, its ancestors are updated by the next Refit()
+	void SetBounds(uint32_t index, const Bounds& bounds);
+	void Refit(bool multithreaded = true);
+	// Whether the tree should be built again: an object went from finite to
+	// infinite bounds or back, or refits made the tree much worse
+	bool NeedsRebuild() const;
+
+	// Append to `visible` the objects whose box intersects the frustum. A
+	// node inside a plane is not tested against it again below.
+	void Cull(const Frustum& frustum, std::vector<uint32_t>& visible);
+	// Closest object hit by the ray, at most at maxDistance. `intersect`
+	// refines the hit against the actual object, returning the distance along
+	// the ray or infinity if missed, otherwise the box is hit.
+	RayHit Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance = std::numeric_limits<float>::infinity(),
+		const std::function<float(uint32_t index)>& intersect = nullptr) const;
+	// Append to `results` the objects whose box intersects the box or sphere
+	void QueryBox(const Bounds& box, std::vector<uint32_t>& results) const;
+	void QuerySphere(const glm::vec3& center, float radius, std::vector<uint32_t>& results) const;
+
+	const Stats& GetStats() const { return m_stats; }
+
+private:
+	struct Node {
+		glm::vec3 min;
+		// Leaf: first of m_objects. Internal node: left child, the right one follows.
+		uint32_t first;
+		glm::vec3 max;
+		uint32_t count; // 0 for internal nodes
+	};
+
+	// Recompute the box of a node from its objects or children, and return
+	// how much its term of m_weightedArea changed
+	double UpdateNode(uint32_t nodeIndex);
+	// Area of a node weighted by the cost of visiting it (SAH)
+	double NodeCost(const Node& node) const;
+	// SAH cost of the tree, relative to the box of the root
+	float GetCost() const;
+	// Append to `results` the objects for which overlaps(boxMin, boxMax)
+	// holds, as well as the unbounded ones
+	template<typename Overlaps>
+	void Query(const Overlaps& overlaps, std::vector<uint32_t>& results) const;
+
+private:
+	std::vector<Bounds> m_bounds; // indexed by object
+	std::vector<Node> m_nodes; // the root first
+	std::vector<uint32_t> m_objects; // in the order of the leaves
+	std::vector<uint32_t> m_unbounded; // objects that are not in the tree
+	std::vector<uint32_t> m_leaves; // leaf of each object, InvalidIndex if unbounded
+	std::vector<uint32_t> m_parents; // of each node
+	// Leaves whose objects moved since the last Refit()
+	std::vector<uint32_t> m_dirtyLeaves;
+	std::vector<uint8_t> m_dirtyNodes;
+	bool m_boundednessChanged = false;
+	// Sum of NodeCost() over the nodes, kept up to date by the refits
+	double m_weightedArea = 0.0;
+	Stats m_stats;
+};
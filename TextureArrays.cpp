@@ -0,0 +1,340 @@
+#include "TextureArrays.h"
+
+#include "Loader.h"
+
+#include <algorithm>
+
+namespace {
+	// Bytes of a block of a format, or of a texel if it is not compressed
+	uint32_t blockBytes(TextureFormat format) {
+		switch (format) {
+		case TextureFormat::BC1RGBAUnorm:
+		case TextureFormat::BC1RGBAUnormSrgb:
+		case TextureFormat::BC4RUnorm:
+			return 8;
+		case TextureFormat::BC3RGBAUnorm:
+		case TextureFormat::BC3RGBAUnormSrgb:
+		case TextureFormat::BC5RGUnorm:
+		case TextureFormat::BC7RGBAUnorm:
+		case TextureFormat::BC7RGBAUnormSrgb:
+			return 16;
+		case TextureFormat::R8Unorm:
+			return 1;
+		case TextureFormat::RG8Unorm:
+			return 2;
+		default:
+			return 4;
+		}
+	}
+
+	// Copies of compressed levels are made of whole blocks, even for levels
+	// smaller than a block
+	uint32_t physicalLevelSize(uint32_t size, uint32_t level, uint32_t block) {
+		return (MipFilter::mipLevelSize(size, level) + block - 1) / block * block;
+	}
+} // namespace
+
+void TextureArrays::Init(Device device)
+{
+	m_device = device;
+}
+
+void TextureArrays::Terminate()
+{
+	ClearBindGroups();
+	for (PendingCopy& copy : m_pendingCopies) {
+		m_retiredTextures.push_back(copy.source);
+	}
+	m_pendingCopies.clear();
+	for (std::unique_ptr<TextureArray>& array : m_arrays) {
+		array->view.release();
+		m_retiredTextures.push_back(array->texture);
+	}
+	m_arrays.clear();
+	m_packedTextures.clear();
+	for (Texture& texture : m_retiredTextures) {
+		texture.destroy();
+		texture.release();
+	}
+	m_retiredTextures.clear();
+	m_device = nullptr;
+}
+
+TextureArrays::Slot TextureArrays::Pack(const TextureHandle& texture)
+{
+	if (!texture) return {};
+	PackedTexture& packed = m_packedTextures[texture.get()];
+	// An entry of an expired texture may have the same address
+	bool sameTexture = packed.handle.lock() == texture;
+	if (sameTexture && packed.array != nullptr && packed.generation == texture->generation) {
+		return { packed.array->view, packed.layer };
+	}
+	if (!texture->texture) {
+		// Nothing new to pack
+		if (sameTexture && packed.array != nullptr) return { packed.array->view, packed.layer };
+		return {};
+	}
+
+	// The texture moves to the array of its new shape
+	if (packed.array != nullptr) FreeLayer(packed.array, packed.layer);
+
+	Texture source = texture->texture;
+	ArrayKey key(source.getFormat(), source.getWidth(), source.getHeight(), source.getMipLevelCount());
+	TextureArray* array = nullptr;
+	Slot slot = AllocateLayer(key, array);
+	m_pendingCopies.push_back({ source, array, slot.layer });
+
+	// From now on the texture only lives in its layer
+	if (texture->view) texture->view.release();
+	texture->view = nullptr;
+	texture->texture = nullptr;
+
+	packed.handle = texture;
+	packed.generation = texture->generation;
+	packed.array = array;
+	packed.layer = slot.layer;
+	return slot;
+}
+
+BindGroup TextureArrays::GetBindGroup(const BindGroupDescriptor& bindGroupDesc)
+{
+	BindGroupKey key;
+	key.push_back(reinterpret_cast<uintptr_t>(static_cast<WGPUBindGroupLayout>(bindGroupDesc.layout)));
+	for (size_t i = 0; i < bindGroupDesc.entryCount; ++i) {
+		const BindGroupEntry& entry = bindGroupDesc.entries[i];
+		key.push_back(entry.binding);
+		key.push_back(reinterpret_cast<uintptr_t>(static_cast<WGPUBuffer>(entry.buffer)));
+		key.push_back(static_cast<uintptr_t>(entry.offset));
+		key.push_back(static_cast<uintptr_t>(entry.size));
+		key.push_back(reinterpret_cast<uintptr_t>(static_cast<WGPUSampler>(entry.sampler)));
+		key.push_back(reinterpret_cast<uintptr_t>(static_cast<WGPUTextureView>(entry.textureView)));
+	}
+
+	auto it = m_bindGroups.find(key);
+	if (it != m_bindGroups.end()) return it->second;
+	BindGroup bindGroup = m_device.createBindGroup(bindGroupDesc);
+	m_bindGroups.emplace(std::move(key), bindGroup);
+	return bindGroup;
+}
+
+void TextureArrays::Update()
+{
+	// The copies of the last frame are submitted
+	for (Texture& texture : m_retiredTextures) {
+		texture.destroy();
+		texture.release();
+	}
+	m_retiredTextures.clear();
+
+	// Layers of the textures nobody uses anymore
+	for (auto it = m_packedTextures.begin(); it != m_packedTextures.end();) {
+		if (!it->second.handle.expired()) {
+			++it;
+			continue;
+		}
+		if (it->second.array != nullptr) FreeLayer(it->second.array, it->second.layer);
+		it = m_packedTextures.erase(it);
+	}
+
+	// Arrays whose upper half is free shrink, so that the layers freed by
+	// textures that moved to other shapes do not stay allocated
+	for (std::unique_ptr<TextureArray>& array : m_arrays) {
+		if (array->usedCount == 0) continue;
+		uint32_t layerCount = static_cast<uint32_t>(array->usedLayers.size());
+		uint32_t usedEnd = static_cast<uint32_t>(array->usedLayers.rend() - std::find(array->usedLayers.rbegin(), array->usedLayers.rend(), true));
+		uint32_t shrunkCount = layerCount;
+		while (shrunkCount > InitialLayers && usedEnd <= shrunkCount / 2) {
+			shrunkCount /= 2;
+		}
+		if (shrunkCount < layerCount) ResizeArray(*array, shrunkCount);
+	}
+
+	// Empty arrays, once no copy to them is pending
+	bool removed = false;
+	for (auto it = m_arrays.begin(); it != m_arrays.end();) {
+		TextureArray* array = it->get();
+		bool pending = std::any_of(m_pendingCopies.begin(), m_pendingCopies.end(), [array](const PendingCopy& copy) { return copy.array == array; });
+		if (array->usedCount > 0 || pending) {
+			++it;
+			continue;
+		}
+		array->view.release();
+		array->texture.destroy();
+		array->texture.release();
+		it = m_arrays.erase(it);
+		removed = true;
+	}
+	if (removed) {
+		ClearBindGroups();
+		++m_generation;
+	}
+}
+
+void TextureArrays::RecordCopies(CommandEncoder encoder)
+{
+	// Arrays that grew first, since the layers packed during this frame are
+	// copied to the new arrays (and not the old ones the growth copies from)
+	uint32_t packedLayers = 0;
+	for (bool growth : { true, false }) {
+		for (PendingCopy& copy : m_pendingCopies) {
+			if ((copy.layer == AllLayers) != growth) continue;
+			TextureFormat format;
+			uint32_t width, height, mipLevelCount;
+			std::tie(format, width, height, mipLevelCount) = copy.array->key;
+			uint32_t block = Loader::blockSize(format);
+
+			ImageCopyTexture source;
+			source.texture = copy.source;
+			source.origin = { 0, 0, 0 };
+			source.aspect = TextureAspect::All;
+			ImageCopyTexture destination;
+			destination.texture = copy.array->texture;
+			destination.origin = { 0, 0, growth ? 0 : copy.layer };
+			destination.aspect = TextureAspect::All;
+			// A shrunk array keeps the first layers of the previous one
+			uint32_t layerCount = growth ? std::min(copy.source.getDepthOrArrayLayers(), static_cast<uint32_t>(copy.array->usedLayers.size())) : 1;
+			for (uint32_t level = 0; level < mipLevelCount; ++level) {
+				source.mipLevel = level;
+				destination.mipLevel = level;
+				Extent3D copySize = { physicalLevelSize(width, level, block), physicalLevelSize(height, level, block), layerCount };
+				encoder.copyTextureToTexture(source, destination, copySize);
+			}
+			if (!growth) ++packedLayers;
+		}
+	}
+
+	for (PendingCopy& copy : m_pendingCopies) {
+		m_retiredTextures.push_back(copy.source);
+	}
+	m_pendingCopies.clear();
+	m_lastPackedLayers = packedLayers;
+}
+
+TextureArrays::Stats TextureArrays::GetStats() const
+{
+	Stats stats;
+	stats.arrayCount = static_cast<uint32_t>(m_arrays.size());
+	for (const std::unique_ptr<TextureArray>& array : m_arrays) {
+		stats.usedLayers += array->usedCount;
+		stats.totalLayers += static_cast<uint32_t>(array->usedLayers.size());
+	}
+	stats.bindGroupCount = static_cast<uint32_t>(m_bindGroups.size());
+	stats.packedLayers = m_lastPackedLayers;
+	for (const std::unique_ptr<TextureArray>& array : m_arrays) {
+		stats.allocatedBytes += array->usedLayers.size() * array->layerBytes;
+	}
+	stats.unusedBytes = GetUnusedBytes();
+	return stats;
+}
+
+uint64_t TextureArrays::GetUnusedBytes() const
+{
+	uint64_t bytes = 0;
+	for (const std::unique_ptr<TextureArray>& array : m_arrays) {
+		bytes += (array->usedLayers.size() - array->usedCount) * array->layerBytes;
+	}
+	return bytes;
+}
+
+TextureArrays::Slot TextureArrays::AllocateLayer(const ArrayKey& key, TextureArray*& array)
+{
+	// A free layer in an array of this shape...
+	for (std::unique_ptr<TextureArray>& candidate : m_arrays) {
+		if (candidate->key != key || candidate->usedCount == candidate->usedLayers.size()) continue;
+		array = candidate.get();
+		break;
+	}
+
+	// ...or in an array grown for it...
+	if (array == nullptr) {
+		for (std::unique_ptr<TextureArray>& candidate : m_arrays) {
+			uint32_t layerCount = static_cast<uint32_t>(candidate->usedLayers.size());
+			if (candidate->key != key || layerCount >= MaxLayers) continue;
+			array = candidate.get();
+			ResizeArray(*array, std::min(2 * layerCount, MaxLayers));
+			break;
+		}
+	}
+
+	// ...or in a new one
+	if (array == nullptr) {
+		m_arrays.push_back(std::make_unique<TextureArray>());
+		array = m_arrays.back().get();
+		array->key = key;
+		ResizeArray(*array, InitialLayers);
+	}
+
+	uint32_t layer = static_cast<uint32_t>(std::find(array->usedLayers.begin(), array->usedLayers.end(), false) - array->usedLayers.begin());
+	array->usedLayers[layer] = true;
+	++array->usedCount;
+	return { array->view, layer };
+}
+
+void TextureArrays::FreeLayer(TextureArray* array, uint32_t layer)
+{
+	// Empty arrays are destroyed by the next update
+	array->usedLayers[layer] = false;
+	--array->usedCount;
+}
+
+void TextureArrays::ResizeArray(TextureArray& array, uint32_t layerCount)
+{
+	TextureFormat format;
+	uint32_t width, height, mipLevelCount;
+	std::tie(format, width, height, mipLevelCount) = array.key;
+
+	TextureDescriptor textureDesc;
+	textureDesc.label = "Texture array";
+	textureDesc.dimension = TextureDimension::_2D;
+	textureDesc.format = format;
+	textureDesc.size = { width, height, layerCount };
+	textureDesc.mipLevelCount = mipLevelCount;
+	textureDesc.sampleCount = 1;
+	// Copied from when the array grows again
+	textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst | TextureUsage::CopySrc;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	Texture texture = m_device.createTexture(textureDesc);
+
+	TextureViewDescriptor textureViewDesc;
+	textureViewDesc.aspect = TextureAspect::All;
+	textureViewDesc.baseArrayLayer = 0;
+	textureViewDesc.arrayLayerCount = layerCount;
+	textureViewDesc.baseMipLevel = 0;
+	textureViewDesc.mipLevelCount = mipLevelCount;
+	textureViewDesc.dimension = TextureViewDimension::_2DArray;
+	textureViewDesc.format = format;
+
+	if (array.texture) {
+		// Layers packed in the previous frames are copied to the new array.
+		// If the array was already resized during this frame, the old one
+		// holds nothing yet and that first copy is the one to keep.
+		bool grew = std::any_of(m_pendingCopies.begin(), m_pendingCopies.end(), [&array](const PendingCopy& copy) {
+			return copy.array == &array && copy.layer == AllLayers;
+		});
+		if (grew) m_retiredTextures.push_back(array.texture);
+		else m_pendingCopies.push_back({ array.texture, &array, AllLayers });
+		array.view.release();
+		// Bind groups hold the view of the old array
+		ClearBindGroups();
+		++m_generation;
+	}
+
+	array.texture = texture;
+	array.view = texture.createView(textureViewDesc);
+	array.usedLayers.resize(layerCount, false);
+	uint32_t block = Loader::blockSize(format);
+	array.layerBytes = 0;
+	for (uint32_t level = 0; level < mipLevelCount; ++level) {
+		uint64_t blocks = static_cast<uint64_t>(physicalLevelSize(width, level, block) / block) * (physicalLevelSize(height, level, block) / block);
+		array.layerBytes += blocks * blockBytes(format);
+	}
+}
+
+void TextureArrays::ClearBindGroups()
+{
+	for (auto& entry : m_bindGroups) {
+		entry.second.release();
+	}
+	m_bindGroups.clear();
+}
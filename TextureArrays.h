@@ -0,0 +1,133 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "TextureRegistry.h"
+
+// Packs the textures of the objects into 2D texture arrays, one per format,
+// size and mip level count, so that objects whose textures have the same
+// shape share a bind group and select their layers through per-instance data
+// (see GameObject::InstanceAttributes) rather than each having its own bind
+// group.
+//
+// Textures are still created on their own by the loader and the streamer,
+// then copied on the GPU into a layer at the beginning of the next frame and
+// destroyed, so they only take memory once. A texture that the streamer
+// replaces moves to the array of its new shape. Arrays start small and grow
+// by being copied into larger ones, and shrink the same way once their upper
+// half is free, which changes their views: users rebuild their bind groups
+// when GetGeneration() changes. The layers that no texture uses are reported
+// by GetUnusedBytes(), which the streamer counts in its budget.
+class TextureArrays {
+public:
+	// Layers of a new array
+	static constexpr uint32_t InitialLayers = 4;
+	// Layers of the largest array, the default limit of every WebGPU device
+	static constexpr uint32_t MaxLayers = 256;
+
+	// Where a texture was packed
+	struct Slot {
+		wgpu::TextureView view = nullptr; // of the whole array
+		uint32_t layer = 0;
+	};
+
+	struct Stats {
+		uint32_t arrayCount = 0;
+		uint32_t usedLayers = 0;
+		uint32_t totalLayers = 0;
+		uint32_t bindGroupCount = 0;
+		uint32_t packedLayers = 0; // copied during the last frame
+		uint64_t allocatedBytes = 0;
+		uint64_t unusedBytes = 0; // see GetUnusedBytes()
+	};
+
+	void Init(wgpu::Device device);
+	void Terminate();
+
+	// Layer holding `texture`, which is packed the first time and again each
+	// time its generation changes. The texture and view of the handle are
+	// taken over (and set to nullptr) by the copy to the layer.
+	Slot Pack(const TextureHandle& texture);
+
+	// Bind group with these entries, created once and shared by all the
+	// callers asking for the same entries. It is valid until the generation
+	// changes, the cache owns it.
+	wgpu::BindGroup GetBindGroup(const wgpu::BindGroupDescriptor& bindGroupDesc);
+
+	// Free the layers of the textures nobody uses anymore, and destroy the
+	// textures copied during the last frame. Call once per frame, before
+	// packing the textures of the frame.
+	void Update();
+
+	// Record the copies to the layers packed since the last call, after the
+	// copies of the upload manager which write the textures being copied.
+	void RecordCopies(wgpu::CommandEncoder encoder);
+
+	// Changes when array views change, and bind groups with them
+	uint32_t GetGeneration() const { return m_generation; }
+
+	// GPU memory of the layers allocated but holding no texture: the room
+	// left by growth, and the layers freed since
+	uint64_t GetUnusedBytes() const;
+
+	Stats GetStats() const;
+
+private:
+	// Format, width, height and mip level count
+	using ArrayKey = std::tuple<wgpu::TextureFormat, uint32_t, uint32_t, uint32_t>;
+
+	struct TextureArray {
+		ArrayKey key;
+		wgpu::Texture texture = nullptr;
+		wgpu::TextureView view = nullptr;
+		std::vector<bool> usedLayers;
+		uint32_t usedCount = 0;
+		uint64_t layerBytes = 0; // with all its mip levels
+	};
+
+	struct PackedTexture {
+		std::weak_ptr<SharedTexture> handle;
+		uint32_t generation = 0;
+		TextureArray* array = nullptr;
+		uint32_t layer = 0;
+	};
+
+	// Copy of a texture into a layer, or of a whole array into a larger one
+	// when `layer` is AllLayers
+	struct PendingCopy {
+		wgpu::Texture source;
+		TextureArray* array;
+		uint32_t layer;
+	};
+	static constexpr uint32_t AllLayers = ~0u;
+
+	// Find a free layer in an array of the shape `key`, growing or creating
+	// an array if needed
+	Slot AllocateLayer(const ArrayKey& key, TextureArray*& array);
+	void FreeLayer(TextureArray* array, uint32_t layer);
+	// Create `array` again with `layerCount` layers, keeping the first ones
+	void ResizeArray(TextureArray& array, uint32_t layerCount);
+	void ClearBindGroups();
+
+private:
+	wgpu::Device m_device = nullptr;
+	std::vector<std::unique_ptr<TextureArray>> m_arrays;
+	std::unordered_map<const SharedTexture*, PackedTexture> m_packedTextures;
+	std::vector<PendingCopy> m_pendingCopies;
+	// Copied during the last frame, destroyed at the next update
+	std::vector<wgpu::Texture> m_retiredTextures;
+
+	// Layout, then binding, buffer, offset, size, sampler and view of each entry
+	using BindGroupKey = std::vector<uintptr_t>;
+	std::map<BindGroupKey, wgpu::BindGroup> m_bindGroups;
+
+	uint32_t m_generation = 0;
+	uint32_t m_lastPackedLayers = 0;
+};
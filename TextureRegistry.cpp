@@ -0,0 +1,248 @@
+#include "TextureRegistry.h"
+
+#include "AsyncFileReader.h"
+#include "Loader.h"
+#include "MappedFile.h"
+#include "TextureStreamer.h"
+#include "ThreadPool.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace {
+	// Whether two files hold the same bytes, for when their hashes match
+	bool sameContent(const fs::path& a, const fs::path& b) {
+		MappedFile fileA, fileB;
+		if (!fileA.Open(a) || !fileB.Open(b)) return false;
+		return fileA.GetSize() == fileB.GetSize() && std::memcmp(fileA.GetData(), fileB.GetData(), fileA.GetSize()) == 0;
+	}
+} // namespace
+
+SharedTexture::~SharedTexture()
+{
+	if (view) view.release();
+	if (texture) {
+		texture.destroy();
+		texture.release();
+	}
+}
+
+TextureHandle TextureRegistry::Load(const fs::path& path, Device device, MipFilter::TextureKind kind)
+{
+	Prune();
+
+	// Different spellings of the same path (relative, with "..", etc.) are the same file
+	std::error_code error;
+	fs::path canonicalPath = fs::weakly_canonical(path, error);
+	if (error) canonicalPath = fs::absolute(path, error);
+	PathKey pathKey(canonicalPath.string(), kind);
+
+	auto byPath = m_byPath.find(pathKey);
+	if (byPath != m_byPath.end()) {
+		if (TextureHandle handle = byPath->second.lock()) {
+			++m_stats.pathHits;
+			return handle;
+		}
+	}
+
+	// Only the directory entry is checked here: the file is read, hashed
+	// and decoded with the others on the worker threads
+	if (!fs::is_regular_file(canonicalPath, error)) return nullptr;
+
+	// The texture is decoded with the others on the worker threads, objects
+	// draw with a placeholder until then
+	++m_stats.misses;
+	TextureHandle handle = std::make_shared<SharedTexture>();
+	handle->texture = Loader::createPlaceholderTexture(device, kind, &handle->view);
+	handle->width = 1;
+	handle->height = 1;
+
+	PendingLoad load;
+	load.handle = handle;
+	load.path = path;
+	load.canonicalPath = canonicalPath;
+	load.device = device;
+	load.kind = kind;
+	load.streamed = m_streamer != nullptr;
+	// The file is read with the other assets (in batches on io_uring), then
+	// hashed and decoded from these bytes on the worker threads
+	auto promise = std::make_shared<std::promise<PreparedLoad>>();
+	load.prepared = promise->get_future();
+	AsyncFileReader::Shared().Read(canonicalPath, [promise, path, device, kind, streamed = load.streamed](AsyncFileReader::ReadResult&& result) {
+		PreparedLoad prepared;
+		prepared.hashed = result.success;
+		if (prepared.hashed) {
+			prepared.size = result.bytes.size();
+			prepared.hash = hashBytes(result.bytes.data(), result.bytes.size());
+			if (streamed) {
+				prepared.texture.ktx2Path = Loader::streamableTexturePath(path, device, kind);
+			}
+			else {
+				Loader::prepareTexture(path, result.bytes.data(), result.bytes.size(), device, kind, prepared.texture);
+			}
+		}
+		promise->set_value(std::move(prepared));
+	});
+	m_pendingLoads.push_back(std::move(load));
+
+	// Registered by content once loaded, see FinishLoad()
+	m_byPath[pathKey] = handle;
+	return handle;
+}
+
+void TextureRegistry::Update()
+{
+	for (auto it = m_pendingLoads.begin(); it != m_pendingLoads.end();) {
+		bool ready = it->sameBytes.valid()
+			? it->sameBytes.wait_for(std::chrono::seconds(0)) == std::future_status::ready
+			: it->prepared.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		if (!ready || !FinishLoad(*it)) {
+			++it;
+			continue;
+		}
+		it = m_pendingLoads.erase(it);
+	}
+}
+
+void TextureRegistry::Terminate()
+{
+	for (PendingLoad& load : m_pendingLoads) {
+		if (load.prepared.valid()) load.prepared.wait();
+		if (load.sameBytes.valid()) load.sameBytes.wait();
+	}
+	m_pendingLoads.clear();
+}
+
+bool TextureRegistry::FinishLoad(PendingLoad& load)
+{
+	// Nobody uses the texture anymore
+	TextureHandle handle = load.handle.lock();
+	const PreparedLoad& prepared = load.result;
+	if (!load.sameBytes.valid()) {
+		load.result = load.prepared.get();
+		if (!handle) return true;
+		if (!prepared.hashed) {
+			std::cerr << "Cannot read " << load.path << ", it stays a placeholder" << std::endl;
+			return true;
+		}
+
+		// A hash collision would bind another image, so the file of a
+		// texture with the same hash is compared with this one first, on the
+		// worker threads as well
+		auto byContent = m_byContent.find(ContentKey(prepared.hash, prepared.size, load.kind));
+		if (byContent != m_byContent.end() && !byContent->second.handle.expired()) {
+			load.candidate = byContent->second.handle;
+			load.sameBytes = ThreadPool::Shared().Submit([candidatePath = byContent->second.path, path = load.canonicalPath]() {
+				return sameContent(candidatePath, path);
+			});
+			return false;
+		}
+	}
+	else if (load.sameBytes.get()) {
+		// A copy of an image already loaded under another name draws with
+		// that texture, and what was just prepared is dropped
+		TextureHandle candidate = load.candidate.lock();
+		if (!handle) return true;
+		if (candidate) {
+			++m_stats.contentHits;
+			--m_stats.misses;
+			if (handle->view) handle->view.release();
+			if (handle->texture) {
+				handle->texture.destroy();
+				handle->texture.release();
+			}
+			handle->view = nullptr;
+			handle->texture = nullptr;
+			handle->sameAs = candidate;
+			++handle->generation;
+			return true;
+		}
+	}
+	if (!handle) return true;
+
+	// Copies loaded afterwards share it. A file whose hash collides with
+	// another one but whose bytes differ takes over the entry.
+	ContentKey contentKey(prepared.hash, prepared.size, load.kind);
+	if (load.streamed && m_streamer) {
+		if (!prepared.texture.ktx2Path.empty() && m_streamer->Open(prepared.texture.ktx2Path, handle)) {
+			m_byContent[contentKey] = { handle, load.canonicalPath };
+			return true;
+		}
+		std::cerr << "Cannot stream " << load.path << ", it stays a placeholder" << std::endl;
+		return true;
+	}
+
+	TextureView view = nullptr;
+	Texture texture = Loader::createPreparedTexture(prepared.texture, load.device, &view, load.kind);
+	if (!texture) {
+		std::cerr << "Cannot load " << load.path << ", it stays a placeholder" << std::endl;
+		return true;
+	}
+
+	// The placeholder is written right away, nothing else refers to it once
+	// the bind groups are rebuilt with the new view
+	if (handle->view) handle->view.release();
+	if (handle->texture) {
+		handle->texture.destroy();
+		handle->texture.release();
+	}
+	handle->texture = texture;
+	handle->view = view;
+	handle->width = texture.getWidth();
+	handle->height = texture.getHeight();
+	++handle->generation;
+	m_byContent[contentKey] = { handle, load.canonicalPath };
+	return true;
+}
+
+const TextureHandle& TextureRegistry::resolve(const TextureHandle& handle)
+{
+	return handle && handle->sameAs ? handle->sameAs : handle;
+}
+
+TextureRegistry::Stats TextureRegistry::GetStats() const
+{
+	Stats stats = m_stats;
+	stats.pendingLoads = static_cast<uint32_t>(m_pendingLoads.size());
+	stats.residentTextures = 0;
+	for (const auto& entry : m_byContent) {
+		if (!entry.second.handle.expired()) ++stats.residentTextures;
+	}
+	return stats;
+}
+
+bool TextureRegistry::hashFile(const fs::path& path, uint64_t& hash, uint64_t& size)
+{
+	MappedFile file;
+	if (!file.Open(path)) return false;
+	size = file.GetSize();
+	hash = hashBytes(file.GetData(), size);
+	return true;
+}
+
+uint64_t TextureRegistry::hashBytes(const unsigned char* data, size_t size)
+{
+	// FNV-1a, fed 8 bytes at a time rather than one to keep up with the disk
+	constexpr uint64_t Prime = 0x100000001b3ull;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		std::memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * Prime;
+	}
+	for (; i < size; ++i) {
+		hash = (hash ^ data[i]) * Prime;
+	}
+	return hash;
+}
+
+void TextureRegistry::Prune()
+{
+	for (auto it = m_byPath.begin(); it != m_byPath.end();) {
+		it = it->second.expired() ? m_byPath.erase(it) : std::next(it);
+	}
+	for (auto it = m_byContent.begin(); it != m_byContent.end();) {
+		it = it->second.handle.expired() ? m_byContent.erase(it) : std::next(it);
+	}
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Loader.h"
+#include "MipFilter.h"
+
+class TextureStreamer;
+
+// A texture loaded once and shared by all the objects that use it. The GPU
+// texture is destroyed when the last handle to it goes away.
+struct SharedTexture {
+	// As created by the loader or the streamer, until TextureArrays packs it
+	// into a layer of an array and they become nullptr
+	wgpu::Texture texture = nullptr;
+	wgpu::TextureView view = nullptr;
+	// Size of level 0, even when a streamed texture only holds coarser levels
+	uint32_t width = 0;
+	uint32_t height = 0;
+	// Incremented when the texture and view are replaced, once loaded or
+	// by the streamer
+	uint32_t generation = 0;
+	// Set once loaded if the file holds the same bytes as the one of another
+	// texture, which is drawn instead (see TextureRegistry::resolve)
+	std::shared_ptr<SharedTexture> sameAs;
+
+	SharedTexture() = default;
+	SharedTexture(const SharedTexture&) = delete;
+	SharedTexture& operator=(const SharedTexture&) = delete;
+	~SharedTexture();
+};
+
+using TextureHandle = std::shared_ptr<SharedTexture>;
+
+// Deduplicates texture loads: objects asking for an image that is already
+// loaded get a handle to the same texture rather than decoding, filtering and
+// uploading it again.
+//
+// Textures are found by canonical path first, then by a hash of the content
+// of the file, so that copies of an image under other names are shared too.
+// The hash is computed on the worker threads along with the decoding, so a
+// copy is only found once loaded: its handle then points to the texture
+// already loaded (SharedTexture::sameAs) and its own decoding is dropped.
+// Files whose hash matches are compared byte for byte before sharing, on
+// the worker threads too: the main thread never reads the files.
+// The registry only keeps weak references, it never extends the lifetime of
+// a texture.
+//
+// Images are decoded (or cooked) on the worker threads, all at once when
+// objects ask for their textures one after the other at startup. Handles
+// hold a placeholder until then, and Update() creates the textures on the
+// main thread in the order their decoding completes. Use from the main
+// thread only.
+class TextureRegistry {
+public:
+	struct Stats {
+		uint32_t pathHits = 0;
+		uint32_t contentHits = 0; // same bytes under another path, once loaded
+		uint32_t misses = 0; // actual loads
+		uint32_t residentTextures = 0;
+		uint32_t pendingLoads = 0; // being decoded on the worker threads
+	};
+
+	// Return nullptr if the file does not exist, see Loader::loadTexture.
+	// The same image used with different kinds is loaded once per kind since
+	// the mip levels are filtered differently. The handle holds a placeholder
+	// until the image is decoded and Update() swaps its texture in. With a
+	// streamer, textures are opened by it and start with their mip tail only.
+	TextureHandle Load(const std::filesystem::path& path, wgpu::Device device,
+		MipFilter::TextureKind kind = MipFilter::TextureKind::Albedo);
+
+	// Create the textures whose decoding completed since the last call. Call
+	// once per frame, before the streamer update.
+	void Update();
+
+	// Wait for the loads in flight and drop them, before the device goes away
+	void Terminate();
+
+	Stats GetStats() const;
+
+	// Texture to draw for `handle`: the one it shares its content with, if any
+	static const TextureHandle& resolve(const TextureHandle& handle);
+
+	// When set, textures loaded afterwards are streamed (nullptr to load
+	// them whole)
+	void SetStreamer(TextureStreamer* streamer) { m_streamer = streamer; }
+
+	// Hash of the bytes of a file used to find identical content
+	static bool hashFile(const std::filesystem::path& path, uint64_t& hash, uint64_t& size);
+	static uint64_t hashBytes(const unsigned char* data, size_t size);
+
+private:
+	// Drop the entries of textures that are not used anymore
+	void Prune();
+
+private:
+	// Result of the work of the worker threads for a load
+	struct PreparedLoad {
+		bool hashed = false; // the file could be read
+		uint64_t hash = 0;
+		uint64_t size = 0;
+		Loader::PreparedTexture texture;
+	};
+
+	struct PendingLoad {
+		std::weak_ptr<SharedTexture> handle;
+		std::filesystem::path path;
+		std::filesystem::path canonicalPath;
+		wgpu::Device device;
+		MipFilter::TextureKind kind;
+		bool streamed; // prepared for the streamer
+		std::future<PreparedLoad> prepared;
+		PreparedLoad result; // of `prepared`, once ready
+		// Texture with the same hash, whose file is compared with this one
+		std::weak_ptr<SharedTexture> candidate;
+		std::future<bool> sameBytes;
+	};
+
+	// Swap the texture of a load in place of its placeholder, or point it
+	// to a texture loaded from the same bytes. Returns false while the bytes
+	// are being compared, the load is then finished once they are.
+	bool FinishLoad(PendingLoad& load);
+
+private:
+	using PathKey = std::tuple<std::string, MipFilter::TextureKind>;
+	using ContentKey = std::tuple<uint64_t, uint64_t, MipFilter::TextureKind>; // hash, size, kind
+
+	struct ContentEntry {
+		std::weak_ptr<SharedTexture> handle;
+		std::filesystem::path path; // of the file the texture was loaded from
+	};
+
+	std::map<PathKey, std::weak_ptr<SharedTexture>> m_byPath;
+	std::map<ContentKey, ContentEntry> m_byContent;
+	std::vector<PendingLoad> m_pendingLoads;
+	Stats m_stats;
+	TextureStreamer* m_streamer = nullptr;
+};
@@ -0,0 +1,246 @@
+#include "TextureStreamer.h"
+
+#include "Loader.h"
+#include "TextureArrays.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+namespace {
+	constexpr float NotRequested = std::numeric_limits<float>::infinity();
+	constexpr uint64_t PageSize = 4096;
+} // namespace
+
+void TextureStreamer::Init(Device device)
+{
+	m_device = device;
+}
+
+void TextureStreamer::Terminate()
+{
+	for (auto& entry : m_textures) {
+		if (entry.second.pendingRead.valid()) entry.second.pendingRead.wait();
+	}
+	m_textures.clear();
+	for (Texture& texture : m_retiredTextures) {
+		texture.destroy();
+		texture.release();
+	}
+	m_retiredTextures.clear();
+	m_device = nullptr;
+}
+
+bool TextureStreamer::Open(const fs::path& path, const TextureHandle& handle)
+{
+	StreamedTexture texture;
+	texture.path = path;
+	texture.file = std::make_shared<MappedFile>();
+	if (!texture.file->Open(path)) return false;
+	std::string error;
+	if (!Ktx2::parse(texture.file->GetData(), texture.file->GetSize(), texture.info, error)) {
+		std::cerr << "Cannot stream " << path << ": " << error << std::endl;
+		return false;
+	}
+
+	// The tail is the first level small enough, or the coarsest one the
+	// texture can start at if none is
+	uint32_t levelCount = static_cast<uint32_t>(texture.info.levels.size());
+	for (uint32_t level = 0; level < levelCount; ++level) {
+		if (!IsValidFirstLevel(texture, level)) continue;
+		texture.tailLevel = level;
+		uint32_t size = std::max(MipFilter::mipLevelSize(texture.info.width, level), MipFilter::mipLevelSize(texture.info.height, level));
+		if (size <= TailSize) break;
+	}
+
+	// The finest level the quality tier keeps, which is the tail at most
+	texture.firstLevel = texture.tailLevel;
+	for (uint32_t level = Loader::firstLoadedLevel(texture.info.width, texture.info.height); level < texture.tailLevel; ++level) {
+		if (!IsValidFirstLevel(texture, level)) continue;
+		texture.firstLevel = level;
+		break;
+	}
+
+	handle->width = texture.info.width;
+	handle->height = texture.info.height;
+	texture.handle = handle;
+	texture.residentLevel = levelCount;
+	texture.requestedLevel = NotRequested;
+	if (!SwapLevel(texture, *handle, texture.tailLevel)) return false;
+
+	// An entry of an expired texture may have the same address
+	m_textures.erase(handle.get());
+	m_textures.emplace(handle.get(), std::move(texture));
+	return true;
+}
+
+void TextureStreamer::Request(const TextureHandle& texture, float level)
+{
+	auto it = m_textures.find(texture.get());
+	if (it == m_textures.end()) return;
+	it->second.requestedLevel = std::min(it->second.requestedLevel, level);
+}
+
+void TextureStreamer::Update()
+{
+	++m_frame;
+	m_stats.streamedIn = 0;
+	m_stats.streamedOut = 0;
+
+	// The copies of the last frame are submitted
+	for (Texture& texture : m_retiredTextures) {
+		texture.destroy();
+		texture.release();
+	}
+	m_retiredTextures.clear();
+
+	// Forget the textures nobody uses anymore, their reads hold the mapping
+	for (auto it = m_textures.begin(); it != m_textures.end();) {
+		it = it->second.handle.expired() ? m_textures.erase(it) : std::next(it);
+	}
+
+	// Level wanted by the requests, rounded to the finer level the texture can start at
+	uint64_t targetBytes = 0;
+	m_stats.requestedBytes = 0;
+	for (auto& entry : m_textures) {
+		StreamedTexture& texture = entry.second;
+		float requested = texture.requestedLevel + m_settings.levelBias;
+		int level = static_cast<int>(texture.tailLevel);
+		if (requested < static_cast<float>(texture.tailLevel)) {
+			level = std::max(static_cast<int>(std::floor(requested)), 0);
+		}
+		while (level > 0 && !IsValidFirstLevel(texture, level)) --level;
+		texture.targetLevel = std::max(static_cast<uint32_t>(level), texture.firstLevel);
+		texture.requestedLevel = NotRequested;
+
+		if (texture.targetLevel <= texture.residentLevel) texture.lastNeededFrame = m_frame;
+		targetBytes += LevelBytes(texture, texture.targetLevel);
+	}
+	m_stats.requestedBytes = targetBytes;
+
+	// Layers of the arrays that hold no texture take memory too
+	uint64_t unusedArrayBytes = m_textureArrays ? m_textureArrays->GetUnusedBytes() : 0;
+	uint64_t budgetBytes = m_settings.budgetBytes - std::min(unusedArrayBytes, m_settings.budgetBytes);
+
+	// Over budget, the largest textures give up their finest level first
+	while (targetBytes > budgetBytes) {
+		StreamedTexture* largest = nullptr;
+		for (auto& entry : m_textures) {
+			StreamedTexture& texture = entry.second;
+			if (texture.targetLevel >= texture.tailLevel) continue;
+			if (!largest || LevelBytes(texture, texture.targetLevel) > LevelBytes(*largest, largest->targetLevel)) {
+				largest = &texture;
+			}
+		}
+		if (!largest) break;
+		uint32_t coarser = largest->targetLevel + 1;
+		while (!IsValidFirstLevel(*largest, coarser)) ++coarser;
+		targetBytes -= LevelBytes(*largest, largest->targetLevel) - LevelBytes(*largest, coarser);
+		largest->targetLevel = coarser;
+	}
+
+	uint64_t residentBytes = 0;
+	for (auto& entry : m_textures) {
+		residentBytes += LevelBytes(entry.second, entry.second.residentLevel);
+	}
+
+	// Swap in the levels that are read, within the upload budget
+	uint64_t uploadedBytes = 0;
+	for (auto& entry : m_textures) {
+		StreamedTexture& texture = entry.second;
+		if (!texture.pendingRead.valid()) continue;
+		if (texture.pendingRead.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+		uint32_t level = std::max(texture.pendingLevel, texture.targetLevel);
+		uint64_t bytes = LevelBytes(texture, level);
+		if (uploadedBytes > 0 && uploadedBytes + bytes > m_settings.uploadBytesPerFrame) continue;
+		texture.pendingRead.get();
+		if (level >= texture.residentLevel) continue;
+		uint64_t previousBytes = LevelBytes(texture, texture.residentLevel);
+		if (SwapLevel(texture, *texture.handle.lock(), level)) {
+			uploadedBytes += bytes;
+			residentBytes += bytes - previousBytes;
+			++m_stats.streamedIn;
+		}
+	}
+
+	// Evict the levels that are not needed anymore, right away when over budget
+	for (auto& entry : m_textures) {
+		StreamedTexture& texture = entry.second;
+		if (texture.targetLevel <= texture.residentLevel) continue;
+		bool expired = m_frame - texture.lastNeededFrame > m_settings.evictionDelay;
+		if (!expired && residentBytes <= budgetBytes) continue;
+		uint64_t previousBytes = LevelBytes(texture, texture.residentLevel);
+		if (SwapLevel(texture, *texture.handle.lock(), texture.targetLevel)) {
+			residentBytes -= previousBytes - LevelBytes(texture, texture.residentLevel);
+			++m_stats.streamedOut;
+		}
+	}
+
+	// Read the missing levels, those furthest from their target first
+	std::vector<StreamedTexture*> missing;
+	uint32_t pendingReads = 0;
+	for (auto& entry : m_textures) {
+		StreamedTexture& texture = entry.second;
+		if (texture.pendingRead.valid()) ++pendingReads;
+		else if (texture.targetLevel < texture.residentLevel) missing.push_back(&texture);
+	}
+	std::sort(missing.begin(), missing.end(), [](const StreamedTexture* a, const StreamedTexture* b) {
+		return a->residentLevel - a->targetLevel > b->residentLevel - b->targetLevel;
+	});
+	for (StreamedTexture* texture : missing) {
+		if (pendingReads >= m_settings.maxConcurrentReads) break;
+		// Only the new levels are read, coarser ones were read by the
+		// previous level changes. Touching their pages is enough, the
+		// mapping then reads them from memory when the texture is created.
+		std::vector<Ktx2::Level> newLevels(texture->info.levels.begin() + texture->targetLevel, texture->info.levels.begin() + texture->residentLevel);
+		std::shared_ptr<MappedFile> file = texture->file;
+		texture->pendingLevel = texture->targetLevel;
+		texture->pendingRead = ThreadPool::Shared().Submit([file, newLevels]() {
+			volatile unsigned char sink = 0;
+			for (const Ktx2::Level& level : newLevels) {
+				for (uint64_t offset = 0; offset < level.size; offset += PageSize) {
+					sink = sink ^ file->GetData()[level.offset + offset];
+				}
+			}
+		});
+		++pendingReads;
+	}
+
+	m_stats.textureCount = static_cast<uint32_t>(m_textures.size());
+	m_stats.pendingReads = pendingReads;
+	m_stats.residentBytes = residentBytes;
+}
+
+bool TextureStreamer::IsValidFirstLevel(const StreamedTexture& texture, uint32_t level)
+{
+	uint32_t blockSize = Ktx2::blockSize(texture.info.vkFormat);
+	return MipFilter::mipLevelSize(texture.info.width, level) % blockSize == 0
+		&& MipFilter::mipLevelSize(texture.info.height, level) % blockSize == 0;
+}
+
+uint64_t TextureStreamer::LevelBytes(const StreamedTexture& texture, uint32_t level)
+{
+	uint64_t bytes = 0;
+	for (uint32_t i = level; i < texture.info.levels.size(); ++i) {
+		bytes += texture.info.levels[i].size;
+	}
+	return bytes;
+}
+
+bool TextureStreamer::SwapLevel(StreamedTexture& texture, SharedTexture& shared, uint32_t level)
+{
+	TextureDescriptor textureDesc;
+	Texture newTexture = Loader::createKtx2Texture(texture.file->GetData(), texture.file->GetSize(), texture.path, m_device, textureDesc, level);
+	if (!newTexture) return false;
+
+	// Bind groups hold their own reference to the previous view
+	if (shared.view) shared.view.release();
+	if (shared.texture) m_retiredTextures.push_back(shared.texture);
+	shared.texture = newTexture;
+	shared.view = Loader::createTextureView(newTexture, textureDesc);
+	++shared.generation;
+	texture.residentLevel = level;
+	return true;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "Ktx2.h"
+#include "MappedFile.h"
+#include "TextureRegistry.h"
+
+class TextureArrays;
+
+// Streams the mip levels of textures in and out depending on how large they
+// appear on screen, so that texture memory stays within a budget however many
+// textures the scene references.
+//
+// Textures are read from KTX2 files (see Loader::streamableTexturePath) that
+// stay mapped in memory. A texture starts with only its mip tail (the levels
+// of at most TailSize texels), then objects request every frame the level at
+// which a texel covers about a pixel. The pages of finer levels are read on
+// the worker threads, and a texture changes level by being created again with
+// its new levels. This bumps SharedTexture::generation, telling the users of
+// the texture to rebuild their bind groups with the new view. Levels finer
+// than the quality tier allows (see Loader::setTextureQuality) are never
+// streamed in.
+class TextureStreamer {
+public:
+	static constexpr uint32_t TailSize = 64;
+
+	struct Settings {
+		// GPU memory of all the streamed textures, and of the unused layers
+		// of the texture arrays they are packed in
+		uint64_t budgetBytes = 128ull << 20;
+		// Bytes of textures created again per frame
+		uint64_t uploadBytesPerFrame = 16ull << 20;
+		// Level reads in flight on the worker threads
+		uint32_t maxConcurrentReads = 4;
+		// Frames a level stays resident once it is not needed anymore
+		uint32_t evictionDelay = 60;
+		// Added to the requested levels, positive for blurrier textures
+		float levelBias = 0.0f;
+	};
+
+	struct Stats {
+		uint32_t textureCount = 0;
+		uint32_t pendingReads = 0;
+		uint64_t residentBytes = 0;
+		uint64_t requestedBytes = 0; // if all the requests were met
+		uint32_t streamedIn = 0; // during the last frame
+		uint32_t streamedOut = 0; // during the last frame
+	};
+
+	void Init(wgpu::Device device);
+	void Terminate();
+
+	// When set, the layers of the arrays that no texture uses count in the
+	// budget. Textures are packed in arrays whose shape changes with their
+	// resident levels (see TextureArrays), so the arrays hold free layers.
+	void SetTextureArrays(const TextureArrays* textureArrays) { m_textureArrays = textureArrays; }
+
+	// Stream the texture of the KTX2 file at `path` into `handle`, starting
+	// with its mip tail only. The texture the handle held until then (e.g. a
+	// placeholder) is replaced like on a level change. Returns false if the
+	// file cannot be loaded.
+	bool Open(const std::filesystem::path& path, const TextureHandle& handle);
+
+	// Ask for `level` of `texture` to be resident. The finest level requested
+	// during a frame wins, and textures that are not requested fall back to
+	// their mip tail. Ignores textures that are not streamed.
+	void Request(const TextureHandle& texture, float level);
+
+	// Apply the requests of the frame within the budget: swap in the levels
+	// that are read, start new reads and evict levels. Call once per frame,
+	// before the upload manager records its copies.
+	void Update();
+
+	Settings& GetSettings() { return m_settings; }
+	const Stats& GetStats() const { return m_stats; }
+
+private:
+	struct StreamedTexture {
+		std::weak_ptr<SharedTexture> handle;
+		std::filesystem::path path;
+		std::shared_ptr<MappedFile> file; // shared with the reads in flight
+		Ktx2::Info info;
+		uint32_t tailLevel = 0;
+		uint32_t firstLevel = 0; // finest level streamed in, see Loader::firstLoadedLevel
+		uint32_t residentLevel = 0; // finest level in the GPU texture
+		uint32_t targetLevel = 0; // for this frame, once within the budget
+		float requestedLevel = 0.0f;
+		uint64_t lastNeededFrame = 0; // last frame residentLevel was needed
+		std::future<void> pendingRead;
+		uint32_t pendingLevel = 0;
+	};
+
+	// Whether the texture can start at `level`, which for block compressed
+	// formats must be made of whole blocks
+	static bool IsValidFirstLevel(const StreamedTexture& texture, uint32_t level);
+	// Bytes of the levels from `level` to the last one
+	static uint64_t LevelBytes(const StreamedTexture& texture, uint32_t level);
+	// Create the texture again with its levels from `level`
+	bool SwapLevel(StreamedTexture& texture, SharedTexture& shared, uint32_t level);
+
+private:
+	wgpu::Device m_device = nullptr;
+	const TextureArrays* m_textureArrays = nullptr;
+	Settings m_settings;
+	Stats m_stats;
+
+	std::unordered_map<const SharedTexture*, StreamedTexture> m_textures;
+	// Textures replaced during the last frame, which its copies may still
+	// target, destroyed at the next update
+	std::vector<wgpu::Texture> m_retiredTextures;
+	uint64_t m_frame = 0;
+};
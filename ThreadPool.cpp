@@ -0,0 +1,190 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int threadCount)
+{
+#ifndef __EMSCRIPTEN__
+	if (threadCount == 0) {
+		unsigned int hardwareThreads = std::thread::hardware_concurrency();
+		threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+	}
+
+	m_workers.reserve(threadCount);
+	for (unsigned int i = 0; i < threadCount; ++i) {
+		m_workers.emplace_back([this]() { WorkerLoop(); });
+	}
+#else
+	threadCount += 0; // avoid warning, tasks run inline
+#endif // __EMSCRIPTEN__
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_condition.notify_all();
+
+	for (std::thread& worker : m_workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+	if (begin >= end) return;
+	grain = std::max<size_t>(grain, 1);
+
+	size_t chunkCount = (end - begin + grain - 1) / grain;
+	if (chunkCount == 1 || m_workers.empty()) {
+		body(begin, end);
+		return;
+	}
+
+	// Workers and the calling thread pull chunk indices from a shared counter
+	struct Shared {
+		std::atomic<size_t> nextChunk{ 0 };
+		std::atomic<size_t> doneChunks{ 0 };
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+	auto shared = std::make_shared<Shared>();
+
+	auto runChunks = [shared, begin, end, grain, chunkCount, &body]() {
+		for (;;) {
+			size_t chunk = shared->nextChunk.fetch_add(1);
+			if (chunk >= chunkCount) return;
+
+			size_t chunkBegin = begin + chunk * grain;
+			body(chunkBegin, std::min(chunkBegin + grain, end));
+
+			if (shared->doneChunks.fetch_add(1) + 1 == chunkCount) {
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				shared->finished.notify_all();
+			}
+		}
+	};
+
+	size_t helperCount = std::min<size_t>(m_workers.size(), chunkCount - 1);
+	for (size_t i = 0; i < helperCount; ++i) {
+		Enqueue(runChunks);
+	}
+	runChunks();
+
+	// Helpers that start after this point find no chunk left and return
+	// immediately, so `body` is never called once we leave this function.
+	std::unique_lock<std::mutex> lock(shared->mutex);
+	shared->finished.wait(lock, [&]() { return shared->doneChunks.load() == chunkCount; });
+}
+
+void ThreadPool::ParallelForOrdered(size_t begin, size_t end, size_t grain,
+	const std::function<void(size_t, size_t)>& body,
+	const std::function<void(size_t, size_t)>& consume)
+{
+	if (begin >= end) return;
+	grain = std::max<size_t>(grain, 1);
+
+	size_t chunkCount = (end - begin + grain - 1) / grain;
+	if (chunkCount == 1 || m_workers.empty()) {
+		for (size_t chunkBegin = begin; chunkBegin < end; chunkBegin += grain) {
+			size_t chunkEnd = std::min(chunkBegin + grain, end);
+			body(chunkBegin, chunkEnd);
+			consume(chunkBegin, chunkEnd);
+		}
+		return;
+	}
+
+	struct Shared {
+		std::atomic<size_t> nextChunk{ 0 };
+		std::unique_ptr<std::atomic<bool>[]> doneChunks;
+		std::mutex mutex;
+		std::condition_variable progress;
+	};
+	auto shared = std::make_shared<Shared>();
+	shared->doneChunks.reset(new std::atomic<bool>[chunkCount]);
+	for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+		shared->doneChunks[chunk].store(false);
+	}
+
+	auto runChunk = [shared, begin, end, grain, &body](size_t chunk) {
+		size_t chunkBegin = begin + chunk * grain;
+		body(chunkBegin, std::min(chunkBegin + grain, end));
+		shared->doneChunks[chunk].store(true, std::memory_order_release);
+		// Taking the lock orders this with the predicate check of the waiter
+		{ std::lock_guard<std::mutex> lock(shared->mutex); }
+		shared->progress.notify_all();
+	};
+
+	size_t helperCount = std::min<size_t>(m_workers.size(), chunkCount - 1);
+	for (size_t i = 0; i < helperCount; ++i) {
+		Enqueue([shared, chunkCount, runChunk]() {
+			for (;;) {
+				size_t chunk = shared->nextChunk.fetch_add(1);
+				if (chunk >= chunkCount) return;
+				runChunk(chunk);
+			}
+		});
+	}
+
+	size_t nextToConsume = 0;
+	while (nextToConsume < chunkCount) {
+		// Consume everything that is ready, in order
+		while (nextToConsume < chunkCount && shared->doneChunks[nextToConsume].load(std::memory_order_acquire)) {
+			size_t chunkBegin = begin + nextToConsume * grain;
+			consume(chunkBegin, std::min(chunkBegin + grain, end));
+			++nextToConsume;
+		}
+		if (nextToConsume == chunkCount) break;
+
+		// Then help with the remaining chunks, or wait for the next one
+		size_t chunk = shared->nextChunk.fetch_add(1);
+		if (chunk < chunkCount) {
+			runChunk(chunk);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(shared->mutex);
+		shared->progress.wait(lock, [&]() { return shared->doneChunks[nextToConsume].load(std::memory_order_acquire); });
+	}
+}
+
+unsigned int ThreadPool::GetThreadCount() const
+{
+	return static_cast<unsigned int>(m_workers.size());
+}
+
+ThreadPool& ThreadPool::Shared()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::Enqueue(std::function<void()> task)
+{
+	if (m_workers.empty()) {
+		task();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push(std::move(task));
+	}
+	m_condition.notify_one();
+}
+
+void ThreadPool::WorkerLoop()
+{
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+			if (m_stopping && m_tasks.empty()) return;
+			task = std::move(m_tasks.front());
+			m_tasks.pop();
+		}
+		task();
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads consuming a FIFO of tasks.
+// When built without thread support (Emscripten), tasks run inline on the
+// calling thread so callers do not need a separate code path.
+class ThreadPool {
+public:
+	// A threadCount of 0 picks one worker per hardware thread, minus the main one.
+	explicit ThreadPool(unsigned int threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Queue a task and get a future on its result.
+	template<typename F>
+	auto Submit(F&& task) -> std::future<decltype(task())>;
+
+	// Run body(chunkBegin, chunkEnd) over [begin, end) split in chunks of at
+	// most `grain` items, and return once all chunks are done. The calling
+	// thread takes chunks too, so this is safe to call from inside a task.
+	void ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+	// Same as ParallelFor, and also call consume(chunkBegin, chunkEnd) on the
+	// calling thread for each chunk, in order, as soon as it and all the chunks
+	// before it are done. Used to hand results to APIs that are not thread
+	// safe (like queue writes) while the next chunks are still being computed.
+	void ParallelForOrdered(size_t begin, size_t end, size_t grain,
+		const std::function<void(size_t, size_t)>& body,
+		const std::function<void(size_t, size_t)>& consume);
+
+	unsigned int GetThreadCount() const;
+
+	// Pool shared by the loaders and the renderer.
+	static ThreadPool& Shared();
+
+private:
+	void Enqueue(std::function<void()> task);
+	void WorkerLoop();
+
+private:
+	std::vector<std::thread> m_workers;
+	std::queue<std::function<void()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_stopping = false;
+};
+
+
+template<typename F>
+auto ThreadPool::Submit(F&& task) -> std::future<decltype(task())>
+{
+	using Result = decltype(task());
+	// std::function needs a copyable callable, hence the shared_ptr
+	auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+	std::future<Result> future = packaged->get_future();
+	Enqueue([packaged]() { (*packaged)(); });
+	return future;
+}
@@ -0,0 +1,227 @@
+#include "UploadManager.h"
+
+#include "Loader.h"
+
+#ifdef __EMSCRIPTEN__
+#  include <emscripten.h>
+#endif // __EMSCRIPTEN__
+
+#include "Helper.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+	// copyBufferToTexture needs bytesPerRow to be a multiple of this, which
+	// also satisfies the alignment of the offset for any texel format.
+	constexpr uint64_t CopyAlignment = 256;
+
+	uint64_t alignUp(uint64_t value, uint64_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+} // namespace
+
+bool UploadManager::Init(Device device)
+{
+	m_device = device;
+	m_queue = device.getQueue();
+	m_currentChunk = CreateChunk();
+	return m_chunks[m_currentChunk]->buffer != nullptr;
+}
+
+void UploadManager::Terminate()
+{
+	if (!m_device) return;
+	m_pendingCopies.clear();
+	// Mapping callbacks point to the chunks, they must have run
+	while (std::any_of(m_chunks.begin(), m_chunks.end(), [](const std::unique_ptr<Chunk>& chunk) { return chunk->mapping; })) {
+		Helper::wgpuPollEvents(m_device, true);
+	}
+	for (std::unique_ptr<Chunk>& chunk : m_chunks) {
+		ReleaseBuffer(*chunk);
+	}
+	m_chunks.clear();
+	m_queue.release();
+	m_queue = nullptr;
+	m_device = nullptr;
+}
+
+void UploadManager::WriteTexture(const ImageCopyTexture& destination, const void* data, size_t dataSize,
+	const TextureDataLayout& layout, const Extent3D& writeSize)
+{
+	uint32_t rowCount = static_cast<uint32_t>((dataSize - layout.offset) / layout.bytesPerRow);
+	if (rowCount == 0) return;
+	// 4 texels per row of blocks for compressed formats, 1 otherwise
+	Texture texture = destination.texture;
+	uint32_t rowHeight = Loader::blockSize(texture.getFormat());
+	uint32_t stagedBytesPerRow = static_cast<uint32_t>(alignUp(layout.bytesPerRow, CopyAlignment));
+	uint32_t rowsPerChunk = static_cast<uint32_t>(ChunkSize / stagedBytesPerRow);
+
+	// Large levels are split in bands of rows that fit in a chunk
+	const unsigned char* rows = static_cast<const unsigned char*>(data) + layout.offset;
+	for (uint32_t firstRow = 0; firstRow < rowCount; firstRow += rowsPerChunk) {
+		uint32_t bandRows = std::min(rowsPerChunk, rowCount - firstRow);
+		uint64_t offset = 0;
+		uint32_t chunkIndex = Allocate(static_cast<uint64_t>(stagedBytesPerRow) * bandRows, offset);
+		if (chunkIndex == InvalidChunk) {
+			std::cerr << "Could not get a staging buffer, texture upload dropped" << std::endl;
+			return;
+		}
+		unsigned char* staged = m_chunks[chunkIndex]->mapped + offset;
+		for (uint32_t row = 0; row < bandRows; ++row) {
+			std::memcpy(staged + static_cast<size_t>(row) * stagedBytesPerRow, rows + static_cast<size_t>(firstRow + row) * layout.bytesPerRow, layout.bytesPerRow);
+		}
+
+		PendingCopy copy;
+		copy.chunk = chunkIndex;
+		copy.offset = offset;
+		copy.bytesPerRow = stagedBytesPerRow;
+		copy.rowCount = bandRows;
+		copy.destination = destination;
+		copy.destination.origin.y += firstRow * rowHeight;
+		copy.size = { writeSize.width, std::min(bandRows * rowHeight, writeSize.height - firstRow * rowHeight), 1 };
+		m_pendingCopies.push_back(copy);
+		++m_frameStats.copies;
+		m_frameStats.bytes += static_cast<uint64_t>(stagedBytesPerRow) * bandRows;
+	}
+}
+
+void UploadManager::RecordCopies(CommandEncoder encoder)
+{
+	// A buffer must be unmapped to be used by the GPU
+	for (std::unique_ptr<Chunk>& chunk : m_chunks) {
+		if (chunk->inFrame) {
+			chunk->buffer.unmap();
+			chunk->mapped = nullptr;
+		}
+	}
+
+	for (const PendingCopy& copy : m_pendingCopies) {
+		ImageCopyBuffer source;
+		source.buffer = m_chunks[copy.chunk]->buffer;
+		source.layout.offset = copy.offset;
+		source.layout.bytesPerRow = copy.bytesPerRow;
+		source.layout.rowsPerImage = copy.rowCount;
+		encoder.copyBufferToTexture(source, copy.destination, copy.size);
+	}
+	m_pendingCopies.clear();
+}
+
+void UploadManager::OnSubmitted()
+{
+	// Chunks are written again once the GPU is done copying from them
+	for (uint32_t i = 0; i < m_chunks.size(); ++i) {
+		Chunk& chunk = *m_chunks[i];
+		if (!chunk.inFrame) continue;
+		chunk.inFrame = false;
+		chunk.used = 0;
+		chunk.mapping = true;
+		chunk.mapCallback = chunk.buffer.mapAsync(MapMode::Write, 0, ChunkSize, [this, i](BufferMapAsyncStatus status) {
+			Chunk& mappedChunk = *m_chunks[i];
+			mappedChunk.mapping = false;
+			if (status == BufferMapAsyncStatus::Success) {
+				mappedChunk.mapped = static_cast<unsigned char*>(mappedChunk.buffer.getMappedRange(0, ChunkSize));
+			}
+			else {
+				// The buffer would never come back in the ring, Allocate()
+				// replaces it by a new one
+				std::cerr << "Could not map a staging buffer" << std::endl;
+				mappedChunk.lost = true;
+			}
+		});
+	}
+
+	m_frameStats.chunks = static_cast<uint32_t>(m_chunks.size());
+	m_stats = m_frameStats;
+	m_frameStats = Stats();
+}
+
+void UploadManager::Flush()
+{
+	if (m_pendingCopies.empty()) return;
+	CommandEncoderDescriptor encoderDesc = {};
+	encoderDesc.label = "Texture uploads";
+	CommandEncoder encoder = m_device.createCommandEncoder(encoderDesc);
+	RecordCopies(encoder);
+	CommandBufferDescriptor cmdBufferDescriptor = {};
+	cmdBufferDescriptor.label = "Texture uploads";
+	CommandBuffer command = encoder.finish(cmdBufferDescriptor);
+	encoder.release();
+	m_queue.submit(1, &command);
+	command.release();
+	OnSubmitted();
+}
+
+uint32_t UploadManager::Allocate(uint64_t size, uint64_t& offset)
+{
+	for (;;) {
+		// Keep filling the current chunk...
+		Chunk& current = *m_chunks[m_currentChunk];
+		uint64_t start = alignUp(current.used, CopyAlignment);
+		if (current.mapped != nullptr && start + size <= ChunkSize) {
+			offset = start;
+			current.used = start + size;
+			current.inFrame = true;
+			return m_currentChunk;
+		}
+
+		// ...then move to a chunk that the GPU is done with, or to a new one
+		for (std::unique_ptr<Chunk>& chunk : m_chunks) {
+			if (chunk->lost) {
+				ReleaseBuffer(*chunk);
+				CreateBuffer(*chunk);
+			}
+		}
+		auto free = std::find_if(m_chunks.begin(), m_chunks.end(), [](const std::unique_ptr<Chunk>& chunk) {
+			return chunk->mapped != nullptr && chunk->used == 0;
+		});
+		if (free != m_chunks.end()) {
+			m_currentChunk = static_cast<uint32_t>(free - m_chunks.begin());
+			continue;
+		}
+		if (m_chunks.size() < MaxChunks) {
+			m_currentChunk = CreateChunk();
+			continue;
+		}
+
+		// The ring is full: submit what it holds and wait for a chunk, unless
+		// none is on its way back (their buffers could not be created again)
+		Flush();
+		if (std::none_of(m_chunks.begin(), m_chunks.end(), [](const std::unique_ptr<Chunk>& chunk) { return chunk->mapping; })) {
+			return InvalidChunk;
+		}
+		Helper::wgpuPollEvents(m_device, true);
+	}
+}
+
+uint32_t UploadManager::CreateChunk()
+{
+	auto chunk = std::make_unique<Chunk>();
+	CreateBuffer(*chunk);
+	m_chunks.push_back(std::move(chunk));
+	return static_cast<uint32_t>(m_chunks.size() - 1);
+}
+
+void UploadManager::CreateBuffer(Chunk& chunk)
+{
+	BufferDescriptor bufferDesc;
+	bufferDesc.label = "Texture staging";
+	bufferDesc.size = ChunkSize;
+	bufferDesc.usage = BufferUsage::MapWrite | BufferUsage::CopySrc;
+	bufferDesc.mappedAtCreation = true;
+	chunk.buffer = m_device.createBuffer(bufferDesc);
+	chunk.mapped = chunk.buffer ? static_cast<unsigned char*>(chunk.buffer.getMappedRange(0, ChunkSize)) : nullptr;
+	chunk.used = 0;
+	// Retried by the next Allocate() if the buffer could not be created
+	chunk.lost = chunk.mapped == nullptr;
+}
+
+void UploadManager::ReleaseBuffer(Chunk& chunk)
+{
+	if (!chunk.buffer) return;
+	chunk.buffer.destroy();
+	chunk.buffer.release();
+	chunk.buffer = nullptr;
+	chunk.mapped = nullptr;
+}
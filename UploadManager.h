@@ -0,0 +1,95 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Batches texture uploads: texels are written into a ring of persistently
+// mapped staging buffers, and the copies to the textures are all recorded in
+// the command encoder of the next frame, rather than each mip level being its
+// own Queue::writeTexture.
+//
+// A staging chunk that was used by a frame is mapped again asynchronously
+// once the GPU is done copying from it, which is when it comes back in the
+// ring (a chunk that fails to map gets a new buffer instead). Rows are laid
+// out with the 256 byte alignment of bytesPerRow that copyBufferToTexture
+// requires, so callers can pass tightly packed data.
+class UploadManager {
+public:
+	// Size of one staging buffer of the ring, larger uploads are split by rows
+	static constexpr uint64_t ChunkSize = 8 << 20;
+	// Beyond this many chunks, writing waits for the GPU to free one
+	static constexpr uint32_t MaxChunks = 8;
+
+	struct Stats {
+		uint32_t copies = 0; // recorded in the last frame
+		uint64_t bytes = 0; // staged for the last frame, with row padding
+		uint32_t chunks = 0;
+	};
+
+	bool Init(wgpu::Device device);
+	void Terminate();
+	bool IsInitialized() const { return m_device != nullptr; }
+
+	// Same arguments as Queue::writeTexture, for a 2D region whose rows (of
+	// texels or of blocks) are `layout.bytesPerRow` bytes apart in `data`.
+	// The data is copied right away, the texture is written by the next
+	// RecordCopies() or Flush().
+	void WriteTexture(const wgpu::ImageCopyTexture& destination, const void* data, size_t dataSize,
+		const wgpu::TextureDataLayout& layout, const wgpu::Extent3D& writeSize);
+
+	bool HasPendingCopies() const { return !m_pendingCopies.empty(); }
+
+	// Record the pending copies at the beginning of `encoder`, then call
+	// OnSubmitted() once the command buffer is submitted.
+	void RecordCopies(wgpu::CommandEncoder encoder);
+	void OnSubmitted();
+
+	// Submit the pending copies on their own, for when a texture must be
+	// written before the next frame (e.g. before generating its mip levels).
+	void Flush();
+
+	const Stats& GetStats() const { return m_stats; }
+
+private:
+	struct Chunk {
+		wgpu::Buffer buffer = nullptr;
+		unsigned char* mapped = nullptr; // nullptr while used by the GPU
+		uint64_t used = 0;
+		bool inFrame = false; // holds data of the pending copies
+		bool mapping = false; // waiting for the GPU to be done with it
+		bool lost = false; // its buffer could not be mapped, to create again
+		std::unique_ptr<wgpu::BufferMapCallback> mapCallback;
+	};
+
+	struct PendingCopy {
+		uint32_t chunk;
+		uint64_t offset;
+		uint32_t bytesPerRow;
+		uint32_t rowCount;
+		wgpu::ImageCopyTexture destination;
+		wgpu::Extent3D size;
+	};
+
+	static constexpr uint32_t InvalidChunk = ~0u;
+
+	// Find room for `size` bytes aligned for a copy, waiting for the GPU if
+	// the ring is full. Returns the index of the chunk, or InvalidChunk if no
+	// staging buffer can be created anymore (e.g. the device is lost).
+	uint32_t Allocate(uint64_t size, uint64_t& offset);
+	uint32_t CreateChunk();
+	// Give the chunk a new buffer, mapped at creation
+	void CreateBuffer(Chunk& chunk);
+	void ReleaseBuffer(Chunk& chunk);
+
+private:
+	wgpu::Device m_device = nullptr;
+	wgpu::Queue m_queue = nullptr;
+	std::vector<std::unique_ptr<Chunk>> m_chunks;
+	uint32_t m_currentChunk = 0;
+	std::vector<PendingCopy> m_pendingCopies;
+	Stats m_stats;
+	Stats m_frameStats;
+};
@@ -0,0 +1,874 @@
+#include "VirtualTextures.h"
+
+#include "Ktx2.h"
+#include "Loader.h"
+#include "ThreadPool.h"
+#include "UploadManager.h"
+
+#ifdef __EMSCRIPTEN__
+#  include <emscripten.h>
+#endif // __EMSCRIPTEN__
+
+#include "Helper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+	constexpr uint32_t VtexMagic = 0x58455456; // "VTEX"
+	constexpr uint32_t VtexVersion = 1;
+	constexpr uint64_t OsPageSize = 4096;
+	// copyTextureToBuffer needs bytesPerRow to be a multiple of this
+	constexpr uint32_t CopyAlignment = 256;
+
+	// Followed by the pages of each level, from level 0 to the tail, in rows.
+	// Each page takes SlotSize x SlotSize texels of `vkFormat`.
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t pageSize;
+		uint32_t border;
+		uint32_t levelCount;
+		uint32_t vkFormat;
+	};
+
+	// Format of the pages of a kind, the format of its cache
+	uint32_t pageFormat(MipFilter::TextureKind kind) {
+		return kind == MipFilter::TextureKind::Normal ? Ktx2::R8G8Unorm : Ktx2::R8G8B8A8Srgb;
+	}
+
+	uint32_t bytesPerTexel(uint32_t vkFormat) {
+		return vkFormat == Ktx2::R8G8Unorm ? 2 : 4;
+	}
+
+	// Levels down to the first one that fits in a single page
+	uint32_t pageLevelCount(uint32_t width, uint32_t height) {
+		uint32_t levelCount = 1;
+		while (std::max(MipFilter::mipLevelSize(width, levelCount - 1), MipFilter::mipLevelSize(height, levelCount - 1)) > VirtualTextures::PageSize) {
+			++levelCount;
+		}
+		return levelCount;
+	}
+
+	uint32_t pageCount(uint32_t size, uint32_t level) {
+		return (MipFilter::mipLevelSize(size, level) + VirtualTextures::PageSize - 1) / VirtualTextures::PageSize;
+	}
+
+	// Coordinates wrap around like with the Repeat address mode, so that
+	// borders match the other side of the texture
+	uint32_t wrap(int64_t coordinate, uint32_t size) {
+		return static_cast<uint32_t>(((coordinate % size) + size) % size);
+	}
+
+	// Copy page (pageX, pageY) of a level and its border, keeping the first
+	// `texelBytes` channels of the RGBA8 pixels
+	void cutPage(const unsigned char* pixels, uint32_t width, uint32_t height, uint32_t pageX, uint32_t pageY, uint32_t texelBytes, unsigned char* page) {
+		constexpr int64_t Border = VirtualTextures::Border;
+		for (uint32_t y = 0; y < VirtualTextures::SlotSize; ++y) {
+			uint32_t sourceY = wrap(static_cast<int64_t>(pageY) * VirtualTextures::PageSize + y - Border, height);
+			const unsigned char* row = pixels + 4 * static_cast<size_t>(sourceY) * width;
+			for (uint32_t x = 0; x < VirtualTextures::SlotSize; ++x) {
+				uint32_t sourceX = wrap(static_cast<int64_t>(pageX) * VirtualTextures::PageSize + x - Border, width);
+				std::memcpy(page, row + 4 * static_cast<size_t>(sourceX), texelBytes);
+				page += texelBytes;
+			}
+		}
+	}
+
+	bool needsCooking(const fs::path& imagePath, const fs::path& cookedPath) {
+		std::error_code error;
+		return !fs::exists(cookedPath, error) || fs::last_write_time(cookedPath, error) < fs::last_write_time(imagePath, error);
+	}
+
+	const char* kindName(MipFilter::TextureKind kind) {
+		return kind == MipFilter::TextureKind::Normal ? "normal" : "albedo";
+	}
+} // namespace
+
+bool VirtualTextures::Cook(const fs::path& imagePath, const fs::path& cookedPath, MipFilter::TextureKind kind)
+{
+	if (kind == MipFilter::TextureKind::Mask) return false;
+
+	// Cooking runs on a worker thread (see Open()), it needs the whole mip chain in memory
+	Loader::DecodedImage image;
+	if (!Loader::decodeImage(imagePath, image)) return false;
+	if (image.width > MaxSize || image.height > MaxSize) {
+		std::cerr << "Cannot cook " << imagePath << ": virtual textures are at most " << MaxSize << " texels wide" << std::endl;
+		return false;
+	}
+	uint32_t levelCount = pageLevelCount(image.width, image.height);
+	std::vector<std::vector<unsigned char>> levels(levelCount);
+	MipFilter::ScratchArena scratch;
+	MipFilter::buildMipChain(image.pixels.get(), image.width, image.height, levelCount, kind, scratch,
+		[&](uint32_t level, uint32_t width, uint32_t height, uint32_t firstRow, uint32_t rowCount, const unsigned char* rows) {
+			levels[level].resize(4 * static_cast<size_t>(width) * height);
+			std::memcpy(levels[level].data() + 4 * static_cast<size_t>(width) * firstRow, rows, 4 * static_cast<size_t>(width) * rowCount);
+		});
+
+	// Written aside then renamed, so that an interrupted cook does not leave
+	// a truncated file that looks up to date
+	fs::path partialPath = fs::path(cookedPath).concat(".partial");
+	std::ofstream file(partialPath, std::ios::binary);
+	if (!file.is_open()) return false;
+	FileHeader header = { VtexMagic, VtexVersion, image.width, image.height, PageSize, Border, levelCount, pageFormat(kind) };
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	// Pages are cut a row at a time on the worker threads
+	uint32_t texelBytes = bytesPerTexel(header.vkFormat);
+	size_t pageBytes = static_cast<size_t>(SlotSize) * SlotSize * texelBytes;
+	std::vector<unsigned char> pageRow;
+	uint32_t totalPages = 0;
+	for (uint32_t level = 0; level < levelCount; ++level) {
+		const unsigned char* pixels = level == 0 ? image.pixels.get() : levels[level].data();
+		uint32_t width = MipFilter::mipLevelSize(image.width, level);
+		uint32_t height = MipFilter::mipLevelSize(image.height, level);
+		uint32_t pagesWide = pageCount(image.width, level);
+		uint32_t pagesHigh = pageCount(image.height, level);
+		pageRow.resize(pagesWide * pageBytes);
+		for (uint32_t pageY = 0; pageY < pagesHigh; ++pageY) {
+			ThreadPool::Shared().ParallelFor(0, pagesWide, 1, [&](size_t begin, size_t end) {
+				for (size_t pageX = begin; pageX < end; ++pageX) {
+					cutPage(pixels, width, height, static_cast<uint32_t>(pageX), pageY, texelBytes, pageRow.data() + pageX * pageBytes);
+				}
+			});
+			file.write(reinterpret_cast<const char*>(pageRow.data()), pageRow.size());
+		}
+		totalPages += pagesWide * pagesHigh;
+	}
+	file.close();
+	std::error_code error;
+	if (!file) {
+		std::cerr << "Could not write " << partialPath << std::endl;
+		fs::remove(partialPath, error);
+		return false;
+	}
+	fs::rename(partialPath, cookedPath, error);
+	if (error) {
+		std::cerr << "Could not rename " << partialPath << ": " << error.message() << std::endl;
+		return false;
+	}
+
+	std::cout << "Cooked " << imagePath << " into " << totalPages << " virtual texture pages over " << levelCount << " levels" << std::endl;
+	return true;
+}
+
+bool VirtualTextures::Init(Device device, UploadManager* uploadManager)
+{
+	m_device = device;
+	m_queue = device.getQueue();
+	m_uploadManager = uploadManager;
+	m_textures.reserve(MaxTextures);
+
+	// Caches, with the same slots for both, as large as the device allows
+	SupportedLimits limits;
+	if (m_device.getLimits(&limits) && limits.limits.maxTextureDimension2D >= SlotSize) {
+		m_settings.slotsPerSide = std::min(m_settings.slotsPerSide, limits.limits.maxTextureDimension2D / SlotSize);
+	}
+	uint32_t cacheSize = m_settings.slotsPerSide * SlotSize;
+	for (uint32_t c = 0; c < CacheCount; ++c) {
+		TextureDescriptor textureDesc;
+		textureDesc.label = c == 0 ? "Virtual texture cache (colors)" : "Virtual texture cache (normals)";
+		textureDesc.dimension = TextureDimension::_2D;
+		textureDesc.format = c == 0 ? TextureFormat::RGBA8UnormSrgb : TextureFormat::RG8Unorm;
+		textureDesc.size = { cacheSize, cacheSize, 1 };
+		textureDesc.mipLevelCount = 1;
+		textureDesc.sampleCount = 1;
+		textureDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst;
+		textureDesc.viewFormatCount = 0;
+		textureDesc.viewFormats = nullptr;
+		m_caches[c].texture = m_device.createTexture(textureDesc);
+		m_caches[c].view = Loader::createTextureView(m_caches[c].texture, textureDesc);
+		m_caches[c].slots.assign(m_settings.slotsPerSide * m_settings.slotsPerSide, Slot());
+	}
+
+	// Page table, a layer per texture and a level per texture level
+	TextureDescriptor pageTableDesc;
+	pageTableDesc.label = "Virtual texture page table";
+	pageTableDesc.dimension = TextureDimension::_2D;
+	pageTableDesc.format = TextureFormat::RGBA8Uint;
+	pageTableDesc.size = { PageTableSize, PageTableSize, MaxTextures };
+	pageTableDesc.mipLevelCount = MipFilter::mipLevelCount(PageTableSize, PageTableSize);
+	pageTableDesc.sampleCount = 1;
+	pageTableDesc.usage = TextureUsage::TextureBinding | TextureUsage::CopyDst;
+	pageTableDesc.viewFormatCount = 0;
+	pageTableDesc.viewFormats = nullptr;
+	m_pageTable = m_device.createTexture(pageTableDesc);
+
+	TextureViewDescriptor pageTableViewDesc;
+	pageTableViewDesc.aspect = TextureAspect::All;
+	pageTableViewDesc.baseArrayLayer = 0;
+	pageTableViewDesc.arrayLayerCount = MaxTextures;
+	pageTableViewDesc.baseMipLevel = 0;
+	pageTableViewDesc.mipLevelCount = pageTableDesc.mipLevelCount;
+	pageTableViewDesc.dimension = TextureViewDimension::_2DArray;
+	pageTableViewDesc.format = pageTableDesc.format;
+	m_pageTableView = m_pageTable.createView(pageTableViewDesc);
+
+	BufferDescriptor bufferDesc;
+	bufferDesc.label = "Virtual texture uniforms";
+	bufferDesc.size = sizeof(Uniforms);
+	bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::Uniform;
+	bufferDesc.mappedAtCreation = false;
+	m_uniformBuffer = m_device.createBuffer(bufferDesc);
+	m_uniforms.cacheSize = static_cast<float>(cacheSize);
+	m_queue.writeBuffer(m_uniformBuffer, 0, &m_uniforms, sizeof(Uniforms));
+
+	// Pages are sampled within their borders, without mip levels
+	SamplerDescriptor samplerDesc;
+	samplerDesc.addressModeU = AddressMode::ClampToEdge;
+	samplerDesc.addressModeV = AddressMode::ClampToEdge;
+	samplerDesc.addressModeW = AddressMode::ClampToEdge;
+	samplerDesc.magFilter = FilterMode::Linear;
+	samplerDesc.minFilter = FilterMode::Linear;
+	samplerDesc.mipmapFilter = MipmapFilterMode::Nearest;
+	samplerDesc.lodMinClamp = 0.0f;
+	samplerDesc.lodMaxClamp = 0.0f;
+	samplerDesc.compare = CompareFunction::Undefined;
+	samplerDesc.maxAnisotropy = 1;
+	m_sampler = m_device.createSampler(samplerDesc);
+
+	std::vector<BindGroupLayoutEntry> bindingLayoutEntries(5, Default);
+	bindingLayoutEntries[0].binding = 0;
+	bindingLayoutEntries[0].visibility = ShaderStage::Fragment;
+	bindingLayoutEntries[0].buffer.type = BufferBindingType::Uniform;
+	bindingLayoutEntries[0].buffer.minBindingSize = sizeof(Uniforms);
+
+	bindingLayoutEntries[1].binding = 1;
+	bindingLayoutEntries[1].visibility = ShaderStage::Fragment;
+	bindingLayoutEntries[1].texture.sampleType = TextureSampleType::Uint;
+	bindingLayoutEntries[1].texture.viewDimension = TextureViewDimension::_2DArray;
+
+	for (uint32_t c = 0; c < CacheCount; ++c) {
+		bindingLayoutEntries[2 + c].binding = 2 + c;
+		bindingLayoutEntries[2 + c].visibility = ShaderStage::Fragment;
+		bindingLayoutEntries[2 + c].texture.sampleType = TextureSampleType::Float;
+		bindingLayoutEntries[2 + c].texture.viewDimension = TextureViewDimension::_2D;
+	}
+
+	bindingLayoutEntries[4].binding = 4;
+	bindingLayoutEntries[4].visibility = ShaderStage::Fragment;
+	bindingLayoutEntries[4].sampler.type = SamplerBindingType::Filtering;
+
+	BindGroupLayoutDescriptor bindGroupLayoutDesc{};
+	bindGroupLayoutDesc.entryCount = (uint32_t)bindingLayoutEntries.size();
+	bindGroupLayoutDesc.entries = bindingLayoutEntries.data();
+	m_bindGroupLayout = m_device.createBindGroupLayout(bindGroupLayoutDesc);
+
+	std::vector<BindGroupEntry> bindings(5);
+	bindings[0].binding = 0;
+	bindings[0].buffer = m_uniformBuffer;
+	bindings[0].offset = 0;
+	bindings[0].size = sizeof(Uniforms);
+	bindings[1].binding = 1;
+	bindings[1].textureView = m_pageTableView;
+	for (uint32_t c = 0; c < CacheCount; ++c) {
+		bindings[2 + c].binding = 2 + c;
+		bindings[2 + c].textureView = m_caches[c].view;
+	}
+	bindings[4].binding = 4;
+	bindings[4].sampler = m_sampler;
+
+	BindGroupDescriptor bindGroupDesc;
+	bindGroupDesc.layout = m_bindGroupLayout;
+	bindGroupDesc.entryCount = (uint32_t)bindings.size();
+	bindGroupDesc.entries = bindings.data();
+	m_bindGroup = m_device.createBindGroup(bindGroupDesc);
+
+	CreateFeedbackTargets();
+	return m_bindGroup != nullptr;
+}
+
+void VirtualTextures::Terminate()
+{
+	if (!m_device) return;
+
+	for (auto& entry : m_pendingReads) {
+		entry.second.wait();
+	}
+	m_pendingReads.clear();
+	for (VirtualTexture& texture : m_textures) {
+		if (texture.cooking.valid()) texture.cooking.wait();
+	}
+
+	// Mapping callbacks point to the readbacks, they must have run
+	while (std::any_of(m_readbacks.begin(), m_readbacks.end(), [](const std::unique_ptr<Readback>& readback) { return readback && readback->mapping; })) {
+		Helper::wgpuPollEvents(m_device, true);
+	}
+	for (std::unique_ptr<Readback>& readback : m_readbacks) {
+		if (!readback) continue;
+		if (readback->mapped) readback->buffer.unmap();
+		readback->buffer.destroy();
+		readback->buffer.release();
+		readback = nullptr;
+	}
+	TerminateFeedbackTargets();
+
+	m_bindGroup.release();
+	m_bindGroupLayout.release();
+	m_sampler.release();
+	m_uniformBuffer.destroy();
+	m_uniformBuffer.release();
+	m_pageTableView.release();
+	m_pageTable.destroy();
+	m_pageTable.release();
+	for (Cache& cache : m_caches) {
+		cache.view.release();
+		cache.texture.destroy();
+		cache.texture.release();
+		cache.slots.clear();
+	}
+
+	m_textures.clear();
+	m_ids.clear();
+	m_requests.clear();
+	m_queue.release();
+	m_queue = nullptr;
+	m_device = nullptr;
+}
+
+bool VirtualTextures::ShouldVirtualize(const fs::path& path) const
+{
+	if (path.extension() == ".vtex") return true;
+	int width, height, channels;
+	if (!stbi_info(path.string().c_str(), &width, &height, &channels)) return false;
+	return static_cast<uint32_t>(std::max(width, height)) >= m_settings.minImageSize;
+}
+
+uint32_t VirtualTextures::Open(const fs::path& path, MipFilter::TextureKind kind)
+{
+	if (kind == MipFilter::TextureKind::Mask) {
+		std::cerr << "Cannot open " << path << ": masks cannot be virtual textures" << std::endl;
+		return InvalidId;
+	}
+
+	std::error_code error;
+	fs::path canonicalPath = fs::weakly_canonical(path, error);
+	if (error) canonicalPath = fs::absolute(path, error);
+	std::string key = canonicalPath.string() + "#" + kindName(kind);
+	auto it = m_ids.find(key);
+	if (it != m_ids.end()) return it->second;
+	if (m_textures.size() >= MaxTextures) {
+		std::cerr << "Cannot open " << path << ": there are already " << MaxTextures << " virtual textures" << std::endl;
+		return InvalidId;
+	}
+
+	// Images are cooked next to them, once for each kind. Cooking decodes
+	// the whole image, so it runs on the worker threads and the texture is
+	// opened by Update() once it is done.
+	uint32_t id = static_cast<uint32_t>(m_textures.size());
+	m_textures.emplace_back();
+	VirtualTexture& texture = m_textures.back();
+	texture.path = path;
+	texture.kind = kind;
+	if (path.extension() != ".vtex") {
+		texture.path = fs::path(path).concat(std::string(".") + kindName(kind) + ".vtex");
+		if (needsCooking(path, texture.path)) {
+			texture.cooking = ThreadPool::Shared().Submit([path, cookedPath = texture.path, kind]() {
+				return Cook(path, cookedPath, kind);
+			});
+			m_ids[key] = id;
+			return id;
+		}
+	}
+
+	if (!OpenCooked(id)) {
+		m_textures.pop_back();
+		return InvalidId;
+	}
+	m_ids[key] = id;
+	return id;
+}
+
+bool VirtualTextures::OpenCooked(uint32_t id)
+{
+	VirtualTexture& texture = m_textures[id];
+	const fs::path& cookedPath = texture.path;
+	std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+	if (!file->Open(cookedPath)) return false;
+	FileHeader header;
+	if (file->GetSize() < sizeof(header)) {
+		std::cerr << "Invalid virtual texture " << cookedPath << std::endl;
+		return false;
+	}
+	std::memcpy(&header, file->GetData(), sizeof(header));
+	if (header.magic != VtexMagic || header.version != VtexVersion || header.pageSize != PageSize || header.border != Border
+		|| header.width == 0 || header.height == 0 || header.width > MaxSize || header.height > MaxSize
+		|| header.levelCount != pageLevelCount(header.width, header.height)) {
+		std::cerr << "Invalid virtual texture " << cookedPath << std::endl;
+		return false;
+	}
+	if (header.vkFormat != pageFormat(texture.kind)) {
+		std::cerr << "Cannot open " << cookedPath << ": it was not cooked as a " << kindName(texture.kind) << " texture" << std::endl;
+		return false;
+	}
+
+	uint64_t pageBytes = static_cast<uint64_t>(SlotSize) * SlotSize * bytesPerTexel(header.vkFormat);
+	std::vector<glm::uvec3> levels;
+	uint32_t totalPages = 0;
+	for (uint32_t level = 0; level < header.levelCount; ++level) {
+		glm::uvec3 pages(pageCount(header.width, level), pageCount(header.height, level), totalPages);
+		levels.push_back(pages);
+		totalPages += pages.x * pages.y;
+	}
+	if (file->GetSize() < sizeof(FileHeader) + totalPages * pageBytes) {
+		std::cerr << "Truncated virtual texture " << cookedPath << std::endl;
+		return false;
+	}
+
+	// The tail stays resident, so that every page has a resident ancestor
+	uint32_t cacheIndex = CacheIndex(texture.kind);
+	int32_t slot = AcquireSlot(cacheIndex);
+	if (slot < 0) {
+		std::cerr << "Cannot open " << cookedPath << ": the virtual texture cache is full" << std::endl;
+		return false;
+	}
+	// Only now is the texture open, feedback requests ignore it until then
+	texture.file = file;
+	texture.width = header.width;
+	texture.height = header.height;
+	texture.levelCount = header.levelCount;
+	texture.pageBytes = pageBytes;
+	texture.levels = std::move(levels);
+	texture.slots.assign(totalPages, -1);
+	uint32_t tailPage = totalPages - 1;
+	texture.slots[tailPage] = slot;
+	texture.pageTableChanged = true;
+	m_caches[cacheIndex].slots[slot] = { id, tailPage, m_frame, true };
+	WritePage(id, tailPage, slot);
+
+	m_uniforms.textures[id] = glm::uvec4(header.width, header.height, header.levelCount - 1, 0);
+	m_queue.writeBuffer(m_uniformBuffer, offsetof(Uniforms, textures) + id * sizeof(glm::uvec4), &m_uniforms.textures[id], sizeof(glm::uvec4));
+
+	std::cout << "Opened virtual texture " << cookedPath << " (" << header.width << "x" << header.height << ", " << totalPages << " pages)" << std::endl;
+	return true;
+}
+
+void VirtualTextures::Resize(uint32_t width, uint32_t height)
+{
+	m_screenWidth = width;
+	m_screenHeight = height;
+	if (!m_device) return;
+	TerminateFeedbackTargets();
+	CreateFeedbackTargets();
+}
+
+RenderPassEncoder VirtualTextures::BeginFeedbackPass(CommandEncoder encoder)
+{
+	if (m_textures.empty() || !m_feedbackTexture) return nullptr;
+
+	// A readback the CPU is done with, of the size of the feedback
+	uint32_t width = m_feedbackTexture.getWidth();
+	uint32_t height = m_feedbackTexture.getHeight();
+	auto free = std::find_if(m_readbacks.begin(), m_readbacks.end(), [](const std::unique_ptr<Readback>& readback) {
+		return !readback || (!readback->mapping && !readback->mapped);
+	});
+	if (free == m_readbacks.end()) return nullptr;
+	if (!*free) *free = std::make_unique<Readback>();
+	Readback& readback = **free;
+	if (!readback.buffer || readback.width != width || readback.height != height) {
+		if (readback.buffer) {
+			readback.buffer.destroy();
+			readback.buffer.release();
+		}
+		readback.width = width;
+		readback.height = height;
+		readback.bytesPerRow = (width * 8 + CopyAlignment - 1) / CopyAlignment * CopyAlignment;
+		BufferDescriptor bufferDesc;
+		bufferDesc.label = "Virtual texture feedback";
+		bufferDesc.size = static_cast<uint64_t>(readback.bytesPerRow) * height;
+		bufferDesc.usage = BufferUsage::CopyDst | BufferUsage::MapRead;
+		bufferDesc.mappedAtCreation = false;
+		readback.buffer = m_device.createBuffer(bufferDesc);
+	}
+	readback.recorded = true;
+
+	// Pixels that no virtual object covers request nothing
+	RenderPassColorAttachment colorAttachment = {};
+	colorAttachment.view = m_feedbackView;
+	colorAttachment.resolveTarget = nullptr;
+	colorAttachment.loadOp = LoadOp::Clear;
+	colorAttachment.storeOp = StoreOp::Store;
+	colorAttachment.clearValue = WGPUColor{ static_cast<double>(InvalidId), static_cast<double>(InvalidId), 0.0, 0.0 };
+#ifndef WEBGPU_BACKEND_WGPU
+	colorAttachment.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
+#endif // NOT WEBGPU_BACKEND_WGPU
+
+	RenderPassDepthStencilAttachment depthStencilAttachment;
+	depthStencilAttachment.view = m_feedbackDepthView;
+	depthStencilAttachment.depthClearValue = 1.0f;
+	depthStencilAttachment.depthLoadOp = LoadOp::Clear;
+	depthStencilAttachment.depthStoreOp = StoreOp::Discard;
+	depthStencilAttachment.depthReadOnly = false;
+	depthStencilAttachment.stencilClearValue = 0;
+#ifdef WEBGPU_BACKEND_WGPU
+	depthStencilAttachment.stencilLoadOp = LoadOp::Clear;
+	depthStencilAttachment.stencilStoreOp = StoreOp::Store;
+#else
+	depthStencilAttachment.stencilLoadOp = LoadOp::Undefined;
+	depthStencilAttachment.stencilStoreOp = StoreOp::Undefined;
+#endif
+	depthStencilAttachment.stencilReadOnly = true;
+
+	RenderPassDescriptor renderPassDesc = {};
+	renderPassDesc.label = "Virtual texture feedback";
+	renderPassDesc.colorAttachmentCount = 1;
+	renderPassDesc.colorAttachments = &colorAttachment;
+	renderPassDesc.depthStencilAttachment = &depthStencilAttachment;
+	renderPassDesc.timestampWrites = nullptr;
+	return encoder.beginRenderPass(renderPassDesc);
+}
+
+void VirtualTextures::EndFeedbackPass(CommandEncoder encoder, RenderPassEncoder feedbackPass)
+{
+	feedbackPass.end();
+	feedbackPass.release();
+
+	for (std::unique_ptr<Readback>& readback : m_readbacks) {
+		if (!readback || !readback->recorded) continue;
+		ImageCopyTexture source;
+		source.texture = m_feedbackTexture;
+		source.mipLevel = 0;
+		source.origin = { 0, 0, 0 };
+		source.aspect = TextureAspect::All;
+		ImageCopyBuffer destination;
+		destination.buffer = readback->buffer;
+		destination.layout.offset = 0;
+		destination.layout.bytesPerRow = readback->bytesPerRow;
+		destination.layout.rowsPerImage = readback->height;
+		encoder.copyTextureToBuffer(source, destination, { readback->width, readback->height, 1 });
+	}
+}
+
+void VirtualTextures::OnSubmitted()
+{
+	// The feedback is read once the GPU is done writing it
+	for (std::unique_ptr<Readback>& readback : m_readbacks) {
+		if (!readback || !readback->recorded) continue;
+		Readback* mappedReadback = readback.get();
+		mappedReadback->recorded = false;
+		mappedReadback->mapping = true;
+		uint64_t size = static_cast<uint64_t>(mappedReadback->bytesPerRow) * mappedReadback->height;
+		mappedReadback->mapCallback = mappedReadback->buffer.mapAsync(MapMode::Read, 0, size, [mappedReadback](BufferMapAsyncStatus status) {
+			mappedReadback->mapping = false;
+			mappedReadback->mapped = status == BufferMapAsyncStatus::Success;
+		});
+	}
+}
+
+void VirtualTextures::Update()
+{
+	++m_frame;
+	m_stats.uploadedPages = 0;
+	m_stats.evictedPages = 0;
+
+	// Textures whose cook finished are opened, and the objects using them
+	// rebuild their bind groups. One that failed stays closed.
+	for (uint32_t id = 0; id < m_textures.size(); ++id) {
+		VirtualTexture& texture = m_textures[id];
+		if (!texture.cooking.valid() || texture.cooking.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+		if (!texture.cooking.get() || !OpenCooked(id)) {
+			std::cerr << "Could not open virtual texture " << texture.path << std::endl;
+		}
+		++m_generation;
+	}
+
+	// The requests only change when a feedback is read back, a few frames
+	// after it was rendered
+	for (std::unique_ptr<Readback>& readback : m_readbacks) {
+		if (readback && readback->mapped) ReadFeedback(*readback);
+	}
+
+	// Level of a page, from the ranges of page indices of the levels
+	auto pageLevel = [this](uint64_t key) {
+		const VirtualTexture& texture = m_textures[key >> 32];
+		uint32_t page = static_cast<uint32_t>(key);
+		uint32_t level = 0;
+		while (level + 1 < texture.levelCount && page >= texture.levels[level + 1].z) ++level;
+		return level;
+	};
+	// Coarsest levels first, since finer pages fall back to them, then the
+	// pages covering the most pixels
+	auto byPriority = [&](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+		uint32_t levelA = pageLevel(a.first);
+		uint32_t levelB = pageLevel(b.first);
+		return levelA != levelB ? levelA > levelB : a.second > b.second;
+	};
+
+	// Requested pages stay in the caches, missing ones are read
+	std::vector<std::pair<uint64_t, uint32_t>> missing;
+	for (const auto& request : m_requests) {
+		VirtualTexture& texture = m_textures[request.first >> 32];
+		int32_t slot = texture.slots[static_cast<uint32_t>(request.first)];
+		if (slot >= 0) {
+			m_caches[CacheIndex(texture.kind)].slots[slot].lastRequestedFrame = m_frame;
+		}
+		else if (m_pendingReads.find(request.first) == m_pendingReads.end()) {
+			missing.push_back(request);
+		}
+	}
+
+	// Upload the pages that are read, within the budget
+	std::vector<std::pair<uint64_t, uint32_t>> ready;
+	for (auto& read : m_pendingReads) {
+		if (read.second.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+		auto request = m_requests.find(read.first);
+		ready.push_back({ read.first, request != m_requests.end() ? request->second : 0 });
+	}
+	std::sort(ready.begin(), ready.end(), byPriority);
+	for (const auto& page : ready) {
+		if (m_stats.uploadedPages >= m_settings.uploadPagesPerFrame) break;
+		m_pendingReads.erase(page.first);
+		// Not requested anymore
+		if (m_requests.find(page.first) == m_requests.end()) continue;
+		uint32_t id = static_cast<uint32_t>(page.first >> 32);
+		VirtualTexture& texture = m_textures[id];
+		uint32_t cacheIndex = CacheIndex(texture.kind);
+		int32_t slot = AcquireSlot(cacheIndex);
+		if (slot < 0) continue; // every slot is requested, the cache is too small
+		m_caches[cacheIndex].slots[slot] = { id, static_cast<uint32_t>(page.first), m_frame, false };
+		texture.slots[static_cast<uint32_t>(page.first)] = slot;
+		texture.pageTableChanged = true;
+		WritePage(id, static_cast<uint32_t>(page.first), slot);
+		++m_stats.uploadedPages;
+	}
+
+	// Start new reads. Pages are stored in the format of the cache, reading
+	// one is touching the pages of the file mapping, which WritePage() then
+	// copies from memory.
+	std::sort(missing.begin(), missing.end(), byPriority);
+	for (const auto& page : missing) {
+		if (m_pendingReads.size() >= m_settings.maxConcurrentReads) break;
+		const VirtualTexture& texture = m_textures[page.first >> 32];
+		std::shared_ptr<MappedFile> file = texture.file;
+		uint64_t offset = sizeof(FileHeader) + static_cast<uint32_t>(page.first) * texture.pageBytes;
+		uint64_t size = texture.pageBytes;
+		m_pendingReads[page.first] = ThreadPool::Shared().Submit([file, offset, size]() {
+			volatile unsigned char sink = 0;
+			for (uint64_t byte = 0; byte < size; byte += OsPageSize) {
+				sink = sink ^ file->GetData()[offset + byte];
+			}
+			sink = sink ^ file->GetData()[offset + size - 1];
+		});
+	}
+
+	for (uint32_t id = 0; id < m_textures.size(); ++id) {
+		if (!m_textures[id].pageTableChanged) continue;
+		WritePageTable(id);
+		m_textures[id].pageTableChanged = false;
+	}
+
+	// The feedback pass is smaller than the screen, so its derivatives ask
+	// for coarser levels than the pixels of the screen
+	float feedbackLevelBias = m_settings.levelBias - std::log2(static_cast<float>(std::max(m_settings.feedbackScale, 1u)));
+	if (feedbackLevelBias != m_uniforms.feedbackLevelBias) {
+		m_uniforms.feedbackLevelBias = feedbackLevelBias;
+		m_queue.writeBuffer(m_uniformBuffer, offsetof(Uniforms, feedbackLevelBias), &m_uniforms.feedbackLevelBias, sizeof(float));
+	}
+
+	m_stats.textureCount = static_cast<uint32_t>(m_textures.size());
+	m_stats.slotCount = static_cast<uint32_t>(m_caches[0].slots.size());
+	m_stats.residentPages = 0;
+	for (const Cache& cache : m_caches) {
+		m_stats.residentPages += static_cast<uint32_t>(std::count_if(cache.slots.begin(), cache.slots.end(), [](const Slot& slot) {
+			return slot.texture != InvalidId;
+		}));
+	}
+	m_stats.pendingReads = static_cast<uint32_t>(m_pendingReads.size());
+}
+
+void VirtualTextures::CreateFeedbackTargets()
+{
+	uint32_t scale = std::max(m_settings.feedbackScale, 1u);
+	uint32_t width = m_screenWidth / scale;
+	uint32_t height = m_screenHeight / scale;
+	if (width == 0 || height == 0) return;
+
+	TextureDescriptor textureDesc;
+	textureDesc.label = "Virtual texture feedback";
+	textureDesc.dimension = TextureDimension::_2D;
+	textureDesc.format = FeedbackFormat;
+	textureDesc.size = { width, height, 1 };
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.usage = TextureUsage::RenderAttachment | TextureUsage::CopySrc;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	m_feedbackTexture = m_device.createTexture(textureDesc);
+	m_feedbackView = Loader::createTextureView(m_feedbackTexture, textureDesc);
+
+	// Same format as the depth buffer of the main pass, see Application::InitPipeline
+	textureDesc.label = "Virtual texture feedback depth";
+	textureDesc.format = TextureFormat::Depth24Plus;
+	textureDesc.usage = TextureUsage::RenderAttachment;
+	m_feedbackDepthTexture = m_device.createTexture(textureDesc);
+
+	TextureViewDescriptor depthViewDesc;
+	depthViewDesc.aspect = TextureAspect::DepthOnly;
+	depthViewDesc.baseArrayLayer = 0;
+	depthViewDesc.arrayLayerCount = 1;
+	depthViewDesc.baseMipLevel = 0;
+	depthViewDesc.mipLevelCount = 1;
+	depthViewDesc.dimension = TextureViewDimension::_2D;
+	depthViewDesc.format = TextureFormat::Depth24Plus;
+	m_feedbackDepthView = m_feedbackDepthTexture.createView(depthViewDesc);
+}
+
+void VirtualTextures::TerminateFeedbackTargets()
+{
+	if (m_feedbackTexture) {
+		m_feedbackView.release();
+		m_feedbackTexture.destroy();
+		m_feedbackTexture.release();
+		m_feedbackDepthView.release();
+		m_feedbackDepthTexture.destroy();
+		m_feedbackDepthTexture.release();
+	}
+	m_feedbackView = nullptr;
+	m_feedbackTexture = nullptr;
+	m_feedbackDepthView = nullptr;
+	m_feedbackDepthTexture = nullptr;
+}
+
+void VirtualTextures::ReadFeedback(Readback& readback)
+{
+	// Each request is the texture id (8 bits), the level (4 bits) and the
+	// page coordinates (10 bits each) written by fs_feedback
+	m_requests.clear();
+	// Levels dropped by the quality tier are never loaded, their parents stand in
+	uint32_t firstLevel = Loader::getTextureQuality().skippedLevels;
+	uint64_t size = static_cast<uint64_t>(readback.bytesPerRow) * readback.height;
+	const unsigned char* data = static_cast<const unsigned char*>(readback.buffer.getConstMappedRange(0, size));
+	uint32_t previous[2] = { InvalidId, InvalidId };
+	for (uint32_t y = 0; data != nullptr && y < readback.height; ++y) {
+		const uint32_t* row = reinterpret_cast<const uint32_t*>(data + static_cast<size_t>(y) * readback.bytesPerRow);
+		for (uint32_t x = 0; x < readback.width; ++x) {
+			for (uint32_t channel = 0; channel < 2; ++channel) {
+				uint32_t request = row[2 * x + channel];
+				if (request == InvalidId) continue;
+				uint32_t id = request >> 24;
+				uint32_t level = (request >> 20) & 0xF;
+				uint32_t pageY = (request >> 10) & 0x3FF;
+				uint32_t pageX = request & 0x3FF;
+				if (id >= m_textures.size() || level >= m_textures[id].levelCount) continue;
+				const VirtualTexture& texture = m_textures[id];
+				glm::uvec3 pages = texture.levels[level];
+				if (pageX >= pages.x || pageY >= pages.y) continue;
+				for (; level < std::min(firstLevel, texture.levelCount - 1); ++level) {
+					pages = texture.levels[level + 1];
+					pageX = std::min(pageX / 2, pages.x - 1);
+					pageY = std::min(pageY / 2, pages.y - 1);
+				}
+				++m_requests[PageKey(id, pages.z + pageY * pages.x + pageX)];
+				// Neighbor pixels mostly request the same page, whose
+				// ancestors are requested already
+				if (request == previous[channel]) continue;
+				previous[channel] = request;
+
+				// Its ancestors too, so that the shader can fall back to them
+				while (++level < texture.levelCount) {
+					pages = texture.levels[level];
+					pageX = std::min(pageX / 2, pages.x - 1);
+					pageY = std::min(pageY / 2, pages.y - 1);
+					if (!m_requests.emplace(PageKey(id, pages.z + pageY * pages.x + pageX), 0).second) break;
+				}
+			}
+		}
+	}
+	readback.buffer.unmap();
+	readback.mapped = false;
+	m_stats.requestedPages = static_cast<uint32_t>(m_requests.size());
+}
+
+int32_t VirtualTextures::AcquireSlot(uint32_t cacheIndex)
+{
+	Cache& cache = m_caches[cacheIndex];
+	int32_t oldest = -1;
+	for (int32_t i = 0; i < static_cast<int32_t>(cache.slots.size()); ++i) {
+		const Slot& slot = cache.slots[i];
+		if (slot.texture == InvalidId) return i;
+		if (slot.pinned || slot.lastRequestedFrame >= m_frame) continue;
+		if (oldest < 0 || slot.lastRequestedFrame < cache.slots[oldest].lastRequestedFrame) oldest = i;
+	}
+	if (oldest < 0) return -1;
+
+	// The page table falls back to an ancestor of the evicted page
+	Slot& slot = cache.slots[oldest];
+	m_textures[slot.texture].slots[slot.page] = -1;
+	m_textures[slot.texture].pageTableChanged = true;
+	slot = Slot();
+	++m_stats.evictedPages;
+	return oldest;
+}
+
+void VirtualTextures::WritePage(uint32_t textureId, uint32_t page, int32_t slot)
+{
+	const VirtualTexture& texture = m_textures[textureId];
+	ImageCopyTexture destination;
+	destination.texture = m_caches[CacheIndex(texture.kind)].texture;
+	destination.mipLevel = 0;
+	destination.origin = { (slot % m_settings.slotsPerSide) * SlotSize, (slot / m_settings.slotsPerSide) * SlotSize, 0 };
+	destination.aspect = TextureAspect::All;
+
+	TextureDataLayout source;
+	source.offset = 0;
+	source.bytesPerRow = static_cast<uint32_t>(texture.pageBytes / SlotSize);
+	source.rowsPerImage = SlotSize;
+	const unsigned char* data = texture.file->GetData() + sizeof(FileHeader) + page * texture.pageBytes;
+	WriteTexture(destination, data, texture.pageBytes, source, { SlotSize, SlotSize, 1 });
+}
+
+void VirtualTextures::WritePageTable(uint32_t textureId)
+{
+	// Entries are the slot coordinates and the level of the page they point
+	// to, built from the tail (always resident) to level 0
+	const VirtualTexture& texture = m_textures[textureId];
+	std::vector<unsigned char> entries(4 * texture.slots.size(), 0);
+	for (uint32_t level = texture.levelCount; level-- > 0;) {
+		glm::uvec3 pages = texture.levels[level];
+		for (uint32_t pageY = 0; pageY < pages.y; ++pageY) {
+			for (uint32_t pageX = 0; pageX < pages.x; ++pageX) {
+				uint32_t page = pages.z + pageY * pages.x + pageX;
+				int32_t slot = texture.slots[page];
+				unsigned char* entry = entries.data() + 4 * static_cast<size_t>(page);
+				if (slot >= 0) {
+					entry[0] = static_cast<unsigned char>(slot % m_settings.slotsPerSide);
+					entry[1] = static_cast<unsigned char>(slot / m_settings.slotsPerSide);
+					entry[2] = static_cast<unsigned char>(level);
+					entry[3] = 1;
+				}
+				else if (level + 1 < texture.levelCount) {
+					glm::uvec3 parentPages = texture.levels[level + 1];
+					uint32_t parent = parentPages.z + std::min(pageY / 2, parentPages.y - 1) * parentPages.x + std::min(pageX / 2, parentPages.x - 1);
+					std::memcpy(entry, entries.data() + 4 * static_cast<size_t>(parent), 4);
+				}
+			}
+		}
+
+		ImageCopyTexture destination;
+		destination.texture = m_pageTable;
+		destination.mipLevel = level;
+		destination.origin = { 0, 0, textureId };
+		destination.aspect = TextureAspect::All;
+		TextureDataLayout source;
+		source.offset = 0;
+		source.bytesPerRow = 4 * pages.x;
+		source.rowsPerImage = pages.y;
+		WriteTexture(destination, entries.data() + 4 * static_cast<size_t>(pages.z), 4 * static_cast<size_t>(pages.x) * pages.y, source, { pages.x, pages.y, 1 });
+	}
+}
+
+void VirtualTextures::WriteTexture(const ImageCopyTexture& destination, const void* data, size_t dataSize,
+	const TextureDataLayout& layout, const Extent3D& writeSize)
+{
+	if (m_uploadManager && m_uploadManager->IsInitialized()) {
+		m_uploadManager->WriteTexture(destination, data, dataSize, layout, writeSize);
+		return;
+	}
+	m_queue.writeTexture(destination, data, dataSize, layout, writeSize);
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <webgpu/webgpu.hpp>
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "MappedFile.h"
+#include "MipFilter.h"
+
+class UploadManager;
+
+// Virtual texturing: textures too large to be resident are cut into pages of
+// PageSize x PageSize texels (for each of their mip levels), and only the
+// pages visible on screen live on the GPU, in a physical cache texture of a
+// fixed size. GPU memory thus does not depend on how many textures the scene
+// uses nor on their size.
+//
+// - Textures are cooked once into a tiled file (.vtex) where each page is
+//   stored with a border of Border texels, in the format of the cache, so
+//   that loading a page is reading its bytes.
+// - Each texture has a layer of the page table, a texture with one texel per
+//   page and one mip level per texture level. A texel holds the slot of the
+//   cache where the page is, or of its closest resident ancestor, which the
+//   shader then samples instead (blurrier, but never missing). The page of
+//   the coarsest level (the tail) is always resident.
+// - A feedback pass renders the virtual objects at a fraction of the screen
+//   resolution, writing for each pixel the pages it samples. It is read back
+//   asynchronously, a few frames later.
+// - Requested pages are read on the worker threads, coarsest levels first,
+//   and uploaded within a per-frame budget into free slots or those of the
+//   least recently requested pages.
+//
+// Pages of color textures and normal maps go to two caches, which share the
+// slot layout but not the slots. Masks are not supported.
+class VirtualTextures {
+public:
+	// Texels per side of a page, and of the border around it that filtering
+	// reads from the neighbor pages. Matches vtPageSize and vtBorder in
+	// shader.wgsl.
+	static constexpr uint32_t PageSize = 128;
+	static constexpr uint32_t Border = 4;
+	static constexpr uint32_t SlotSize = PageSize + 2 * Border;
+	// Largest size of a virtual texture, hence the size of the page table
+	static constexpr uint32_t MaxSize = 16384;
+	static constexpr uint32_t PageTableSize = MaxSize / PageSize;
+	// Layers of the page table (and entries of Uniforms::textures)
+	static constexpr uint32_t MaxTextures = 64;
+	// Id of a texture that could not be opened, the shader uses a default value
+	static constexpr uint32_t InvalidId = ~0u;
+	// Two page requests per pixel, one for each texture of the object
+	static constexpr wgpu::TextureFormat FeedbackFormat = wgpu::TextureFormat::RG32Uint;
+
+	struct Settings {
+		// Slots per side of the caches, only read by Init(), which lowers it
+		// to the largest texture the device supports
+		uint32_t slotsPerSide = 32;
+		// Images at least this large are virtual (see ShouldVirtualize)
+		uint32_t minImageSize = 4096;
+		// The feedback pass is this many times smaller than the screen
+		uint32_t feedbackScale = 8;
+		// Page reads in flight on the worker threads
+		uint32_t maxConcurrentReads = 16;
+		// Pages written to the caches per frame
+		uint32_t uploadPagesPerFrame = 32;
+		// Added to the requested levels, positive for blurrier textures
+		float levelBias = 0.0f;
+	};
+
+	struct Stats {
+		uint32_t textureCount = 0;
+		uint32_t slotCount = 0; // per cache
+		uint32_t residentPages = 0; // in both caches
+		uint32_t requestedPages = 0; // by the last feedback read back
+		uint32_t pendingReads = 0;
+		uint32_t uploadedPages = 0; // during the last frame
+		uint32_t evictedPages = 0; // during the last frame
+	};
+
+	// Matches VirtualTextureUniforms in shader.wgsl
+	struct Uniforms {
+		float cacheSize = 0.0f; // texels per side of the caches
+		float feedbackLevelBias = 0.0f;
+		float _pad[2] = { 0.0f, 0.0f };
+		// Width, height and tail level of each texture
+		std::array<glm::uvec4, MaxTextures> textures = {};
+	};
+	static_assert(sizeof(Uniforms) % 16 == 0);
+
+	// Cut the image at `imagePath` and its mip levels, filtered according to
+	// `kind`, into pages written to `cookedPath`. Pages of a level are cut on
+	// the worker threads.
+	static bool Cook(const std::filesystem::path& imagePath, const std::filesystem::path& cookedPath, MipFilter::TextureKind kind);
+
+	// Create the caches, the page table and the bind group. `uploadManager`
+	// stages the pages when it is initialized, they are written through the
+	// queue otherwise.
+	bool Init(wgpu::Device device, UploadManager* uploadManager);
+	void Terminate();
+
+	// Whether the image at `path` is large enough to be virtual, or is a
+	// tiled file already
+	bool ShouldVirtualize(const std::filesystem::path& path) const;
+	// Id of the virtual texture of an image (cooked next to it the first
+	// time) or of a .vtex file, InvalidId if it cannot be opened. Textures
+	// stay open until Terminate(), opening one again returns the same id.
+	// An image that needs cooking is cooked on the worker threads, and its
+	// id is not ready until an Update() opens it, which bumps the generation.
+	uint32_t Open(const std::filesystem::path& path, MipFilter::TextureKind kind);
+	bool IsReady(uint32_t id) const { return id < m_textures.size() && m_textures[id].file != nullptr; }
+	uint32_t GetGeneration() const { return m_generation; }
+
+	// Size of the screen, of which the feedback pass is a fraction
+	void Resize(uint32_t width, uint32_t height);
+
+	// Begin the feedback pass of the frame, in which the virtual objects are
+	// drawn with the feedback pipeline, or return nullptr if this frame has
+	// no feedback (nothing is virtual, or all the readbacks are in flight).
+	// EndFeedbackPass() ends it and records its readback, then call
+	// OnSubmitted() once the command buffer is submitted.
+	wgpu::RenderPassEncoder BeginFeedbackPass(wgpu::CommandEncoder encoder);
+	void EndFeedbackPass(wgpu::CommandEncoder encoder, wgpu::RenderPassEncoder feedbackPass);
+	void OnSubmitted();
+
+	// Read the last feedback back, load the pages it requests and evict
+	// those that are not requested anymore. Call once per frame, before the
+	// upload manager records its copies.
+	void Update();
+
+	// Group 2 of the virtual and feedback pipelines: uniforms, page table,
+	// caches and their sampler
+	wgpu::BindGroupLayout GetBindGroupLayout() const { return m_bindGroupLayout; }
+	wgpu::BindGroup GetBindGroup() const { return m_bindGroup; }
+
+	Settings& GetSettings() { return m_settings; }
+	const Stats& GetStats() const { return m_stats; }
+
+private:
+	// Caches of color textures and of normal maps
+	static constexpr uint32_t CacheCount = 2;
+	// Feedbacks being read back at once
+	static constexpr uint32_t ReadbackCount = 3;
+
+	struct VirtualTexture {
+		std::filesystem::path path; // of the .vtex file
+		MipFilter::TextureKind kind = MipFilter::TextureKind::Albedo;
+		std::future<bool> cooking; // valid while being cooked
+		std::shared_ptr<MappedFile> file; // shared with the reads in flight, null until open
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t levelCount = 0; // the last one is the tail, a single page
+		uint64_t pageBytes = 0; // of a page with its border
+		// Pages wide, pages high and index of the first page of each level
+		std::vector<glm::uvec3> levels;
+		// Slot of each page in the cache, -1 when not resident
+		std::vector<int32_t> slots;
+		bool pageTableChanged = false;
+	};
+
+	struct Slot {
+		uint32_t texture = InvalidId; // InvalidId when free
+		uint32_t page = 0;
+		uint64_t lastRequestedFrame = 0;
+		bool pinned = false; // the tail of its texture
+	};
+
+	struct Cache {
+		wgpu::Texture texture = nullptr;
+		wgpu::TextureView view = nullptr;
+		std::vector<Slot> slots;
+	};
+
+	struct Readback {
+		wgpu::Buffer buffer = nullptr;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t bytesPerRow = 0;
+		bool recorded = false; // copied to by the frame being recorded
+		bool mapping = false;
+		bool mapped = false;
+		std::unique_ptr<wgpu::BufferMapCallback> mapCallback;
+	};
+
+	// Page `page` of texture `texture`, as the keys of the requests and reads
+	static uint64_t PageKey(uint32_t texture, uint32_t page) { return (static_cast<uint64_t>(texture) << 32) | page; }
+	static uint32_t CacheIndex(MipFilter::TextureKind kind) { return kind == MipFilter::TextureKind::Normal ? 1 : 0; }
+
+	// Map the cooked file of a texture and make its tail resident
+	bool OpenCooked(uint32_t id);
+	void CreateFeedbackTargets();
+	void TerminateFeedbackTargets();
+	// Turn the feedback of a mapped readback into page requests
+	void ReadFeedback(Readback& readback);
+	// Free slot of a cache, or the least recently requested one that was not
+	// requested this frame, whose page is then evicted. -1 if there is none.
+	int32_t AcquireSlot(uint32_t cacheIndex);
+	// Copy a page from the file to its slot
+	void WritePage(uint32_t textureId, uint32_t page, int32_t slot);
+	// Point each page of the page table to the page or its closest resident ancestor
+	void WritePageTable(uint32_t textureId);
+	void WriteTexture(const wgpu::ImageCopyTexture& destination, const void* data, size_t dataSize,
+		const wgpu::TextureDataLayout& layout, const wgpu::Extent3D& writeSize);
+
+private:
+	wgpu::Device m_device = nullptr;
+	wgpu::Queue m_queue = nullptr;
+	UploadManager* m_uploadManager = nullptr;
+	Settings m_settings;
+	Stats m_stats;
+	uint64_t m_frame = 0;
+	uint32_t m_generation = 0; // bumped when cooked textures are opened
+
+	std::vector<VirtualTexture> m_textures; // indexed by id
+	std::unordered_map<std::string, uint32_t> m_ids; // by path and kind
+	std::array<Cache, CacheCount> m_caches;
+	wgpu::Texture m_pageTable = nullptr;
+	wgpu::TextureView m_pageTableView = nullptr;
+	Uniforms m_uniforms;
+	wgpu::Buffer m_uniformBuffer = nullptr;
+	wgpu::Sampler m_sampler = nullptr;
+	wgpu::BindGroupLayout m_bindGroupLayout = nullptr;
+	wgpu::BindGroup m_bindGroup = nullptr;
+
+	// Pages requested by the last feedback, with how many pixels asked for them
+	std::unordered_map<uint64_t, uint32_t> m_requests;
+	std::unordered_map<uint64_t, std::future<void>> m_pendingReads;
+
+	// Feedback pass, at a fraction of the screen size
+	uint32_t m_screenWidth = 0;
+	uint32_t m_screenHeight = 0;
+	wgpu::Texture m_feedbackTexture = nullptr;
+	wgpu::TextureView m_feedbackView = nullptr;
+	wgpu::Texture m_feedbackDepthTexture = nullptr;
+	wgpu::TextureView m_feedbackDepthView = nullptr;
+	std::array<std::unique_ptr<Readback>, ReadbackCount> m_readbacks;
+};
@@ -5,10 +5,37 @@
 
 #include "Application.h"
 
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 
-int main() {
+
+int main(int argc, char* argv[]) {
 	Application app;
 
+	// --skip-texture-levels=N drops the N finest mip levels of every texture,
+	// at most MaxSkippedLevels (textures 256 times smaller on each side)
+	const char* skipOption = "--skip-texture-levels=";
+	constexpr unsigned long MaxSkippedLevels = 8;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strncmp(argv[i], skipOption, std::strlen(skipOption)) == 0) {
+			const char* value = argv[i] + std::strlen(skipOption);
+			char* end = nullptr;
+			// strtoul would accept a sign, and wrap "-1" around
+			unsigned long levels = std::isdigit(static_cast<unsigned char>(value[0])) ? std::strtoul(value, &end, 10) : 0;
+			if (end == nullptr || *end != '\0') {
+				std::cerr << "Ignoring " << argv[i] << ": expected a number of levels" << std::endl;
+				continue;
+			}
+			if (levels > MaxSkippedLevels) {
+				std::cerr << "Skipping " << MaxSkippedLevels << " texture levels rather than " << value << std::endl;
+				levels = MaxSkippedLevels;
+			}
+			app.SetSkippedTextureLevels(static_cast<uint32_t>(levels));
+		}
+	}
+
 	if (!app.Initialize()) {
 		return 1;
 	}
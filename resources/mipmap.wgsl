@@ -0,0 +1,186 @@
+// Mip chain generation (see MipGenerator).
+//
+// Each dispatch reads one level and writes the next levelCount ones (1 to 4).
+// A workgroup computes a 16x16 tile of the first level it writes, straight
+// from the source level, then halves the tile in workgroup memory for each
+// following level, so that the source texture is only read once.
+//
+// Filtering matches the CPU path (MipFilter): colors are averaged in linear
+// space, normals are renormalized, and odd sizes use 3 taps per axis. sRGB
+// colors are decoded here rather than by the texture format, since storage
+// textures are RGBA8Unorm.
+
+struct Params {
+	// Number of levels written by this dispatch
+	levelCount: u32,
+	// 0 = Albedo, 1 = Normal, 2 = Mask, as MipFilter::TextureKind
+	kind: u32,
+	_pad0: u32,
+	_pad1: u32,
+};
+
+@group(0) @binding(0) var sourceLevel: texture_2d<f32>;
+@group(0) @binding(1) var outputLevel1: texture_storage_2d<rgba8unorm, write>;
+@group(0) @binding(2) var outputLevel2: texture_storage_2d<rgba8unorm, write>;
+@group(0) @binding(3) var outputLevel3: texture_storage_2d<rgba8unorm, write>;
+@group(0) @binding(4) var outputLevel4: texture_storage_2d<rgba8unorm, write>;
+@group(0) @binding(5) var<uniform> params: Params;
+
+const TileSize = 16u;
+
+// Decoded texels of the last level written, one per invocation
+var<workgroup> tile: array<vec4f, TileSize * TileSize>;
+
+fn srgbToLinear(c: vec3f) -> vec3f {
+	return select(pow((c + 0.055) / 1.055, vec3f(2.4)), c / 12.92, c <= vec3f(0.04045));
+}
+
+fn linearToSrgb(c: vec3f) -> vec3f {
+	return select(1.055 * pow(c, vec3f(1.0 / 2.4)) - 0.055, 12.92 * c, c <= vec3f(0.0031308));
+}
+
+// From texel values to values that can be averaged
+fn decode(texel: vec4f) -> vec4f {
+	switch params.kind {
+		case 0u: {
+			return vec4f(srgbToLinear(texel.rgb), texel.a);
+		}
+		case 1u: {
+			return vec4f(2.0 * texel.rgb - 1.0, texel.a);
+		}
+		default: {
+			return texel;
+		}
+	}
+}
+
+// From averaged values back to texel values
+fn encode(value: vec4f) -> vec4f {
+	let v = clamp(value, vec4f(-1.0), vec4f(1.0));
+	switch params.kind {
+		case 0u: {
+			return vec4f(linearToSrgb(clamp(v.rgb, vec3f(0.0), vec3f(1.0))), clamp(v.a, 0.0, 1.0));
+		}
+		case 1u: {
+			// Averaging shortens normals, bring them back to unit length
+			let len = length(v.rgb);
+			let n = select(vec3f(0.0), v.rgb / len, len > 1e-6);
+			return vec4f(0.5 * n + 0.5, clamp(v.a, 0.0, 1.0));
+		}
+		default: {
+			return clamp(v, vec4f(0.0), vec4f(1.0));
+		}
+	}
+}
+
+// Round to the nearest 8-bit value, halfway values up like the CPU path,
+// rather than relying on how the hardware rounds when storing.
+fn quantize(texel: vec4f) -> vec4f {
+	return floor(texel * 255.0 + 0.5) / 255.0;
+}
+
+// The value that the next level reads back from an 8-bit texel, so that
+// levels built from workgroup memory match levels built from the texture.
+fn requantize(value: vec4f) -> vec4f {
+	return decode(quantize(encode(value)));
+}
+
+// Source texels and weights of destination texel `i` along an axis of `size`
+// source texels, like taps() in MipFilter.cpp
+struct Taps {
+	first: u32,
+	count: u32,
+	weights: vec3f,
+};
+
+fn taps(i: u32, size: u32) -> Taps {
+	if (size == 1u) {
+		return Taps(0u, 1u, vec3f(1.0, 0.0, 0.0));
+	}
+	if (size % 2u == 0u) {
+		return Taps(2u * i, 2u, vec3f(0.5, 0.5, 0.0));
+	}
+	let halfSize = size / 2u;
+	let n = f32(size);
+	return Taps(2u * i, 3u, vec3f(f32(halfSize - i), f32(halfSize), f32(i + 1u)) / n);
+}
+
+fn storeLevel(level: u32, texel: vec2u, value: vec4f) {
+	let encoded = quantize(encode(value));
+	switch level {
+		case 1u: {
+			textureStore(outputLevel1, texel, encoded);
+		}
+		case 2u: {
+			textureStore(outputLevel2, texel, encoded);
+		}
+		case 3u: {
+			textureStore(outputLevel3, texel, encoded);
+		}
+		default: {
+			textureStore(outputLevel4, texel, encoded);
+		}
+	}
+}
+
+@compute @workgroup_size(16, 16)
+fn cs_main(@builtin(workgroup_id) group: vec3u, @builtin(local_invocation_id) local: vec3u) {
+	// First level: filter the source texels under each destination texel
+	let sourceSize = textureDimensions(sourceLevel);
+	var size = max(sourceSize / 2u, vec2u(1u));
+	let texel = group.xy * TileSize + local.xy;
+	var value = vec4f(0.0);
+	if (all(texel < size)) {
+		let tx = taps(texel.x, sourceSize.x);
+		let ty = taps(texel.y, sourceSize.y);
+		for (var j = 0u; j < ty.count; j++) {
+			var row = vec4f(0.0);
+			for (var i = 0u; i < tx.count; i++) {
+				row += tx.weights[i] * decode(textureLoad(sourceLevel, vec2u(tx.first + i, ty.first + j), 0));
+			}
+			value += ty.weights[j] * row;
+		}
+		storeLevel(1u, texel, value);
+	}
+	tile[local.y * TileSize + local.x] = requantize(value);
+
+	// Next levels: the host only chains levels of even size, so the 2x2
+	// source texels of a texel always are in the tile of its workgroup.
+	var tileSize = TileSize;
+	for (var level = 2u; level <= params.levelCount; level++) {
+		workgroupBarrier();
+		tileSize = tileSize / 2u;
+		size = max(size / 2u, vec2u(1u));
+		let active = all(local.xy < vec2u(tileSize));
+		var average = vec4f(0.0);
+		if (active) {
+			let corner = 2u * local.y * TileSize + 2u * local.x;
+			average = 0.25 * (tile[corner] + tile[corner + 1u] + tile[corner + TileSize] + tile[corner + TileSize + 1u]);
+		}
+		workgroupBarrier();
+		if (active) {
+			tile[local.y * TileSize + local.x] = requantize(average);
+			let t = group.xy * tileSize + local.xy;
+			if (all(t < size)) {
+				storeLevel(level, t, average);
+			}
+		}
+	}
+}
+
+// Levels of formats that cannot be storage textures (RG8, R8) are rendered
+// from the RGBA8 levels built above, one triangle covering each level. The
+// binding comes after the ones of cs_main so that they never clash.
+@group(0) @binding(6) var levelTexels: texture_2d<f32>;
+
+@vertex
+fn vs_level(@builtin(vertex_index) index: u32) -> @builtin(position) vec4f {
+	let corner = vec2f(f32((index << 1u) & 2u), f32(index & 2u));
+	return vec4f(2.0 * corner - 1.0, 0.0, 1.0);
+}
+
+@fragment
+fn fs_level(@builtin(position) position: vec4f) -> @location(0) vec4f {
+	// Targets with fewer channels keep the first ones
+	return textureLoad(levelTexels, vec2u(position.xy), 0);
+}
@@ -0,0 +1,81 @@
+struct PointInput {
+	@location(0) position: vec3f,
+	@location(1) color: vec4f, // unpacked from Unorm8x4
+};
+
+struct VertexOutput {
+	@builtin(position) position: vec4f,
+	@location(0) color: vec3f,
+	@location(1) corner: vec2f, // position within the splat, in [-1, 1]
+};
+
+/**
+ * Same layout as in shader.wgsl, shared by all pipelines
+ */
+struct MyUniforms {
+	projectionMatrix: mat4x4f,
+	viewMatrix: mat4x4f,
+	modelMatrix: mat4x4f,
+	color: vec4f,
+	cameraWorldPosition: vec3f,
+	time: f32,
+};
+
+/**
+ * Settings specific to the point cloud
+ */
+struct PointCloudUniforms {
+	modelMatrix: mat4x4f,
+	viewportSize: vec2f,
+	pointSize: f32, // splat diameter, in pixels
+	_pad: f32,
+};
+
+@group(0) @binding(0) var<uniform> uMyUniforms: MyUniforms;
+@group(0) @binding(1) var<uniform> uPointCloud: PointCloudUniforms;
+
+fn projectPoint(position: vec3f) -> vec4f {
+	return uMyUniforms.projectionMatrix * uMyUniforms.viewMatrix * uPointCloud.modelMatrix * vec4f(position, 1.0);
+}
+
+@vertex
+fn vs_points(in: PointInput) -> VertexOutput {
+	var out: VertexOutput;
+	out.position = projectPoint(in.position);
+	out.color = in.color.rgb;
+	out.corner = vec2f(0.0);
+	return out;
+}
+
+// Splats are drawn as instanced quads: the point buffer steps per instance
+// and the vertex index selects the corner of the quad.
+@vertex
+fn vs_splats(@builtin(vertex_index) vertexIndex: u32, in: PointInput) -> VertexOutput {
+	var corners = array<vec2f, 6>(
+		vec2f(-1.0, -1.0), vec2f(1.0, -1.0), vec2f(1.0, 1.0),
+		vec2f(-1.0, -1.0), vec2f(1.0, 1.0), vec2f(-1.0, 1.0),
+	);
+	let corner = corners[vertexIndex];
+
+	var out: VertexOutput;
+	out.position = projectPoint(in.position);
+	// Offset in pixels converted to clip space (NDC spans 2 units per viewport)
+	out.position += vec4f(corner * uPointCloud.pointSize / uPointCloud.viewportSize * out.position.w, 0.0, 0.0);
+	out.color = in.color.rgb;
+	out.corner = corner;
+	return out;
+}
+
+@fragment
+fn fs_points(in: VertexOutput) -> @location(0) vec4f {
+	return vec4f(in.color, 1.0);
+}
+
+@fragment
+fn fs_splats(in: VertexOutput) -> @location(0) vec4f {
+	// Round splats
+	if (dot(in.corner, in.corner) > 1.0) {
+		discard;
+	}
+	return vec4f(in.color, 1.0);
+}
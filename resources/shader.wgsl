@@ -7,6 +7,20 @@ struct VertexInput {
     @location(5) bitangent: vec3f,
 };
 
+// Transform of the instance being drawn, see GameObject::InstanceAttributes
+struct InstanceInput {
+    @location(6) model0: vec4f,
+    @location(7) model1: vec4f,
+    @location(8) model2: vec4f,
+    @location(9) model3: vec4f,
+    // Array layers of the base color and normal textures, or their ids for
+    // virtual objects (see VirtualTextures)
+    @location(10) textureLayers: vec2u,
+    @location(11) tint: vec4f,
+    // Index of the ObjectUniforms of the object in `objects`
+    @location(12) objectIndex: u32,
+};
+
 struct VertexOutput {
 	@builtin(position) position: vec4f,
 	@location(0) color: vec3f,
@@ -15,6 +29,8 @@ struct VertexOutput {
     @location(3) viewDirection: vec3f, // <--- Add a view direction output
     @location(4) tangent: vec3f,
     @location(5) bitangent: vec3f,
+    @location(6) @interpolate(flat) textureLayers: vec2u,
+    @location(7) @interpolate(flat) tint: vec3f,
 };
 
 /**
@@ -29,6 +45,12 @@ struct MyUniforms {
 	time: f32,
 };
 
+// Uniforms of an object, in a buffer shared by all the objects and indexed
+// by their instances (see GameObject::ObjectUniforms)
+struct ObjectUniforms {
+    modelMatrix: mat4x4f,
+};
+
 /**
  * A structure holding the lighting settings
  */
@@ -44,40 +66,101 @@ const pi = 3.14159265359;
 
 // Instead of the simple uTime variable, our uniform variable is a struct
 @group(0) @binding(0) var<uniform> uMyUniforms: MyUniforms;
-@group(0) @binding(1) var baseColorTexture: texture_2d<f32>;
-@group(0) @binding(2) var normalTexture: texture_2d<f32>;
+// Objects whose textures have the same size and format share the arrays
+@group(0) @binding(1) var baseColorTexture: texture_2d_array<f32>;
+@group(0) @binding(2) var normalTexture: texture_2d_array<f32>;
 //                        ^^^^^^^^^^^^^ New binding!
 @group(0) @binding(3) var textureSampler: sampler;
 @group(0) @binding(4) var<uniform> uLighting: LightingUniforms;
+@group(0) @binding(5) var<storage, read> objects: array<ObjectUniforms>;
+
+// Image based lighting, see Environment. Matches Environment::Uniforms.
+struct EnvironmentUniforms {
+    // Spherical harmonics of the irradiance divided by pi, constants folded in
+    irradiance: array<vec4f, 9>,
+    specularLevels: f32,
+    intensity: f32,
+}
+
+@group(1) @binding(0) var<uniform> uEnvironment: EnvironmentUniforms;
+// Level l is the light reflected by a roughness of l / (specularLevels - 1)
+@group(1) @binding(1) var specularCube: texture_cube<f32>;
+@group(1) @binding(2) var environmentSampler: sampler;
+
+// Virtual textures, see VirtualTextures. Matches VirtualTextures::PageSize
+// and VirtualTextures::Border.
+const vtPageSize = 128.0;
+const vtBorder = 4.0;
+const vtInvalidId = 0xffffffffu;
+
+struct VirtualTextureUniforms {
+    cacheSize: f32, // texels per side of the caches
+    feedbackLevelBias: f32,
+    // Width, height and tail level of each virtual texture (up to
+    // VirtualTextures::MaxTextures)
+    textures: array<vec4u, 64>,
+}
+
+@group(2) @binding(0) var<uniform> uVirtual: VirtualTextureUniforms;
+// Slot (x, y) and level of the page, or of its closest resident ancestor
+@group(2) @binding(1) var pageTables: texture_2d_array<u32>;
+@group(2) @binding(2) var baseColorCache: texture_2d<f32>;
+@group(2) @binding(3) var normalCache: texture_2d<f32>;
+@group(2) @binding(4) var cacheSampler: sampler;
 
 @vertex
-fn vs_main(in: VertexInput) -> VertexOutput {
+fn vs_main(in: VertexInput, instance: InstanceInput) -> VertexOutput {
 	var out: VertexOutput;
-	out.position = uMyUniforms.projectionMatrix * uMyUniforms.viewMatrix * uMyUniforms.modelMatrix * vec4f(in.position, 1.0);
-	// Forward the normal
-    out.normal = (uMyUniforms.modelMatrix * vec4f(in.normal, 0.0)).xyz;
+    // Instances are rigid transforms, so they apply to normals as they are
+    let modelMatrix = uMyUniforms.modelMatrix * objects[instance.objectIndex].modelMatrix * mat4x4f(instance.model0, instance.model1, instance.model2, instance.model3);
 	out.color = in.color;
     out.uv = in.uv;
-    let worldPosition = uMyUniforms.modelMatrix * vec4f(in.position, 1.0);
+    let worldPosition = modelMatrix * vec4f(in.position, 1.0);
     out.position = uMyUniforms.projectionMatrix * uMyUniforms.viewMatrix * worldPosition;
 
     // Then we only need the camera position to get the view direction:
     let cameraWorldPosition = uMyUniforms.cameraWorldPosition;
     out.viewDirection = cameraWorldPosition - worldPosition.xyz;
 
-    out.tangent = (uMyUniforms.modelMatrix * vec4f(in.tangent, 0.0)).xyz;
-    out.bitangent = (uMyUniforms.modelMatrix * vec4f(in.bitangent, 0.0)).xyz;
-    out.normal = (uMyUniforms.modelMatrix * vec4f(in.normal, 0.0)).xyz;
+    out.tangent = (modelMatrix * vec4f(in.tangent, 0.0)).xyz;
+    out.bitangent = (modelMatrix * vec4f(in.bitangent, 0.0)).xyz;
+    out.normal = (modelMatrix * vec4f(in.normal, 0.0)).xyz;
+    out.textureLayers = instance.textureLayers;
+    out.tint = instance.tint.rgb;
 	return out;
 }
 
-@fragment
-fn fs_main(in: VertexOutput) -> @location(0) vec4f {
+// Irradiance divided by pi around the normal `n`, from its spherical harmonics
+fn environmentIrradiance(n: vec3f) -> vec3f {
+    let c = uEnvironment.irradiance;
+    let irradiance = c[0].rgb
+        + c[1].rgb * n.y + c[2].rgb * n.z + c[3].rgb * n.x
+        + c[4].rgb * n.x * n.y + c[5].rgb * n.y * n.z + c[6].rgb * (3.0 * n.z * n.z - 1.0)
+        + c[7].rgb * n.x * n.z + c[8].rgb * (n.x * n.x - n.y * n.y);
+    return max(irradiance, vec3f(0.0));
+}
+
+// Scale and bias of the specular color integrated over the GGX lobe, an
+// analytic fit rather than a lookup table ("Physically Based Shading on
+// Mobile", Karis, 2014)
+fn environmentBrdf(f0: vec3f, roughness: f32, NoV: f32) -> vec3f {
+    let c0 = vec4f(-1.0, -0.0275, -0.572, 0.022);
+    let c1 = vec4f(1.0, 0.0425, 1.04, -0.04);
+    let r = roughness * c0 + c1;
+    let a004 = min(r.x * r.x, exp2(-9.28 * NoV)) * r.x + r.y;
+    let ab = vec2f(-1.04, 1.04) * a004 + r.zw;
+    return f0 * ab.x + ab.y;
+}
+
+// Blinn-Phong shading of a fragment, given its base color and the X and Y
+// of its normal map
+fn shade(in: VertexOutput, baseColor: vec3f, encodedN: vec2f) -> vec4f {
 	// Compute shading
     let normalMapStrength = 1.0;
-	// Sample normal
-    let encodedN = textureSample(normalTexture, textureSampler, in.uv).rgb;
-    let localN = encodedN * 2.0 - 1.0;
+    // Only X and Y are used (RG8 and BC5 normal maps have no blue channel),
+    // Z is rebuilt from the normal being of unit length and facing outwards.
+    let localXY = encodedN * 2.0 - 1.0;
+    let localN = vec3f(localXY, sqrt(max(0.0, 1.0 - dot(localXY, localXY))));
     // The TBN matrix converts directions from the local space to the world space
     let localToWorld = mat3x3f(
         normalize(in.tangent),
@@ -88,8 +171,6 @@ fn fs_main(in: VertexOutput) -> @location(0) vec4f {
     let N = mix(in.normal, worldN, normalMapStrength);
 	let V = normalize(in.viewDirection);
 
-	// Sample texture
-	let baseColor = textureSample(baseColorTexture, textureSampler, in.uv).rgb;
 	let kd = uLighting.kd;
 	let ks = uLighting.ks;
 	let hardness = uLighting.hardness;
@@ -109,5 +190,101 @@ fn fs_main(in: VertexOutput) -> @location(0) vec4f {
 		color += baseColor * kd * diffuse + ks * specular;
 	}
 
+    // Image based lighting. The GGX lobe of alpha = roughness^2 is about as
+    // wide as the Phong lobe of this hardness when alpha^2 = 2 / (hardness + 2).
+    let n = normalize(N);
+    let roughness = clamp(pow(2.0 / (hardness + 2.0), 0.25), 0.0, 1.0);
+    let NoV = clamp(dot(n, V), 1e-4, 1.0);
+    let level = roughness * (uEnvironment.specularLevels - 1.0);
+    let prefiltered = textureSampleLevel(specularCube, environmentSampler, reflect(-V, n), level).rgb;
+    let ambientSpecular = prefiltered * environmentBrdf(vec3f(ks), roughness, NoV);
+    let ambientDiffuse = baseColor * kd * environmentIrradiance(n);
+    color += uEnvironment.intensity * (ambientDiffuse + ambientSpecular);
+
     return vec4f(color, uMyUniforms.color.a);
-}
\ No newline at end of file
+}
+
+@fragment
+fn fs_main(in: VertexOutput) -> @location(0) vec4f {
+	// Sample texture, decoded from sRGB to linear by the sampler
+	let baseColor = textureSample(baseColorTexture, textureSampler, in.uv, in.textureLayers.x).rgb;
+	// Sample normal
+    let encodedN = textureSample(normalTexture, textureSampler, in.uv, in.textureLayers.y).rg;
+    return shade(in, baseColor * in.tint, encodedN);
+}
+
+// Size of a level of a virtual texture, in texels
+fn vtLevelSize(id: u32, level: u32) -> vec2f {
+    return vec2f(max(uVirtual.textures[id].xy >> vec2u(level), vec2u(1u)));
+}
+
+// Level of detail of a virtual texture, from the derivatives of the UVs
+// (taken before any branch, they need uniform control flow)
+fn vtLevel(id: u32, uvDx: vec2f, uvDy: vec2f) -> f32 {
+    let size = vtLevelSize(id, 0u);
+    let dx = uvDx * size;
+    let dy = uvDy * size;
+    let rho2 = max(dot(dx, dx), dot(dy, dy));
+    return clamp(0.5 * log2(max(rho2, 1e-8)), 0.0, f32(uVirtual.textures[id].z));
+}
+
+// Sample level `level` of a virtual texture through the page table
+fn vtSampleLevel(cache: texture_2d<f32>, id: u32, uv: vec2f, level: u32) -> vec4f {
+    // UVs repeat, like with the sampler of the texture arrays
+    let wrapped = fract(uv);
+    let page = vec2u(wrapped * vtLevelSize(id, level) / vtPageSize);
+    let entry = textureLoad(pageTables, page, id, level);
+    // The page may be an ancestor, of a coarser level
+    let texel = wrapped * vtLevelSize(id, entry.z);
+    let inPage = texel - floor(texel / vtPageSize) * vtPageSize;
+    let slotOrigin = vec2f(entry.xy) * (vtPageSize + 2.0 * vtBorder) + vtBorder;
+    return textureSampleLevel(cache, cacheSampler, (slotOrigin + inPage) / uVirtual.cacheSize, 0.0);
+}
+
+// Trilinear sample of a virtual texture, blending the two closest levels
+fn vtSample(cache: texture_2d<f32>, id: u32, uv: vec2f, level: f32) -> vec4f {
+    let fine = u32(level);
+    let coarse = min(fine + 1u, uVirtual.textures[id].z);
+    return mix(vtSampleLevel(cache, id, uv, fine), vtSampleLevel(cache, id, uv, coarse), fract(level));
+}
+
+// Same as fs_main, for objects whose textures are virtual
+@fragment
+fn fs_main_virtual(in: VertexOutput) -> @location(0) vec4f {
+    let uvDx = dpdx(in.uv);
+    let uvDy = dpdy(in.uv);
+    let ids = in.textureLayers;
+
+    // Textures that could not be opened are mid grey and flat, like the
+    // placeholder textures (sRGB 0.5 is 0.2158 once decoded)
+    var baseColor = vec3f(0.2158);
+    if (ids.x != vtInvalidId) {
+        baseColor = vtSample(baseColorCache, ids.x, in.uv, vtLevel(ids.x, uvDx, uvDy)).rgb;
+    }
+    var encodedN = vec2f(0.5);
+    if (ids.y != vtInvalidId) {
+        encodedN = vtSample(normalCache, ids.y, in.uv, vtLevel(ids.y, uvDx, uvDy)).rg;
+    }
+    return shade(in, baseColor * in.tint, encodedN);
+}
+
+// Page of a virtual texture that a fragment samples, packed as the texture
+// id (8 bits), the level (4 bits) and the page coordinates (10 bits each)
+fn vtRequest(id: u32, uv: vec2f, uvDx: vec2f, uvDy: vec2f) -> u32 {
+    if (id == vtInvalidId) {
+        return vtInvalidId;
+    }
+    let tail = f32(uVirtual.textures[id].z);
+    let level = u32(clamp(vtLevel(id, uvDx, uvDy) + uVirtual.feedbackLevelBias, 0.0, tail));
+    let page = vec2u(fract(uv) * vtLevelSize(id, level) / vtPageSize);
+    return (id << 24u) | (level << 20u) | (page.y << 10u) | page.x;
+}
+
+// Feedback pass of the virtual objects, read back by VirtualTextures
+@fragment
+fn fs_feedback(in: VertexOutput) -> @location(0) vec2u {
+    let uvDx = dpdx(in.uv);
+    let uvDy = dpdy(in.uv);
+    let ids = in.textureLayers;
+    return vec2u(vtRequest(ids.x, in.uv, uvDx, uvDy), vtRequest(ids.y, in.uv, uvDx, uvDy));
+}